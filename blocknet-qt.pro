@@ -131,6 +131,16 @@ contains(USE_IPV6, -) {
     DEFINES += USE_IPV6=$$USE_IPV6
 }
 
+# use: qmake "USE_NATIVE_ECDSA=1" (verify and sign with src/ecdsa.cpp)
+#  or: qmake "USE_NATIVE_ECDSA=0" (use OpenSSL ECDSA; default)
+count(USE_NATIVE_ECDSA, 0) {
+    USE_NATIVE_ECDSA=0
+}
+contains(USE_NATIVE_ECDSA, 1) {
+    message(Building with native ECDSA)
+    DEFINES += USE_NATIVE_ECDSA
+}
+
 contains(BITCOIN_NEED_QT_PLUGINS, 1) {
     DEFINES += BITCOIN_NEED_QT_PLUGINS
     QTPLUGIN += qcncodecs qjpcodecs qtwcodecs qkrcodecs qtaccessiblewidgets
@@ -162,6 +172,8 @@ SOURCES += src/txdb-leveldb.cpp \
 	src/hamsi.c \
 	src/shabal.c \
     src/whirlpool.c \
+    src/hashblock.cpp \
+    src/blockstore.cpp \
     src/qt/messagedialog/messagedelegate.cpp \
     src/qt/messagedialog/messagedialog.cpp \
     src/qt/messagedialog/messagesmodel.cpp \
@@ -310,6 +322,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/miner.h \
     src/net.h \
     src/key.h \
+    src/ecdsa.h \
     src/db.h \
     src/txdb.h \
     src/walletdb.h \
@@ -341,6 +354,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/qt/transactionview.h \
     src/qt/walletmodel.h \
     src/bitcoinrpc.h \
+    src/jsonstream.h \
     src/qt/overviewpage.h \
     src/qt/csvmodelwriter.h \
     src/crypter.h \
@@ -363,7 +377,10 @@ HEADERS += src/qt/bitcoingui.h \
     src/checkqueue.h \
     src/hash.h \
     src/hashblock.h \
+    src/blockstore.h \
     src/limitedmap.h \
+    src/memusage.h \
+    src/smallvector.h \
     src/sph_blake.h \
     src/sph_bmw.h \
     src/sph_cubehash.h \
@@ -451,6 +468,7 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/util.cpp \
     src/netbase.cpp \
     src/key.cpp \
+    src/ecdsa.cpp \
     src/script.cpp \
     src/main.cpp \
     src/miner.cpp \
@@ -477,6 +495,7 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/qt/transactionview.cpp \
     src/qt/walletmodel.cpp \
     src/bitcoinrpc.cpp \
+    src/jsonstream.cpp \
     src/rpcdump.cpp \
     src/rpcnet.cpp \
     src/rpcmining.cpp \
@@ -9,6 +9,7 @@
 #include "ui_interface.h"
 #include "base58.h"
 #include "bitcoinrpc.h"
+#include "jsonstream.h"
 #include "db.h"
 
 #undef printf
@@ -22,6 +23,9 @@
 #include <boost/asio/ssl.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <deque>
 #include <list>
 
 #define printf OutputDebugStringF
@@ -38,6 +42,14 @@ static std::string strRPCUserColonPass;
 const Object emptyobj;
 
 void ThreadRPCServer3(void* parg);
+static string HTTPExecute(map<string, string>& mapHeaders, const string& strRequest, const string& strPeer, bool& fKeepAlive, int& nDelayMs);
+
+static const int DEFAULT_RPC_THREADS = 4;
+static const int DEFAULT_RPC_WORKQUEUE = 16;
+
+// Seconds an idle keep-alive connection, or a client that is slow to send a
+// request or read its reply, may hold on to a socket
+static const int RPC_IDLE_TIMEOUT = 30;
 
 static inline unsigned short GetDefaultRPCPort()
 {
@@ -233,89 +245,91 @@ Value stop(const Array& params, bool fHelp)
 
 
 static const CRPCCommand vRPCCommands[] =
-{ //  name                      function                 safemd  unlocked
-  //  ------------------------  -----------------------  ------  --------
-    { "help",                   &help,                   true,   true },
-    { "stop",                   &stop,                   true,   true },
-    { "getbestblockhash",       &getbestblockhash,       true,   false },
-    { "getblockcount",          &getblockcount,          true,   false },
-    { "getconnectioncount",     &getconnectioncount,     true,   false },
-    { "getpeerinfo",            &getpeerinfo,            true,   false },
-    { "getdifficulty",          &getdifficulty,          true,   false },
-    { "getinfo",                &getinfo,                true,   false },
-    { "getsubsidy",             &getsubsidy,             true,   false },
-    { "getmininginfo",          &getmininginfo,          true,   false },
-    { "getstakinginfo",         &getstakinginfo,         true,   false },
-    { "getnewaddress",          &getnewaddress,          true,   false },
-    { "getnewpubkey",           &getnewpubkey,           true,   false },
-    { "getaccountaddress",      &getaccountaddress,      true,   false },
-    { "setaccount",             &setaccount,             true,   false },
-    { "getaccount",             &getaccount,             false,  false },
-    { "getaddressesbyaccount",  &getaddressesbyaccount,  true,   false },
-    { "sendtoaddress",          &sendtoaddress,          false,  false },
-    { "getreceivedbyaddress",   &getreceivedbyaddress,   false,  false },
-    { "getreceivedbyaccount",   &getreceivedbyaccount,   false,  false },
-    { "listreceivedbyaddress",  &listreceivedbyaddress,  false,  false },
-    { "listreceivedbyaccount",  &listreceivedbyaccount,  false,  false },
-    { "backupwallet",           &backupwallet,           true,   false },
-    { "keypoolrefill",          &keypoolrefill,          true,   false },
-    { "walletpassphrase",       &walletpassphrase,       true,   false },
-    { "walletpassphrasechange", &walletpassphrasechange, false,  false },
-    { "walletlock",             &walletlock,             true,   false },
-    { "encryptwallet",          &encryptwallet,          false,  false },
-    { "validateaddress",        &validateaddress,        true,   false },
-    { "validatepubkey",         &validatepubkey,         true,   false },
-    { "getbalance",             &getbalance,             false,  false },
-    { "move",                   &movecmd,                false,  false },
-    { "sendfrom",               &sendfrom,               false,  false },
-    { "sendmany",               &sendmany,               false,  false },
-    { "addmultisigaddress",     &addmultisigaddress,     false,  false },
-    { "addredeemscript",        &addredeemscript,        false,  false },
-    { "getrawmempool",          &getrawmempool,          true,   false },
-    { "getblock",               &getblock,               false,  false },
-    { "getblockbynumber",       &getblockbynumber,       false,  false },
-    { "getblockhash",           &getblockhash,           false,  false },
-    { "gettransaction",         &gettransaction,         false,  false },
-    { "listtransactions",       &listtransactions,       false,  false },
-    { "listaddressgroupings",   &listaddressgroupings,   false,  false },
-    { "signmessage",            &signmessage,            false,  false },
-    { "verifymessage",          &verifymessage,          false,  false },
-    { "getwork",                &getwork,                true,   false },
-    { "getworkex",              &getworkex,              true,   false },
-    { "listaccounts",           &listaccounts,           false,  false },
-    { "settxfee",               &settxfee,               false,  false },
-    { "getblocktemplate",       &getblocktemplate,       true,   false },
-    { "submitblock",            &submitblock,            false,  false },
-    { "listsinceblock",         &listsinceblock,         false,  false },
-    { "dumpprivkey",            &dumpprivkey,            false,  false },
-    { "dumpwallet",             &dumpwallet,             true,   false },
-    { "importwallet",           &importwallet,           false,  false },
-    { "importprivkey",          &importprivkey,          false,  false },
-    { "listunspent",            &listunspent,            false,  false },
-    { "listlockunspent",        &listlockunspent,        false,  false },
-    { "lockunspent",            &lockunspent,            true,   false  },
-    { "getrawtransaction",      &getrawtransaction,      false,  false },
-    { "createrawtransaction",   &createrawtransaction,   false,  false },
-    { "decoderawtransaction",   &decoderawtransaction,   false,  false },
-    { "decodescript",           &decodescript,           false,  false },
-    { "signrawtransaction",     &signrawtransaction,     false,  false },
-    { "sendrawtransaction",     &sendrawtransaction,     false,  false },
-    { "getcheckpoint",          &getcheckpoint,          true,   false },
-    { "reservebalance",         &reservebalance,         false,  true},
-    { "checkwallet",            &checkwallet,            false,  true},
-    { "repairwallet",           &repairwallet,           false,  true},
-    { "resendtx",               &resendtx,               false,  true},
-    { "makekeypair",            &makekeypair,            false,  true},
-    { "sendalert",              &sendalert,              false,  false},
+{ //  name                      function                 safemd  locks            stream
+  //  ------------------------  -----------------------  ------  ---------------  ------------------------
+    { "help",                   &help,                   true,   RPC_LOCK_NONE,   NULL },
+    { "stop",                   &stop,                   true,   RPC_LOCK_NONE,   NULL },
+    { "getbestblockhash",       &getbestblockhash,       true,   RPC_LOCK_MAIN,   NULL },
+    { "getblockcount",          &getblockcount,          true,   RPC_LOCK_NONE,   NULL },
+    { "getconnectioncount",     &getconnectioncount,     true,   RPC_LOCK_NONE,   NULL },
+    { "getpeerinfo",            &getpeerinfo,            true,   RPC_LOCK_NONE,   NULL },
+    { "getdifficulty",          &getdifficulty,          true,   RPC_LOCK_MAIN,   NULL },
+    { "getinfo",                &getinfo,                true,   RPC_LOCK_WALLET, NULL },
+    { "getsubsidy",             &getsubsidy,             true,   RPC_LOCK_MAIN,   NULL },
+    { "getmininginfo",          &getmininginfo,          true,   RPC_LOCK_WALLET, NULL },
+    { "getstakinginfo",         &getstakinginfo,         true,   RPC_LOCK_WALLET, NULL },
+    { "getnewaddress",          &getnewaddress,          true,   RPC_LOCK_WALLET, NULL },
+    { "getnewpubkey",           &getnewpubkey,           true,   RPC_LOCK_WALLET, NULL },
+    { "getaccountaddress",      &getaccountaddress,      true,   RPC_LOCK_WALLET, NULL },
+    { "setaccount",             &setaccount,             true,   RPC_LOCK_WALLET, NULL },
+    { "getaccount",             &getaccount,             false,  RPC_LOCK_WALLET, NULL },
+    { "getaddressesbyaccount",  &getaddressesbyaccount,  true,   RPC_LOCK_WALLET, NULL },
+    { "sendtoaddress",          &sendtoaddress,          false,  RPC_LOCK_WALLET, NULL },
+    { "getreceivedbyaddress",   &getreceivedbyaddress,   false,  RPC_LOCK_WALLET, NULL },
+    { "getreceivedbyaccount",   &getreceivedbyaccount,   false,  RPC_LOCK_WALLET, NULL },
+    { "listreceivedbyaddress",  &listreceivedbyaddress,  false,  RPC_LOCK_WALLET, NULL },
+    { "listreceivedbyaccount",  &listreceivedbyaccount,  false,  RPC_LOCK_WALLET, NULL },
+    { "backupwallet",           &backupwallet,           true,   RPC_LOCK_WALLET, NULL },
+    { "keypoolrefill",          &keypoolrefill,          true,   RPC_LOCK_WALLET, NULL },
+    { "walletpassphrase",       &walletpassphrase,       true,   RPC_LOCK_WALLET, NULL },
+    { "walletpassphrasechange", &walletpassphrasechange, false,  RPC_LOCK_WALLET, NULL },
+    { "walletlock",             &walletlock,             true,   RPC_LOCK_WALLET, NULL },
+    { "encryptwallet",          &encryptwallet,          false,  RPC_LOCK_WALLET, NULL },
+    { "validateaddress",        &validateaddress,        true,   RPC_LOCK_WALLET, NULL },
+    { "validatepubkey",         &validatepubkey,         true,   RPC_LOCK_WALLET, NULL },
+    { "getbalance",             &getbalance,             false,  RPC_LOCK_WALLET, NULL },
+    { "move",                   &movecmd,                false,  RPC_LOCK_WALLET, NULL },
+    { "sendfrom",               &sendfrom,               false,  RPC_LOCK_WALLET, NULL },
+    { "sendmany",               &sendmany,               false,  RPC_LOCK_WALLET, NULL },
+    { "addmultisigaddress",     &addmultisigaddress,     false,  RPC_LOCK_WALLET, NULL },
+    { "addredeemscript",        &addredeemscript,        false,  RPC_LOCK_WALLET, NULL },
+    { "getrawmempool",          &getrawmempool,          true,   RPC_LOCK_NONE,   &streamgetrawmempool },
+    { "getmempoolinfo",         &getmempoolinfo,         true,   RPC_LOCK_NONE,   NULL },
+    { "getblock",               &getblock,               false,  RPC_LOCK_NONE,   &streamgetblock },
+    { "getblockbynumber",       &getblockbynumber,       false,  RPC_LOCK_NONE,   &streamgetblockbynumber },
+    { "getblockhash",           &getblockhash,           false,  RPC_LOCK_MAIN,   NULL },
+    { "gettransaction",         &gettransaction,         false,  RPC_LOCK_WALLET, NULL },
+    { "listtransactions",       &listtransactions,       false,  RPC_LOCK_WALLET, &streamlisttransactions },
+    { "listaddressgroupings",   &listaddressgroupings,   false,  RPC_LOCK_WALLET, NULL },
+    { "signmessage",            &signmessage,            false,  RPC_LOCK_WALLET, NULL },
+    { "verifymessage",          &verifymessage,          false,  RPC_LOCK_NONE,   NULL },
+    { "getwork",                &getwork,                true,   RPC_LOCK_WALLET, NULL },
+    { "getworkex",              &getworkex,              true,   RPC_LOCK_WALLET, NULL },
+    { "listaccounts",           &listaccounts,           false,  RPC_LOCK_WALLET, NULL },
+    { "settxfee",               &settxfee,               false,  RPC_LOCK_WALLET, NULL },
+    { "getblocktemplate",       &getblocktemplate,       true,   RPC_LOCK_WALLET, NULL },
+    { "submitblock",            &submitblock,            false,  RPC_LOCK_WALLET, NULL },
+    { "listsinceblock",         &listsinceblock,         false,  RPC_LOCK_WALLET, NULL },
+    { "dumpprivkey",            &dumpprivkey,            false,  RPC_LOCK_WALLET, NULL },
+    { "dumpwallet",             &dumpwallet,             true,   RPC_LOCK_WALLET, NULL },
+    { "importwallet",           &importwallet,           false,  RPC_LOCK_WALLET, NULL },
+    { "importprivkey",          &importprivkey,          false,  RPC_LOCK_WALLET, NULL },
+    { "listunspent",            &listunspent,            false,  RPC_LOCK_WALLET, NULL },
+    { "listlockunspent",        &listlockunspent,        false,  RPC_LOCK_WALLET, NULL },
+    { "lockunspent",            &lockunspent,            true,   RPC_LOCK_WALLET, NULL },
+    { "getrawtransaction",      &getrawtransaction,      false,  RPC_LOCK_MAIN,   NULL },
+    { "createrawtransaction",   &createrawtransaction,   false,  RPC_LOCK_NONE,   NULL },
+    { "decoderawtransaction",   &decoderawtransaction,   false,  RPC_LOCK_NONE,   NULL },
+    { "decodescript",           &decodescript,           false,  RPC_LOCK_NONE,   NULL },
+    { "signrawtransaction",     &signrawtransaction,     false,  RPC_LOCK_WALLET, NULL },
+    { "sendrawtransaction",     &sendrawtransaction,     false,  RPC_LOCK_WALLET, NULL },
+    { "getcheckpoint",          &getcheckpoint,          true,   RPC_LOCK_MAIN,   NULL },
+    { "getsigcacheinfo",        &getsigcacheinfo,        true,   RPC_LOCK_NONE,   NULL },
+    { "reservebalance",         &reservebalance,         false,  RPC_LOCK_NONE,   NULL },
+    { "checkwallet",            &checkwallet,            false,  RPC_LOCK_NONE,   NULL },
+    { "repairwallet",           &repairwallet,           false,  RPC_LOCK_NONE,   NULL },
+    { "resendtx",               &resendtx,               false,  RPC_LOCK_NONE,   NULL },
+    { "makekeypair",            &makekeypair,            false,  RPC_LOCK_NONE,   NULL },
+    { "sendalert",              &sendalert,              false,  RPC_LOCK_WALLET, NULL },
 
   //xbridge
-    { "dxGetTransactionList",           &dxGetTransactionList,          true,   true},
-    { "dxGetTransactionsHistoryList",   &dxGetTransactionsHistoryList,  true,   true},
-    { "dxGetTransactionInfo",           &dxGetTransactionInfo,          true,   true},
-    { "dxGetCurrencyList",              &dxGetCurrencyList,             true,   true},
-    { "dxCreateTransaction",            &dxCreateTransaction,           true,   true},
-    { "dxAcceptTransaction",            &dxAcceptTransaction,           true,   true},
-    { "dxCancelTransaction",            &dxCancelTransaction,           true,   true},
+    { "dxGetTransactionList",           &dxGetTransactionList,          true,   RPC_LOCK_NONE,   NULL },
+    { "dxGetTransactionsHistoryList",   &dxGetTransactionsHistoryList,  true,   RPC_LOCK_NONE,   NULL },
+    { "dxGetTransactionInfo",           &dxGetTransactionInfo,          true,   RPC_LOCK_NONE,   NULL },
+    { "dxGetCurrencyList",              &dxGetCurrencyList,             true,   RPC_LOCK_NONE,   NULL },
+    { "dxCreateTransaction",            &dxCreateTransaction,           true,   RPC_LOCK_NONE,   NULL },
+    { "dxAcceptTransaction",            &dxAcceptTransaction,           true,   RPC_LOCK_NONE,   NULL },
+    { "dxCancelTransaction",            &dxCancelTransaction,           true,   RPC_LOCK_NONE,   NULL },
 };
 
 CRPCTable::CRPCTable()
@@ -375,7 +389,7 @@ string rfc1123Time()
     return string(buffer);
 }
 
-static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
+string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
 {
     if (nStatus == HTTP_UNAUTHORIZED)
         return strprintf("HTTP/1.0 401 Authorization Required\r\n"
@@ -400,7 +414,9 @@ static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
     else if (nStatus == HTTP_FORBIDDEN) cStatus = "Forbidden";
     else if (nStatus == HTTP_NOT_FOUND) cStatus = "Not Found";
     else if (nStatus == HTTP_INTERNAL_SERVER_ERROR) cStatus = "Internal Server Error";
+    else if (nStatus == HTTP_SERVICE_UNAVAILABLE) cStatus = "Service Unavailable";
     else cStatus = "";
+    // The body is appended rather than formatted, replies can be megabytes
     return strprintf(
             "HTTP/1.1 %d %s\r\n"
             "Date: %s\r\n"
@@ -408,15 +424,13 @@ static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
             "Content-Length: %" PRIszu "\r\n"
             "Content-Type: application/json\r\n"
             "Server: blocknet-json-rpc/%s\r\n"
-            "\r\n"
-            "%s",
+            "\r\n",
         nStatus,
         cStatus,
         rfc1123Time().c_str(),
         keepalive ? "keep-alive" : "close",
         strMsg.size(),
-        FormatFullVersion().c_str(),
-        strMsg.c_str());
+        FormatFullVersion().c_str()) + strMsg;
 }
 
 int ReadHTTPStatus(std::basic_istream<char>& stream, int &proto)
@@ -459,6 +473,20 @@ int ReadHTTPHeader(std::basic_istream<char>& stream, map<string, string>& mapHea
     return nLen;
 }
 
+// Settle the connection header, which defaults to keep-alive from HTTP/1.1 on
+static void ReadHTTPConnection(map<string, string>& mapHeaders, int nProto)
+{
+    string sConHdr = mapHeaders["connection"];
+
+    if ((sConHdr != "close") && (sConHdr != "keep-alive"))
+    {
+        if (nProto >= 1)
+            mapHeaders["connection"] = "keep-alive";
+        else
+            mapHeaders["connection"] = "close";
+    }
+}
+
 int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRet, string& strMessageRet)
 {
     mapHeadersRet.clear();
@@ -481,17 +509,49 @@ int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRe
         strMessageRet = string(vch.begin(), vch.end());
     }
 
-    string sConHdr = mapHeadersRet["connection"];
+    ReadHTTPConnection(mapHeadersRet, nProto);
 
-    if ((sConHdr != "close") && (sConHdr != "keep-alive"))
+    return nStatus;
+}
+
+int ReadHTTPRequest(const string& strBuffer, map<string, string>& mapHeadersRet, string& strMessageRet)
+{
+    mapHeadersRet.clear();
+    strMessageRet = "";
+
+    // Skip the empty lines some clients send between pipelined requests
+    size_t nStart = strBuffer.find_first_not_of("\r\n");
+    if (nStart == string::npos)
+        return strBuffer.size() > MAX_HTTP_HEADER_SIZE ? -1 : 0;
+
+    // Find the empty line that ends the header
+    size_t nPos = nStart;
+    while (true)
     {
-        if (nProto >= 1)
-            mapHeadersRet["connection"] = "keep-alive";
-        else
-            mapHeadersRet["connection"] = "close";
+        size_t nEnd = strBuffer.find('\n', nPos);
+        if (nEnd == string::npos)
+            return strBuffer.size() - nStart > MAX_HTTP_HEADER_SIZE ? -1 : 0;
+        bool fEmpty = nEnd == nPos || (nEnd == nPos + 1 && strBuffer[nPos] == '\r');
+        nPos = nEnd + 1;
+        if (fEmpty)
+            break;
     }
+    if (nPos - nStart > MAX_HTTP_HEADER_SIZE)
+        return -1;
 
-    return nStatus;
+    istringstream stream(strBuffer.substr(nStart, nPos - nStart));
+    int nProto = 0;
+    ReadHTTPStatus(stream, nProto);
+    int nLen = ReadHTTPHeader(stream, mapHeadersRet);
+    if (nLen < 0 || nLen > (int)MAX_SIZE)
+        return -1;
+    if (strBuffer.size() - nPos < (size_t)nLen)
+        return 0;
+    strMessageRet = strBuffer.substr(nPos, nLen);
+
+    ReadHTTPConnection(mapHeadersRet, nProto);
+
+    return nPos + nLen;
 }
 
 bool HTTPAuthorized(map<string, string>& mapHeaders)
@@ -541,7 +601,7 @@ string JSONRPCReply(const Value& result, const Value& error, const Value& id)
     return write_string(Value(reply), false) + "\n";
 }
 
-void ErrorReply(std::ostream& stream, const Object& objError, const Value& id)
+static string ErrorReply(const Object& objError, const Value& id, bool fKeepAlive)
 {
     // Send error reply from json-rpc error object
     int nStatus = HTTP_INTERNAL_SERVER_ERROR;
@@ -549,7 +609,7 @@ void ErrorReply(std::ostream& stream, const Object& objError, const Value& id)
     if (code == RPC_INVALID_REQUEST) nStatus = HTTP_BAD_REQUEST;
     else if (code == RPC_METHOD_NOT_FOUND) nStatus = HTTP_NOT_FOUND;
     string strReply = JSONRPCReply(Value::null, objError, id);
-    stream << HTTPReply(nStatus, strReply, false) << std::flush;
+    return HTTPReply(nStatus, strReply, fKeepAlive);
 }
 
 bool ClientAllowed(const boost::asio::ip::address& address)
@@ -628,51 +688,196 @@ private:
     asio::ssl::stream<typename Protocol::socket>& stream;
 };
 
-class AcceptedConnection
-{
-public:
-    virtual ~AcceptedConnection() {}
-
-    virtual std::iostream& stream() = 0;
-    virtual std::string peer_address_to_string() const = 0;
-    virtual void close() = 0;
-};
+static CRPCWorkQueue rpcWorkQueue(DEFAULT_RPC_WORKQUEUE);
 
+/** A client connection. Reads, writes and the TLS handshake run
+ *  asynchronously on the listener thread. Each complete request is handed
+ *  to the work queue, and the next one in the buffer is only parsed after
+ *  its reply has been written, so pipelined requests are answered in order
+ *  and one connection never holds more than one worker.
+ */
 template <typename Protocol>
-class AcceptedConnectionImpl : public AcceptedConnection
+class CRPCConnection : public boost::enable_shared_from_this< CRPCConnection<Protocol> >
 {
 public:
-    AcceptedConnectionImpl(
-            asio::io_service& io_service,
+    CRPCConnection(
+            asio::io_service& io_serviceIn,
             ssl::context &context,
-            bool fUseSSL) :
-        sslStream(io_service, context),
-        _d(sslStream, fUseSSL),
-        _stream(_d)
-    {
-    }
-
-    virtual std::iostream& stream()
+            bool fUseSSLIn) :
+        sslStream(io_serviceIn, context),
+        io_service(io_serviceIn),
+        timer(io_serviceIn),
+        fUseSSL(fUseSSLIn),
+        fClose(false)
     {
-        return _stream;
     }
 
-    virtual std::string peer_address_to_string() const
+    void Start()
     {
-        return peer.address().to_string();
+        if (!fUseSSL)
+        {
+            Read();
+            return;
+        }
+        SetTimer();
+        sslStream.async_handshake(ssl::stream_base::server,
+            boost::bind(&CRPCConnection::HandleHandshake, this->shared_from_this(), asio::placeholders::error));
     }
 
-    virtual void close()
+    // Write a reply, then go on to the next request unless the connection
+    // is to be closed. Only called on the listener thread.
+    void Reply(const string& strReply, bool fKeepAlive)
     {
-        _stream.close();
+        strWrite = strReply;
+        fClose = !fKeepAlive;
+        SetTimer();
+        if (fUseSSL)
+            asio::async_write(sslStream, asio::buffer(strWrite),
+                boost::bind(&CRPCConnection::HandleWrite, this->shared_from_this(), asio::placeholders::error));
+        else
+            asio::async_write(sslStream.next_layer(), asio::buffer(strWrite),
+                boost::bind(&CRPCConnection::HandleWrite, this->shared_from_this(), asio::placeholders::error));
     }
 
     typename Protocol::endpoint peer;
     asio::ssl::stream<typename Protocol::socket> sslStream;
 
 private:
-    SSLIOStreamDevice<Protocol> _d;
-    iostreams::stream< SSLIOStreamDevice<Protocol> > _stream;
+    asio::io_service& io_service;
+    asio::deadline_timer timer;
+    bool fUseSSL;
+    bool fClose;
+    string strBuffer; // received but not parsed yet
+    string strWrite;
+    char pchRead[4096];
+
+    void SetTimer()
+    {
+        timer.expires_from_now(boost::posix_time::seconds(RPC_IDLE_TIMEOUT));
+        timer.async_wait(boost::bind(&CRPCConnection::HandleTimeout, this->shared_from_this(), asio::placeholders::error));
+    }
+
+    // Push the deadline out of reach, so a timeout that fired just before
+    // can't close the connection while a worker runs its request
+    void CancelTimer()
+    {
+        timer.expires_at(boost::posix_time::pos_infin);
+    }
+
+    void HandleTimeout(const boost::system::error_code& error)
+    {
+        if (!error && timer.expires_at() <= asio::deadline_timer::traits_type::now())
+            Close();
+    }
+
+    void HandleHandshake(const boost::system::error_code& error)
+    {
+        CancelTimer();
+        if (error)
+            Close();
+        else
+            Read();
+    }
+
+    void Read()
+    {
+        SetTimer();
+        if (fUseSSL)
+            sslStream.async_read_some(asio::buffer(pchRead, sizeof(pchRead)),
+                boost::bind(&CRPCConnection::HandleRead, this->shared_from_this(),
+                    asio::placeholders::error, asio::placeholders::bytes_transferred));
+        else
+            sslStream.next_layer().async_read_some(asio::buffer(pchRead, sizeof(pchRead)),
+                boost::bind(&CRPCConnection::HandleRead, this->shared_from_this(),
+                    asio::placeholders::error, asio::placeholders::bytes_transferred));
+    }
+
+    void HandleRead(const boost::system::error_code& error, size_t nBytes)
+    {
+        CancelTimer();
+        if (error || fShutdown)
+        {
+            Close();
+            return;
+        }
+        strBuffer.append(pchRead, nBytes);
+        Process();
+    }
+
+    void HandleWrite(const boost::system::error_code& error)
+    {
+        CancelTimer();
+        if (error || fClose || fShutdown)
+        {
+            Close();
+            return;
+        }
+        string().swap(strWrite);
+        Process();
+    }
+
+    // Queue the next buffered request, or read more if there is none
+    void Process()
+    {
+        map<string, string> mapHeaders;
+        string strRequest;
+        int nUsed = ReadHTTPRequest(strBuffer, mapHeaders, strRequest);
+        if (nUsed == 0)
+        {
+            Read();
+            return;
+        }
+        if (nUsed < 0)
+        {
+            Reply(HTTPReply(HTTP_BAD_REQUEST, "", false), false);
+            return;
+        }
+        strBuffer.erase(0, nUsed);
+
+        if (!rpcWorkQueue.Enqueue(boost::bind(&CRPCConnection::Execute, this->shared_from_this(), mapHeaders, strRequest)))
+        {
+            printf("ThreadRPCServer work queue full, rejecting request from %s\n", peer.address().to_string().c_str());
+            bool fKeepAlive = mapHeaders["connection"] != "close";
+            Reply(HTTPReply(HTTP_SERVICE_UNAVAILABLE, "", fKeepAlive), fKeepAlive);
+        }
+    }
+
+    // Runs on a worker thread, and hands the reply back to the listener
+    void Execute(map<string, string>& mapHeaders, const string& strRequest)
+    {
+        bool fKeepAlive = false;
+        int nDelayMs = 0;
+        string strReply = HTTPExecute(mapHeaders, strRequest, peer.address().to_string(), fKeepAlive, nDelayMs);
+        if (nDelayMs > 0)
+            io_service.post(boost::bind(&CRPCConnection::ReplyLater, this->shared_from_this(), strReply, fKeepAlive, nDelayMs));
+        else
+            io_service.post(boost::bind(&CRPCConnection::Reply, this->shared_from_this(), strReply, fKeepAlive));
+    }
+
+    // Hold a reply back on the connection's timer, leaving the worker free
+    void ReplyLater(const string& strReply, bool fKeepAlive, int nDelayMs)
+    {
+        timer.expires_from_now(boost::posix_time::milliseconds(nDelayMs));
+        timer.async_wait(boost::bind(&CRPCConnection::HandleDelay, this->shared_from_this(),
+            asio::placeholders::error, strReply, fKeepAlive));
+    }
+
+    void HandleDelay(const boost::system::error_code& error, const string& strReply, bool fKeepAlive)
+    {
+        if (error || fShutdown)
+        {
+            Close();
+            return;
+        }
+        Reply(strReply, fKeepAlive);
+    }
+
+    void Close()
+    {
+        CancelTimer();
+        boost::system::error_code error;
+        sslStream.lowest_layer().close(error);
+    }
 };
 
 void ThreadRPCServer(void* parg)
@@ -701,7 +906,7 @@ template <typename Protocol, typename SocketAcceptorService>
 static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
                              ssl::context& context,
                              bool fUseSSL,
-                             AcceptedConnection* conn,
+                             boost::shared_ptr< CRPCConnection<Protocol> > conn,
                              const boost::system::error_code& error);
 
 /**
@@ -713,7 +918,7 @@ static void RPCListen(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketA
                    const bool fUseSSL)
 {
     // Accept connection
-    AcceptedConnectionImpl<Protocol>* conn = new AcceptedConnectionImpl<Protocol>(acceptor->get_io_service(), context, fUseSSL);
+    boost::shared_ptr< CRPCConnection<Protocol> > conn(new CRPCConnection<Protocol>(acceptor->get_io_service(), context, fUseSSL));
 
     acceptor->async_accept(
             conn->sslStream.lowest_layer(),
@@ -733,7 +938,7 @@ template <typename Protocol, typename SocketAcceptorService>
 static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
                              ssl::context& context,
                              const bool fUseSSL,
-                             AcceptedConnection* conn,
+                             boost::shared_ptr< CRPCConnection<Protocol> > conn,
                              const boost::system::error_code& error)
 {
     vnThreadsRunning[THREAD_RPCLISTENER]++;
@@ -743,30 +948,18 @@ static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol,
      && acceptor->is_open())
         RPCListen(acceptor, context, fUseSSL);
 
-    AcceptedConnectionImpl<ip::tcp>* tcp_conn = dynamic_cast< AcceptedConnectionImpl<ip::tcp>* >(conn);
-
     // TODO: Actually handle errors
-    if (error)
+    if (!error)
     {
-        delete conn;
-    }
+        // Restrict callers by IP.  It is important to
+        // do this before reading any request, to filter out
+        // certain DoS and misbehaving clients.
+        if (ClientAllowed(conn->peer.address()))
+            conn->Start();
 
-    // Restrict callers by IP.  It is important to
-    // do this before starting client thread, to filter out
-    // certain DoS and misbehaving clients.
-    else if (tcp_conn
-          && !ClientAllowed(tcp_conn->peer.address()))
-    {
         // Only send a 403 if we're not using SSL to prevent a DoS during the SSL handshake.
-        if (!fUseSSL)
-            conn->stream() << HTTPReply(HTTP_FORBIDDEN, "", false) << std::flush;
-        delete conn;
-    }
-
-    // start HTTP client thread
-    else if (!NewThread(ThreadRPCServer3, conn)) {
-        printf("Failed to create RPC server client thread\n");
-        delete conn;
+        else if (!fUseSSL)
+            conn->Reply(HTTPReply(HTTP_FORBIDDEN, "", false), false);
     }
 
     vnThreadsRunning[THREAD_RPCLISTENER]--;
@@ -896,11 +1089,25 @@ void ThreadRPCServer2(void* parg)
         return;
     }
 
+    // Start the worker pool
+    rpcWorkQueue.SetMaxDepth(max((int)GetArg("-rpcworkqueue", DEFAULT_RPC_WORKQUEUE), 1));
+    int nThreads = max((int)GetArg("-rpcthreads", DEFAULT_RPC_THREADS), 1);
+    for (int i = 0; i < nThreads; i++)
+        if (!NewThread(ThreadRPCServer3, NULL))
+            printf("Failed to create RPC server worker thread\n");
+
     vnThreadsRunning[THREAD_RPCLISTENER]--;
     while (!fShutdown)
         io_service.run_one();
     vnThreadsRunning[THREAD_RPCLISTENER]++;
     StopRequests();
+
+    // Wait for the workers to finish what they are running, then write out
+    // replies that are ready, such as the one to "stop"
+    while (vnThreadsRunning[THREAD_RPCHANDLER] > 0)
+        MilliSleep(20);
+    rpcWorkQueue.Clear();
+    io_service.poll();
 }
 
 class JSONRequest
@@ -944,138 +1151,163 @@ void JSONRequest::parse(const Value& valRequest)
         throw JSONRPCError(RPC_INVALID_REQUEST, "Params must be an array");
 }
 
-static Object JSONRPCExecOne(const Value& req)
+// Run a parsed request and write its reply object, with the result written
+// straight into it rather than built as a json_spirit value first
+static void JSONRPCExecReply(const JSONRequest& jreq, CJSONWriter& reply)
 {
-    Object rpc_result;
+    reply.BeginObject();
+    reply.Key("result");
+    tableRPC.execute(jreq.strMethod, jreq.params, reply);
+    reply.Pair("error", Value::null);
+    reply.Pair("id", jreq.id);
+    reply.EndObject();
+}
+
+static void JSONRPCExecOne(const Value& req, CJSONWriter& ret)
+{
+    CJSONWriter reply;
 
     JSONRequest jreq;
     try {
         jreq.parse(req);
 
-        Value result = tableRPC.execute(jreq.strMethod, jreq.params);
-        rpc_result = JSONRPCReplyObj(result, Value::null, jreq.id);
+        JSONRPCExecReply(jreq, reply);
     }
     catch (Object& objError)
     {
-        rpc_result = JSONRPCReplyObj(Value::null, objError, jreq.id);
+        reply.clear();
+        reply.Write(JSONRPCReplyObj(Value::null, objError, jreq.id));
     }
     catch (std::exception& e)
     {
-        rpc_result = JSONRPCReplyObj(Value::null,
-                                     JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
+        reply.clear();
+        reply.Write(JSONRPCReplyObj(Value::null,
+                                    JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id));
     }
 
-    return rpc_result;
+    ret.Raw(reply.str());
 }
 
 static string JSONRPCExecBatch(const Array& vReq)
 {
-    Array ret;
+    CJSONWriter ret;
+    ret.BeginArray();
     for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
+        JSONRPCExecOne(vReq[reqIdx], ret);
+    ret.EndArray();
 
-    return write_string(Value(ret), false) + "\n";
+    return ret.str() + "\n";
 }
 
 static CCriticalSection cs_THREAD_RPCHANDLER;
 
 void ThreadRPCServer3(void* parg)
 {
-    // Make this thread recognisable as the RPC handler
-    RenameThread("blocknet-rpchand");
+    // Make this thread recognisable as an RPC worker
+    RenameThread("blocknet-rpcwork");
 
     {
         LOCK(cs_THREAD_RPCHANDLER);
         vnThreadsRunning[THREAD_RPCHANDLER]++;
     }
-    AcceptedConnection *conn = (AcceptedConnection *) parg;
 
-    bool fRun = true;
-    while (true)
+    try
     {
-        if (fShutdown || !fRun)
-        {
-            conn->close();
-            delete conn;
-            {
-                LOCK(cs_THREAD_RPCHANDLER);
-                --vnThreadsRunning[THREAD_RPCHANDLER];
-            }
-            return;
-        }
-        map<string, string> mapHeaders;
-        string strRequest;
+        rpcWorkQueue.Thread();
+    }
+    catch (std::exception& e) {
+        PrintException(&e, "ThreadRPCServer3()");
+    } catch (...) {
+        PrintException(NULL, "ThreadRPCServer3()");
+    }
 
-        ReadHTTP(conn->stream(), mapHeaders, strRequest);
+    {
+        LOCK(cs_THREAD_RPCHANDLER);
+        vnThreadsRunning[THREAD_RPCHANDLER]--;
+    }
+}
 
-        // Check authorization
-        if (mapHeaders.count("authorization") == 0)
-        {
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
-        }
-        if (!HTTPAuthorized(mapHeaders))
-        {
-            printf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string().c_str());
-            /* Deter brute-forcing short passwords.
-               If this results in a DOS the user really
-               shouldn't have their RPC port exposed.*/
-            if (mapArgs["-rpcpassword"].size() < 20)
-                MilliSleep(250);
-
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
-        }
-        if (mapHeaders["connection"] == "close")
-            fRun = false;
+// Authorize and run one HTTP request, returning the full HTTP reply.
+// fKeepAlive is set when the connection may stay open for the next one, and
+// nDelayMs to how long the reply is to be held back.
+static string HTTPExecute(map<string, string>& mapHeaders, const string& strRequest, const string& strPeer, bool& fKeepAlive, int& nDelayMs)
+{
+    fKeepAlive = false;
+    nDelayMs = 0;
 
-        JSONRequest jreq;
-        try
-        {
-            // Parse request
-            Value valRequest;
-            if (!read_string(strRequest, valRequest))
-                throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
+    // Check authorization
+    if (mapHeaders.count("authorization") == 0)
+        return HTTPReply(HTTP_UNAUTHORIZED, "", false);
+    if (!HTTPAuthorized(mapHeaders))
+    {
+        printf("ThreadRPCServer incorrect password attempt from %s\n", strPeer.c_str());
+        /* Deter brute-forcing short passwords.
+           If this results in a DOS the user really
+           shouldn't have their RPC port exposed.*/
+        if (mapArgs["-rpcpassword"].size() < 20)
+            nDelayMs = 250;
+
+        return HTTPReply(HTTP_UNAUTHORIZED, "", false);
+    }
+    fKeepAlive = mapHeaders["connection"] != "close";
 
-            string strReply;
+    JSONRequest jreq;
+    try
+    {
+        // Parse request
+        Value valRequest;
+        if (!ReadJSON(strRequest, valRequest))
+            throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
 
-            // singleton request
-            if (valRequest.type() == obj_type) {
-                jreq.parse(valRequest);
+        string strReply;
 
-                Value result = tableRPC.execute(jreq.strMethod, jreq.params);
+        // singleton request
+        if (valRequest.type() == obj_type) {
+            jreq.parse(valRequest);
 
-                // Send reply
-                strReply = JSONRPCReply(result, Value::null, jreq.id);
+            CJSONWriter reply;
+            JSONRPCExecReply(jreq, reply);
 
-            // array of requests
-            } else if (valRequest.type() == array_type)
-                strReply = JSONRPCExecBatch(valRequest.get_array());
-            else
-                throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
+            // Send reply
+            strReply = reply.str() + "\n";
 
-            conn->stream() << HTTPReply(HTTP_OK, strReply, fRun) << std::flush;
-        }
-        catch (Object& objError)
-        {
-            ErrorReply(conn->stream(), objError, jreq.id);
-            break;
-        }
-        catch (std::exception& e)
-        {
-            ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
-            break;
-        }
-    }
+        // array of requests
+        } else if (valRequest.type() == array_type)
+            strReply = JSONRPCExecBatch(valRequest.get_array());
+        else
+            throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
 
-    delete conn;
+        return HTTPReply(HTTP_OK, strReply, fKeepAlive);
+    }
+    catch (Object& objError)
     {
-        LOCK(cs_THREAD_RPCHANDLER);
-        vnThreadsRunning[THREAD_RPCHANDLER]--;
+        return ErrorReply(objError, jreq.id, fKeepAlive);
     }
+    catch (std::exception& e)
+    {
+        return ErrorReply(JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id, fKeepAlive);
+    }
+}
+
+// Stream actors write while holding the command's locks, since the state
+// they report may change once released
+static void RunCommand(const CRPCCommand* pcmd, const Array& params, Value& value, CJSONHandler& result)
+{
+    if (pcmd->streamActor)
+        pcmd->streamActor(params, false, result);
+    else
+        value = pcmd->actor(params, false);
 }
 
 json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
+{
+    Value result;
+    CJSONValueBuilder builder(result);
+    execute(strMethod, params, builder);
+    return result;
+}
+
+void CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params, CJSONHandler& result) const
 {
     // Find method
     const CRPCCommand *pcmd = tableRPC[strMethod];
@@ -1091,16 +1323,27 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
     try
     {
         // Execute
-        Value result;
+        Value value;
+        switch (pcmd->lockMode)
+        {
+        case RPC_LOCK_NONE:
+            RunCommand(pcmd, params, value, result);
+            break;
+        case RPC_LOCK_MAIN:
         {
-            if (pcmd->unlocked)
-                result = pcmd->actor(params, false);
-            else {
-                LOCK2(cs_main, pwalletMain->cs_wallet);
-                result = pcmd->actor(params, false);
-            }
+            LOCK(cs_main);
+            RunCommand(pcmd, params, value, result);
+            break;
+        }
+        case RPC_LOCK_WALLET:
+        {
+            LOCK2(cs_main, pwalletMain->cs_wallet);
+            RunCommand(pcmd, params, value, result);
+            break;
+        }
         }
-        return result;
+        if (!pcmd->streamActor)
+            result.Write(value);
     }
     catch (std::exception& e)
     {
@@ -1151,7 +1394,7 @@ Object CallRPC(const string& strMethod, const Array& params)
 
     // Parse reply
     Value valReply;
-    if (!read_string(strReply, valReply))
+    if (!ReadJSON(strReply, valReply))
         throw runtime_error("couldn't parse reply from server");
     const Object& reply = valReply.get_obj();
     if (reply.empty())
@@ -1173,7 +1416,7 @@ void ConvertTo(Value& value, bool fAllowNull=false)
         // reinterpret string as unquoted json value
         Value value2;
         string strJSON = value.get_str();
-        if (!read_string(strJSON, value2))
+        if (!ReadJSON(strJSON, value2))
             throw runtime_error(string("Error parsing JSON:")+strJSON);
         ConvertTo<T>(value2, fAllowNull);
         value = value2;
@@ -9,8 +9,12 @@
 #include <string>
 #include <list>
 #include <map>
+#include <deque>
+
+#include <boost/function.hpp>
 
 class CBlockIndex;
+class CJSONHandler;
 
 #include "json/json_spirit_reader_template.h"
 #include "json/json_spirit_writer_template.h"
@@ -28,6 +32,7 @@ enum HTTPStatusCode
     HTTP_FORBIDDEN             = 403,
     HTTP_NOT_FOUND             = 404,
     HTTP_INTERNAL_SERVER_ERROR = 500,
+    HTTP_SERVICE_UNAVAILABLE   = 503,
 };
 
 // Bitcoin RPC error codes
@@ -71,6 +76,78 @@ json_spirit::Object JSONRPCError(int code, const std::string& message);
 void ThreadRPCServer(void* parg);
 int CommandLineRPC(int argc, char *argv[]);
 
+static const unsigned int MAX_HTTP_HEADER_SIZE = 8192;
+
+std::string HTTPReply(int nStatus, const std::string& strMsg, bool keepalive);
+// Parse one request from the front of strBuffer. Returns the number of bytes
+// it took, 0 if the request isn't complete yet, or -1 if it is malformed.
+int ReadHTTPRequest(const std::string& strBuffer, std::map<std::string, std::string>& mapHeadersRet, std::string& strMessageRet);
+
+/** Parsed requests waiting for one of the -rpcthreads worker threads. The
+ *  listener thread only does the socket I/O and never blocks on a command;
+ *  when the queue is full new requests are turned away with a 503.
+ */
+class CRPCWorkQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque< boost::function<void ()> > queue;
+    unsigned int nMaxDepth;
+
+public:
+    explicit CRPCWorkQueue(unsigned int nMaxDepthIn) : nMaxDepth(nMaxDepthIn) {}
+
+    void SetMaxDepth(unsigned int nMaxDepthIn)
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        nMaxDepth = nMaxDepthIn;
+    }
+
+    bool Enqueue(const boost::function<void ()>& job)
+    {
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            if (queue.size() >= nMaxDepth)
+                return false;
+            queue.push_back(job);
+        }
+        cond.notify_one();
+        return true;
+    }
+
+    // Take the oldest job, waiting up to nTimeoutMs for one
+    bool Dequeue(boost::function<void ()>& job, int nTimeoutMs)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (queue.empty())
+            cond.timed_wait(lock, boost::posix_time::milliseconds(nTimeoutMs));
+        if (queue.empty())
+            return false;
+        job.swap(queue.front());
+        queue.pop_front();
+        return true;
+    }
+
+    // Worker thread, runs jobs until shutdown
+    void Thread()
+    {
+        while (!fShutdown)
+        {
+            boost::function<void ()> job;
+            if (Dequeue(job, 100))
+                job();
+        }
+    }
+
+    // Drop what is left once the workers are gone
+    void Clear()
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        queue.clear();
+    }
+};
+
 /** Convert parameter values for RPC call from strings to command-specific JSON objects. */
 json_spirit::Array RPCConvertValues(const std::string &strMethod, const std::vector<std::string> &strParams);
 
@@ -89,6 +166,16 @@ void RPCTypeCheck(const json_spirit::Object& o,
                   const std::map<std::string, json_spirit::Value_type>& typesExpected, bool fAllowNull=false);
 
 typedef json_spirit::Value(*rpcfn_type)(const json_spirit::Array& params, bool fHelp);
+/** Writes the result into a CJSONHandler instead of returning it, for commands with big replies */
+typedef void(*rpcstreamfn_type)(const json_spirit::Array& params, bool fHelp, CJSONHandler& result);
+
+/** Global locks CRPCTable::execute holds while a command runs */
+enum RPCLockMode
+{
+    RPC_LOCK_NONE,   // the command takes whatever locks it needs itself
+    RPC_LOCK_MAIN,   // cs_main
+    RPC_LOCK_WALLET, // cs_main and pwalletMain->cs_wallet
+};
 
 class CRPCCommand
 {
@@ -96,7 +183,8 @@ public:
     std::string name;
     rpcfn_type actor;
     bool okSafeMode;
-    bool unlocked;
+    RPCLockMode lockMode;
+    rpcstreamfn_type streamActor; // used instead of actor by the server when set
 };
 
 /**
@@ -119,6 +207,13 @@ public:
      * @throws an exception (json_spirit::Value) when an error happens.
      */
     json_spirit::Value execute(const std::string &method, const json_spirit::Array &params) const;
+
+    /**
+     * Execute a method, writing its result into a handler. Commands with a
+     * stream actor write while they run, others are written when done.
+     * @throws like execute, in which case part of the result may be written.
+     */
+    void execute(const std::string &method, const json_spirit::Array &params, CJSONHandler& result) const;
 };
 
 extern const CRPCTable tableRPC;
@@ -184,6 +279,7 @@ json_spirit::Value addredeemscript(const json_spirit::Array& params, bool fHelp)
 json_spirit::Value listreceivedbyaddress(const json_spirit::Array& params, bool fHelp);
 json_spirit::Value listreceivedbyaccount(const json_spirit::Array& params, bool fHelp);
 json_spirit::Value listtransactions(const json_spirit::Array& params, bool fHelp);
+void streamlisttransactions(const json_spirit::Array& params, bool fHelp, CJSONHandler& result);
 json_spirit::Value listaddressgroupings(const json_spirit::Array& params, bool fHelp);
 json_spirit::Value listaccounts(const json_spirit::Array& params, bool fHelp);
 json_spirit::Value listsinceblock(const json_spirit::Array& params, bool fHelp);
@@ -219,10 +315,15 @@ json_spirit::Value getblockcount(const json_spirit::Array& params, bool fHelp);
 json_spirit::Value getdifficulty(const json_spirit::Array& params, bool fHelp);
 json_spirit::Value settxfee(const json_spirit::Array& params, bool fHelp);
 json_spirit::Value getrawmempool(const json_spirit::Array& params, bool fHelp);
+void streamgetrawmempool(const json_spirit::Array& params, bool fHelp, CJSONHandler& result);
+json_spirit::Value getmempoolinfo(const json_spirit::Array& params, bool fHelp);
 json_spirit::Value getblockhash(const json_spirit::Array& params, bool fHelp);
 json_spirit::Value getblock(const json_spirit::Array& params, bool fHelp);
+void streamgetblock(const json_spirit::Array& params, bool fHelp, CJSONHandler& result);
 json_spirit::Value getblockbynumber(const json_spirit::Array& params, bool fHelp);
+void streamgetblockbynumber(const json_spirit::Array& params, bool fHelp, CJSONHandler& result);
 json_spirit::Value getcheckpoint(const json_spirit::Array& params, bool fHelp);
+json_spirit::Value getsigcacheinfo(const json_spirit::Array& params, bool fHelp);
 
 extern json_spirit::Value dxGetTransactionList(const json_spirit::Array& params, bool fHelp); // in bitcoinrpchandlers.cpp
 extern json_spirit::Value dxGetTransactionsHistoryList(const json_spirit::Array& params, bool fHelp);
@@ -0,0 +1,142 @@
+// Copyright (c) 2014 The Blocknet developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "blockstore.h"
+#include "main.h"
+
+using namespace std;
+
+/** A read-only mapping of a whole block file as it was when mapped. */
+class CBlockFileMapping
+{
+public:
+    const char* pdata;
+    size_t nSize;
+#ifdef WIN32
+    HANDLE hMapping;
+#endif
+
+    CBlockFileMapping() : pdata(NULL), nSize(0)
+    {
+#ifdef WIN32
+        hMapping = NULL;
+#endif
+    }
+
+    ~CBlockFileMapping()
+    {
+#ifdef WIN32
+        if (pdata)
+            UnmapViewOfFile(pdata);
+        if (hMapping)
+            CloseHandle(hMapping);
+#else
+        if (pdata)
+            munmap((void*)pdata, nSize);
+#endif
+    }
+
+    bool Map(const boost::filesystem::path& path)
+    {
+#ifdef WIN32
+        HANDLE hFile = CreateFileA(path.string().c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                   NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER nFileSize;
+        if (!GetFileSizeEx(hFile, &nFileSize) || nFileSize.QuadPart == 0)
+        {
+            CloseHandle(hFile);
+            return false;
+        }
+        hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        CloseHandle(hFile);
+        if (!hMapping)
+            return false;
+        pdata = (const char*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+        if (!pdata)
+            return false;
+        nSize = nFileSize.QuadPart;
+#else
+        int fd = open(path.string().c_str(), O_RDONLY);
+        if (fd == -1)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+            close(fd);
+            return false;
+        }
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+            return false;
+        pdata = (const char*)p;
+        nSize = st.st_size;
+#endif
+        return true;
+    }
+};
+
+void CBlockStore::SetEnabled(bool fEnabledIn)
+{
+    LOCK(cs);
+    fEnabled = fEnabledIn;
+    if (!fEnabled)
+        mapFiles.clear();
+}
+
+bool CBlockStore::GetSpan(unsigned int nFile, unsigned int nPos, CBlockSpan& span)
+{
+    LOCK(cs);
+    if (!fEnabled)
+        return false;
+
+    map<unsigned int, CMappedFile>::iterator mi = mapFiles.find(nFile);
+    if (mi == mapFiles.end() || nPos >= mi->second.mapping->nSize)
+    {
+        // Not mapped yet, or the file has grown past the mapping
+        boost::shared_ptr<CBlockFileMapping> mapping(new CBlockFileMapping());
+        if (!mapping->Map(BlockFilePath(nFile)) || nPos >= mapping->nSize)
+            return false;
+
+        if (mi == mapFiles.end() && mapFiles.size() >= BLOCKSTORE_MAX_MAPPINGS)
+        {
+            map<unsigned int, CMappedFile>::iterator miOldest = mapFiles.begin();
+            for (map<unsigned int, CMappedFile>::iterator it = mapFiles.begin(); it != mapFiles.end(); ++it)
+                if (it->second.nLastUsed < miOldest->second.nLastUsed)
+                    miOldest = it;
+            mapFiles.erase(miOldest);
+        }
+        mi = mapFiles.insert(make_pair(nFile, CMappedFile())).first;
+        mi->second.mapping = mapping;
+    }
+    mi->second.nLastUsed = ++nUseCounter;
+
+    span.mapping = mi->second.mapping;
+    span.pbegin = span.mapping->pdata + nPos;
+    span.pend = span.mapping->pdata + span.mapping->nSize;
+    return true;
+}
+
+void CBlockStore::Invalidate(unsigned int nFile)
+{
+    LOCK(cs);
+    mapFiles.erase(nFile);
+}
+
+CBlockStore& GetBlockStore()
+{
+    static CBlockStore blockStore;
+    return blockStore;
+}
@@ -0,0 +1,89 @@
+// Copyright (c) 2014 The Blocknet developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKSTORE_H
+#define BITCOIN_BLOCKSTORE_H
+
+#include <map>
+
+#include <boost/shared_ptr.hpp>
+
+#include "serialize.h"
+#include "sync.h"
+
+class CBlockFileMapping;
+
+/** Maximum number of block files kept mapped at once */
+static const unsigned int BLOCKSTORE_MAX_MAPPINGS = 64;
+
+/** Bytes of a mapped block file from a given position to the end of the
+ *  mapping. Holds a reference to the mapping, so it stays readable after
+ *  the store has dropped the file.
+ */
+class CBlockSpan
+{
+public:
+    boost::shared_ptr<CBlockFileMapping> mapping;
+    const char* pbegin;
+    const char* pend;
+
+    CBlockSpan() : pbegin(NULL), pend(NULL) {}
+};
+
+/** Read-only access to the blkNNNN.dat files through memory mappings that
+ *  are created once per file and shared by every read, instead of an
+ *  fopen/fseek/fread for each block or transaction. Block files are only
+ *  ever appended to, so a mapping stays valid and is only replaced when a
+ *  read reaches past its end.
+ */
+class CBlockStore
+{
+private:
+    struct CMappedFile
+    {
+        boost::shared_ptr<CBlockFileMapping> mapping;
+        int64_t nLastUsed;
+    };
+
+    CCriticalSection cs;
+    std::map<unsigned int, CMappedFile> mapFiles;
+    int64_t nUseCounter;
+    bool fEnabled;
+
+public:
+    CBlockStore() : nUseCounter(0), fEnabled(true) {}
+
+    void SetEnabled(bool fEnabledIn);
+
+    // Map the tail of block file nFile starting at nPos
+    bool GetSpan(unsigned int nFile, unsigned int nPos, CBlockSpan& span);
+
+    // Forget the mapping of nFile, so the next read maps it again
+    void Invalidate(unsigned int nFile);
+};
+
+CBlockStore& GetBlockStore();
+
+/** Unserialize an object stored at nPos of block file nFile directly from
+ *  its mapping. Returns false if the file can't be mapped or the object
+ *  doesn't fit in what was mapped, so the caller can fall back to stdio.
+ */
+template<typename T>
+bool ReadFromBlockStore(unsigned int nFile, unsigned int nPos, int nType, int nVersion, T& obj)
+{
+    CBlockSpan span;
+    if (!GetBlockStore().GetSpan(nFile, nPos, span))
+        return false;
+    try {
+        CSpanReader reader(span.pbegin, span.pend, nType, nVersion);
+        reader >> obj;
+    }
+    catch (std::exception &e) {
+        // The object may have been written after the file was mapped
+        GetBlockStore().Invalidate(nFile);
+        return false;
+    }
+    return true;
+}
+
+#endif
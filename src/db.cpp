@@ -363,6 +363,126 @@ bool CDBEnv::RemoveDb(const string& strFile)
     return (rc == 0);
 }
 
+void CDBEnv::BeginBatch(const string& strFile)
+{
+    if (strFile.empty())
+        return;
+    LOCK(cs_db);
+    mapBatch[make_pair(strFile, boost::this_thread::get_id())].nDepth++;
+}
+
+bool CDBEnv::EndBatch(const string& strFile)
+{
+    if (strFile.empty())
+        return true;
+    BatchKey key(strFile, boost::this_thread::get_id());
+    {
+        LOCK(cs_db);
+        map<BatchKey, CBatch>::iterator mi = mapBatch.find(key);
+        if (mi == mapBatch.end() || --mi->second.nDepth > 0)
+            return true;
+    }
+
+    // The batch stays listed until committed, so writes from other threads
+    // keep waiting for the commit
+    bool fSuccess = WriteBatch(strFile);
+    LOCK(cs_db);
+    map<BatchKey, CBatch>::iterator mi = mapBatch.find(key);
+    if (mi != mapBatch.end())
+    {
+        if (mi->second.fFailed)
+            fSuccess = false;
+        mapBatch.erase(mi);
+    }
+    return fSuccess;
+}
+
+void CDBEnv::Unbatch(const string& strFile, const CDBData& vchKey)
+{
+    LOCK(cs_db);
+    for (map<BatchKey, CBatch>::iterator mi = mapBatch.begin(); mi != mapBatch.end(); ++mi)
+        if (mi->first.first == strFile)
+            mi->second.mapWrites.erase(vchKey);
+}
+
+/** Commits the pending writes of a batch inside one transaction */
+class CBatchWriter : public CDB
+{
+public:
+    explicit CBatchWriter(const string& strFile) : CDB(strFile.c_str(), "r+") {}
+
+    bool Write(const map<CDBData, pair<bool, CDBData> >& mapWrites)
+    {
+        if (!TxnBegin())
+            return false;
+        for (map<CDBData, pair<bool, CDBData> >::const_iterator it = mapWrites.begin(); it != mapWrites.end(); ++it)
+        {
+            Dbt datKey((void*)it->first.data(), it->first.size());
+            int ret;
+            if (it->second.first)
+            {
+                ret = pdb->del(activeTxn, &datKey, 0);
+                if (ret == DB_NOTFOUND)
+                    ret = 0;
+            }
+            else
+            {
+                Dbt datValue((void*)it->second.second.data(), it->second.second.size());
+                ret = pdb->put(activeTxn, &datKey, &datValue, 0);
+            }
+            if (ret != 0)
+            {
+                TxnAbort();
+                return false;
+            }
+        }
+        return TxnCommit();
+    }
+};
+
+bool CDBEnv::WriteBatch(const string& strFile)
+{
+    BatchKey key(strFile, boost::this_thread::get_id());
+
+    // Nothing to do, as for the writer's own transaction below
+    {
+        LOCK(cs_db);
+        map<BatchKey, CBatch>::iterator mi = mapBatch.find(key);
+        if (mi == mapBatch.end() || mi->second.mapWrites.empty())
+            return true;
+    }
+
+    // The writes are taken out with the commit lock held, so a direct write
+    // that missed them in Unbatch waits for them to land. The commit runs
+    // without cs_db: it waits on page locks that a thread inside a
+    // transaction may hold while it goes on to take cs_db.
+    map<CDBData, pair<bool, CDBData> > mapWrites;
+    bool fSuccess;
+    {
+        boost::lock_guard<boost::mutex> lock(mutexBatchCommit);
+        {
+            LOCK(cs_db);
+            map<BatchKey, CBatch>::iterator mi = mapBatch.find(key);
+            if (mi == mapBatch.end() || mi->second.mapWrites.empty())
+                return true;
+            mapWrites.swap(mi->second.mapWrites);
+        }
+        fSuccess = CBatchWriter(strFile).Write(mapWrites);
+    }
+    if (fSuccess && !fMockDb)
+        dbenv.log_flush(NULL);
+    nWalletDBUpdated++;
+    if (!fSuccess)
+    {
+        LOCK(cs_db);
+        map<BatchKey, CBatch>::iterator mi = mapBatch.find(key);
+        if (mi != mapBatch.end())
+            mi->second.fFailed = true;
+        printf("CDBEnv::WriteBatch() : committing %" PRIszu " writes to %s failed\n", mapWrites.size(), strFile.c_str());
+    }
+    return fSuccess;
+}
+
 bool CDB::Rewrite(const string& strFile, const char* pszSkip)
 {
     while (!fShutdown)
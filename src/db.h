@@ -29,6 +29,8 @@ extern unsigned int nWalletDBUpdated;
 void ThreadFlushWalletDB(void* parg);
 bool BackupWallet(const CWallet& wallet, const std::string& strDest);
 
+typedef std::vector<char, zero_after_free_allocator<char> > CDBData;
+
 
 class CDBEnv
 {
@@ -47,6 +49,22 @@ public:
     std::map<std::string, int> mapFileUseCount;
     std::map<std::string, Db*> mapDb;
 
+    /** Writes to a file held back by a thread's batch, by key. An erase
+     *  is kept as an entry with the flag set and no value. */
+    struct CBatch
+    {
+        int nDepth;
+        bool fFailed; // committing part of it early failed
+        std::map<CDBData, std::pair<bool, CDBData> > mapWrites;
+
+        CBatch() : nDepth(0), fFailed(false) {}
+    };
+    typedef std::pair<std::string, boost::thread::id> BatchKey;
+    std::map<BatchKey, CBatch> mapBatch;
+    // Held while a batch is committed, which happens without cs_db, and by
+    // writes outside any batch so they land after the older values it holds
+    boost::mutex mutexBatchCommit;
+
     CDBEnv();
     ~CDBEnv();
     void MakeMock();
@@ -80,6 +98,23 @@ public:
     void CloseDb(const std::string& strFile);
     bool RemoveDb(const std::string& strFile);
 
+    /*
+     * Writes to strFile made by the calling thread between BeginBatch and
+     * the matching EndBatch are kept in memory, where that thread's reads
+     * see them, and committed in one database transaction with a single log
+     * sync when the outermost batch ends. Writing the same key again
+     * replaces the pending value. Other threads keep writing straight to
+     * the file, and a key they write is taken out of the batch, so it can't
+     * be overwritten with older data later. EndBatch returns false when
+     * anything the batch held could not be committed.
+     */
+    void BeginBatch(const std::string& strFile);
+    bool EndBatch(const std::string& strFile);
+    // Commits what the calling thread's batch on strFile holds so far
+    bool WriteBatch(const std::string& strFile);
+    // Drops a key written directly from every batch on strFile
+    void Unbatch(const std::string& strFile, const CDBData& vchKey);
+
     DbTxn *TxnBegin(int flags=DB_TXN_WRITE_NOSYNC)
     {
         DbTxn* ptxn = NULL;
@@ -92,6 +127,38 @@ public:
 
 extern CDBEnv bitdb;
 
+/** Batches this thread's writes to a database file while in scope */
+class CDBBatch
+{
+private:
+    std::string strFile;
+    bool fOpen;
+
+    CDBBatch(const CDBBatch&);
+    void operator=(const CDBBatch&);
+
+public:
+    explicit CDBBatch(const std::string& strFileIn) : strFile(strFileIn), fOpen(true)
+    {
+        bitdb.BeginBatch(strFile);
+    }
+
+    // Ends the batch, returning false if what it held didn't reach the
+    // file. Inside an enclosing batch this only leaves it, and the
+    // outermost one reports.
+    bool Commit()
+    {
+        fOpen = false;
+        return bitdb.EndBatch(strFile);
+    }
+
+    ~CDBBatch()
+    {
+        if (fOpen)
+            bitdb.EndBatch(strFile);
+    }
+};
+
 
 /** RAII class that provides access to a Berkeley database */
 class CDB
@@ -111,6 +178,23 @@ private:
     void operator=(const CDB&);
 
 protected:
+    // Whether batches need to be looked at. Transactions skip them and
+    // cs_db altogether, as they hold page locks a commit may wait on.
+    bool UseBatches() const
+    {
+        return !activeTxn && !bitdb.mapBatch.empty();
+    }
+
+    // The calling thread's batch on this file, if any. Writes inside an
+    // explicit transaction go straight to it. Call with bitdb.cs_db locked.
+    CDBEnv::CBatch* GetBatch()
+    {
+        if (activeTxn || bitdb.mapBatch.empty())
+            return NULL;
+        std::map<CDBEnv::BatchKey, CDBEnv::CBatch>::iterator mi = bitdb.mapBatch.find(std::make_pair(strFile, boost::this_thread::get_id()));
+        return mi == bitdb.mapBatch.end() ? NULL : &mi->second;
+    }
+
     template<typename K, typename T>
     bool Read(const K& key, T& value)
     {
@@ -123,6 +207,28 @@ protected:
         ssKey << key;
         Dbt datKey(&ssKey[0], ssKey.size());
 
+        // Pending in a batch
+        if (UseBatches())
+        {
+            LOCK(bitdb.cs_db);
+            CDBEnv::CBatch* pbatch = GetBatch();
+            std::map<CDBData, std::pair<bool, CDBData> >::const_iterator mi;
+            if (pbatch && (mi = pbatch->mapWrites.find(CDBData(ssKey.begin(), ssKey.end()))) != pbatch->mapWrites.end())
+            {
+                memset(datKey.get_data(), 0, datKey.get_size());
+                if (mi->second.first)
+                    return false;
+                try {
+                    CDataStream ssValue(mi->second.second.begin(), mi->second.second.end(), SER_DISK, CLIENT_VERSION);
+                    ssValue >> value;
+                }
+                catch (std::exception &e) {
+                    return false;
+                }
+                return true;
+            }
+        }
+
         // Read
         Dbt datValue;
         datValue.set_flags(DB_DBT_MALLOC);
@@ -166,6 +272,44 @@ protected:
         ssValue << value;
         Dbt datValue(&ssValue[0], ssValue.size());
 
+        // Hold back for the batch. The database is only asked whether the
+        // key exists once cs_db is released, as that may wait on a lock.
+        boost::unique_lock<boost::mutex> lockCommit(bitdb.mutexBatchCommit, boost::defer_lock);
+        if (UseBatches())
+        {
+            CDBData vchKey(ssKey.begin(), ssKey.end());
+            bool fBatched, fPending = false, fWrite = fOverwrite;
+            {
+                LOCK(bitdb.cs_db);
+                CDBEnv::CBatch* pbatch = GetBatch();
+                fBatched = (pbatch != NULL);
+                if (!fBatched)
+                    bitdb.Unbatch(strFile, vchKey);
+                else if (!fWrite)
+                {
+                    std::map<CDBData, std::pair<bool, CDBData> >::const_iterator mi = pbatch->mapWrites.find(vchKey);
+                    fPending = (mi != pbatch->mapWrites.end());
+                    fWrite = fPending && mi->second.first;
+                }
+            }
+            if (fBatched)
+            {
+                if (!fOverwrite && !fPending)
+                    fWrite = pdb->exists(NULL, &datKey, 0) != 0;
+                if (fWrite)
+                {
+                    LOCK(bitdb.cs_db);
+                    CDBEnv::CBatch* pbatch = GetBatch();
+                    if (pbatch)
+                        pbatch->mapWrites[vchKey] = std::make_pair(false, CDBData(ssValue.begin(), ssValue.end()));
+                }
+                memset(datKey.get_data(), 0, datKey.get_size());
+                memset(datValue.get_data(), 0, datValue.get_size());
+                return fWrite;
+            }
+            lockCommit.lock();
+        }
+
         // Write
         int ret = pdb->put(activeTxn, &datKey, &datValue, (fOverwrite ? 0 : DB_NOOVERWRITE));
 
@@ -189,6 +333,24 @@ protected:
         ssKey << key;
         Dbt datKey(&ssKey[0], ssKey.size());
 
+        // Hold back for the batch
+        boost::unique_lock<boost::mutex> lockCommit(bitdb.mutexBatchCommit, boost::defer_lock);
+        if (UseBatches())
+        {
+            {
+                LOCK(bitdb.cs_db);
+                CDBEnv::CBatch* pbatch = GetBatch();
+                if (pbatch)
+                {
+                    pbatch->mapWrites[CDBData(ssKey.begin(), ssKey.end())] = std::make_pair(true, CDBData());
+                    memset(datKey.get_data(), 0, datKey.get_size());
+                    return true;
+                }
+                bitdb.Unbatch(strFile, CDBData(ssKey.begin(), ssKey.end()));
+            }
+            lockCommit.lock();
+        }
+
         // Erase
         int ret = pdb->del(activeTxn, &datKey, 0);
 
@@ -209,6 +371,19 @@ protected:
         ssKey << key;
         Dbt datKey(&ssKey[0], ssKey.size());
 
+        // Pending in a batch
+        if (UseBatches())
+        {
+            LOCK(bitdb.cs_db);
+            CDBEnv::CBatch* pbatch = GetBatch();
+            std::map<CDBData, std::pair<bool, CDBData> >::const_iterator mi;
+            if (pbatch && (mi = pbatch->mapWrites.find(CDBData(ssKey.begin(), ssKey.end()))) != pbatch->mapWrites.end())
+            {
+                memset(datKey.get_data(), 0, datKey.get_size());
+                return !mi->second.first;
+            }
+        }
+
         // Exists
         int ret = pdb->exists(activeTxn, &datKey, 0);
 
@@ -221,6 +396,9 @@ protected:
     {
         if (!pdb)
             return NULL;
+        // Cursors only see what is in the database
+        if (!activeTxn && !bitdb.WriteBatch(strFile))
+            return NULL;
         Dbc* pcursor = NULL;
         int ret = pdb->cursor(NULL, &pcursor, 0);
         if (ret != 0)
@@ -272,6 +450,8 @@ public:
     {
         if (!pdb || activeTxn)
             return false;
+        if (!bitdb.WriteBatch(strFile))
+            return false;
         DbTxn* ptxn = bitdb.TxnBegin();
         if (!ptxn)
             return false;
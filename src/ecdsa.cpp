@@ -0,0 +1,1302 @@
+// Copyright (c) 2014 The Blocknet developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/crypto.h>
+
+#include "ecdsa.h"
+#include "pbkdf2.h"
+
+using namespace std;
+
+namespace ecdsa
+{
+
+namespace
+{
+
+// Numbers are arrays of limbs, least significant first: four 64 bit limbs
+// where the compiler has a 128 bit type, eight 32 bit limbs elsewhere
+#if defined(__SIZEOF_INT128__)
+typedef uint64_t limb_t;
+typedef unsigned __int128 dlimb_t;
+static const int LIMB_BITS = 64;
+#define LIMBS(lo, hi) ((uint64_t)(hi) << 32 | (lo))
+#else
+typedef uint32_t limb_t;
+typedef uint64_t dlimb_t;
+static const int LIMB_BITS = 32;
+#define LIMBS(lo, hi) (lo), (hi)
+#endif
+static const int N = 256 / LIMB_BITS;
+
+// The limb loops run a handful of times; -O2 only unrolls them when asked
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 8
+#define UNROLL _Pragma("GCC unroll 16")
+#else
+#define UNROLL
+#endif
+
+// The field prime p, the group order n, and 2^256 - p and 2^256 - n that
+// fold the high half of a product back onto the low half
+static const limb_t FIELD_P[N] = {
+    LIMBS(0xFFFFFC2F, 0xFFFFFFFE), LIMBS(0xFFFFFFFF, 0xFFFFFFFF), LIMBS(0xFFFFFFFF, 0xFFFFFFFF), LIMBS(0xFFFFFFFF, 0xFFFFFFFF) };
+static const limb_t FIELD_C[] = { LIMBS(0x000003D1, 0x00000001) };
+static const limb_t ORDER_N[N] = {
+    LIMBS(0xD0364141, 0xBFD25E8C), LIMBS(0xAF48A03B, 0xBAAEDCE6), LIMBS(0xFFFFFFFE, 0xFFFFFFFF), LIMBS(0xFFFFFFFF, 0xFFFFFFFF) };
+static const limb_t ORDER_C[] = { LIMBS(0x2FC9BEBF, 0x402DA173), LIMBS(0x50B75FC4, 0x45512319), LIMBS(0x00000001, 0x00000000) };
+static const limb_t ORDER_HALF[N] = {
+    LIMBS(0x681B20A0, 0xDFE92F46), LIMBS(0x57A4501D, 0x5D576E73), LIMBS(0xFFFFFFFF, 0xFFFFFFFF), LIMBS(0xFFFFFFFF, 0x7FFFFFFF) };
+static const int FIELD_C_LIMBS = sizeof(FIELD_C) / sizeof(limb_t);
+static const int ORDER_C_LIMBS = sizeof(ORDER_C) / sizeof(limb_t);
+
+// n - 2, the exponent that inverts a scalar
+static const unsigned char ORDER_N_MINUS_2[32] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFE,
+    0xBA, 0xAE, 0xDC, 0xE6, 0xAF, 0x48, 0xA0, 0x3B, 0xBF, 0xD2, 0x5E, 0x8C, 0xD0, 0x36, 0x41, 0x3F };
+
+static const unsigned char GENERATOR_X[32] = {
+    0x79, 0xBE, 0x66, 0x7E, 0xF9, 0xDC, 0xBB, 0xAC, 0x55, 0xA0, 0x62, 0x95, 0xCE, 0x87, 0x0B, 0x07,
+    0x02, 0x9B, 0xFC, 0xDB, 0x2D, 0xCE, 0x28, 0xD9, 0x59, 0xF2, 0x81, 0x5B, 0x16, 0xF8, 0x17, 0x98 };
+static const unsigned char GENERATOR_Y[32] = {
+    0x48, 0x3A, 0xDA, 0x77, 0x26, 0xA3, 0xC4, 0x65, 0x5D, 0xA4, 0xFB, 0xFC, 0x0E, 0x11, 0x08, 0xA8,
+    0xFD, 0x17, 0xB4, 0x48, 0xA6, 0x85, 0x54, 0x19, 0x9C, 0x47, 0xD0, 0x8F, 0xFB, 0x10, 0xD4, 0xB8 };
+
+// wNAF widths of the generator, whose odd multiples are precomputed once,
+// and of the public key, whose odd multiples are computed per verification
+static const int WINDOW_G = 10;
+static const int WINDOW_A = 5;
+
+// Length of a wNAF: one digit per bit and a final carry
+static const int WNAF_BITS = 257;
+
+
+// r = a + b * c, truncated to nr limbs. The callers size r so that nothing
+// is lost. Sizes are template arguments so the loops unroll.
+template<int nr, int na, int nb, int nc>
+static inline void MulAdd(limb_t* r, const limb_t* a, const limb_t* b, const limb_t* c)
+{
+    UNROLL
+    for (int k = 0; k < nr; k++)
+        r[k] = k < na ? a[k] : 0;
+    UNROLL
+    for (int i = 0; i < nb && i < nr; i++)
+    {
+        limb_t carry = 0;
+        int k = i;
+        UNROLL
+        for (int j = 0; j < nc && k < nr; j++, k++)
+        {
+            dlimb_t t = (dlimb_t)b[i] * c[j] + r[k] + carry;
+            r[k] = (limb_t)t;
+            carry = (limb_t)(t >> LIMB_BITS);
+        }
+        UNROLL
+        for (; k < nr; k++)
+        {
+            dlimb_t t = (dlimb_t)r[k] + carry;
+            r[k] = (limb_t)t;
+            carry = (limb_t)(t >> LIMB_BITS);
+        }
+    }
+}
+
+// r = a * b, 2N limbs
+static void MulWide(limb_t* r, const limb_t* a, const limb_t* b)
+{
+    UNROLL
+    for (int k = 0; k < 2 * N; k++)
+        r[k] = 0;
+    UNROLL
+    for (int i = 0; i < N; i++)
+    {
+        limb_t carry = 0;
+        UNROLL
+        for (int j = 0; j < N; j++)
+        {
+            dlimb_t t = (dlimb_t)a[i] * b[j] + r[i + j] + carry;
+            r[i + j] = (limb_t)t;
+            carry = (limb_t)(t >> LIMB_BITS);
+        }
+        r[i + N] = carry;
+    }
+}
+
+// r = a if flag else r, without branching on flag
+static void CMov(limb_t* r, const limb_t* a, limb_t flag)
+{
+    limb_t mask = 0 - flag;
+    UNROLL
+    for (int i = 0; i < N; i++)
+        r[i] = (r[i] & ~mask) | (a[i] & mask);
+}
+
+// r -= m when r >= m, for r < 2m
+static void CondSub(limb_t* r, const limb_t* m)
+{
+    limb_t s[N];
+    limb_t borrow = 0;
+    UNROLL
+    for (int i = 0; i < N; i++)
+    {
+        dlimb_t t = (dlimb_t)r[i] - m[i] - borrow;
+        s[i] = (limb_t)t;
+        borrow = (limb_t)(t >> LIMB_BITS) & 1;
+    }
+    CMov(r, s, borrow ^ 1);
+}
+
+// r = a + b modulo m = 2^256 - c, for a, b < m
+template<int nc>
+static inline void ModAdd(limb_t* r, const limb_t* a, const limb_t* b, const limb_t* c)
+{
+    limb_t s[N], t[N];
+    limb_t carry = 0;
+    UNROLL
+    for (int i = 0; i < N; i++)
+    {
+        dlimb_t x = (dlimb_t)a[i] + b[i] + carry;
+        s[i] = (limb_t)x;
+        carry = (limb_t)(x >> LIMB_BITS);
+    }
+    // The sum reaches m exactly when adding 2^256 - m carries out of it
+    limb_t carry2 = 0;
+    UNROLL
+    for (int i = 0; i < N; i++)
+    {
+        dlimb_t x = (dlimb_t)s[i] + (i < nc ? c[i] : 0) + carry2;
+        t[i] = (limb_t)x;
+        carry2 = (limb_t)(x >> LIMB_BITS);
+    }
+    CMov(s, t, carry | carry2);
+    memcpy(r, s, sizeof(s));
+}
+
+// r = a - b modulo m = 2^256 - c, for a, b < m
+template<int nc>
+static inline void ModSub(limb_t* r, const limb_t* a, const limb_t* b, const limb_t* c)
+{
+    limb_t s[N];
+    limb_t borrow = 0;
+    UNROLL
+    for (int i = 0; i < N; i++)
+    {
+        dlimb_t x = (dlimb_t)a[i] - b[i] - borrow;
+        s[i] = (limb_t)x;
+        borrow = (limb_t)(x >> LIMB_BITS) & 1;
+    }
+    // Adding m back on a borrow is subtracting 2^256 - m
+    limb_t mask = 0 - borrow;
+    limb_t borrow2 = 0;
+    UNROLL
+    for (int i = 0; i < N; i++)
+    {
+        dlimb_t x = (dlimb_t)s[i] - ((i < nc ? c[i] : 0) & mask) - borrow2;
+        r[i] = (limb_t)x;
+        borrow2 = (limb_t)(x >> LIMB_BITS) & 1;
+    }
+}
+
+// r = t modulo m = 2^256 - c for a 2N limb t, c below 2^130
+template<int nc>
+static inline void ModReduce(limb_t* r, const limb_t* t, const limb_t* c, const limb_t* m)
+{
+    // Each step folds the limbs above 2^256 onto the low ones through
+    // 2^256 = c: below 2^386, then 2^260, then 2^256 + 2^133, then 2^256
+    limb_t t1[N + nc], t2[N + 1], t3[N + 1];
+    MulAdd<N + nc, N, N, nc>(t1, t, t + N, c);
+    MulAdd<N + 1, N, nc, nc>(t2, t1, t1 + N, c);
+    MulAdd<N + 1, N, 1, nc>(t3, t2, t2 + N, c);
+    MulAdd<N, N, 1, nc>(r, t3, t3 + N, c);
+    CondSub(r, m);
+}
+
+static int Compare(const limb_t* a, const limb_t* b)
+{
+    for (int i = N - 1; i >= 0; i--)
+        if (a[i] != b[i])
+            return a[i] < b[i] ? -1 : 1;
+    return 0;
+}
+
+static void LimbsFromBytes(limb_t* r, const unsigned char* pch)
+{
+    for (int i = 0; i < N; i++)
+    {
+        limb_t v = 0;
+            for (int j = 0; j < LIMB_BITS / 8; j++)
+            v = (v << 8) | pch[32 - (i + 1) * (LIMB_BITS / 8) + j];
+        r[i] = v;
+    }
+}
+
+static void LimbsToBytes(unsigned char* pch, const limb_t* a)
+{
+    for (int i = 0; i < N; i++)
+            for (int j = 0; j < LIMB_BITS / 8; j++)
+            pch[32 - (i + 1) * (LIMB_BITS / 8) + j] = (unsigned char)(a[i] >> (LIMB_BITS - 8 * (j + 1)));
+}
+
+
+/** Element of the field modulo p, always fully reduced */
+struct CFieldElem
+{
+    limb_t n[N];
+};
+
+static void FeSetInt(CFieldElem& r, unsigned int v)
+{
+    memset(r.n, 0, sizeof(r.n));
+    r.n[0] = v;
+}
+
+// False when the 32 big endian bytes are not below p
+static bool FeSetBytes(CFieldElem& r, const unsigned char* pch)
+{
+    LimbsFromBytes(r.n, pch);
+    return Compare(r.n, FIELD_P) < 0;
+}
+
+static void FeGetBytes(unsigned char* pch, const CFieldElem& a)
+{
+    LimbsToBytes(pch, a.n);
+}
+
+static bool FeIsZero(const CFieldElem& a)
+{
+    limb_t z = 0;
+    for (int i = 0; i < N; i++)
+        z |= a.n[i];
+    return z == 0;
+}
+
+static bool FeIsOdd(const CFieldElem& a)
+{
+    return a.n[0] & 1;
+}
+
+static bool FeEqual(const CFieldElem& a, const CFieldElem& b)
+{
+    limb_t z = 0;
+    for (int i = 0; i < N; i++)
+        z |= a.n[i] ^ b.n[i];
+    return z == 0;
+}
+
+static void FeAdd(CFieldElem& r, const CFieldElem& a, const CFieldElem& b)
+{
+    ModAdd<FIELD_C_LIMBS>(r.n, a.n, b.n, FIELD_C);
+}
+
+static void FeSub(CFieldElem& r, const CFieldElem& a, const CFieldElem& b)
+{
+    ModSub<FIELD_C_LIMBS>(r.n, a.n, b.n, FIELD_C);
+}
+
+static void FeNeg(CFieldElem& r, const CFieldElem& a)
+{
+    CFieldElem zero;
+    FeSetInt(zero, 0);
+    FeSub(r, zero, a);
+}
+
+#if defined(__SIZEOF_INT128__)
+// r = t modulo p for an 8 limb t, where 2^256 - p fits in one limb
+static void FeReduce(limb_t* r, const limb_t* t)
+{
+    const limb_t c = FIELD_C[0];
+    limb_t s[N];
+    dlimb_t acc = 0;
+    for (int i = 0; i < N; i++)
+    {
+        acc += (dlimb_t)t[N + i] * c + t[i];
+        s[i] = (limb_t)acc;
+        acc >>= 64;
+    }
+    // 34 bits are left over the top; folding them in again leaves at most
+    // one, and then the low limbs are small enough to take c without a carry
+    for (int k = 0; k < 2; k++)
+    {
+        acc = (dlimb_t)(limb_t)acc * c + s[0];
+        s[0] = (limb_t)acc;
+        acc >>= 64;
+        for (int i = 1; i < N; i++)
+        {
+            acc += s[i];
+            s[i] = (limb_t)acc;
+            acc >>= 64;
+        }
+    }
+    CondSub(s, FIELD_P);
+    memcpy(r, s, sizeof(s));
+}
+#else
+static void FeReduce(limb_t* r, const limb_t* t)
+{
+    ModReduce<FIELD_C_LIMBS>(r, t, FIELD_C, FIELD_P);
+}
+#endif
+
+static void FeMul(CFieldElem& r, const CFieldElem& a, const CFieldElem& b)
+{
+    limb_t t[2 * N];
+    MulWide(t, a.n, b.n);
+    FeReduce(r.n, t);
+}
+
+static void FeSqr(CFieldElem& r, const CFieldElem& a)
+{
+    FeMul(r, a, a);
+}
+
+// r = a^(2^k)
+static void FeSqrN(CFieldElem& r, const CFieldElem& a, int k)
+{
+    r = a;
+    for (int i = 0; i < k; i++)
+        FeSqr(r, r);
+}
+
+// The powers a^(2^k - 1) for k = 2, 22 and 223 that both a^(p - 2) and
+// a^((p + 1) / 4) start from: p is 223 ones, a zero, 22 ones and ten more
+// bits
+static void FePowBlocks(CFieldElem& x2, CFieldElem& x22, CFieldElem& x223, const CFieldElem& a)
+{
+    CFieldElem x3, x6, x9, x11, x44, x88, x176, x220;
+    FeSqr(x2, a);
+    FeMul(x2, x2, a);
+    FeSqr(x3, x2);
+    FeMul(x3, x3, a);
+    FeSqrN(x6, x3, 3);
+    FeMul(x6, x6, x3);
+    FeSqrN(x9, x6, 3);
+    FeMul(x9, x9, x3);
+    FeSqrN(x11, x9, 2);
+    FeMul(x11, x11, x2);
+    FeSqrN(x22, x11, 11);
+    FeMul(x22, x22, x11);
+    FeSqrN(x44, x22, 22);
+    FeMul(x44, x44, x22);
+    FeSqrN(x88, x44, 44);
+    FeMul(x88, x88, x44);
+    FeSqrN(x176, x88, 88);
+    FeMul(x176, x176, x88);
+    FeSqrN(x220, x176, 44);
+    FeMul(x220, x220, x44);
+    FeSqrN(x223, x220, 3);
+    FeMul(x223, x223, x3);
+}
+
+// r = a^(p - 2), the inverse of a nonzero a
+static void FeInv(CFieldElem& r, const CFieldElem& a)
+{
+    CFieldElem x2, x22, x223, t;
+    FePowBlocks(x2, x22, x223, a);
+    FeSqrN(t, x223, 23);
+    FeMul(t, t, x22);
+    FeSqrN(t, t, 5);
+    FeMul(t, t, a);
+    FeSqrN(t, t, 3);
+    FeMul(t, t, x2);
+    FeSqrN(t, t, 2);
+    FeMul(r, t, a);
+}
+
+// r = a^((p + 1) / 4), a square root of a if a has one
+static bool FeSqrt(CFieldElem& r, const CFieldElem& a)
+{
+    CFieldElem x2, x22, x223, t, c;
+    FePowBlocks(x2, x22, x223, a);
+    FeSqrN(t, x223, 23);
+    FeMul(t, t, x22);
+    FeSqrN(t, t, 6);
+    FeMul(t, t, x2);
+    FeSqrN(t, t, 2);
+    FeSqr(c, t);
+    bool fSquare = FeEqual(c, a);
+    r = t;
+    return fSquare;
+}
+
+
+/** Integer modulo the group order n, always fully reduced */
+struct CScalar
+{
+    limb_t n[N];
+};
+
+static void ScSetInt(CScalar& r, unsigned int v)
+{
+    memset(r.n, 0, sizeof(r.n));
+    r.n[0] = v;
+}
+
+// Reduces the 32 big endian bytes modulo n; fOverflow tells whether they
+// were n or more
+static void ScSetBytes(CScalar& r, const unsigned char* pch, bool& fOverflow)
+{
+    limb_t s[N];
+    LimbsFromBytes(r.n, pch);
+    limb_t borrow = 0;
+    for (int i = 0; i < N; i++)
+    {
+        dlimb_t t = (dlimb_t)r.n[i] - ORDER_N[i] - borrow;
+        s[i] = (limb_t)t;
+        borrow = (limb_t)(t >> LIMB_BITS) & 1;
+    }
+    CMov(r.n, s, borrow ^ 1);
+    fOverflow = !borrow;
+}
+
+static void ScGetBytes(unsigned char* pch, const CScalar& a)
+{
+    LimbsToBytes(pch, a.n);
+}
+
+static bool ScIsZero(const CScalar& a)
+{
+    limb_t z = 0;
+    for (int i = 0; i < N; i++)
+        z |= a.n[i];
+    return z == 0;
+}
+
+static bool ScIsHigh(const CScalar& a)
+{
+    return Compare(a.n, ORDER_HALF) > 0;
+}
+
+static void ScAdd(CScalar& r, const CScalar& a, const CScalar& b)
+{
+    ModAdd<ORDER_C_LIMBS>(r.n, a.n, b.n, ORDER_C);
+}
+
+static void ScNeg(CScalar& r, const CScalar& a)
+{
+    CScalar zero;
+    ScSetInt(zero, 0);
+    ModSub<ORDER_C_LIMBS>(r.n, zero.n, a.n, ORDER_C);
+}
+
+static void ScMul(CScalar& r, const CScalar& a, const CScalar& b)
+{
+    limb_t t[2 * N];
+    MulWide(t, a.n, b.n);
+    ModReduce<ORDER_C_LIMBS>(r.n, t, ORDER_C, ORDER_N);
+}
+
+// r = a^(n - 2) by fixed 4 bit windows, so the sequence of operations only
+// depends on the public exponent
+static void ScInv(CScalar& r, const CScalar& a)
+{
+    CScalar vPow[16];
+    ScSetInt(vPow[0], 1);
+    for (int i = 1; i < 16; i++)
+        ScMul(vPow[i], vPow[i - 1], a);
+    CScalar x;
+    ScSetInt(x, 1);
+    for (int i = 0; i < 64; i++)
+    {
+        for (int j = 0; i > 0 && j < 4; j++)
+            ScMul(x, x, x);
+        ScMul(x, x, vPow[(ORDER_N_MINUS_2[i / 2] >> (i % 2 ? 0 : 4)) & 15]);
+    }
+    r = x;
+    OPENSSL_cleanse(vPow, sizeof(vPow));
+}
+
+// a >>= 1, shifting top in at bit 255
+static void ShiftRight1(limb_t* a, limb_t top)
+{
+    for (int i = 0; i < N - 1; i++)
+        a[i] = (a[i] >> 1) | (a[i + 1] << (LIMB_BITS - 1));
+    a[N - 1] = (a[N - 1] >> 1) | (top << (LIMB_BITS - 1));
+}
+
+// r = a^-1 for a public nonzero a, by the binary extended Euclidean
+// algorithm: far fewer operations than ScInv, in a time that depends on a
+static void ScInvVar(CScalar& r, const CScalar& a)
+{
+    // x1 a = u and x2 a = v modulo n throughout
+    limb_t u[N], v[N];
+    CScalar x1, x2;
+    memcpy(u, a.n, sizeof(u));
+    memcpy(v, ORDER_N, sizeof(v));
+    ScSetInt(x1, 1);
+    ScSetInt(x2, 0);
+    limb_t one[N] = { 1 };
+    while (Compare(u, one) != 0 && Compare(v, one) != 0)
+    {
+        limb_t* pu[2] = { u, v };
+        CScalar* px[2] = { &x1, &x2 };
+        for (int k = 0; k < 2; k++)
+        {
+            while (!(pu[k][0] & 1))
+            {
+                ShiftRight1(pu[k], 0);
+                // Halving modulo the odd n: add n first to odd numbers
+                limb_t* x = px[k]->n;
+                limb_t carry = 0;
+                if (x[0] & 1)
+                {
+                    for (int i = 0; i < N; i++)
+                    {
+                        dlimb_t t = (dlimb_t)x[i] + ORDER_N[i] + carry;
+                        x[i] = (limb_t)t;
+                        carry = (limb_t)(t >> LIMB_BITS);
+                    }
+                }
+                ShiftRight1(x, carry);
+            }
+        }
+        int k = Compare(u, v) >= 0 ? 0 : 1;
+        limb_t borrow = 0;
+        for (int i = 0; i < N; i++)
+        {
+            dlimb_t t = (dlimb_t)pu[k][i] - pu[1 - k][i] - borrow;
+            pu[k][i] = (limb_t)t;
+            borrow = (limb_t)(t >> LIMB_BITS) & 1;
+        }
+        ModSub<ORDER_C_LIMBS>(px[k]->n, px[k]->n, px[1 - k]->n, ORDER_C);
+    }
+    r = Compare(u, one) == 0 ? x1 : x2;
+}
+
+// count bits of a starting at bit, zero past the top
+static unsigned int ScGetBits(const CScalar& a, int bit, int count)
+{
+    unsigned int r = 0;
+    for (int i = 0; i < count; i++)
+        if (bit + i < 256)
+            r |= (unsigned int)((a.n[(bit + i) / LIMB_BITS] >> ((bit + i) % LIMB_BITS)) & 1) << i;
+    return r;
+}
+
+// Signed odd digits of a below 2^(w-1), at least w positions apart
+static void ScWnaf(int* pnWnaf, const CScalar& a, int w)
+{
+    memset(pnWnaf, 0, WNAF_BITS * sizeof(int));
+    int nCarry = 0;
+    int nBit = 0;
+    while (nBit < 256)
+    {
+        if (ScGetBits(a, nBit, 1) == (unsigned int)nCarry)
+        {
+            nBit++;
+            continue;
+        }
+        int nWord = ScGetBits(a, nBit, w) + nCarry;
+        nCarry = (nWord >> (w - 1)) & 1;
+        nWord -= nCarry << w;
+        pnWnaf[nBit] = nWord;
+        nBit += w;
+    }
+    // A carry only survives when the last window ends on bit 255
+    if (nCarry)
+        pnWnaf[256] = nCarry;
+}
+
+
+/** Curve point in affine coordinates */
+struct CAffine
+{
+    CFieldElem x, y;
+    bool fInfinity;
+};
+
+/** Curve point in Jacobian coordinates, x = X / Z^2 and y = Y / Z^3 */
+struct CJacobian
+{
+    CFieldElem x, y, z;
+    bool fInfinity;
+};
+
+/** Curve point in homogeneous coordinates, x = X / Z and y = Y / Z, with
+ *  (0, 1, 0) at infinity */
+struct CProjective
+{
+    CFieldElem x, y, z;
+};
+
+static bool IsOnCurve(const CAffine& a)
+{
+    CFieldElem y2, x3, seven;
+    FeSqr(y2, a.y);
+    FeSqr(x3, a.x);
+    FeMul(x3, x3, a.x);
+    FeSetInt(seven, 7);
+    FeAdd(x3, x3, seven);
+    return FeEqual(y2, x3);
+}
+
+// The point with this x and y parity, if there is one
+static bool Decompress(CAffine& r, const CFieldElem& x, bool fOdd)
+{
+    CFieldElem c, seven;
+    FeSqr(c, x);
+    FeMul(c, c, x);
+    FeSetInt(seven, 7);
+    FeAdd(c, c, seven);
+    if (!FeSqrt(r.y, c))
+        return false;
+    if (FeIsOdd(r.y) != fOdd)
+        FeNeg(r.y, r.y);
+    r.x = x;
+    r.fInfinity = false;
+    return true;
+}
+
+static void ToJacobian(CJacobian& r, const CAffine& a)
+{
+    r.x = a.x;
+    r.y = a.y;
+    FeSetInt(r.z, 1);
+    r.fInfinity = a.fInfinity;
+}
+
+static void ToAffine(CAffine& r, const CJacobian& a)
+{
+    r.fInfinity = a.fInfinity;
+    if (a.fInfinity)
+        return;
+    CFieldElem zi, zi2, zi3;
+    FeInv(zi, a.z);
+    FeSqr(zi2, zi);
+    FeMul(zi3, zi2, zi);
+    FeMul(r.x, a.x, zi2);
+    FeMul(r.y, a.y, zi3);
+}
+
+// Affine forms of many points with a single inversion
+static void ToAffineBatch(CAffine* pr, const CJacobian* pa, int nCount)
+{
+    vector<CFieldElem> vPrefix(nCount);
+    CFieldElem acc;
+    FeSetInt(acc, 1);
+    for (int i = 0; i < nCount; i++)
+    {
+        vPrefix[i] = acc;
+        if (!pa[i].fInfinity)
+            FeMul(acc, acc, pa[i].z);
+    }
+    CFieldElem inv;
+    FeInv(inv, acc);
+    for (int i = nCount - 1; i >= 0; i--)
+    {
+        pr[i].fInfinity = pa[i].fInfinity;
+        if (pa[i].fInfinity)
+            continue;
+        CFieldElem zi, zi2, zi3;
+        FeMul(zi, inv, vPrefix[i]);
+        FeMul(inv, inv, pa[i].z);
+        FeSqr(zi2, zi);
+        FeMul(zi3, zi2, zi);
+        FeMul(pr[i].x, pa[i].x, zi2);
+        FeMul(pr[i].y, pa[i].y, zi3);
+    }
+}
+
+static void JDouble(CJacobian& r, const CJacobian& a)
+{
+    if (a.fInfinity)
+    {
+        r.fInfinity = true;
+        return;
+    }
+    // dbl-2009-l; no point of order two lives on the curve
+    CFieldElem A, B, C, D, E, F, t, z;
+    FeSqr(A, a.x);
+    FeSqr(B, a.y);
+    FeSqr(C, B);
+    FeAdd(t, a.x, B);
+    FeSqr(t, t);
+    FeSub(t, t, A);
+    FeSub(t, t, C);
+    FeAdd(D, t, t);
+    FeAdd(E, A, A);
+    FeAdd(E, E, A);
+    FeSqr(F, E);
+    FeMul(z, a.y, a.z);
+    FeAdd(r.z, z, z);
+    FeAdd(t, D, D);
+    FeSub(r.x, F, t);
+    FeSub(t, D, r.x);
+    FeMul(t, E, t);
+    FeAdd(C, C, C);
+    FeAdd(C, C, C);
+    FeAdd(C, C, C);
+    FeSub(r.y, t, C);
+    r.fInfinity = false;
+}
+
+// r = a + b, for the final U1, U2, S1 and S2 of either addition
+static void JAddFinish(CJacobian& r, const CJacobian& a, const CFieldElem& u1, const CFieldElem& u2,
+                       const CFieldElem& s1, const CFieldElem& s2, const CFieldElem& z)
+{
+    CFieldElem h, R, hh, hhh, v, t;
+    FeSub(h, u2, u1);
+    FeSub(R, s2, s1);
+    if (FeIsZero(h))
+    {
+        if (FeIsZero(R))
+            JDouble(r, a);
+        else
+            r.fInfinity = true;
+        return;
+    }
+    FeSqr(hh, h);
+    FeMul(hhh, h, hh);
+    FeMul(v, u1, hh);
+    FeMul(r.z, z, h);
+    FeSqr(t, R);
+    FeSub(t, t, hhh);
+    FeSub(t, t, v);
+    FeSub(r.x, t, v);
+    FeSub(t, v, r.x);
+    FeMul(t, R, t);
+    FeMul(hhh, s1, hhh);
+    FeSub(r.y, t, hhh);
+    r.fInfinity = false;
+}
+
+static void JAdd(CJacobian& r, const CJacobian& a, const CJacobian& b)
+{
+    if (a.fInfinity)
+    {
+        r = b;
+        return;
+    }
+    if (b.fInfinity)
+    {
+        r = a;
+        return;
+    }
+    CFieldElem z1z1, z2z2, u1, u2, s1, s2, z;
+    FeSqr(z1z1, a.z);
+    FeSqr(z2z2, b.z);
+    FeMul(u1, a.x, z2z2);
+    FeMul(u2, b.x, z1z1);
+    FeMul(s1, a.y, b.z);
+    FeMul(s1, s1, z2z2);
+    FeMul(s2, b.y, a.z);
+    FeMul(s2, s2, z1z1);
+    FeMul(z, a.z, b.z);
+    CJacobian aa = a;
+    JAddFinish(r, aa, u1, u2, s1, s2, z);
+}
+
+static void JAddAffine(CJacobian& r, const CJacobian& a, const CAffine& b)
+{
+    if (b.fInfinity)
+    {
+        r = a;
+        return;
+    }
+    if (a.fInfinity)
+    {
+        ToJacobian(r, b);
+        return;
+    }
+    CFieldElem z1z1, u2, s2;
+    FeSqr(z1z1, a.z);
+    FeMul(u2, b.x, z1z1);
+    FeMul(s2, b.y, a.z);
+    FeMul(s2, s2, z1z1);
+    CJacobian aa = a;
+    JAddFinish(r, aa, aa.x, u2, aa.y, s2, aa.z);
+}
+
+// r = a + b for any a and an affine b other than infinity, with the same
+// operations whatever the points (Renes, Costello and Batina, "Complete
+// addition formulas for prime order elliptic curves", algorithm 8)
+static void PAddAffine(CProjective& r, const CProjective& a, const CAffine& b)
+{
+    CFieldElem b3, t0, t1, t2, t3, t4, x3, y3, z3;
+    FeSetInt(b3, 3 * 7);
+    FeMul(t0, a.x, b.x);
+    FeMul(t1, a.y, b.y);
+    FeAdd(t3, b.x, b.y);
+    FeAdd(t4, a.x, a.y);
+    FeMul(t3, t3, t4);
+    FeAdd(t4, t0, t1);
+    FeSub(t3, t3, t4);
+    FeMul(t4, b.y, a.z);
+    FeAdd(t4, t4, a.y);
+    FeMul(y3, b.x, a.z);
+    FeAdd(y3, y3, a.x);
+    FeAdd(x3, t0, t0);
+    FeAdd(t0, x3, t0);
+    FeMul(t2, a.z, b3);
+    FeAdd(z3, t1, t2);
+    FeSub(t1, t1, t2);
+    FeMul(y3, y3, b3);
+    FeMul(x3, t4, y3);
+    FeMul(t2, t3, t1);
+    FeSub(x3, t2, x3);
+    FeMul(y3, y3, t0);
+    FeMul(t1, t1, z3);
+    FeAdd(y3, t1, y3);
+    FeMul(t0, t0, t3);
+    FeMul(z3, z3, t4);
+    FeAdd(z3, z3, t0);
+    r.x = x3;
+    r.y = y3;
+    r.z = z3;
+}
+
+
+/** Multiples of the generator: the odd ones for wNAF multiplication, and
+ *  j 16^i G for each 4 bit digit j of a constant time multiplication */
+class CGeneratorTables
+{
+public:
+    CAffine vOdd[1 << (WINDOW_G - 2)];
+    CAffine vComb[64][16];
+
+    CGeneratorTables()
+    {
+        CAffine g;
+        FeSetBytes(g.x, GENERATOR_X);
+        FeSetBytes(g.y, GENERATOR_Y);
+        g.fInfinity = false;
+
+        CJacobian gj, g2;
+        ToJacobian(gj, g);
+        JDouble(g2, gj);
+        vector<CJacobian> vPoints(1 << (WINDOW_G - 2));
+        vPoints[0] = gj;
+        for (unsigned int i = 1; i < vPoints.size(); i++)
+            JAdd(vPoints[i], vPoints[i - 1], g2);
+        ToAffineBatch(vOdd, &vPoints[0], vPoints.size());
+
+        vPoints.resize(64 * 16);
+        CJacobian base = gj;
+        for (int i = 0; i < 64; i++)
+        {
+            vPoints[i * 16].fInfinity = true;
+            vPoints[i * 16 + 1] = base;
+            for (int j = 2; j < 16; j++)
+                JAdd(vPoints[i * 16 + j], vPoints[i * 16 + j - 1], base);
+            for (int j = 0; j < 4; j++)
+                JDouble(base, base);
+        }
+        ToAffineBatch(&vComb[0][0], &vPoints[0], vPoints.size());
+    }
+};
+
+static const CGeneratorTables& GetGeneratorTables()
+{
+    static const CGeneratorTables tables;
+    return tables;
+}
+
+// r = na a + ng G (Strauss), variable time
+static void MulVar(CJacobian& r, const CScalar& na, const CJacobian& a, const CScalar& ng)
+{
+    const CGeneratorTables& tables = GetGeneratorTables();
+    int vWnafA[WNAF_BITS], vWnafG[WNAF_BITS];
+    ScWnaf(vWnafA, na, WINDOW_A);
+    ScWnaf(vWnafG, ng, WINDOW_G);
+
+    CJacobian vOddA[1 << (WINDOW_A - 2)];
+    if (!a.fInfinity)
+    {
+        CJacobian a2;
+        JDouble(a2, a);
+        vOddA[0] = a;
+        for (int i = 1; i < (1 << (WINDOW_A - 2)); i++)
+            JAdd(vOddA[i], vOddA[i - 1], a2);
+    }
+
+    r.fInfinity = true;
+    for (int i = WNAF_BITS - 1; i >= 0; i--)
+    {
+        JDouble(r, r);
+        int n = vWnafA[i];
+        if (n && !a.fInfinity)
+        {
+            CJacobian p = vOddA[(abs(n) - 1) / 2];
+            if (n < 0)
+                FeNeg(p.y, p.y);
+            JAdd(r, r, p);
+        }
+        n = vWnafG[i];
+        if (n)
+        {
+            CAffine p = tables.vOdd[(abs(n) - 1) / 2];
+            if (n < 0)
+                FeNeg(p.y, p.y);
+            JAddAffine(r, r, p);
+        }
+    }
+}
+
+// r = k G for a secret k, in constant time: one complete addition per 4 bit
+// digit, from a table entry picked by scanning the whole row
+static void MulGen(CAffine& r, const CScalar& k)
+{
+    const CGeneratorTables& tables = GetGeneratorTables();
+    CProjective acc;
+    FeSetInt(acc.x, 0);
+    FeSetInt(acc.y, 1);
+    FeSetInt(acc.z, 0);
+    for (int i = 0; i < 64; i++)
+    {
+        limb_t nDigit = ScGetBits(k, 4 * i, 4);
+        CAffine p = tables.vComb[i][1];
+        for (limb_t j = 2; j < 16; j++)
+        {
+            limb_t fEqual = (limb_t)((uint32_t)((j ^ nDigit) - 1) >> 31);
+            CMov(p.x.n, tables.vComb[i][j].x.n, fEqual);
+            CMov(p.y.n, tables.vComb[i][j].y.n, fEqual);
+        }
+        // Digit zero adds a dummy point and keeps the old sum
+        CProjective sum;
+        PAddAffine(sum, acc, p);
+        limb_t fNonZero = (limb_t)((uint32_t)(0 - nDigit) >> 31);
+        CMov(acc.x.n, sum.x.n, fNonZero);
+        CMov(acc.y.n, sum.y.n, fNonZero);
+        CMov(acc.z.n, sum.z.n, fNonZero);
+    }
+    CFieldElem zi;
+    FeInv(zi, acc.z);
+    FeMul(r.x, acc.x, zi);
+    FeMul(r.y, acc.y, zi);
+    r.fInfinity = FeIsZero(acc.z);
+    OPENSSL_cleanse(&acc, sizeof(acc));
+}
+
+
+// The encodings OpenSSL's o2i_ECPublicKey takes
+static bool ParsePubKey(CAffine& r, const unsigned char* pch, size_t nLen)
+{
+    if (nLen == 1 && pch[0] == 0x00)
+    {
+        r.fInfinity = true;
+        return true;
+    }
+    if (nLen == 33 && (pch[0] == 0x02 || pch[0] == 0x03))
+    {
+        CFieldElem x;
+        return FeSetBytes(x, pch + 1) && Decompress(r, x, pch[0] == 0x03);
+    }
+    if (nLen == 65 && (pch[0] == 0x04 || pch[0] == 0x06 || pch[0] == 0x07))
+    {
+        if (!FeSetBytes(r.x, pch + 1) || !FeSetBytes(r.y, pch + 33))
+            return false;
+        // Hybrid encodings repeat the parity of y in the prefix
+        if (pch[0] != 0x04 && FeIsOdd(r.y) != (pch[0] == 0x07))
+            return false;
+        r.fInfinity = false;
+        return IsOnCurve(r);
+    }
+    return false;
+}
+
+static void SerializePubKey(vector<unsigned char>& vch, const CAffine& a, bool fCompressed)
+{
+    vch.resize(fCompressed ? 33 : 65);
+    vch[0] = fCompressed ? (FeIsOdd(a.y) ? 0x03 : 0x02) : 0x04;
+    FeGetBytes(&vch[1], a.x);
+    if (!fCompressed)
+        FeGetBytes(&vch[33], a.y);
+}
+
+// One DER integer, positive and minimally encoded, of at most 32 bytes
+static bool ParseDERInteger(unsigned char* pch32, const unsigned char*& pch, const unsigned char* pend)
+{
+    if (pend - pch < 2 || pch[0] != 0x02)
+        return false;
+    size_t nLen = pch[1];
+    pch += 2;
+    if (nLen == 0 || nLen >= 0x80 || (size_t)(pend - pch) < nLen)
+        return false;
+    if (pch[0] & 0x80)
+        return false;
+    if (nLen > 1 && pch[0] == 0x00 && !(pch[1] & 0x80))
+        return false;
+    const unsigned char* pvalue = pch;
+    pch += nLen;
+    while (nLen > 0 && *pvalue == 0x00)
+    {
+        pvalue++;
+        nLen--;
+    }
+    if (nLen > 32)
+        return false;
+    memset(pch32, 0, 32);
+    memcpy(pch32 + 32 - nLen, pvalue, nLen);
+    return true;
+}
+
+// Strict DER, which is what OpenSSL's ECDSA_verify takes: it re-encodes the
+// signature and compares. r and s must be in [1, n - 1].
+static bool ParseDER(CScalar& r, CScalar& s, const unsigned char* pch, size_t nLen)
+{
+    const unsigned char* pend = pch + nLen;
+    if (nLen < 2 || pch[0] != 0x30 || pch[1] >= 0x80 || (size_t)pch[1] != nLen - 2)
+        return false;
+    pch += 2;
+    unsigned char vchR[32], vchS[32];
+    if (!ParseDERInteger(vchR, pch, pend) || !ParseDERInteger(vchS, pch, pend) || pch != pend)
+        return false;
+    bool fOverflowR, fOverflowS;
+    ScSetBytes(r, vchR, fOverflowR);
+    ScSetBytes(s, vchS, fOverflowS);
+    return !fOverflowR && !fOverflowS && !ScIsZero(r) && !ScIsZero(s);
+}
+
+static void AppendDERInteger(vector<unsigned char>& vch, const CScalar& a)
+{
+    unsigned char pch[33];
+    pch[0] = 0x00;
+    ScGetBytes(pch + 1, a);
+    int nStart = 0;
+    while (nStart < 32 && pch[nStart] == 0x00 && !(pch[nStart + 1] & 0x80))
+        nStart++;
+    vch.push_back(0x02);
+    vch.push_back(33 - nStart);
+    vch.insert(vch.end(), pch + nStart, pch + 33);
+}
+
+/** RFC 6979 nonces from HMAC-SHA256, keyed on the secret and the hash */
+class CNonceGenerator
+{
+private:
+    unsigned char vchK[32];
+    unsigned char vchV[32];
+    bool fRetry;
+
+    void Mac(unsigned char* pchOut, const unsigned char* pch1, size_t n1, const unsigned char* pch2 = NULL, size_t n2 = 0,
+              const unsigned char* pch3 = NULL, size_t n3 = 0, const unsigned char* pch4 = NULL, size_t n4 = 0)
+    {
+        HMAC_SHA256_CTX ctx;
+        HMAC_SHA256_Init(&ctx, vchK, 32);
+        HMAC_SHA256_Update(&ctx, pch1, n1);
+        HMAC_SHA256_Update(&ctx, pch2, n2);
+        HMAC_SHA256_Update(&ctx, pch3, n3);
+        HMAC_SHA256_Update(&ctx, pch4, n4);
+        HMAC_SHA256_Final(pchOut, &ctx);
+        OPENSSL_cleanse(&ctx, sizeof(ctx));
+    }
+
+public:
+    CNonceGenerator(const unsigned char* pchSecret, const unsigned char* pchHash)
+    {
+        static const unsigned char zero = 0x00, one = 0x01;
+        memset(vchV, 0x01, 32);
+        memset(vchK, 0x00, 32);
+        Mac(vchK, vchV, 32, &zero, 1, pchSecret, 32, pchHash, 32);
+        Mac(vchV, vchV, 32);
+        Mac(vchK, vchV, 32, &one, 1, pchSecret, 32, pchHash, 32);
+        Mac(vchV, vchV, 32);
+        fRetry = false;
+    }
+
+    ~CNonceGenerator()
+    {
+        OPENSSL_cleanse(vchK, 32);
+        OPENSSL_cleanse(vchV, 32);
+    }
+
+    void Generate(unsigned char* pch32)
+    {
+        static const unsigned char zero = 0x00;
+        if (fRetry)
+        {
+            Mac(vchK, vchV, 32, &zero, 1);
+            Mac(vchV, vchV, 32);
+        }
+        Mac(vchV, vchV, 32);
+        memcpy(pch32, vchV, 32);
+        fRetry = true;
+    }
+};
+
+static bool SignRaw(const uint256& hash, const unsigned char* pchSecret, CScalar& r, CScalar& s, int& nRecId)
+{
+    CScalar d, z;
+    bool fOverflow;
+    ScSetBytes(d, pchSecret, fOverflow);
+    if (fOverflow || ScIsZero(d))
+        return false;
+    ScSetBytes(z, hash.begin(), fOverflow);
+    unsigned char vchHash[32];
+    ScGetBytes(vchHash, z);
+
+    CNonceGenerator nonces(pchSecret, vchHash);
+    bool fSigned = false;
+    while (!fSigned)
+    {
+        unsigned char vchNonce[32];
+        nonces.Generate(vchNonce);
+        CScalar k;
+        ScSetBytes(k, vchNonce, fOverflow);
+        OPENSSL_cleanse(vchNonce, 32);
+        if (fOverflow || ScIsZero(k))
+            continue;
+
+        CAffine R;
+        MulGen(R, k);
+        unsigned char vchX[32];
+        FeGetBytes(vchX, R.x);
+        ScSetBytes(r, vchX, fOverflow);
+        nRecId = (fOverflow ? 2 : 0) | (FeIsOdd(R.y) ? 1 : 0);
+
+        CScalar kinv;
+        ScInv(kinv, k);
+        ScMul(s, r, d);
+        ScAdd(s, s, z);
+        ScMul(s, s, kinv);
+        OPENSSL_cleanse(&k, sizeof(k));
+        OPENSSL_cleanse(&kinv, sizeof(kinv));
+        fSigned = !ScIsZero(r) && !ScIsZero(s);
+    }
+    OPENSSL_cleanse(&d, sizeof(d));
+
+    if (ScIsHigh(s))
+    {
+        ScNeg(s, s);
+        nRecId ^= 1;
+    }
+    return true;
+}
+
+}
+
+bool Verify(const uint256& hash, const unsigned char* pchSig, size_t nSigLen,
+            const unsigned char* pchPubKey, size_t nPubKeyLen)
+{
+    CAffine pub;
+    CScalar r, s;
+    if (!ParsePubKey(pub, pchPubKey, nPubKeyLen) || !ParseDER(r, s, pchSig, nSigLen))
+        return false;
+
+    CScalar z, w, u1, u2;
+    bool fOverflow;
+    ScSetBytes(z, hash.begin(), fOverflow);
+    ScInvVar(w, s);
+    ScMul(u1, z, w);
+    ScMul(u2, r, w);
+
+    CJacobian q, R;
+    ToJacobian(q, pub);
+    MulVar(R, u2, q, u1);
+    if (R.fInfinity)
+        return false;
+
+    // x(R) mod n == r, checked as X == r Z^2 or, where r + n is still
+    // below p, X == (r + n) Z^2, saving the inversion of Z
+    CFieldElem zz, xr;
+    FeSqr(zz, R.z);
+    memcpy(xr.n, r.n, sizeof(r.n));
+    FeMul(xr, xr, zz);
+    if (FeEqual(xr, R.x))
+        return true;
+    limb_t carry = 0;
+    for (int i = 0; i < N; i++)
+    {
+        dlimb_t t = (dlimb_t)r.n[i] + ORDER_N[i] + carry;
+        xr.n[i] = (limb_t)t;
+        carry = (limb_t)(t >> LIMB_BITS);
+    }
+    if (carry || Compare(xr.n, FIELD_P) >= 0)
+        return false;
+    FeMul(xr, xr, zz);
+    return FeEqual(xr, R.x);
+}
+
+bool GetPubKey(const unsigned char* pchSecret, bool fCompressed, vector<unsigned char>& vchPubKey)
+{
+    CScalar d;
+    bool fOverflow;
+    ScSetBytes(d, pchSecret, fOverflow);
+    if (fOverflow || ScIsZero(d))
+        return false;
+    CAffine pub;
+    MulGen(pub, d);
+    OPENSSL_cleanse(&d, sizeof(d));
+    SerializePubKey(vchPubKey, pub, fCompressed);
+    return true;
+}
+
+bool Sign(const uint256& hash, const unsigned char* pchSecret, vector<unsigned char>& vchSig)
+{
+    CScalar r, s;
+    int nRecId;
+    if (!SignRaw(hash, pchSecret, r, s, nRecId))
+        return false;
+    vchSig.clear();
+    vchSig.push_back(0x30);
+    vchSig.push_back(0x00);
+    AppendDERInteger(vchSig, r);
+    AppendDERInteger(vchSig, s);
+    vchSig[1] = vchSig.size() - 2;
+    return true;
+}
+
+bool SignCompact(const uint256& hash, const unsigned char* pchSecret, unsigned char* pchSig64, int& nRecId)
+{
+    CScalar r, s;
+    if (!SignRaw(hash, pchSecret, r, s, nRecId))
+        return false;
+    ScGetBytes(pchSig64, r);
+    ScGetBytes(pchSig64 + 32, s);
+    return true;
+}
+
+bool Recover(const uint256& hash, const unsigned char* pchSig64, int nRecId, bool fCompressed,
+             vector<unsigned char>& vchPubKey)
+{
+    // R has x = r + (nRecId / 2) n and the parity of y in nRecId % 2, as in
+    // ECDSA_SIG_recover_key_GFp
+    if (nRecId < 0 || nRecId > 3)
+        return false;
+    CFieldElem x;
+    if (!FeSetBytes(x, pchSig64))
+        return false;
+    if (nRecId & 2)
+    {
+        limb_t carry = 0;
+        for (int i = 0; i < N; i++)
+        {
+            dlimb_t t = (dlimb_t)x.n[i] + ORDER_N[i] + carry;
+            x.n[i] = (limb_t)t;
+            carry = (limb_t)(t >> LIMB_BITS);
+        }
+        if (carry || Compare(x.n, FIELD_P) >= 0)
+            return false;
+    }
+    CAffine R;
+    if (!Decompress(R, x, nRecId & 1))
+        return false;
+
+    // Q = r^-1 (s R - z G)
+    CScalar r, s, z, rinv, u1, u2;
+    bool fOverflow;
+    ScSetBytes(r, pchSig64, fOverflow);
+    ScSetBytes(s, pchSig64 + 32, fOverflow);
+    ScSetBytes(z, hash.begin(), fOverflow);
+    if (ScIsZero(r))
+        return false;
+    ScInvVar(rinv, r);
+    ScMul(u1, z, rinv);
+    ScNeg(u1, u1);
+    ScMul(u2, s, rinv);
+
+    CJacobian rj, qj;
+    ToJacobian(rj, R);
+    MulVar(qj, u2, rj, u1);
+    if (qj.fInfinity)
+        return false;
+    CAffine Q;
+    ToAffine(Q, qj);
+    SerializePubKey(vchPubKey, Q, fCompressed);
+    return true;
+}
+
+}
@@ -0,0 +1,45 @@
+// Copyright (c) 2014 The Blocknet developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_ECDSA_H
+#define BITCOIN_ECDSA_H
+
+#include <stddef.h>
+
+#include <vector>
+
+#include "uint256.h"
+
+/** Native secp256k1 ECDSA, used by CKey and CPubKey instead of OpenSSL when
+ *  built with USE_NATIVE_ECDSA.
+ *
+ *  Verification and public key recovery only see public data and run in
+ *  variable time, from a table of multiples of the generator built on first
+ *  use. Signing and public key derivation run in constant time in the secret
+ *  and the nonce, which comes from RFC 6979. Accepted encodings are the ones
+ *  OpenSSL accepts: strict DER signatures, and compressed, uncompressed,
+ *  hybrid or point at infinity public keys.
+ */
+namespace ecdsa
+{
+
+/** Check a DER signature of hash against a serialized public key */
+bool Verify(const uint256& hash, const unsigned char* pchSig, size_t nSigLen,
+            const unsigned char* pchPubKey, size_t nPubKeyLen);
+
+/** Serialized public key of a 32 byte big endian secret */
+bool GetPubKey(const unsigned char* pchSecret, bool fCompressed, std::vector<unsigned char>& vchPubKey);
+
+/** Low S DER signature of hash */
+bool Sign(const uint256& hash, const unsigned char* pchSecret, std::vector<unsigned char>& vchSig);
+
+/** Low S signature of hash as 32 byte r and s, with the id that recovers the public key */
+bool SignCompact(const uint256& hash, const unsigned char* pchSecret, unsigned char* pchSig64, int& nRecId);
+
+/** Public key of a compact signature of hash, see SignCompact */
+bool Recover(const uint256& hash, const unsigned char* pchSig64, int nRecId, bool fCompressed,
+             std::vector<unsigned char>& vchPubKey);
+
+}
+
+#endif
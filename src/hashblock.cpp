@@ -0,0 +1,148 @@
+// Copyright (c) 2014 The Blocknet developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <string.h>
+
+#include <boost/thread.hpp>
+
+// define the z_* template contexts declared in hashblock.h in this unit
+#define GLOBALDEFINED
+#include "hashblock.h"
+
+using namespace std;
+
+// Below this many headers the cost of spawning lanes outweighs the gain
+static const size_t HASH9_MIN_HEADERS_PER_LANE = 64;
+
+static boost::once_flag hash9InitFlag = BOOST_ONCE_INIT;
+
+static void Hash9InitContexts()
+{
+    fillz();
+}
+
+// Hash a contiguous run of headers on the calling thread. The z_* contexts
+// are only read after Hash9InitContexts() has run, so lanes can share them.
+static void Hash9Lane(const unsigned char* pHeaders, size_t nHeaders, uint256* pHashes)
+{
+    sph_blake512_context     ctx_blake;
+    sph_bmw512_context       ctx_bmw;
+    sph_groestl512_context   ctx_groestl;
+    sph_jh512_context        ctx_jh;
+    sph_keccak512_context    ctx_keccak;
+    sph_skein512_context     ctx_skein;
+    sph_luffa512_context     ctx_luffa;
+    sph_cubehash512_context  ctx_cubehash;
+    sph_shavite512_context   ctx_shavite;
+    sph_simd512_context      ctx_simd;
+    sph_echo512_context      ctx_echo;
+    sph_hamsi512_context     ctx_hamsi;
+    sph_fugue512_context     ctx_fugue;
+    sph_shabal512_context    ctx_shabal;
+    sph_whirlpool_context    ctx_whirlpool;
+
+    uint512 hash[15];
+
+    for (size_t i = 0; i < nHeaders; i++)
+    {
+        const unsigned char* pheader = pHeaders + i * HASH9_HEADER_SIZE;
+
+        ZBLAKE;
+        sph_blake512 (&ctx_blake, pheader, HASH9_HEADER_SIZE);
+        sph_blake512_close(&ctx_blake, static_cast<void*>(&hash[0]));
+
+        ZBMW;
+        sph_bmw512 (&ctx_bmw, static_cast<const void*>(&hash[0]), 64);
+        sph_bmw512_close(&ctx_bmw, static_cast<void*>(&hash[1]));
+
+        ZGROESTL;
+        sph_groestl512 (&ctx_groestl, static_cast<const void*>(&hash[1]), 64);
+        sph_groestl512_close(&ctx_groestl, static_cast<void*>(&hash[2]));
+
+        ZSKEIN;
+        sph_skein512 (&ctx_skein, static_cast<const void*>(&hash[2]), 64);
+        sph_skein512_close(&ctx_skein, static_cast<void*>(&hash[3]));
+
+        ZJH;
+        sph_jh512 (&ctx_jh, static_cast<const void*>(&hash[3]), 64);
+        sph_jh512_close(&ctx_jh, static_cast<void*>(&hash[4]));
+
+        ZKECCAK;
+        sph_keccak512 (&ctx_keccak, static_cast<const void*>(&hash[4]), 64);
+        sph_keccak512_close(&ctx_keccak, static_cast<void*>(&hash[5]));
+
+        ZLUFFA;
+        sph_luffa512 (&ctx_luffa, static_cast<const void*>(&hash[5]), 64);
+        sph_luffa512_close(&ctx_luffa, static_cast<void*>(&hash[6]));
+
+        ZCUBEHASH;
+        sph_cubehash512 (&ctx_cubehash, static_cast<const void*>(&hash[6]), 64);
+        sph_cubehash512_close(&ctx_cubehash, static_cast<void*>(&hash[7]));
+
+        ZSHAVITE;
+        sph_shavite512 (&ctx_shavite, static_cast<const void*>(&hash[7]), 64);
+        sph_shavite512_close(&ctx_shavite, static_cast<void*>(&hash[8]));
+
+        ZSIMD;
+        sph_simd512 (&ctx_simd, static_cast<const void*>(&hash[8]), 64);
+        sph_simd512_close(&ctx_simd, static_cast<void*>(&hash[9]));
+
+        ZECHO;
+        sph_echo512 (&ctx_echo, static_cast<const void*>(&hash[9]), 64);
+        sph_echo512_close(&ctx_echo, static_cast<void*>(&hash[10]));
+
+        ZHAMSI;
+        sph_hamsi512 (&ctx_hamsi, static_cast<const void*>(&hash[10]), 64);
+        sph_hamsi512_close(&ctx_hamsi, static_cast<void*>(&hash[11]));
+
+        ZFUGUE;
+        sph_fugue512 (&ctx_fugue, static_cast<const void*>(&hash[11]), 64);
+        sph_fugue512_close(&ctx_fugue, static_cast<void*>(&hash[12]));
+
+        ZSHABAL;
+        sph_shabal512 (&ctx_shabal, static_cast<const void*>(&hash[12]), 64);
+        sph_shabal512_close(&ctx_shabal, static_cast<void*>(&hash[13]));
+
+        ZWHIRLPOOL;
+        sph_whirlpool (&ctx_whirlpool, static_cast<const void*>(&hash[13]), 64);
+        sph_whirlpool_close(&ctx_whirlpool, static_cast<void*>(&hash[14]));
+
+        pHashes[i] = hash[14].trim256();
+    }
+}
+
+void Hash9Batch(const unsigned char* pHeaders, size_t nHeaders, uint256* pHashes)
+{
+    if (nHeaders == 0)
+        return;
+
+    boost::call_once(&Hash9InitContexts, hash9InitFlag);
+
+    size_t nLanes = boost::thread::hardware_concurrency();
+    if (nLanes > nHeaders / HASH9_MIN_HEADERS_PER_LANE)
+        nLanes = nHeaders / HASH9_MIN_HEADERS_PER_LANE;
+
+    if (nLanes <= 1)
+    {
+        Hash9Lane(pHeaders, nHeaders, pHashes);
+        return;
+    }
+
+    // Every lane writes a disjoint slice of pHashes; the calling thread takes
+    // the last slice itself rather than sitting idle in join_all().
+    size_t nPerLane = (nHeaders + nLanes - 1) / nLanes;
+    boost::thread_group lanes;
+    size_t nStart = 0;
+    try
+    {
+        for (; nStart + nPerLane < nHeaders; nStart += nPerLane)
+            lanes.create_thread(boost::bind(&Hash9Lane, pHeaders + nStart * HASH9_HEADER_SIZE, nPerLane, pHashes + nStart));
+    }
+    catch (boost::thread_resource_error& e)
+    {
+        // Could not get another lane; finish the remainder here.
+    }
+    Hash9Lane(pHeaders + nStart * HASH9_HEADER_SIZE, nHeaders - nStart, pHashes + nStart);
+    lanes.join_all();
+}
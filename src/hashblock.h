@@ -73,6 +73,22 @@ GLOBAL sph_whirlpool_context     z_whirlpool;
 #define ZFUGUE (memcpy(&ctx_fugue, &z_fugue, sizeof(z_fugue)))
 #define ZSHABAL (memcpy(&ctx_shabal, &z_shabal, sizeof(z_shabal)))
 #define ZWHIRLPOOL (memcpy(&ctx_whirlpool, &z_whirlpool, sizeof(z_whirlpool)))
+#define ZLUFFA (memcpy(&ctx_luffa, &z_luffa, sizeof(z_luffa)))
+#define ZCUBEHASH (memcpy(&ctx_cubehash, &z_cubehash, sizeof(z_cubehash)))
+#define ZSHAVITE (memcpy(&ctx_shavite, &z_shavite, sizeof(z_shavite)))
+#define ZSIMD (memcpy(&ctx_simd, &z_simd, sizeof(z_simd)))
+#define ZECHO (memcpy(&ctx_echo, &z_echo, sizeof(z_echo)))
+
+/** Size of a serialized block header, nVersion through nNonce. */
+static const unsigned int HASH9_HEADER_SIZE = 80;
+
+/** Hash a batch of serialized block headers (HASH9_HEADER_SIZE bytes each,
+ *  packed back to back) into pHashes. Contexts are reset from the z_*
+ *  templates instead of being re-initialised, and large batches are split
+ *  into lanes that run on all available cores. Results are identical to
+ *  calling Hash9() on every header.
+ */
+void Hash9Batch(const unsigned char* pHeaders, size_t nHeaders, uint256* pHashes);
 
 template<typename T1>
 inline uint256 Hash9(const T1 pbegin, const T1 pend)
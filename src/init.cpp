@@ -92,6 +92,11 @@ void Shutdown(void* parg)
 //        CTxDB().Close();
         bitdb.Flush(false);
         StopNode();
+        if (GetBoolArg("-indexsnapshot", true) && !mapBlockIndex.empty())
+        {
+            LOCK(cs_main);
+            CTxDB().WriteBlockIndexSnapshot();
+        }
         bitdb.Flush(true);
         boost::filesystem::remove(GetPidFile());
         UnregisterWallet(pwalletMain);
@@ -248,7 +253,15 @@ std::string HelpMessage()
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
         "  -wallet=<dir>          " + _("Specify wallet file (within data directory)") + "\n" +
         "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n" +
+        "  -txcache=<n>           " + _("Cache up to <n> megabytes of decoded transaction index entries and transactions (default: 16)") + "\n" +
+        "  -mmapblocks            " + _("Read block files through memory mappings (default: 1)") + "\n" +
+        "  -indexsnapshot         " + _("Save chain trust at shutdown to speed up loading the block index (default: 1)") + "\n" +
         "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n" +
+        "  -sigcachemaxmb=<n>     " + _("Limit the signature cache to <n> megabytes (default: 32)") + "\n" +
+        "  -maxmempool=<n>        " + _("Keep the transaction memory pool below <n> megabytes (default: 300)") + "\n" +
+        "  -mempoolexpiry=<n>     " + _("Do not keep transactions in the memory pool longer than <n> hours (default: 72)") + "\n" +
+        "  -par=<n>               " + _("Set the number of script verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
+        "  -stakethreads=<n>      " + _("Set the number of stake kernel search threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n" +
         "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n" +
         "  -socks=<n>             " + _("Select the version of socks proxy to use (4-5, default: 5)") + "\n" +
@@ -302,6 +315,8 @@ std::string HelpMessage()
         "  -rpcpassword=<pw>      " + _("Password for JSON-RPC connections") + "\n" +
         "  -rpcport=<port>        " + _("Listen for JSON-RPC connections on <port> (default: 21358 or testnet: 22358)") + "\n" +
         "  -rpcallowip=<ip>       " + _("Allow JSON-RPC connections from specified IP address") + "\n" +
+        "  -rpcthreads=<n>        " + _("Set the number of threads to service RPC calls (default: 4)") + "\n" +
+        "  -rpcworkqueue=<n>      " + _("Set the depth of the work queue to service RPC calls (default: 16)") + "\n" +
         "  -rpcconnect=<ip>       " + _("Send commands to node running on <ip> (default: 127.0.0.1)") + "\n" +
         "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n" +
         "  -walletnotify=<cmd>    " + _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)") + "\n" +
@@ -381,6 +396,24 @@ bool AppInit2()
 
     nNodeLifespan = GetArg("-addrlifespan", 7);
     fUseFastIndex = GetBoolArg("-fastindex", true);
+    GetBlockStore().SetEnabled(GetBoolArg("-mmapblocks", true));
+
+    // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
+    nScriptCheckThreads = GetArg("-par", 0);
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads += boost::thread::hardware_concurrency();
+    if (nScriptCheckThreads <= 1)
+        nScriptCheckThreads = 0;
+    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
+        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+
+    nStakeThreads = GetArg("-stakethreads", 0);
+    if (nStakeThreads <= 0)
+        nStakeThreads += boost::thread::hardware_concurrency();
+    if (nStakeThreads <= 1)
+        nStakeThreads = 0;
+    else if (nStakeThreads > MAX_STAKE_THREADS)
+        nStakeThreads = MAX_STAKE_THREADS;
     nMinerSleep = GetArg("-minersleep", 500);
 
     CheckpointsMode = Checkpoints::STRICT;
@@ -539,6 +572,22 @@ bool AppInit2()
     printf("Used data directory %s\n", strDataDir.c_str());
     std::ostringstream strErrors;
 
+    if (nScriptCheckThreads)
+    {
+        printf("Using %u threads for script verification\n", nScriptCheckThreads);
+        // the thread calling ConnectBlock joins the pool as the last worker
+        for (int i = 0; i < nScriptCheckThreads - 1; i++)
+            NewThread(ThreadScriptCheck, NULL);
+    }
+
+    if (nStakeThreads)
+    {
+        printf("Using %u threads for stake kernel search\n", nStakeThreads);
+        // the staking thread joins the pool as the last worker
+        for (int i = 0; i < nStakeThreads - 1; i++)
+            NewThread(ThreadStakeKernelSearch, NULL);
+    }
+
     if (fDaemon)
         fprintf(stdout, "blocknet server starting\n");
 
@@ -744,7 +793,7 @@ bool AppInit2()
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -842,7 +891,8 @@ bool AppInit2()
         uiInterface.InitMessage(_("Rescanning..."));
         printf("Rescanning last %i blocks (from block %i)...\n", pindexBest->nHeight - pindexRescan->nHeight, pindexRescan->nHeight);
         nStart = GetTimeMillis();
-        pwalletMain->ScanForWalletTransactions(pindexRescan, true);
+        if (pwalletMain->ScanForWalletTransactions(pindexRescan, true) < 0)
+            return InitError(_("Error writing the rescan to the wallet file"));
         printf(" rescan      %15" PRId64 "ms\n", GetTimeMillis() - nStart);
     }
 
@@ -0,0 +1,555 @@
+// Copyright (c) 2014 The Blocknet developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "jsonstream.h"
+
+#include <ctype.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wctype.h>
+
+#include <iomanip>
+#include <limits>
+#include <locale>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+
+// Deeper documents are rejected rather than risking the stack
+static const int MAX_JSON_DEPTH = 1000;
+
+void CJSONHandler::Raw(const string& strJSON)
+{
+    if (!ParseJSON(strJSON, *this))
+        throw runtime_error("CJSONHandler::Raw() : invalid JSON");
+}
+
+void CJSONHandler::Write(const json_spirit::Value& value)
+{
+    switch (value.type())
+    {
+    case json_spirit::obj_type:
+    {
+        const json_spirit::Object& obj = value.get_obj();
+        BeginObject();
+        for (json_spirit::Object::const_iterator it = obj.begin(); it != obj.end(); ++it)
+        {
+            Key(it->name_);
+            Write(it->value_);
+        }
+        EndObject();
+        break;
+    }
+    case json_spirit::array_type:
+    {
+        const json_spirit::Array& arr = value.get_array();
+        BeginArray();
+        for (json_spirit::Array::const_iterator it = arr.begin(); it != arr.end(); ++it)
+            Write(*it);
+        EndArray();
+        break;
+    }
+    case json_spirit::str_type:
+        String(value.get_str());
+        break;
+    case json_spirit::bool_type:
+        Bool(value.get_bool());
+        break;
+    case json_spirit::int_type:
+        if (value.is_uint64())
+            Uint64(value.get_uint64());
+        else
+            Int(value.get_int64());
+        break;
+    case json_spirit::real_type:
+        Real(value.get_real());
+        break;
+    case json_spirit::null_type:
+        Null();
+        break;
+    }
+}
+
+static void AppendDecimal(string& str, uint64_t n, bool fNegative)
+{
+    char buf[24];
+    char* pend = buf + sizeof(buf);
+    char* p = pend;
+    do
+    {
+        *--p = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    if (fNegative)
+        *--p = '-';
+    str.append(p, pend);
+}
+
+void CJSONWriter::Int(int64_t n)
+{
+    Separate();
+    AppendDecimal(strOut, n < 0 ? 0 - (uint64_t)n : (uint64_t)n, n < 0);
+    fComma = true;
+}
+
+void CJSONWriter::Uint64(uint64_t n)
+{
+    Separate();
+    AppendDecimal(strOut, n, false);
+    fComma = true;
+}
+
+void CJSONWriter::Real(double d)
+{
+    Separate();
+    // json_spirit writes doubles with std::fixed and 17 digits. snprintf
+    // gives the same text unless the C locale has another decimal point
+    // (Qt sets it from the environment), or d isn't finite.
+    char buf[512];
+    int n = snprintf(buf, sizeof(buf), "%.17f", d);
+    if (n > 0 && n < (int)sizeof(buf) && memchr(buf, '.', n))
+        strOut.append(buf, n);
+    else
+    {
+        ostringstream os;
+        os.imbue(locale::classic());
+        os << fixed << setprecision(17) << d;
+        strOut += os.str();
+    }
+    fComma = true;
+}
+
+void CJSONWriter::WriteString(const string& str)
+{
+    strOut += '"';
+    const char* p = str.data();
+    const char* pend = p + str.size();
+    while (p < pend)
+    {
+        // Copy runs of plain printable ASCII at once
+        const char* pstart = p;
+        while (p < pend && *p >= 0x20 && *p < 0x7f && *p != '"' && *p != '\\')
+            p++;
+        strOut.append(pstart, p);
+        if (p == pend)
+            break;
+
+        unsigned char c = *p++;
+        switch (c)
+        {
+        case '"':  strOut += "\\\""; break;
+        case '\\': strOut += "\\\\"; break;
+        case '\b': strOut += "\\b"; break;
+        case '\f': strOut += "\\f"; break;
+        case '\n': strOut += "\\n"; break;
+        case '\r': strOut += "\\r"; break;
+        case '\t': strOut += "\\t"; break;
+        default:
+            if (iswprint(c))
+                strOut += (char)c;
+            else
+            {
+                static const char* pszHex = "0123456789ABCDEF";
+                char esc[6] = { '\\', 'u', '0', '0', pszHex[c >> 4], pszHex[c & 0xf] };
+                strOut.append(esc, sizeof(esc));
+            }
+        }
+    }
+    strOut += '"';
+}
+
+json_spirit::Value* CJSONValueBuilder::Add(const json_spirit::Value& v)
+{
+    json_spirit::Object* pobj = pobjOut;
+    json_spirit::Array* parr = parrOut;
+    if (!vStack.empty())
+    {
+        // Only the innermost open container grows, so the pointers to the
+        // containers around it stay valid
+        json_spirit::Value* pParent = vStack.back();
+        pobj = pParent->type() == json_spirit::obj_type ? &pParent->get_obj() : NULL;
+        parr = pParent->type() == json_spirit::array_type ? &pParent->get_array() : NULL;
+    }
+    else if (!pobj && !parr)
+    {
+        *pvalueOut = v;
+        return pvalueOut;
+    }
+
+    if (parr)
+    {
+        parr->push_back(v);
+        return &parr->back();
+    }
+    pobj->push_back(json_spirit::Pair(strKey, v));
+    return &pobj->back().value_;
+}
+
+void CJSONTextList::Complete()
+{
+    if (nDepth == 0)
+    {
+        vText.push_back(writer.str());
+        writer.clear();
+    }
+}
+
+static int HexValue(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return 0;
+}
+
+// Same substitutions as json_spirit: \x takes two hex digits, \u four of
+// which only the low byte is kept, and unknown escapes are dropped.
+static void Unescape(const char* pbegin, const char* pend, string& str)
+{
+    str.clear();
+    const char* pstart = pbegin;
+    for (const char* p = pbegin; p < pend - 1; p++)
+    {
+        if (*p != '\\')
+            continue;
+        str.append(pstart, p);
+        p++;
+        switch (*p)
+        {
+        case 't':  str += '\t'; break;
+        case 'b':  str += '\b'; break;
+        case 'f':  str += '\f'; break;
+        case 'n':  str += '\n'; break;
+        case 'r':  str += '\r'; break;
+        case '\\': str += '\\'; break;
+        case '/':  str += '/';  break;
+        case '"':  str += '"';  break;
+        case 'x':
+            if (pend - p >= 3)
+            {
+                str += (char)((HexValue(p[1]) << 4) + HexValue(p[2]));
+                p += 2;
+            }
+            break;
+        case 'u':
+            if (pend - p >= 5)
+            {
+                str += (char)((HexValue(p[3]) << 4) + HexValue(p[4]));
+                p += 4;
+            }
+            break;
+        }
+        pstart = p + 1;
+    }
+    str.append(pstart, pend);
+}
+
+static bool ParseDouble(const char* pbegin, const char* pend, double& d)
+{
+    string str(pbegin, pend);
+    const char* pszPoint = localeconv()->decimal_point;
+    if (pszPoint[0] == '.' && pszPoint[1] == 0)
+    {
+        char* pszEnd;
+        d = strtod(str.c_str(), &pszEnd);
+        return pszEnd == str.c_str() + str.size();
+    }
+
+    // strtod would want the locale's decimal point
+    istringstream is(str);
+    is.imbue(locale::classic());
+    is >> d;
+    return !is.fail();
+}
+
+/** Recursive descent parser behind ParseJSON */
+class CJSONReader
+{
+private:
+    const char* p;
+    const char* pend;
+    CJSONHandler& handler;
+    string strScratch;
+    int nDepth;
+
+    // Whitespace and comments
+    void SkipSpace()
+    {
+        while (p < pend)
+        {
+            if (isspace((unsigned char)*p))
+                p++;
+            else if (*p == '/' && pend - p >= 2 && p[1] == '/')
+            {
+                p += 2;
+                while (p < pend && *p != '\n')
+                    p++;
+            }
+            else if (*p == '/' && pend - p >= 2 && p[1] == '*')
+            {
+                const char* q = p + 2;
+                while (q < pend - 1 && !(q[0] == '*' && q[1] == '/'))
+                    q++;
+                if (q >= pend - 1)
+                    return;
+                p = q + 2;
+            }
+            else
+                return;
+        }
+    }
+
+    bool Literal(const char* psz)
+    {
+        size_t nLen = strlen(psz);
+        if ((size_t)(pend - p) < nLen || memcmp(p, psz, nLen) != 0)
+            return false;
+        p += nLen;
+        return true;
+    }
+
+    bool ParseString(string& str)
+    {
+        const char* pbegin = ++p;
+        bool fEscaped = false;
+        while (p < pend && *p != '"')
+        {
+            if (*p == '\\')
+            {
+                fEscaped = true;
+                if (++p == pend)
+                    return false;
+                // json_spirit rejects \x without two hex digits
+                if (*p == 'x' && (pend - p < 3 || !isxdigit((unsigned char)p[1]) || !isxdigit((unsigned char)p[2])))
+                    return false;
+            }
+            p++;
+        }
+        if (p == pend)
+            return false;
+        if (fEscaped)
+            Unescape(pbegin, p, str);
+        else
+            str.assign(pbegin, p);
+        p++;
+        return true;
+    }
+
+    // A real needs a point or an exponent, otherwise it is an int64, or a
+    // uint64 when too large for that and unsigned. As in json_spirit, an
+    // exponent marker without digits spoils the real, leaving only the
+    // integer part in front of the point.
+    bool ParseNumber()
+    {
+        const char* q = p;
+        bool fSigned = false;
+        bool fNegative = false;
+        if (q < pend && (*q == '+' || *q == '-'))
+        {
+            fSigned = true;
+            fNegative = *q == '-';
+            q++;
+        }
+        const char* pdigits = q;
+        while (q < pend && isdigit((unsigned char)*q))
+            q++;
+        const char* pdigitsEnd = q;
+        bool fReal = false;
+        if (q < pend && *q == '.')
+        {
+            const char* r = q + 1;
+            while (r < pend && isdigit((unsigned char)*r))
+                r++;
+            if (pdigitsEnd > pdigits || r > q + 1)
+            {
+                fReal = true;
+                q = r;
+            }
+        }
+        if (pdigitsEnd == pdigits && !fReal)
+            return false;
+        if (q < pend && (*q == 'e' || *q == 'E'))
+        {
+            const char* r = q + 1;
+            if (r < pend && (*r == '+' || *r == '-'))
+                r++;
+            const char* pexp = r;
+            while (r < pend && isdigit((unsigned char)*r))
+                r++;
+            if (r > pexp)
+            {
+                fReal = true;
+                q = r;
+            }
+            else if (pdigitsEnd > pdigits)
+            {
+                fReal = false;
+                q = pdigitsEnd;
+            }
+            else
+                return false;
+        }
+
+        if (fReal)
+        {
+            double d;
+            if (!ParseDouble(p, q, d))
+                return false;
+            handler.Real(d);
+        }
+        else
+        {
+            uint64_t n = 0;
+            for (const char* r = pdigits; r < pdigitsEnd; r++)
+            {
+                unsigned int nDigit = *r - '0';
+                if (n > (numeric_limits<uint64_t>::max() - nDigit) / 10)
+                    return false;
+                n = n * 10 + nDigit;
+            }
+            const uint64_t nMaxInt64 = numeric_limits<int64_t>::max();
+            if (fNegative)
+            {
+                if (n > nMaxInt64 + 1)
+                    return false;
+                handler.Int((int64_t)(0 - n));
+            }
+            else if (n <= nMaxInt64)
+                handler.Int((int64_t)n);
+            else if (!fSigned)
+                handler.Uint64(n);
+            else
+                return false;
+        }
+        p = q;
+        return true;
+    }
+
+    bool ParseObject()
+    {
+        p++;
+        handler.BeginObject();
+        SkipSpace();
+        if (p < pend && *p == '}')
+            p++;
+        else
+        {
+            while (true)
+            {
+                SkipSpace();
+                if (p == pend || *p != '"' || !ParseString(strScratch))
+                    return false;
+                handler.Key(strScratch);
+                SkipSpace();
+                if (p == pend || *p != ':')
+                    return false;
+                p++;
+                if (!ParseValue())
+                    return false;
+                SkipSpace();
+                if (p < pend && *p == ',')
+                    p++;
+                else if (p < pend && *p == '}')
+                {
+                    p++;
+                    break;
+                }
+                else
+                    return false;
+            }
+        }
+        handler.EndObject();
+        return true;
+    }
+
+    bool ParseArray()
+    {
+        p++;
+        handler.BeginArray();
+        SkipSpace();
+        if (p < pend && *p == ']')
+            p++;
+        else
+        {
+            while (true)
+            {
+                if (!ParseValue())
+                    return false;
+                SkipSpace();
+                if (p < pend && *p == ',')
+                    p++;
+                else if (p < pend && *p == ']')
+                {
+                    p++;
+                    break;
+                }
+                else
+                    return false;
+            }
+        }
+        handler.EndArray();
+        return true;
+    }
+
+public:
+    CJSONReader(const string& str, CJSONHandler& handlerIn) : p(str.data()), pend(str.data() + str.size()), handler(handlerIn), nDepth(0) {}
+
+    bool ParseValue()
+    {
+        SkipSpace();
+        if (p == pend)
+            return false;
+        switch (*p)
+        {
+        case '{':
+        case '[':
+        {
+            if (nDepth >= MAX_JSON_DEPTH)
+                return false;
+            nDepth++;
+            bool fRet = *p == '{' ? ParseObject() : ParseArray();
+            nDepth--;
+            return fRet;
+        }
+        case '"':
+            if (!ParseString(strScratch))
+                return false;
+            handler.String(strScratch);
+            return true;
+        case 't':
+            if (!Literal("true"))
+                return false;
+            handler.Bool(true);
+            return true;
+        case 'f':
+            if (!Literal("false"))
+                return false;
+            handler.Bool(false);
+            return true;
+        case 'n':
+            if (!Literal("null"))
+                return false;
+            handler.Null();
+            return true;
+        default:
+            return ParseNumber();
+        }
+    }
+};
+
+bool ParseJSON(const string& str, CJSONHandler& handler)
+{
+    // Like read_string, anything after the first value is ignored
+    CJSONReader reader(str, handler);
+    return reader.ParseValue();
+}
+
+bool ReadJSON(const string& str, json_spirit::Value& value)
+{
+    CJSONValueBuilder builder(value);
+    return ParseJSON(str, builder);
+}
@@ -0,0 +1,176 @@
+// Copyright (c) 2014 The Blocknet developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_JSONSTREAM_H
+#define BITCOIN_JSONSTREAM_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "json/json_spirit_value.h"
+
+/** Receives a JSON document as a sequence of events, either from ParseJSON
+ *  or from an RPC handler that emits its result directly instead of building
+ *  a json_spirit value first. Inside an object every value is preceded by
+ *  its Key.
+ */
+class CJSONHandler
+{
+public:
+    virtual ~CJSONHandler() {}
+
+    virtual void BeginObject() = 0;
+    virtual void EndObject() = 0;
+    virtual void BeginArray() = 0;
+    virtual void EndArray() = 0;
+    virtual void Key(const std::string& str) = 0;
+    virtual void String(const std::string& str) = 0;
+    virtual void Int(int64_t n) = 0;
+    virtual void Uint64(uint64_t n) = 0;
+    virtual void Real(double d) = 0;
+    virtual void Bool(bool f) = 0;
+    virtual void Null() = 0;
+
+    // One complete value as JSON text, like a CJSONWriter's output
+    virtual void Raw(const std::string& strJSON);
+
+    // Replay a json_spirit value as events
+    void Write(const json_spirit::Value& value);
+
+    void Write(const std::string& str) { String(str); }
+    void Write(const char* psz) { String(psz); }
+    void Write(int n) { Int(n); }
+    void Write(int64_t n) { Int(n); }
+    void Write(uint64_t n) { Uint64(n); }
+    void Write(double d) { Real(d); }
+    void Write(bool f) { Bool(f); }
+
+    template<typename T>
+    void Pair(const std::string& strKey, const T& value)
+    {
+        Key(strKey);
+        Write(value);
+    }
+};
+
+/** Writes JSON text exactly as json_spirit's write_string(value, false)
+ *  would write the same document, so a command's reply doesn't change when
+ *  it starts emitting directly.
+ */
+class CJSONWriter : public CJSONHandler
+{
+private:
+    std::string strOut;
+    bool fComma; // a value was completed at the current level
+
+    void Separate()
+    {
+        if (fComma)
+            strOut += ',';
+    }
+    void WriteString(const std::string& str);
+
+public:
+    CJSONWriter() : fComma(false) {}
+
+    void BeginObject() { Separate(); strOut += '{'; fComma = false; }
+    void EndObject() { strOut += '}'; fComma = true; }
+    void BeginArray() { Separate(); strOut += '['; fComma = false; }
+    void EndArray() { strOut += ']'; fComma = true; }
+    void Key(const std::string& str) { Separate(); WriteString(str); strOut += ':'; fComma = false; }
+    void String(const std::string& str) { Separate(); WriteString(str); fComma = true; }
+    void Int(int64_t n);
+    void Uint64(uint64_t n);
+    void Real(double d);
+    void Bool(bool f) { Separate(); strOut += f ? "true" : "false"; fComma = true; }
+    void Null() { Separate(); strOut += "null"; fComma = true; }
+    void Raw(const std::string& strJSON) { Separate(); strOut += strJSON; fComma = true; }
+
+    const std::string& str() const { return strOut; }
+    void clear() { strOut.clear(); fComma = false; }
+};
+
+/** Builds a json_spirit value from events, for callers of handlers that
+ *  still want a Value, like the Qt console. Writes into valueOut when given,
+ *  so big results aren't copied out afterwards, or appends what is written at
+ *  the top level to an existing object or array.
+ */
+class CJSONValueBuilder : public CJSONHandler
+{
+private:
+    json_spirit::Value valueOwn;
+    json_spirit::Value* pvalueOut;
+    json_spirit::Object* pobjOut;
+    json_spirit::Array* parrOut;
+    std::vector<json_spirit::Value*> vStack; // open objects and arrays
+    std::string strKey;
+
+    json_spirit::Value* Add(const json_spirit::Value& v);
+
+    CJSONValueBuilder(const CJSONValueBuilder&);
+    CJSONValueBuilder& operator=(const CJSONValueBuilder&);
+
+public:
+    CJSONValueBuilder() : pvalueOut(&valueOwn), pobjOut(NULL), parrOut(NULL) {}
+    explicit CJSONValueBuilder(json_spirit::Value& valueOut) : pvalueOut(&valueOut), pobjOut(NULL), parrOut(NULL) {}
+    explicit CJSONValueBuilder(json_spirit::Object& objOut) : pvalueOut(&valueOwn), pobjOut(&objOut), parrOut(NULL) {}
+    explicit CJSONValueBuilder(json_spirit::Array& arrOut) : pvalueOut(&valueOwn), pobjOut(NULL), parrOut(&arrOut) {}
+
+    void BeginObject() { vStack.push_back(Add(json_spirit::Object())); }
+    void EndObject() { vStack.pop_back(); }
+    void BeginArray() { vStack.push_back(Add(json_spirit::Array())); }
+    void EndArray() { vStack.pop_back(); }
+    void Key(const std::string& str) { strKey = str; }
+    void String(const std::string& str) { Add(str); }
+    void Int(int64_t n) { Add(n); }
+    void Uint64(uint64_t n) { Add(n); }
+    void Real(double d) { Add(d); }
+    void Bool(bool f) { Add(f); }
+    void Null() { Add(json_spirit::Value()); }
+
+    json_spirit::Value& GetValue() { return *pvalueOut; }
+};
+
+/** Collects the text of each top level value separately, so a handler can
+ *  pick and order whole entries before writing them out with Raw.
+ */
+class CJSONTextList : public CJSONHandler
+{
+private:
+    CJSONWriter writer;
+    int nDepth;
+
+    void Complete();
+
+public:
+    std::vector<std::string> vText;
+
+    CJSONTextList() : nDepth(0) {}
+
+    void BeginObject() { nDepth++; writer.BeginObject(); }
+    void EndObject() { writer.EndObject(); nDepth--; Complete(); }
+    void BeginArray() { nDepth++; writer.BeginArray(); }
+    void EndArray() { writer.EndArray(); nDepth--; Complete(); }
+    void Key(const std::string& str) { writer.Key(str); }
+    void String(const std::string& str) { writer.String(str); Complete(); }
+    void Int(int64_t n) { writer.Int(n); Complete(); }
+    void Uint64(uint64_t n) { writer.Uint64(n); Complete(); }
+    void Real(double d) { writer.Real(d); Complete(); }
+    void Bool(bool f) { writer.Bool(f); Complete(); }
+    void Null() { writer.Null(); Complete(); }
+    void Raw(const std::string& strJSON) { writer.Raw(strJSON); Complete(); }
+};
+
+/** Parse the first JSON value in str into events. Accepts what json_spirit's
+ *  read_string accepts, with the same number types, comments and escapes,
+ *  though reals are rounded correctly where json_spirit can be off in the
+ *  last bit. Events already sent stay sent when it fails.
+ */
+bool ParseJSON(const std::string& str, CJSONHandler& handler);
+
+/** Drop-in replacement for json_spirit's read_string */
+bool ReadJSON(const std::string& str, json_spirit::Value& value);
+
+#endif
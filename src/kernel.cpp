@@ -6,6 +6,7 @@
 
 #include "kernel.h"
 #include "txdb.h"
+#include "checkqueue.h"
 
 using namespace std;
 
@@ -66,45 +67,48 @@ static int64_t GetStakeModifierSelectionInterval()
     return nSelectionInterval;
 }
 
+// A block eligible for the next stake modifier. The selection hash only
+// depends on the block and the previous modifier, so it is computed once
+// rather than in each of the 64 rounds.
+struct CStakeModifierCandidate
+{
+    int64_t nTime;
+    uint256 hashBlock;
+    const CBlockIndex* pindex;
+    uint256 hashSelection;
+    bool fSelected;
+
+    // same order as sorting (timestamp, block hash) pairs
+    bool operator<(const CStakeModifierCandidate& other) const
+    {
+        return nTime < other.nTime || (nTime == other.nTime && hashBlock < other.hashBlock);
+    }
+};
+
 // select a block from the candidate blocks in vSortedByTimestamp, excluding
-// already selected blocks in vSelectedBlocks, and with timestamp up to
-// nSelectionIntervalStop.
-static bool SelectBlockFromCandidates(vector<pair<int64_t, uint256> >& vSortedByTimestamp, map<uint256, const CBlockIndex*>& mapSelectedBlocks,
-    int64_t nSelectionIntervalStop, uint64_t nStakeModifierPrev, const CBlockIndex** pindexSelected)
+// already selected blocks, and with timestamp up to nSelectionIntervalStop.
+static bool SelectBlockFromCandidates(vector<CStakeModifierCandidate>& vSortedByTimestamp,
+    int64_t nSelectionIntervalStop, CStakeModifierCandidate** ppcandidateSelected)
 {
     bool fSelected = false;
     uint256 hashBest = 0;
-    *pindexSelected = (const CBlockIndex*) 0;
-    for (const PAIRTYPE(int64_t, uint256)& item : vSortedByTimestamp)
+    *ppcandidateSelected = NULL;
+    for (CStakeModifierCandidate& candidate : vSortedByTimestamp)
     {
-        if (!mapBlockIndex.count(item.second))
-            return error("SelectBlockFromCandidates: failed to find block index for candidate block %s", item.second.ToString().c_str());
-        const CBlockIndex* pindex = mapBlockIndex[item.second];
-        if (fSelected && pindex->GetBlockTime() > nSelectionIntervalStop)
+        if (fSelected && candidate.nTime > nSelectionIntervalStop)
             break;
-        if (mapSelectedBlocks.count(pindex->GetBlockHash()) > 0)
+        if (candidate.fSelected)
             continue;
-        // compute the selection hash by hashing its proof-hash and the
-        // previous proof-of-stake modifier
-        uint256 hashProof = pindex->IsProofOfStake()? pindex->hashProofOfStake : pindex->GetBlockHash();
-        CDataStream ss(SER_GETHASH, 0);
-        ss << hashProof << nStakeModifierPrev;
-        uint256 hashSelection = Hash(ss.begin(), ss.end());
-        // the selection hash is divided by 2**32 so that proof-of-stake block
-        // is always favored over proof-of-work block. this is to preserve
-        // the energy efficiency property
-        if (pindex->IsProofOfStake())
-            hashSelection >>= 32;
-        if (fSelected && hashSelection < hashBest)
+        if (fSelected && candidate.hashSelection < hashBest)
         {
-            hashBest = hashSelection;
-            *pindexSelected = (const CBlockIndex*) pindex;
+            hashBest = candidate.hashSelection;
+            *ppcandidateSelected = &candidate;
         }
         else if (!fSelected)
         {
             fSelected = true;
-            hashBest = hashSelection;
-            *pindexSelected = (const CBlockIndex*) pindex;
+            hashBest = candidate.hashSelection;
+            *ppcandidateSelected = &candidate;
         }
     }
     if (fDebug && GetBoolArg("-printstakemodifier"))
@@ -147,14 +151,32 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
         return true;
 
     // Sort candidate blocks by timestamp
-    vector<pair<int64_t, uint256> > vSortedByTimestamp;
+    vector<CStakeModifierCandidate> vSortedByTimestamp;
     vSortedByTimestamp.reserve(64 * nModifierInterval / nTargetSpacing);
     int64_t nSelectionInterval = GetStakeModifierSelectionInterval();
     int64_t nSelectionIntervalStart = (pindexPrev->GetBlockTime() / nModifierInterval) * nModifierInterval - nSelectionInterval;
     const CBlockIndex* pindex = pindexPrev;
     while (pindex && pindex->GetBlockTime() >= nSelectionIntervalStart)
     {
-        vSortedByTimestamp.push_back(make_pair(pindex->GetBlockTime(), pindex->GetBlockHash()));
+        CStakeModifierCandidate candidate;
+        candidate.nTime = pindex->GetBlockTime();
+        candidate.hashBlock = pindex->GetBlockHash();
+        candidate.pindex = pindex;
+        candidate.fSelected = false;
+
+        // compute the selection hash by hashing its proof-hash and the
+        // previous proof-of-stake modifier
+        uint256 hashProof = pindex->IsProofOfStake()? pindex->hashProofOfStake : candidate.hashBlock;
+        CDataStream ss(SER_GETHASH, 0);
+        ss << hashProof << nStakeModifier;
+        candidate.hashSelection = Hash(ss.begin(), ss.end());
+        // the selection hash is divided by 2**32 so that proof-of-stake block
+        // is always favored over proof-of-work block. this is to preserve
+        // the energy efficiency property
+        if (pindex->IsProofOfStake())
+            candidate.hashSelection >>= 32;
+
+        vSortedByTimestamp.push_back(candidate);
         pindex = pindex->pprev;
     }
     int nHeightFirstCandidate = pindex ? (pindex->nHeight + 1) : 0;
@@ -164,18 +186,19 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
     // Select 64 blocks from candidate blocks to generate stake modifier
     uint64_t nStakeModifierNew = 0;
     int64_t nSelectionIntervalStop = nSelectionIntervalStart;
-    map<uint256, const CBlockIndex*> mapSelectedBlocks;
     for (int nRound=0; nRound<min(64, (int)vSortedByTimestamp.size()); nRound++)
     {
         // add an interval section to the current selection round
         nSelectionIntervalStop += GetStakeModifierSelectionIntervalSection(nRound);
         // select a block from the candidates of current round
-        if (!SelectBlockFromCandidates(vSortedByTimestamp, mapSelectedBlocks, nSelectionIntervalStop, nStakeModifier, &pindex))
+        CStakeModifierCandidate* pcandidate;
+        if (!SelectBlockFromCandidates(vSortedByTimestamp, nSelectionIntervalStop, &pcandidate))
             return error("ComputeNextStakeModifier: unable to select block at round %d", nRound);
+        pindex = pcandidate->pindex;
         // write the entropy bit of the selected block
         nStakeModifierNew |= (((uint64_t)pindex->GetStakeEntropyBit()) << nRound);
-        // add the selected block from candidates to selected list
-        mapSelectedBlocks.insert(make_pair(pindex->GetBlockHash(), pindex));
+        // exclude the selected block from later rounds
+        pcandidate->fSelected = true;
         if (fDebug && GetBoolArg("-printstakemodifier"))
             printf("ComputeNextStakeModifier: selected round %d stop=%s height=%d bit=%d\n", nRound, DateTimeStrFormat(nSelectionIntervalStop).c_str(), pindex->nHeight, pindex->GetStakeEntropyBit());
     }
@@ -194,11 +217,13 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
                 strSelectionMap.replace(pindex->nHeight - nHeightFirstCandidate, 1, "=");
             pindex = pindex->pprev;
         }
-        for (const PAIRTYPE(uint256, const CBlockIndex*)& item : mapSelectedBlocks)
+        for (const CStakeModifierCandidate& candidate : vSortedByTimestamp)
         {
+            if (!candidate.fSelected)
+                continue;
             // 'S' indicates selected proof-of-stake blocks
             // 'W' indicates selected proof-of-work blocks
-            strSelectionMap.replace(item.second->nHeight - nHeightFirstCandidate, 1, item.second->IsProofOfStake()? "S" : "W");
+            strSelectionMap.replace(candidate.pindex->nHeight - nHeightFirstCandidate, 1, candidate.pindex->IsProofOfStake()? "S" : "W");
         }
         printf("ComputeNextStakeModifier: selection height [%d, %d] map %s\n", nHeightFirstCandidate, pindexPrev->nHeight, strSelectionMap.c_str());
     }
@@ -212,40 +237,283 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
     return true;
 }
 
+// Main chain blocks that generated a stake modifier, in height order. Each
+// entry carries the largest block time up to it, which never decreases, so
+// the first modifier generated at or after a given time is a binary search.
+struct CStakeModifierEntry
+{
+    const CBlockIndex* pindex;
+    int64_t nTimeMax;
+};
+
+static std::vector<CStakeModifierEntry> vStakeModifierIndex;
+static const CBlockIndex* pindexStakeModifierIndexed = NULL; // last main chain block scanned
+static CCriticalSection cs_StakeModifierIndex;
+
+// Drop entries for blocks that left the main chain and scan the blocks
+// connected since, following the same pnext links the kernel rules use
+static void SyncStakeModifierIndex()
+{
+    const CBlockIndex* pindex = pindexStakeModifierIndexed;
+    while (pindex && !pindex->IsInMainChain())
+        pindex = pindex->pprev;
+    while (!vStakeModifierIndex.empty() && (!pindex || vStakeModifierIndex.back().pindex->nHeight > pindex->nHeight))
+        vStakeModifierIndex.pop_back();
+
+    for (const CBlockIndex* pnext = pindex ? pindex->pnext : pindexGenesisBlock; pnext; pnext = pnext->pnext)
+    {
+        pindex = pnext;
+        if (!pindex->GeneratedStakeModifier())
+            continue;
+        CStakeModifierEntry entry;
+        entry.pindex = pindex;
+        entry.nTimeMax = pindex->GetBlockTime();
+        if (!vStakeModifierIndex.empty())
+            entry.nTimeMax = max(entry.nTimeMax, vStakeModifierIndex.back().nTimeMax);
+        vStakeModifierIndex.push_back(entry);
+    }
+    pindexStakeModifierIndexed = pindex;
+}
+
+void UpdateStakeModifierIndex()
+{
+    LOCK(cs_StakeModifierIndex);
+    SyncStakeModifierIndex();
+}
+
+// First main chain block above pindexFrom that generated a modifier at or
+// after nTime, or NULL if the chain has not got that far yet
+static const CBlockIndex* FindStakeModifierBlock(const CBlockIndex* pindexFrom, int64_t nTime)
+{
+    LOCK(cs_StakeModifierIndex);
+    SyncStakeModifierIndex();
+
+    std::vector<CStakeModifierEntry>::const_iterator it = vStakeModifierIndex.begin();
+    std::vector<CStakeModifierEntry>::const_iterator end = vStakeModifierIndex.end();
+    while (it != end)
+    {
+        std::vector<CStakeModifierEntry>::const_iterator mid = it + (end - it) / 2;
+        if (mid->pindex->nHeight <= pindexFrom->nHeight)
+            it = mid + 1;
+        else
+            end = mid;
+    }
+    end = vStakeModifierIndex.end();
+    if (it != vStakeModifierIndex.begin() && (it - 1)->nTimeMax >= nTime)
+    {
+        // An earlier block is timestamped past nTime, so the running maximum
+        // says nothing about the blocks above pindexFrom; look at each
+        for (; it != end; ++it)
+            if (it->pindex->GetBlockTime() >= nTime)
+                return it->pindex;
+        return NULL;
+    }
+    while (it != end)
+    {
+        std::vector<CStakeModifierEntry>::const_iterator mid = it + (end - it) / 2;
+        if (mid->nTimeMax < nTime)
+            it = mid + 1;
+        else
+            end = mid;
+    }
+    return it == vStakeModifierIndex.end() ? NULL : it->pindex;
+}
+
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
-static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake)
+static bool GetKernelStakeModifier(const CBlockIndex* pindexFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, const CBlockIndex*& pindexModifier, bool fPrintProofOfStake)
 {
     nStakeModifier = 0;
-    if (!mapBlockIndex.count(hashBlockFrom))
-        return error("GetKernelStakeModifier() : block not indexed");
-    const CBlockIndex* pindexFrom = mapBlockIndex[hashBlockFrom];
     nStakeModifierHeight = pindexFrom->nHeight;
     nStakeModifierTime = pindexFrom->GetBlockTime();
     int64_t nStakeModifierSelectionInterval = GetStakeModifierSelectionInterval();
     const CBlockIndex* pindex = pindexFrom;
-    // loop to find the stake modifier later by a selection interval
-    while (nStakeModifierTime < pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval)
+    // find the stake modifier later by a selection interval
+    if (nStakeModifierTime < pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval)
     {
-        if (!pindex->pnext)
+        if (pindex->pnext)
+            pindex = FindStakeModifierBlock(pindexFrom, pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval);
+        else
+            pindex = NULL;
+        if (!pindex)
         {   // reached best block; may happen if node is behind on block chain
+            pindex = pindexFrom->pnext ? pindexBest : pindexFrom;
             if (fPrintProofOfStake || (pindex->GetBlockTime() + nStakeMinAge - nStakeModifierSelectionInterval > GetAdjustedTime()))
                 return error("GetKernelStakeModifier() : reached best block %s at height %d from block %s",
-                    pindex->GetBlockHash().ToString().c_str(), pindex->nHeight, hashBlockFrom.ToString().c_str());
+                    pindex->GetBlockHash().ToString().c_str(), pindex->nHeight, pindexFrom->GetBlockHash().ToString().c_str());
             else
                 return false;
         }
-        pindex = pindex->pnext;
-        if (pindex->GeneratedStakeModifier())
-        {
-            nStakeModifierHeight = pindex->nHeight;
-            nStakeModifierTime = pindex->GetBlockTime();
-        }
+        nStakeModifierHeight = pindex->nHeight;
+        nStakeModifierTime = pindex->GetBlockTime();
     }
     nStakeModifier = pindex->nStakeModifier;
+    pindexModifier = pindex;
     return true;
 }
 
+static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake)
+{
+    nStakeModifier = 0;
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlockFrom);
+    if (mi == mapBlockIndex.end())
+        return error("GetKernelStakeModifier() : block not indexed");
+    const CBlockIndex* pindexModifier;
+    return GetKernelStakeModifier(mi->second, nStakeModifier, nStakeModifierHeight, nStakeModifierTime, pindexModifier, fPrintProofOfStake);
+}
+
+bool GetKernelStakeModifier(const CBlockIndex* pindexFrom, uint64_t& nStakeModifier, const CBlockIndex*& pindexModifier)
+{
+    int nStakeModifierHeight;
+    int64_t nStakeModifierTime;
+    return GetKernelStakeModifier(pindexFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime, pindexModifier, false);
+}
+
+//
+// Stake kernel hasher
+//
+// The kernel preimage is always 28 bytes: nStakeModifier, nTimeBlockFrom,
+// nTxPrevOffset, nTimeTxPrev, nPrevout and nTimeTx. Both SHA-256 passes of
+// Hash() over it are a single compression, and between the timestamps of a
+// search only the message word holding nTimeTx changes. So the first six
+// rounds are run once per coin and the rest is evaluated for
+// STAKE_KERNEL_LANES timestamps side by side in vector registers.
+//
+#if defined(__GNUC__)
+static const unsigned int STAKE_KERNEL_LANES = 8;
+typedef uint32_t kernel_word __attribute__((vector_size(4 * STAKE_KERNEL_LANES)));
+#else
+static const unsigned int STAKE_KERNEL_LANES = 1;
+typedef uint32_t kernel_word;
+#endif
+
+static const uint32_t pKernelSHA256Init[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const uint32_t pKernelSHA256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define KERNEL_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static inline uint32_t KernelByteSwap(uint32_t x)
+{
+    return (x >> 24) | ((x >> 8) & 0x0000ff00) | ((x << 8) & 0x00ff0000) | (x << 24);
+}
+
+// Run SHA-256 rounds [nBegin, nEnd) over state s, expanding the message
+// schedule w in place. w must hold the first 16 words.
+template<typename W>
+static inline void KernelRounds(W s[8], W w[64], int nBegin, int nEnd)
+{
+    W a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = nBegin; i < nEnd; i++)
+    {
+        if (i >= 16)
+        {
+            W s0 = KERNEL_ROTR(w[i-15], 7) ^ KERNEL_ROTR(w[i-15], 18) ^ (w[i-15] >> 3);
+            W s1 = KERNEL_ROTR(w[i-2], 17) ^ KERNEL_ROTR(w[i-2], 19) ^ (w[i-2] >> 10);
+            w[i] = w[i-16] + s0 + w[i-7] + s1;
+        }
+        W t1 = h + (KERNEL_ROTR(e, 6) ^ KERNEL_ROTR(e, 11) ^ KERNEL_ROTR(e, 25)) + ((e & f) ^ (~e & g)) + pKernelSHA256K[i] + w[i];
+        W t2 = (KERNEL_ROTR(a, 2) ^ KERNEL_ROTR(a, 13) ^ KERNEL_ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    s[0] = a; s[1] = b; s[2] = c; s[3] = d; s[4] = e; s[5] = f; s[6] = g; s[7] = h;
+}
+
+// The per-coin part of the first SHA-256 pass: message words 0-5 and the
+// state after the rounds that only depend on them
+struct CStakeKernelMidstate
+{
+    uint32_t w[6];
+    uint32_t s[8];
+
+    CStakeKernelMidstate(const CStakeKernel& kernel)
+    {
+        w[0] = KernelByteSwap((uint32_t)kernel.nStakeModifier);
+        w[1] = KernelByteSwap((uint32_t)(kernel.nStakeModifier >> 32));
+        w[2] = KernelByteSwap(kernel.nTimeBlockFrom);
+        w[3] = KernelByteSwap(kernel.nTxPrevOffset);
+        w[4] = KernelByteSwap(kernel.nTimeTxPrev);
+        w[5] = KernelByteSwap(kernel.nPrevout);
+        uint32_t ws[64];
+        memcpy(ws, w, sizeof(w));
+        memcpy(s, pKernelSHA256Init, sizeof(s));
+        KernelRounds(s, ws, 0, 6);
+    }
+};
+
+// Kernel hashes of STAKE_KERNEL_LANES timestamps at once
+static void GetStakeKernelHashes(const CStakeKernelMidstate& mid, const unsigned int pnTimeTx[STAKE_KERNEL_LANES], uint256 phash[STAKE_KERNEL_LANES])
+{
+    const kernel_word zero = kernel_word();
+    kernel_word w[64];
+    kernel_word s[8];
+
+    // First pass: 28 byte preimage, padding, bit length 224
+    uint32_t pTime[STAKE_KERNEL_LANES];
+    for (unsigned int i = 0; i < STAKE_KERNEL_LANES; i++)
+        pTime[i] = KernelByteSwap(pnTimeTx[i]);
+    for (int i = 0; i < 6; i++)
+        w[i] = zero + mid.w[i];
+    memcpy(&w[6], pTime, sizeof(w[6]));
+    w[7] = zero + 0x80000000;
+    for (int i = 8; i < 15; i++)
+        w[i] = zero;
+    w[15] = zero + 224;
+    for (int i = 0; i < 8; i++)
+        s[i] = zero + mid.s[i];
+    KernelRounds(s, w, 6, 64);
+
+    // Second pass over the 32 byte digest
+    for (int i = 0; i < 8; i++)
+    {
+        w[i] = s[i] + pKernelSHA256Init[i];
+        s[i] = zero + pKernelSHA256Init[i];
+    }
+    w[8] = zero + 0x80000000;
+    for (int i = 9; i < 15; i++)
+        w[i] = zero;
+    w[15] = zero + 256;
+    KernelRounds(s, w, 0, 64);
+
+    uint32_t pOut[8][STAKE_KERNEL_LANES];
+    for (int i = 0; i < 8; i++)
+    {
+        s[i] += pKernelSHA256Init[i];
+        memcpy(pOut[i], &s[i], sizeof(pOut[i]));
+    }
+    for (unsigned int n = 0; n < STAKE_KERNEL_LANES; n++)
+    {
+        uint32_t pHash[8];
+        for (int i = 0; i < 8; i++)
+            pHash[i] = KernelByteSwap(pOut[i][n]);
+        memcpy(phash[n].begin(), pHash, sizeof(pHash));
+    }
+}
+
+static uint256 GetStakeKernelHash(uint64_t nStakeModifier, unsigned int nTimeBlockFrom, unsigned int nTxPrevOffset, unsigned int nTimeTxPrev, unsigned int nPrevout, unsigned int nTimeTx)
+{
+    unsigned char pch[28];
+    memcpy(&pch[0], &nStakeModifier, 8);
+    memcpy(&pch[8], &nTimeBlockFrom, 4);
+    memcpy(&pch[12], &nTxPrevOffset, 4);
+    memcpy(&pch[16], &nTimeTxPrev, 4);
+    memcpy(&pch[20], &nPrevout, 4);
+    memcpy(&pch[24], &nTimeTx, 4);
+    return Hash(BEGIN(pch), END(pch));
+}
+
 // ppcoin kernel protocol
 // coinstake must meet hash target according to the protocol:
 // kernel (input 0) must meet the formula
@@ -286,17 +554,14 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned
     targetProofOfStake = (bnCoinDayWeight * bnTargetPerCoinDay).getuint256();
 
     // Calculate hash
-    CDataStream ss(SER_GETHASH, 0);
     uint64_t nStakeModifier = 0;
     int nStakeModifierHeight = 0;
     int64_t nStakeModifierTime = 0;
 
     if (!GetKernelStakeModifier(hashBlockFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime, fPrintProofOfStake))
         return false;
-    ss << nStakeModifier;
 
-    ss << nTimeBlockFrom << nTxPrevOffset << txPrev.nTime << prevout.n << nTimeTx;
-    hashProofOfStake = Hash(ss.begin(), ss.end());
+    hashProofOfStake = GetStakeKernelHash(nStakeModifier, nTimeBlockFrom, nTxPrevOffset, txPrev.nTime, prevout.n, nTimeTx);
     if (fPrintProofOfStake)
     {
         printf("CheckStakeKernelHash() : using modifier 0x%016" PRIx64 " at height=%d timestamp=%s for block from height=%d timestamp=%s\n",
@@ -328,6 +593,220 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned
     return true;
 }
 
+// Decode nBits like CBigNum::SetCompact. Fails for negative targets and
+// ones that do not fit 256 bits, which are left to the CBigNum path.
+static bool GetStakeTargetPerCoinDay(unsigned int nBits, uint256& target)
+{
+    unsigned int nSize = nBits >> 24;
+    unsigned int nWord = nBits & 0x007fffff;
+    target = 0;
+    if (nSize == 0)
+        return true;
+    if (nSize <= 3)
+        nWord >>= 8 * (3 - nSize);
+    if ((nBits & 0x00800000) && nWord != 0)
+        return false;
+    if (nWord == 0)
+        return true;
+    if (nSize > 3 && 8 * (nSize - 3) > 256 - 23)
+        return false;
+    target = nWord;
+    if (nSize > 3)
+        target <<= 8 * (nSize - 3);
+    return true;
+}
+
+// bnCoinDayWeight * bnTargetPerCoinDay in uint256 arithmetic. Fails where
+// the result would differ from CheckStakeKernelHash's CBigNum maths. A
+// product past 256 bits sets fOverflow and keeps the low bits, like
+// CBigNum::getuint256.
+static bool GetStakeTarget(const uint256& targetPerCoinDay, const CStakeKernel& kernel, unsigned int nTimeTx, uint256& target, bool& fOverflow)
+{
+    int64_t nWeight = GetWeight((int64_t)kernel.nTimeTxPrev, (int64_t)nTimeTx);
+    if (nWeight < 0 || kernel.nValueIn < 0)
+        return false;
+
+    // nValueIn * nWeight / COIN / (24 * 60 * 60), split so nothing overflows
+    uint64_t nCoins = kernel.nValueIn / COIN, nRest = kernel.nValueIn % COIN;
+    if (nWeight > 0xffffffff || (nCoins != 0 && (uint64_t)nWeight > (std::numeric_limits<uint64_t>::max() >> 1) / nCoins))
+        return false;
+    uint64_t nCoinDayWeight = (nCoins * nWeight + nRest * nWeight / COIN) / (24 * 60 * 60);
+
+    uint32_t pa[8];
+    uint64_t pr[10] = {0};
+    memcpy(pa, targetPerCoinDay.begin(), sizeof(pa));
+    for (int j = 0; j < 2; j++)
+    {
+        uint64_t b = (uint32_t)(nCoinDayWeight >> (32 * j));
+        uint64_t carry = 0;
+        for (int i = 0; i < 8; i++)
+        {
+            uint64_t n = carry + pr[i + j] + pa[i] * b;
+            pr[i + j] = n & 0xffffffff;
+            carry = n >> 32;
+        }
+        pr[8 + j] += carry;
+    }
+    fOverflow = (pr[8] || pr[9]);
+    uint32_t pt[8];
+    for (int i = 0; i < 8; i++)
+        pt[i] = (uint32_t)pr[i];
+    memcpy(target.begin(), pt, sizeof(pt));
+    return true;
+}
+
+// Search nTimeTx and the nSearchSpan-1 seconds before it for a kernel of a
+// precomputed coin, newest timestamp first. Sets nTimeTx to the timestamp
+// found. Same rules as CheckStakeKernelHash without any disk or index access.
+bool SearchStakeKernel(unsigned int nBits, const CStakeKernel& kernel, unsigned int& nTimeTx, unsigned int nSearchSpan, uint256& hashProofOfStake, uint256& targetProofOfStake)
+{
+    // Older timestamps only get further from meeting the tx time and min age rules
+    unsigned int nTimeMin = max(kernel.nTimeTxPrev, kernel.nTimeBlockFrom + nStakeMinAge);
+    if (nTimeTx < nTimeMin)
+        return false;
+    nSearchSpan = min(nSearchSpan, nTimeTx - nTimeMin + 1);
+
+    uint256 targetPerCoinDay;
+    bool fFastTarget = GetStakeTargetPerCoinDay(nBits, targetPerCoinDay);
+
+    CStakeKernelMidstate mid(kernel);
+    for (unsigned int n = 0; n < nSearchSpan; n += STAKE_KERNEL_LANES)
+    {
+        unsigned int pnTime[STAKE_KERNEL_LANES];
+        uint256 phash[STAKE_KERNEL_LANES];
+        for (unsigned int i = 0; i < STAKE_KERNEL_LANES; i++)
+            pnTime[i] = nTimeTx - min(n + i, nSearchSpan - 1);
+        GetStakeKernelHashes(mid, pnTime, phash);
+
+        for (unsigned int i = 0; i < STAKE_KERNEL_LANES && n + i < nSearchSpan; i++)
+        {
+            uint256 target;
+            bool fOverflow;
+            if (fFastTarget && GetStakeTarget(targetPerCoinDay, kernel, pnTime[i], target, fOverflow))
+            {
+                if (!fOverflow && phash[i] > target)
+                    continue;
+            }
+            else
+            {
+                CBigNum bnTargetPerCoinDay;
+                bnTargetPerCoinDay.SetCompact(nBits);
+                CBigNum bnCoinDayWeight = CBigNum(kernel.nValueIn) * GetWeight((int64_t)kernel.nTimeTxPrev, (int64_t)pnTime[i]) / COIN / (24 * 60 * 60);
+                CBigNum bnTarget = bnCoinDayWeight * bnTargetPerCoinDay;
+                if (CBigNum(phash[i]) > bnTarget)
+                    continue;
+                target = bnTarget.getuint256();
+            }
+
+            nTimeTx = pnTime[i];
+            hashProofOfStake = phash[i];
+            targetProofOfStake = target;
+            return true;
+        }
+    }
+    return false;
+}
+
+struct CStakeKernelResult
+{
+    bool fFound;
+    unsigned int nTimeTx;
+    uint256 hashProofOfStake;
+    uint256 targetProofOfStake;
+
+    CStakeKernelResult() : fFound(false), nTimeTx(0) {}
+};
+
+// Searches the window of one coin on the stake check queue. The queue
+// stops handing out work after a job fails, so a found kernel is reported
+// as a failure.
+class CStakeKernelCheck
+{
+private:
+    const CStakeKernel* pkernel;
+    unsigned int nBits;
+    unsigned int nTimeTx;
+    unsigned int nSearchSpan;
+    CStakeKernelResult* presult;
+
+public:
+    CStakeKernelCheck() : pkernel(NULL), nBits(0), nTimeTx(0), nSearchSpan(0), presult(NULL) {}
+    CStakeKernelCheck(const CStakeKernel* pkernelIn, unsigned int nBitsIn, unsigned int nTimeTxIn, unsigned int nSearchSpanIn, CStakeKernelResult* presultIn) :
+        pkernel(pkernelIn), nBits(nBitsIn), nTimeTx(nTimeTxIn), nSearchSpan(nSearchSpanIn), presult(presultIn) {}
+
+    bool operator()()
+    {
+        if (fShutdown)
+            return false;
+        presult->nTimeTx = nTimeTx;
+        presult->fFound = SearchStakeKernel(nBits, *pkernel, presult->nTimeTx, nSearchSpan, presult->hashProofOfStake, presult->targetProofOfStake);
+        return !presult->fFound;
+    }
+
+    void swap(CStakeKernelCheck& check)
+    {
+        std::swap(pkernel, check.pkernel);
+        std::swap(nBits, check.nBits);
+        std::swap(nTimeTx, check.nTimeTx);
+        std::swap(nSearchSpan, check.nSearchSpan);
+        std::swap(presult, check.presult);
+    }
+};
+
+int nStakeThreads = 0;
+static CCheckQueue<CStakeKernelCheck> stakecheckqueue(8);
+static CCriticalSection cs_stakecheckqueue;
+
+void ThreadStakeKernelSearch(void*)
+{
+    RenameThread("blocknet-stakech");
+    // Like the script check workers, these idle on the queue and are left
+    // to be torn down with the process.
+    stakecheckqueue.Thread();
+}
+
+// Search the windows of vKernels[nStart..] for a kernel, across the stake
+// threads if there are any. Returns the lowest index found, or -1.
+int SearchStakeKernels(unsigned int nBits, const std::vector<CStakeKernel>& vKernels, unsigned int nStart, unsigned int& nTimeTx, unsigned int nSearchSpan, uint256& hashProofOfStake, uint256& targetProofOfStake)
+{
+    if (nStart >= vKernels.size())
+        return -1;
+
+    if (!nStakeThreads)
+    {
+        for (unsigned int i = nStart; i < vKernels.size() && !fShutdown; i++)
+            if (SearchStakeKernel(nBits, vKernels[i], nTimeTx, nSearchSpan, hashProofOfStake, targetProofOfStake))
+                return i;
+        return -1;
+    }
+
+    std::vector<CStakeKernelResult> vResults(vKernels.size() - nStart);
+    {
+        LOCK(cs_stakecheckqueue);
+        CCheckQueueControl<CStakeKernelCheck> control(&stakecheckqueue);
+
+        // The queue works from the back, so queue the lowest index last
+        std::vector<CStakeKernelCheck> vChecks;
+        vChecks.reserve(vResults.size());
+        for (unsigned int i = vKernels.size(); i-- > nStart;)
+            vChecks.push_back(CStakeKernelCheck(&vKernels[i], nBits, nTimeTx, nSearchSpan, &vResults[i - nStart]));
+        control.Add(vChecks);
+        control.Wait();
+    }
+
+    for (unsigned int i = 0; i < vResults.size(); i++)
+    {
+        if (vResults[i].fFound)
+        {
+            nTimeTx = vResults[i].nTimeTx;
+            hashProofOfStake = vResults[i].hashProofOfStake;
+            targetProofOfStake = vResults[i].targetProofOfStake;
+            return nStart + i;
+        }
+    }
+    return -1;
+}
+
 // Check kernel hash target and coinstake signature
 bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake, uint256& targetProofOfStake)
 {
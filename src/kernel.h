@@ -20,6 +20,38 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
 // Sets hashProofOfStake on success return
 bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
 
+// Bring the main chain stake modifier index up to date after the best chain changed
+void UpdateStakeModifierIndex();
+
+// Resolve the stake modifier a kernel from pindexFrom hashes with. Fails
+// until the chain has grown a selection interval past pindexFrom; on
+// success pindexModifier is the block whose modifier was taken.
+bool GetKernelStakeModifier(const CBlockIndex* pindexFrom, uint64_t& nStakeModifier, const CBlockIndex*& pindexModifier);
+
+// Kernel inputs of one stakeable output that do not depend on the coinstake time
+struct CStakeKernel
+{
+    uint64_t nStakeModifier;
+    unsigned int nTimeBlockFrom;
+    unsigned int nTxPrevOffset;
+    unsigned int nTimeTxPrev;
+    unsigned int nPrevout;
+    int64_t nValueIn;
+};
+
+// Search up to nSearchSpan timestamps back from nTimeTx for a kernel meeting the target
+// Sets nTimeTx and hashProofOfStake on success return
+bool SearchStakeKernel(unsigned int nBits, const CStakeKernel& kernel, unsigned int& nTimeTx, unsigned int nSearchSpan, uint256& hashProofOfStake, uint256& targetProofOfStake);
+
+// Maximum number of stake kernel search threads (-stakethreads)
+static const int MAX_STAKE_THREADS = 16;
+extern int nStakeThreads;
+void ThreadStakeKernelSearch(void* parg);
+
+// Search every kernel from vKernels[nStart] on, sharded across the stake threads
+// Returns the lowest index with a kernel and sets nTimeTx and hashProofOfStake, or -1
+int SearchStakeKernels(unsigned int nBits, const std::vector<CStakeKernel>& vKernels, unsigned int nStart, unsigned int& nTimeTx, unsigned int nSearchSpan, uint256& hashProofOfStake, uint256& targetProofOfStake);
+
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
 bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake, uint256& targetProofOfStake);
@@ -8,6 +8,9 @@
 #include <openssl/obj_mac.h>
 
 #include "key.h"
+#ifdef USE_NATIVE_ECDSA
+#include "ecdsa.h"
+#endif
 
 // Generate a private key from just the secret parameter
 int EC_KEY_regenerate_key(EC_KEY *eckey, BIGNUM *priv_key)
@@ -286,6 +289,13 @@ CPubKey CKey::GetPubKey() const
 bool CKey::Sign(uint256 hash, std::vector<unsigned char>& vchSig)
 {
     vchSig.clear();
+#ifdef USE_NATIVE_ECDSA
+    if (EC_KEY_get0_private_key(pkey) == NULL)
+        return false;
+    bool fCompressed;
+    CSecret vchSecret = GetSecret(fCompressed);
+    return ecdsa::Sign(hash, &vchSecret[0], vchSig);
+#else
     ECDSA_SIG *sig = ECDSA_do_sign((unsigned char*)&hash, sizeof(hash), pkey);
     if (sig == NULL)
         return false;
@@ -309,6 +319,7 @@ bool CKey::Sign(uint256 hash, std::vector<unsigned char>& vchSig)
     ECDSA_SIG_free(sig);
     vchSig.resize(nSize); // Shrink to fit actual size
     return true;
+#endif
 }
 
 // create a compact signature (65 bytes), which allows reconstructing the used public key
@@ -317,6 +328,19 @@ bool CKey::Sign(uint256 hash, std::vector<unsigned char>& vchSig)
 //                  0x1D = second key with even y, 0x1E = second key with odd y
 bool CKey::SignCompact(uint256 hash, std::vector<unsigned char>& vchSig)
 {
+#ifdef USE_NATIVE_ECDSA
+    if (EC_KEY_get0_private_key(pkey) == NULL)
+        return false;
+    bool fCompressed;
+    CSecret vchSecret = GetSecret(fCompressed);
+    int nRecId;
+    vchSig.clear();
+    vchSig.resize(65,0);
+    if (!ecdsa::SignCompact(hash, &vchSecret[0], &vchSig[1], nRecId))
+        return false;
+    vchSig[0] = nRecId+27+(fCompressedPubKey ? 4 : 0);
+    return true;
+#else
     bool fOk = false;
     ECDSA_SIG *sig = ECDSA_do_sign((unsigned char*)&hash, sizeof(hash), pkey);
     if (sig==NULL)
@@ -355,6 +379,7 @@ bool CKey::SignCompact(uint256 hash, std::vector<unsigned char>& vchSig)
     }
     ECDSA_SIG_free(sig);
     return fOk;
+#endif
 }
 
 // reconstruct public key from a compact signature
@@ -368,6 +393,12 @@ bool CKey::SetCompactSignature(uint256 hash, const std::vector<unsigned char>& v
     int nV = vchSig[0];
     if (nV<27 || nV>=35)
         return false;
+#ifdef USE_NATIVE_ECDSA
+    std::vector<unsigned char> vchPubKey;
+    if (!ecdsa::Recover(hash, &vchSig[1], (nV - 27) & 3, nV >= 31, vchPubKey))
+        return false;
+    return SetPubKey(CPubKey(vchPubKey));
+#else
     ECDSA_SIG *sig = ECDSA_SIG_new();
     BN_bin2bn(&vchSig[1],32,sig->r);
     BN_bin2bn(&vchSig[33],32,sig->s);
@@ -387,15 +418,21 @@ bool CKey::SetCompactSignature(uint256 hash, const std::vector<unsigned char>& v
     }
     ECDSA_SIG_free(sig);
     return false;
+#endif
 }
 
 bool CKey::Verify(uint256 hash, const std::vector<unsigned char>& vchSig)
 {
+#ifdef USE_NATIVE_ECDSA
+    CPubKey vchPubKey = GetPubKey();
+    return vchSig.size() && ecdsa::Verify(hash, &vchSig[0], vchSig.size(), vchPubKey.begin(), vchPubKey.size());
+#else
     // -1 = error, 0 = bad sig, 1 = good
     if (ECDSA_verify(0, (unsigned char*)&hash, sizeof(hash), &vchSig[0], vchSig.size(), pkey) != 1)
         return false;
 
     return true;
+#endif
 }
 
 bool CKey::VerifyCompact(uint256 hash, const std::vector<unsigned char>& vchSig)
@@ -409,6 +446,20 @@ bool CKey::VerifyCompact(uint256 hash, const std::vector<unsigned char>& vchSig)
     return true;
 }
 
+bool CPubKey::Verify(const uint256& hash, const std::vector<unsigned char>& vchSig) const
+{
+    if (vchPubKey.empty() || vchSig.empty())
+        return false;
+#ifdef USE_NATIVE_ECDSA
+    return ecdsa::Verify(hash, &vchSig[0], vchSig.size(), &vchPubKey[0], vchPubKey.size());
+#else
+    CKey key;
+    if (!key.SetPubKey(*this))
+        return false;
+    return key.Verify(hash, vchSig);
+#endif
+}
+
 bool CKey::IsValid()
 {
     if (!fSet)
@@ -102,6 +102,10 @@ public:
     std::vector<unsigned char> Raw() const {
         return vchPubKey;
     }
+
+    // Check a DER signature of hash by this key, without building a CKey
+    // when the native ECDSA backend is in use
+    bool Verify(const uint256& hash, const std::vector<unsigned char>& vchSig) const;
 };
 
 
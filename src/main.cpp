@@ -6,12 +6,14 @@
 #include "xbridge/xbridgeapp.h"
 #include "alert.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "db.h"
 #include "txdb.h"
 #include "net.h"
 #include "init.h"
 #include "ui_interface.h"
 #include "kernel.h"
+#include "memusage.h"
 #include "message.h"
 // #include "xbridgeconnector.h"
 
@@ -36,7 +38,7 @@ CCriticalSection cs_main;
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 
 CBigNum bnProofOfWorkLimit(~uint256() >> 20); // "standard" scrypt target limit for proof of work, results with 0,000244140625 proof-of-work difficulty
@@ -57,6 +59,7 @@ uint256 nBestInvalidTrust = 0;
 
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
+CChain chainActive;
 int64_t nTimeBestReceived = 0;
 
 CMedianFilter<int> cPeerBlockCounts(5, 0); // Amount of blocks that other nodes claim to have
@@ -77,6 +80,7 @@ const string strMessageMagic = "blocknet Signed Message:\n";
 int64_t nTransactionFee = MIN_TX_FEE;
 int64_t nReserveBalance = 0;
 int64_t nMinimumInputValue = 0;
+int nScriptCheckThreads = 0;
 
 extern enum Checkpoints::CPMode CheckpointsMode;
 
@@ -148,6 +152,22 @@ void SyncWithWallets(const CTransaction& tx, const CBlock* pblock, bool fUpdate,
         pwallet->AddToWalletIfInvolvingMe(tx, pblock, fUpdate);
 }
 
+// hold back the wallets' database writes until EndWalletBatches
+void static BeginWalletBatches()
+{
+    for (CWallet* pwallet : setpwalletRegistered)
+        bitdb.BeginBatch(pwallet->strWalletFile);
+}
+
+bool static EndWalletBatches()
+{
+    bool fSuccess = true;
+    for (CWallet* pwallet : setpwalletRegistered)
+        if (!bitdb.EndBatch(pwallet->strWalletFile))
+            fSuccess = false;
+    return fSuccess;
+}
+
 // notify wallets about a new best chain
 void static SetBestChain(const CBlockLocator& loc)
 {
@@ -162,6 +182,13 @@ void static UpdatedTransaction(const uint256& hashTx)
         pwallet->UpdatedTransaction(hashTx);
 }
 
+// notify wallets that a block left the main chain
+void static BlockDisconnected(const CBlockIndex* pindex)
+{
+    for (CWallet* pwallet : setpwalletRegistered)
+        pwallet->BlockDisconnected(pindex);
+}
+
 // dump all wallets
 void static PrintWallets(const CBlock& block)
 {
@@ -271,7 +298,7 @@ bool CTransaction::ReadFromDisk(CTxDB& txdb, COutPoint prevout, CTxIndex& txinde
     SetNull();
     if (!txdb.ReadTxIndex(prevout.hash, txindexRet))
         return false;
-    if (!ReadFromDisk(txindexRet.pos))
+    if (!txdb.ReadDiskTxAt(prevout.hash, txindexRet.pos, *this))
         return false;
     if (prevout.n >= vout.size())
     {
@@ -449,7 +476,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -610,9 +637,9 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
         }
     }
 
+    MapPrevTx mapInputs;
     if (fCheckInputs)
     {
-        MapPrevTx mapInputs;
         map<uint256, CTxIndex> mapUnused;
         bool fInvalid = false;
         if (!tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
@@ -674,6 +701,14 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
             return error("CTxMemPool::accept() : ConnectInputs failed %s", hash.ToString().substr(0,10).c_str());
         }
     }
+    else
+    {
+        // Still look the inputs up so the pool knows the fee and priority
+        map<uint256, CTxIndex> mapUnused;
+        bool fInvalid = false;
+        if (!tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
+            mapInputs.clear();
+    }
 
     // Store transaction in memory
     {
@@ -683,7 +718,12 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
             printf("CTxMemPool::accept() : replacing tx %s with new version\n", ptxOld->GetHash().ToString().c_str());
             remove(*ptxOld);
         }
-        addUnchecked(hash, tx);
+        addUnchecked(hash, tx, &mapInputs);
+
+        Expire(GetTime() - GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+        TrimToSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+        if (!exists(hash))
+            return error("CTxMemPool::accept() : memory pool full, %s not accepted", hash.ToString().substr(0,10).c_str());
     }
 
     ///// are we sure this is ok when loading transactions or restoring block txes
@@ -702,7 +742,18 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
     return mempool.accept(txdb, *this, fCheckInputs, pfMissingInputs);
 }
 
-bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
+// Heap memory held by a transaction's inputs, outputs and scripts
+static size_t TransactionUsage(const CTransaction& tx)
+{
+    size_t nUsage = memusage::DynamicUsage(tx.vin) + memusage::DynamicUsage(tx.vout);
+    for (const CTxIn& txin : tx.vin)
+        nUsage += memusage::DynamicUsage(txin.scriptSig);
+    for (const CTxOut& txout : tx.vout)
+        nUsage += memusage::DynamicUsage(txout.scriptPubKey);
+    return nUsage;
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx, const MapPrevTx* pmapInputs)
 {
     // Add to memory pool without checking anything.  Don't call this directly,
     // call CTxMemPool::accept to properly check the transaction first.
@@ -710,6 +761,80 @@ bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
         mapTx[hash] = tx;
         for (unsigned int i = 0; i < tx.vin.size(); i++)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+
+        // Inputs from the pool are found there; the rest only count towards
+        // fee and priority when the caller looked them up
+        CTxMemPoolEntry& entry = mapEntry[hash];
+        entry.nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        int64_t nValueIn = 0;
+        for (const CTxIn& txin : tx.vin)
+        {
+            map<uint256, CTransaction>::const_iterator mi = mapTx.find(txin.prevout.hash);
+            if (mi != mapTx.end())
+            {
+                if (entry.setDepends.insert(txin.prevout.hash).second)
+                    nUsage += memusage::IncrementalDynamicUsage(entry.setDepends);
+                if (txin.prevout.n < (*mi).second.vout.size())
+                    nValueIn += (*mi).second.vout[txin.prevout.n].nValue;
+                continue;
+            }
+            MapPrevTx::const_iterator mp;
+            if (!pmapInputs || (mp = pmapInputs->find(txin.prevout.hash)) == pmapInputs->end() ||
+                txin.prevout.n >= (*mp).second.second.vout.size())
+            {
+                if (entry.setMissing.insert(txin.prevout.hash).second)
+                    nUsage += memusage::IncrementalDynamicUsage(entry.setMissing);
+                continue;
+            }
+            int64_t nValue = (*mp).second.second.vout[txin.prevout.n].nValue;
+            nValueIn += nValue;
+            int nConf = (*mp).second.first.GetDepthInMainChain();
+            if (nConf > 0)
+            {
+                entry.nValueInChain += nValue;
+                entry.dValueInHeight += (double)nValue * (nBestHeight + 1 - nConf);
+            }
+        }
+        entry.nFee = nValueIn - tx.GetValueOut();
+        entry.nTime = GetTime();
+        setTxByFeeRate.insert(make_pair(entry.GetFeePerKb(), hash));
+        setTxByTime.insert(make_pair(entry.nTime, hash));
+
+        entry.nUsage = TransactionUsage(tx) +
+                       memusage::IncrementalDynamicUsage(mapTx) +
+                       memusage::IncrementalDynamicUsage(mapNextTx) * tx.vin.size() +
+                       memusage::IncrementalDynamicUsage(mapEntry) +
+                       memusage::IncrementalDynamicUsage(setTxByFeeRate) +
+                       memusage::IncrementalDynamicUsage(setTxByTime);
+        nUsage += entry.nUsage;
+
+        // Transactions resurrected by a reorganization can arrive after
+        // the ones spending them, which then left these outputs out of
+        // their fee
+        std::vector<CTxMemPoolEntry*> vSpenders;
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+            if (it == mapNextTx.end())
+                continue;
+            uint256 hashNext = it->second.ptx->GetHash();
+            std::map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hashNext);
+            if (mi == mapEntry.end())
+                continue;
+            CTxMemPoolEntry& entryNext = (*mi).second;
+            if (entryNext.setDepends.insert(hash).second)
+                nUsage += memusage::IncrementalDynamicUsage(entryNext.setDepends);
+            if (entryNext.setMissing.count(hash))
+            {
+                setTxByFeeRate.erase(make_pair(entryNext.GetFeePerKb(), hashNext));
+                entryNext.nFee += tx.vout[i].nValue;
+                setTxByFeeRate.insert(make_pair(entryNext.GetFeePerKb(), hashNext));
+                vSpenders.push_back(&entryNext);
+            }
+        }
+        for (CTxMemPoolEntry* pentryNext : vSpenders)
+            if (pentryNext->setMissing.erase(hash))
+                nUsage -= memusage::IncrementalDynamicUsage(pentryNext->setMissing);
         nTransactionsUpdated++;
     }
     return true;
@@ -724,15 +849,36 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
         uint256 hash = tx.GetHash();
         if (mapTx.count(hash))
         {
-            if (fRecursive) {
-                for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
-                    if (it != mapNextTx.end())
-                        remove(*it->second.ptx, true);
+            for (unsigned int i = 0; i < tx.vout.size(); i++) {
+                std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+                if (it == mapNextTx.end())
+                    continue;
+                if (fRecursive) {
+                    remove(*it->second.ptx, true);
+                    continue;
                 }
+                // The spender stays behind; what it spends from tx is
+                // about to be confirmed in the next block
+                std::map<uint256, CTxMemPoolEntry>::iterator miNext = mapEntry.find(it->second.ptx->GetHash());
+                if (miNext == mapEntry.end())
+                    continue;
+                CTxMemPoolEntry& entryNext = (*miNext).second;
+                if (entryNext.setDepends.erase(hash))
+                    nUsage -= memusage::IncrementalDynamicUsage(entryNext.setDepends);
+                entryNext.nValueInChain += tx.vout[i].nValue;
+                entryNext.dValueInHeight += (double)tx.vout[i].nValue * (nBestHeight + 1);
             }
             for (const CTxIn& txin : tx.vin)
                 mapNextTx.erase(txin.prevout);
+            std::map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hash);
+            if (mi != mapEntry.end())
+            {
+                const CTxMemPoolEntry& entry = (*mi).second;
+                setTxByFeeRate.erase(make_pair(entry.GetFeePerKb(), hash));
+                setTxByTime.erase(make_pair(entry.nTime, hash));
+                nUsage -= entry.nUsage + memusage::DynamicUsage(entry.setDepends) + memusage::DynamicUsage(entry.setMissing);
+                mapEntry.erase(mi);
+            }
             mapTx.erase(hash);
             nTransactionsUpdated++;
         }
@@ -760,9 +906,59 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    mapEntry.clear();
+    setTxByFeeRate.clear();
+    setTxByTime.clear();
+    nUsage = 0;
     ++nTransactionsUpdated;
 }
 
+unsigned int CTxMemPool::TrimToSize(size_t nSizeLimit)
+{
+    LOCK(cs);
+    unsigned int nRemoved = 0;
+    while (nUsage > nSizeLimit && !setTxByFeeRate.empty())
+    {
+        uint256 hash = setTxByFeeRate.begin()->second;
+        map<uint256, CTransaction>::iterator mi = mapTx.find(hash);
+        if (mi == mapTx.end())
+        {
+            // Stale index entry; removing nothing would never end the loop
+            setTxByFeeRate.erase(setTxByFeeRate.begin());
+            continue;
+        }
+        unsigned int nSize = mapTx.size();
+        remove((*mi).second, true);
+        nRemoved += nSize - mapTx.size();
+    }
+    if (nRemoved)
+        printf("CTxMemPool::TrimToSize() : evicted %u transactions, %" PRIszu " bytes in use\n", nRemoved, nUsage);
+    return nRemoved;
+}
+
+unsigned int CTxMemPool::Expire(int64_t nTime)
+{
+    LOCK(cs);
+    unsigned int nRemoved = 0;
+    while (!setTxByTime.empty() && setTxByTime.begin()->first < nTime)
+    {
+        uint256 hash = setTxByTime.begin()->second;
+        map<uint256, CTransaction>::iterator mi = mapTx.find(hash);
+        if (mi == mapTx.end())
+        {
+            // Stale index entry; removing nothing would never end the loop
+            setTxByTime.erase(setTxByTime.begin());
+            continue;
+        }
+        unsigned int nSize = mapTx.size();
+        remove((*mi).second, true);
+        nRemoved += nSize - mapTx.size();
+    }
+    if (nRemoved)
+        printf("CTxMemPool::Expire() : removed %u expired transactions\n", nRemoved);
+    return nRemoved;
+}
+
 void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 {
     vtxid.clear();
@@ -782,7 +978,7 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
         return 0;
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -873,7 +1069,7 @@ int CTxIndex::GetDepthInMainChain() const
     if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
         return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -920,22 +1116,31 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
+void CChain::SetTip(CBlockIndex* pindex)
+{
+    if (!pindex)
+    {
+        vChain.clear();
+        return;
+    }
+    vChain.resize(pindex->nHeight + 1);
+    while (pindex && vChain[pindex->nHeight] != pindex)
+    {
+        vChain[pindex->nHeight] = pindex;
+        pindex = pindex->pprev;
+    }
+}
+
+CBlockIndex* CChain::FindFork(CBlockIndex* pindex) const
+{
+    while (pindex && !Contains(pindex))
+        pindex = pindex->pprev;
+    return pindex;
+}
+
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    return chainActive[nHeight];
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
@@ -952,6 +1157,42 @@ bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
     return true;
 }
 
+bool ReadRawBlockFromDisk(const CBlockIndex* pindex, CBlockSpan& span)
+{
+    // Blocks are stored after the message start and their serialized size
+    const unsigned int nHeaderSize = sizeof(pchMessageStart) + sizeof(unsigned int);
+    if (pindex->nBlockPos < nHeaderSize)
+        return false;
+
+    unsigned int nSize = 0;
+    for (int nTry = 0; nTry < 2; nTry++)
+    {
+        if (!GetBlockStore().GetSpan(pindex->nFile, pindex->nBlockPos - nHeaderSize, span))
+            return false;
+        if ((size_t)(span.pend - span.pbegin) >= nHeaderSize)
+        {
+            if (memcmp(span.pbegin, pchMessageStart, sizeof(pchMessageStart)) != 0)
+                return error("ReadRawBlockFromDisk() : no message start before block %s", pindex->GetBlockHash().ToString().substr(0,20).c_str());
+            memcpy(&nSize, span.pbegin + sizeof(pchMessageStart), sizeof(nSize));
+            if (nSize < HASH9_HEADER_SIZE || nSize > MAX_SIZE)
+                return error("ReadRawBlockFromDisk() : bad size %u for block %s", nSize, pindex->GetBlockHash().ToString().substr(0,20).c_str());
+            if ((size_t)(span.pend - span.pbegin) >= nHeaderSize + nSize)
+                break;
+        }
+        // Written after the file was mapped
+        GetBlockStore().Invalidate(pindex->nFile);
+        nSize = 0;
+    }
+    if (nSize == 0)
+        return false;
+
+    span.pbegin += nHeaderSize;
+    span.pend = span.pbegin + nSize;
+    if (Hash9(span.pbegin, span.pbegin + HASH9_HEADER_SIZE) != pindex->GetBlockHash())
+        return error("ReadRawBlockFromDisk() : header hash doesn't match index");
+    return true;
+}
+
 uint256 static GetOrphanRoot(const CBlock* pblock)
 {
     // Work back to the first block in the orphan chain
@@ -1248,7 +1489,7 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
         else
         {
             // Get prev tx from disk
-            if (!txPrev.ReadFromDisk(txindex.pos))
+            if (!txdb.ReadDiskTxAt(prevout.hash, txindex.pos, txPrev))
                 return error("FetchInputs() : %s ReadFromDisk prev tx %s failed", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
         }
     }
@@ -1314,8 +1555,16 @@ unsigned int CTransaction::GetP2SHSigOpCount(const MapPrevTx& inputs) const
     return nSigOps;
 }
 
+bool CScriptCheck::operator()() const
+{
+    const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nHashType, psighash.get()))
+        return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString().substr(0,10).c_str());
+    return true;
+}
+
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner)
+    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, std::vector<CScriptCheck> *pvChecks)
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1354,6 +1603,10 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
         // The first loop above does all the inexpensive checks.
         // Only if ALL inputs pass do we perform expensive ECDSA signature checks.
         // Helps prevent CPU exhaustion attacks.
+        // Inputs of one transaction share its signature hash midstates.
+        boost::shared_ptr<const CSignatureHashContext> psighash;
+        if (vin.size() > 1 && !(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
+            psighash.reset(new CSignatureHashContext(*this));
         for (unsigned int i = 0; i < vin.size(); i++)
         {
             COutPoint prevout = vin[i].prevout;
@@ -1372,8 +1625,18 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             // still computed and checked, and any change will be caught at the next checkpoint.
             if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
             {
+                if (pvChecks)
+                {
+                    // Defer the expensive script check to the caller's queue,
+                    // the cheap prevout consistency check stays here
+                    if (txPrev.GetHash() != prevout.hash)
+                        return DoS(100,error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString().substr(0,10).c_str()));
+                    pvChecks->push_back(CScriptCheck());
+                    CScriptCheck check(txPrev, *this, i, 0, psighash);
+                    check.swap(pvChecks->back());
+                }
                 // Verify signature
-                if (!VerifySignature(txPrev, *this, i, 0))
+                else if (!VerifySignature(txPrev, *this, i, 0, psighash.get()))
                 {
                     return DoS(100,error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString().substr(0,10).c_str()));
                 }
@@ -1422,6 +1685,7 @@ bool CTransaction::ClientConnectInputs()
     {
         LOCK(mempool.cs);
         int64_t nValueIn = 0;
+        CSignatureHashContext sighash(*this);
         for (unsigned int i = 0; i < vin.size(); i++)
         {
             // Get prev tx from single transactions in memory
@@ -1434,7 +1698,7 @@ bool CTransaction::ClientConnectInputs()
                 return false;
 
             // Verify signature
-            if (!VerifySignature(txPrev, *this, i, 0))
+            if (!VerifySignature(txPrev, *this, i, 0, &sighash))
                 return error("ConnectInputs() : VerifySignature failed");
 
             ///// this is redundant with the mempool.mapNextTx stuff,
@@ -1482,10 +1746,21 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     // ppcoin: clean up wallet after disconnecting coinstake
     for (CTransaction& tx : vtx)
         SyncWithWallets(tx, this, false, false);
+    BlockDisconnected(pindex);
 
     return true;
 }
 
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void ThreadScriptCheck(void*)
+{
+    RenameThread("blocknet-scriptch");
+    // Script check workers idle on the queue's condition variable and are
+    // left to be torn down with the process, like the other free threads.
+    scriptcheckqueue.Thread();
+}
+
 bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 {
     // Check it again in case a previous version let a bad block in, but skip BlockSig checking
@@ -1501,6 +1776,10 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     else
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
+    // Script checks of all transactions are queued and run by the
+    // -par worker pool while this thread keeps connecting inputs
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+
     map<uint256, CTxIndex> mapQueuedChanges;
     int64_t nFees = 0;
     int64_t nValueIn = 0;
@@ -1563,13 +1842,18 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             if (tx.IsCoinStake())
                 nStakeReward = nTxValueOut - nTxValueIn;
 
-            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false))
+            std::vector<CScriptCheck> vChecks;
+            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
+            control.Add(vChecks);
         }
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
     }
 
+    if (!control.Wait())
+        return DoS(100, error("ConnectBlock() : script verification failed"));
+
     if (IsProofOfWork())
     {
         int64_t nReward = GetProofOfWorkReward(nFees);
@@ -1618,9 +1902,18 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return error("ConnectBlock() : WriteBlockIndex failed");
     }
 
-    // Watch for transactions paying to me
+    // Watch for transactions paying to me, writing what the wallets change
+    // for this block in one go
+    BeginWalletBatches();
     for (CTransaction& tx : vtx)
         SyncWithWallets(tx, this, true);
+    // The block is valid whatever happens to the wallet files, so a failed
+    // write only leaves the wallet to be rescanned
+    if (!EndWalletBatches())
+    {
+        printf("ERROR: ConnectBlock() : writing wallet updates for block %s failed\n", pindex->GetBlockHash().ToString().c_str());
+        strMiscWarning = _("Warning: error writing to the wallet file, restart with -rescan!");
+    }
 
     return true;
 }
@@ -1630,18 +1923,9 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     printf("REORGANIZE\n");
 
     // Find the fork
-    CBlockIndex* pfork = pindexBest;
-    CBlockIndex* plonger = pindexNew;
-    while (pfork != plonger)
-    {
-        while (plonger->nHeight > pfork->nHeight)
-            if (!(plonger = plonger->pprev))
-                return error("Reorganize() : plonger->pprev is null");
-        if (pfork == plonger)
-            break;
-        if (!(pfork = pfork->pprev))
-            return error("Reorganize() : pfork->pprev is null");
-    }
+    CBlockIndex* pfork = chainActive.FindFork(pindexNew);
+    if (!pfork)
+        return error("Reorganize() : no fork with the best chain");
 
     // List of what to disconnect
     vector<CBlockIndex*> vDisconnect;
@@ -1827,11 +2111,12 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = hash;
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
+    chainActive.SetTip(pindexNew);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
+    UpdateStakeModifierIndex();
 
     uint256 nBestBlockTrust = pindexBest->nHeight != 0 ? (pindexBest->nChainTrust - pindexBest->pprev->nChainTrust) : pindexBest->nChainTrust;
 
@@ -1946,11 +2231,10 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
         return error("AddToBlockIndex() : %s already exists", hash.ToString().substr(0,20).c_str());
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(nFile, nBlockPos, *this);
-    if (!pindexNew)
-        return error("AddToBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = NewBlockIndex();
+    *pindexNew = CBlockIndex(nFile, nBlockPos, *this);
     pindexNew->phashBlock = &hash;
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
@@ -1978,7 +2262,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
         return error("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=0x%016" PRIx64, pindexNew->nHeight, nStakeModifier);
 
     // Add to mapBlockIndex
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     if (pindexNew->IsProofOfStake())
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
     pindexNew->phashBlock = &((*mi).first);
@@ -2106,7 +2390,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return DoS(10, error("AcceptBlock() : prev block not found"));
     CBlockIndex* pindexPrev = (*mi).second;
@@ -2210,6 +2494,33 @@ bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, uns
     return (nFound >= nRequired);
 }
 
+void CDiskBlockIndex::ComputeBlockHashes(vector<CDiskBlockIndex>& vIndex)
+{
+    vector<unsigned int> vPending;
+    vector<unsigned char> vHeaders;
+    vPending.reserve(vIndex.size());
+    vHeaders.reserve(vIndex.size() * HASH9_HEADER_SIZE);
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+    {
+        const CDiskBlockIndex& diskindex = vIndex[i];
+        if (diskindex.fBlockHashComputed || diskindex.HasFastBlockHash())
+            continue;
+        CBlock header = diskindex.GetBlockHeader();
+        vHeaders.insert(vHeaders.end(), BEGIN(header.nVersion), END(header.nNonce));
+        vPending.push_back(i);
+    }
+    if (vPending.empty())
+        return;
+
+    vector<uint256> vHashes(vPending.size());
+    Hash9Batch(&vHeaders[0], vPending.size(), &vHashes[0]);
+    for (unsigned int i = 0; i < vPending.size(); i++)
+    {
+        vIndex[vPending[i]].blockHash = vHashes[i];
+        vIndex[vPending[i]].fBlockHashComputed = true;
+    }
+}
+
 bool ProcessBlock(CNode* pfrom, CBlock* pblock)
 {
     // Check for duplicate
@@ -2413,7 +2724,7 @@ bool CheckDiskSpace(uint64_t nAdditionalBytes)
     return true;
 }
 
-static filesystem::path BlockFilePath(unsigned int nFile)
+filesystem::path BlockFilePath(unsigned int nFile)
 {
     string strBlockFn = strprintf("blk%04u.dat", nFile);
     return GetDataDir() / strBlockFn;
@@ -2460,6 +2771,24 @@ FILE* AppendBlockFile(unsigned int& nFileRet)
     }
 }
 
+// Block index entries live as long as the process, so they are carved out
+// of large chunks instead of being allocated one at a time.
+static const unsigned int BLOCKINDEX_ARENA_CHUNK = 16384;
+static CCriticalSection cs_BlockIndexArena;
+static vector<CBlockIndex*> vBlockIndexArena;
+static unsigned int nBlockIndexArenaUsed = BLOCKINDEX_ARENA_CHUNK;
+
+CBlockIndex* NewBlockIndex()
+{
+    LOCK(cs_BlockIndexArena);
+    if (nBlockIndexArenaUsed == BLOCKINDEX_ARENA_CHUNK)
+    {
+        vBlockIndexArena.push_back(new CBlockIndex[BLOCKINDEX_ARENA_CHUNK]);
+        nBlockIndexArenaUsed = 0;
+    }
+    return &vBlockIndexArena.back()[nBlockIndexArenaUsed++];
+}
+
 bool LoadBlockIndex(bool fAllowNew)
 {
     CBigNum bnTrustedModulus;
@@ -2575,7 +2904,7 @@ void PrintBlockTree()
 {
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -3114,12 +3443,18 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             if (inv.type == MSG_BLOCK)
             {
                 // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
+                    CBlockSpan span;
+                    if (ReadRawBlockFromDisk((*mi).second, span))
+                        pfrom->PushMessageRaw("block", span.pbegin, span.pend);
+                    else
+                    {
+                        CBlock block;
+                        block.ReadFromDisk((*mi).second);
+                        pfrom->PushMessage("block", block);
+                    }
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -3225,7 +3560,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -11,9 +11,13 @@
 #include "script.h"
 #include "scrypt.h"
 #include "hashblock.h"
+#include "blockstore.h"
 
 #include <list>
 
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+
 class CWallet;
 class CBlock;
 class CBlockIndex;
@@ -38,10 +42,16 @@ static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
 static const unsigned int MAX_INV_SZ = 50000;
 static const int64_t MIN_TX_FEE = 1000;
 static const int64_t MIN_RELAY_TX_FEE = MIN_TX_FEE;
+/** Default for -maxmempool, the memory pool size limit in megabytes */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, in hours */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
 static const int64_t MAX_MONEY = 10100000 * COIN;  //  transaction size limit, is total ico + stake interest
 static const int64_t COIN_YEAR_REWARD = 1 * CENT; 
 static const int64_t MAX_MINT_PROOF_OF_STAKE = 0.03 * COIN;	// 3% annual interest
 static const int MODIFIER_INTERVAL_SWITCH = 2;
+/** Maximum number of script-checking threads allowed */
+static const int MAX_SCRIPTCHECK_THREADS = 16;
 
 inline bool MoneyRange(int64_t nValue) { return (nValue >= 0 && nValue <= MAX_MONEY); }
 // Threshold for nLockTime: below this value it is interpreted as block number, otherwise as UNIX timestamp.
@@ -60,7 +70,14 @@ inline int64_t FutureDrift(int64_t nTime) { return nTime + 10 * 60; } // up to 1
 
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+
+/** Block hashes are already uniformly distributed, so any 64 bits will do. */
+struct BlockHasher
+{
+    size_t operator()(const uint256& hash) const { return hash.Get64(); }
+};
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+extern BlockMap mapBlockIndex;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern CBlockIndex* pindexGenesisBlock;
 extern unsigned int nStakeMinAge;
@@ -88,6 +105,7 @@ extern int64_t nReserveBalance;
 extern int64_t nMinimumInputValue;
 extern bool fUseFastIndex;
 extern unsigned int nDerivationMethodIndex;
+extern int nScriptCheckThreads;
 
 extern bool fEnforceCanonical;
 
@@ -97,20 +115,27 @@ static const uint64_t nMinDiskSpace = 52428800;
 class CReserveKey;
 class CTxDB;
 class CTxIndex;
+class CScriptCheck;
 
 void RegisterWallet(CWallet* pwalletIn);
 void UnregisterWallet(CWallet* pwalletIn);
 void SyncWithWallets(const CTransaction& tx, const CBlock* pblock = NULL, bool fUpdate = false, bool fConnect = true);
 bool ProcessBlock(CNode* pfrom, CBlock* pblock);
 bool CheckDiskSpace(uint64_t nAdditionalBytes=0);
+boost::filesystem::path BlockFilePath(unsigned int nFile);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
 FILE* AppendBlockFile(unsigned int& nFileRet);
 bool LoadBlockIndex(bool fAllowNew=true);
+/** Allocate a block index entry; entries are never freed */
+CBlockIndex* NewBlockIndex();
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 bool LoadExternalBlockFile(FILE* fileIn);
+/** Locate the serialized bytes of a block in its mapped block file, to be
+ *  passed on as they are instead of unserialized and serialized again */
+bool ReadRawBlockFromDisk(const CBlockIndex* pindex, CBlockSpan& span);
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake);
@@ -126,6 +151,8 @@ uint256 WantedByOrphan(const CBlock* pblockOrphan);
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake);
 void StakeMiner(CWallet *pwallet);
 void ResendWalletTransactions(bool fForce = false);
+/** Run an instance of the script checking thread */
+void ThreadScriptCheck(void* parg);
 
 bool GetWalletFile(CWallet* pwallet, std::string &strWalletFileOut);
 
@@ -581,6 +608,9 @@ public:
 
     bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
     {
+        if (!pfileRet && ReadFromBlockStore(pos.nFile, pos.nTxPos, SER_DISK, CLIENT_VERSION, *this))
+            return true;
+
         CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
         if (!filein)
             return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
@@ -678,11 +708,13 @@ public:
         @param[in] pindexBlock
         @param[in] fBlock	true if called from ConnectBlock
         @param[in] fMiner	true if called from CreateNewBlock
+        @param[out] pvChecks	If non-NULL, script checks are appended here instead of being run
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner,
+                       std::vector<CScriptCheck> *pvChecks = NULL);
     bool ClientConnectInputs();
     bool CheckTransaction() const;
     bool AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs=true, bool* pfMissingInputs=NULL);
@@ -695,6 +727,40 @@ protected:
 
 
 
+/** Closure representing one script verification.
+ *  Note that this stores a pointer to the spending transaction, which must
+ *  outlive the check.
+ */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction *ptxTo;
+    unsigned int nIn;
+    int nHashType;
+    boost::shared_ptr<const CSignatureHashContext> psighash;
+
+public:
+    CScriptCheck() : ptxTo(NULL), nIn(0), nHashType(0) {}
+    CScriptCheck(const CTransaction& txFromIn, const CTransaction& txToIn, unsigned int nInIn, int nHashTypeIn,
+                 const boost::shared_ptr<const CSignatureHashContext>& psighashIn = boost::shared_ptr<const CSignatureHashContext>()) :
+        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
+        ptxTo(&txToIn), nIn(nInIn), nHashType(nHashTypeIn), psighash(psighashIn) { }
+
+    bool operator()() const;
+
+    void swap(CScriptCheck &check)
+    {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(nHashType, check.nHashType);
+        psighash.swap(check.psighash);
+    }
+};
+
+
+
 
 /** A transaction with a merkle branch linking it to the block chain. */
 class CMerkleTx : public CTransaction
@@ -844,6 +910,14 @@ public:
     // memory only
     mutable std::vector<uint256> vMerkleTree;
 
+    // memory only: Hash9 of the header. The header fields are public and get
+    // changed in place (nNonce/nTime by the miner, deserialization), so the
+    // cached hash is only used while the header still matches the bytes it
+    // was computed from.
+    mutable uint256 hashCached;
+    mutable unsigned char pchHashedHeader[HASH9_HEADER_SIZE];
+    mutable bool fHashCached;
+
     // Denial-of-service detection:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
@@ -887,6 +961,7 @@ public:
         vtx.clear();
         vchBlockSig.clear();
         vMerkleTree.clear();
+        fHashCached = false;
         nDoS = 0;
     }
 
@@ -897,7 +972,17 @@ public:
 
     uint256 GetHash() const
     {
-        return Hash9(BEGIN(nVersion), END(nNonce));
+        if (!fHashCached || memcmp(pchHashedHeader, BEGIN(nVersion), HASH9_HEADER_SIZE) != 0)
+            SetCachedHash(Hash9(BEGIN(nVersion), END(nNonce)));
+        return hashCached;
+    }
+
+    // Seed the header hash cache with a hash computed elsewhere (Hash9Batch)
+    void SetCachedHash(const uint256& hash) const
+    {
+        memcpy(pchHashedHeader, BEGIN(nVersion), HASH9_HEADER_SIZE);
+        hashCached = hash;
+        fHashCached = true;
     }
 
     int64_t GetBlockTime() const
@@ -1023,19 +1108,24 @@ public:
     {
         SetNull();
 
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
-        if (!fReadTransactions)
-            filein.nType |= SER_BLOCKHEADERONLY;
+        // Read block from the mapped file, or through stdio if it can't be
+        int nType = SER_DISK | (fReadTransactions ? 0 : SER_BLOCKHEADERONLY);
+        if (!ReadFromBlockStore(nFile, nBlockPos, nType, CLIENT_VERSION, *this))
+        {
+            SetNull();
 
-        // Read block
-        try {
-            filein >> *this;
-        }
-        catch (std::exception &e) {
-            return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+            // Open history file to read
+            CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), nType, CLIENT_VERSION);
+            if (!filein)
+                return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
+
+            // Read block
+            try {
+                filein >> *this;
+            }
+            catch (std::exception &e) {
+                return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+            }
         }
 
         // Check the header
@@ -1335,6 +1425,9 @@ class CDiskBlockIndex : public CBlockIndex
 private:
     uint256 blockHash;
 
+    // memory only: blockHash has been computed from the header
+    bool fBlockHashComputed;
+
 public:
     uint256 hashPrev;
     uint256 hashNext;
@@ -1344,12 +1437,15 @@ public:
         hashPrev = 0;
         hashNext = 0;
         blockHash = 0;
+        fBlockHashComputed = false;
     }
 
     explicit CDiskBlockIndex(CBlockIndex* pindex) : CBlockIndex(*pindex)
     {
         hashPrev = (pprev ? pprev->GetBlockHash() : 0);
         hashNext = (pnext ? pnext->GetBlockHash() : 0);
+        blockHash = 0;
+        fBlockHashComputed = false;
     }
 
     IMPLEMENT_SERIALIZE
@@ -1388,11 +1484,8 @@ public:
         READWRITE(blockHash);
     )
 
-    uint256 GetBlockHash() const
+    CBlock GetBlockHeader() const
     {
-        if (fUseFastIndex && (nTime < GetAdjustedTime() - 24 * 60 * 60) && blockHash != 0)
-            return blockHash;
-
         CBlock block;
         block.nVersion        = nVersion;
         block.hashPrevBlock   = hashPrev;
@@ -1400,12 +1493,29 @@ public:
         block.nTime           = nTime;
         block.nBits           = nBits;
         block.nNonce          = nNonce;
+        return block;
+    }
+
+    // Whether the stored hash may be trusted without hashing the header
+    bool HasFastBlockHash() const
+    {
+        return fUseFastIndex && (nTime < GetAdjustedTime() - 24 * 60 * 60) && blockHash != 0;
+    }
+
+    uint256 GetBlockHash() const
+    {
+        if (fBlockHashComputed || HasFastBlockHash())
+            return blockHash;
 
-        const_cast<CDiskBlockIndex*>(this)->blockHash = block.GetHash();
+        const_cast<CDiskBlockIndex*>(this)->blockHash = GetBlockHeader().GetHash();
+        const_cast<CDiskBlockIndex*>(this)->fBlockHashComputed = true;
 
         return blockHash;
     }
 
+    // Compute the block hashes of a run of index entries with one Hash9Batch()
+    static void ComputeBlockHashes(std::vector<CDiskBlockIndex>& vIndex);
+
     std::string ToString() const
     {
         std::string str = "CDiskBlockIndex(";
@@ -1430,6 +1540,57 @@ public:
 
 
 
+/** The blocks of the best chain laid out by height, so that walking to a
+ * height or testing membership doesn't follow pprev/pnext links.
+ * Protected by cs_main.
+ */
+class CChain
+{
+private:
+    std::vector<CBlockIndex*> vChain;
+
+public:
+    CBlockIndex* Genesis() const
+    {
+        return vChain.empty() ? NULL : vChain[0];
+    }
+
+    CBlockIndex* Tip() const
+    {
+        return vChain.empty() ? NULL : vChain.back();
+    }
+
+    CBlockIndex* operator[](int nHeight) const
+    {
+        if (nHeight < 0 || nHeight >= (int)vChain.size())
+            return NULL;
+        return vChain[nHeight];
+    }
+
+    bool Contains(const CBlockIndex* pindex) const
+    {
+        return (*this)[pindex->nHeight] == pindex;
+    }
+
+    CBlockIndex* Next(const CBlockIndex* pindex) const
+    {
+        return Contains(pindex) ? (*this)[pindex->nHeight + 1] : NULL;
+    }
+
+    int Height() const
+    {
+        return vChain.size() - 1;
+    }
+
+    /** Make pindex the tip, rewriting only the heights above the fork */
+    void SetTip(CBlockIndex* pindex);
+
+    /** The last block of this chain that is an ancestor of pindex */
+    CBlockIndex* FindFork(CBlockIndex* pindex) const;
+};
+
+extern CChain chainActive;
+
 /** Describes a place in the block chain to another node such that if the
  * other node doesn't have the same branch, it can find a recent common trunk.
  * The further back it is, the further before the fork it may be.
@@ -1451,7 +1612,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1486,9 +1647,13 @@ public:
         {
             vHave.push_back(pindex->GetBlockHash());
 
-            // Exponentially larger steps back
-            for (int i = 0; pindex && i < nStep; i++)
-                pindex = pindex->pprev;
+            // Exponentially larger steps back, jumping straight to the
+            // height once on the best chain
+            if (chainActive.Contains(pindex))
+                pindex = chainActive[pindex->nHeight - nStep];
+            else
+                for (int i = 0; pindex && i < nStep; i++)
+                    pindex = pindex->pprev;
             if (vHave.size() > 10)
                 nStep *= 2;
         }
@@ -1502,7 +1667,7 @@ public:
         int nStep = 1;
         for (const uint256& hash : vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1521,7 +1686,7 @@ public:
         // Find the first block the caller has in the main chain
         for (const uint256& hash : vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1537,7 +1702,7 @@ public:
         // Find the first block the caller has in the main chain
         for (const uint256& hash : vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1564,20 +1729,81 @@ public:
 
 
 
+/** What block assembly needs to know about a memory pool transaction,
+ * worked out once when it enters the pool instead of on every new block.
+ */
+class CTxMemPoolEntry
+{
+public:
+    int64_t nFee;                 // value in less value out
+    unsigned int nTxSize;
+    int64_t nValueInChain;        // value of the inputs confirmed in the block chain
+    double dValueInHeight;        // sum of those inputs' value times their height
+    std::set<uint256> setDepends; // memory pool transactions it spends
+    std::set<uint256> setMissing; // transactions it spends whose outputs nFee leaves out
+    int64_t nTime;                // when it entered the pool
+    size_t nUsage;                // heap memory the pool holds for it, apart from the sets
+
+    CTxMemPoolEntry()
+    {
+        nFee = 0;
+        nTxSize = 0;
+        nValueInChain = 0;
+        dValueInHeight = 0;
+        nTime = 0;
+        nUsage = 0;
+    }
+
+    // This is a more accurate fee-per-kilobyte than is used by the client code, because the
+    // client code rounds up the size to the nearest 1K. That's good, because it gives an
+    // incentive to create smaller transactions.
+    double GetFeePerKb() const
+    {
+        return double(nFee) / (double(nTxSize) / 1000.0);
+    }
+
+    // Priority is sum(valuein * age) / txsize, with age counted in
+    // confirmations on top of a best block at nHeight
+    double GetPriority(int nHeight) const
+    {
+        return ((double)nValueInChain * (nHeight + 1) - dValueInHeight) / nTxSize;
+    }
+};
+
 class CTxMemPool
 {
 public:
     mutable CCriticalSection cs;
     std::map<uint256, CTransaction> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
+    std::map<uint256, CTxMemPoolEntry> mapEntry;
+    std::set<std::pair<double, uint256> > setTxByFeeRate; // (fee per kB, hash), lowest first
+    std::set<std::pair<int64_t, uint256> > setTxByTime;   // (entry time, hash), oldest first
+    size_t nUsage;                                        // heap memory held by all of the above
+
+    CTxMemPool()
+    {
+        nUsage = 0;
+    }
 
     bool accept(CTxDB& txdb, CTransaction &tx,
                 bool fCheckInputs, bool* pfMissingInputs);
-    bool addUnchecked(const uint256& hash, CTransaction &tx);
+    bool addUnchecked(const uint256& hash, CTransaction &tx, const MapPrevTx* pmapInputs = NULL);
     bool remove(const CTransaction &tx, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
+    // Evict the lowest fee rate transactions and their descendants until
+    // the pool uses at most nSizeLimit bytes; returns how many were removed
+    unsigned int TrimToSize(size_t nSizeLimit);
+    // Remove transactions, and their descendants, that entered before nTime
+    unsigned int Expire(int64_t nTime);
+
+    size_t DynamicMemoryUsage()
+    {
+        LOCK(cs);
+        return nUsage;
+    }
 
     unsigned long size()
     {
@@ -0,0 +1,75 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_MEMUSAGE_H
+#define BITCOIN_MEMUSAGE_H
+
+#include <stddef.h>
+
+#include <map>
+#include <set>
+#include <vector>
+
+/** Estimates of the heap memory held by standard containers, counting the
+ * rounding and bookkeeping a glibc style malloc adds to each allocation.
+ * Only the container's own allocations are counted, not what its elements
+ * point to.
+ */
+namespace memusage
+{
+
+/** Heap usage of a single malloc of nAlloc bytes */
+static inline size_t MallocUsage(size_t nAlloc)
+{
+    if (nAlloc == 0)
+        return 0;
+    if (sizeof(void*) == 8)
+        return ((nAlloc + 31) >> 4) << 4;
+    return ((nAlloc + 15) >> 3) << 3;
+}
+
+// Layout of a red-black tree node in the common STL implementations
+template<typename X>
+struct stl_tree_node
+{
+private:
+    int color;
+    void* parent;
+    void* left;
+    void* right;
+    X x;
+};
+
+template<typename X>
+static inline size_t DynamicUsage(const std::vector<X>& v)
+{
+    return MallocUsage(v.capacity() * sizeof(X));
+}
+
+template<typename X, typename Y>
+static inline size_t DynamicUsage(const std::set<X, Y>& s)
+{
+    return MallocUsage(sizeof(stl_tree_node<X>)) * s.size();
+}
+
+template<typename X, typename Y>
+static inline size_t IncrementalDynamicUsage(const std::set<X, Y>& s)
+{
+    return MallocUsage(sizeof(stl_tree_node<X>));
+}
+
+template<typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const std::map<X, Y, Z>& m)
+{
+    return MallocUsage(sizeof(stl_tree_node<std::pair<const X, Y> >)) * m.size();
+}
+
+template<typename X, typename Y, typename Z>
+static inline size_t IncrementalDynamicUsage(const std::map<X, Y, Z>& m)
+{
+    return MallocUsage(sizeof(stl_tree_node<std::pair<const X, Y> >));
+}
+
+}
+
+#endif
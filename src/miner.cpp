@@ -175,7 +175,9 @@ CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake, int64_t* pFees)
         list<COrphan> vOrphan; // list memory doesn't move
         map<uint256, vector<COrphan*> > mapDependers;
 
-        // This vector will be sorted into a priority queue:
+        // This vector will be sorted into a priority queue. Fees, input
+        // ages and dependencies were worked out when each transaction
+        // entered the pool, so none of this touches the disk.
         vector<TxPriority> vecPriority;
         vecPriority.reserve(mempool.mapTx.size());
         for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
@@ -184,63 +186,25 @@ CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake, int64_t* pFees)
             if (tx.IsCoinBase() || tx.IsCoinStake() || !tx.IsFinal())
                 continue;
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64_t nTotalIn = 0;
-            bool fMissingInputs = false;
-            for (const CTxIn& txin : tx.vin)
-            {
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        printf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = txindex.GetDepthInMainChain();
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
+            // Every pooled transaction gets an entry in addUnchecked; don't
+            // mine one that somehow lacks it on zeroed fee and priority
+            map<uint256, CTxMemPoolEntry>::const_iterator me = mempool.mapEntry.find((*mi).first);
+            if (me == mempool.mapEntry.end())
+                continue;
+            const CTxMemPoolEntry& entry = (*me).second;
+            double dPriority = entry.GetPriority(pindexPrev->nHeight);
+            double dFeePerKb = entry.GetFeePerKb();
 
-            if (porphan)
+            if (!entry.setDepends.empty())
             {
+                // Has to wait for dependencies
+                vOrphan.push_back(COrphan(&tx));
+                COrphan* porphan = &vOrphan.back();
+                porphan->setDependsOn = entry.setDepends;
                 porphan->dPriority = dPriority;
                 porphan->dFeePerKb = dFeePerKb;
+                for (const uint256& hashDependsOn : entry.setDepends)
+                    mapDependers[hashDependsOn].push_back(porphan);
             }
             else
                 vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
@@ -15,6 +15,12 @@
 #include <string.h>
 #endif
 
+#ifdef __linux__
+#define USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniwget.h>
 #include <miniupnpc/miniupnpc.h>
@@ -76,6 +82,53 @@ CCriticalSection cs_setservAddNodeAddresses;
 
 static CSemaphore *semOutbound = NULL;
 
+// Message handler wakeup, signalled when a peer has something to process
+static boost::mutex mutexMsgHandler;
+static boost::condition_variable condMsgHandler;
+static bool fMsgHandlerWake = false;
+
+#ifdef USE_EPOLL
+static int hEpoll = -1;
+static int hSocketHandlerWake = -1;
+static const int MAX_EPOLL_EVENTS = 256;
+// Milliseconds to wait before retrying a ready socket that made no progress
+static const int EPOLL_RETRY_DELAY = 10;
+#endif
+
+void WakeMessageHandler()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutexMsgHandler);
+        fMsgHandlerWake = true;
+    }
+    condMsgHandler.notify_one();
+}
+
+void WakeSocketHandler()
+{
+#ifdef USE_EPOLL
+    if (hSocketHandlerWake != -1)
+    {
+        uint64_t n = 1;
+        if (write(hSocketHandlerWake, &n, sizeof(n)) < 0 && errno != EAGAIN)
+            printf("socket handler wakeup failed: %d\n", errno);
+    }
+#endif
+}
+
+// True once vRecv holds a whole message, or bytes that are not a valid
+// header at all; either way ProcessMessages has work to do.
+static bool HaveCompleteMessage(const CDataStream& vRecv)
+{
+    static const unsigned int nHeaderSize = CMessageHeader::CHECKSUM_OFFSET + sizeof(unsigned int);
+    if (vRecv.size() < nHeaderSize)
+        return false;
+    unsigned int nMessageSize;
+    memcpy(&nMessageSize, &vRecv.begin()[CMessageHeader::MESSAGE_SIZE_OFFSET], sizeof(nMessageSize));
+    return memcmp(&vRecv.begin()[0], pchMessageStart, sizeof(pchMessageStart)) != 0 ||
+           vRecv.size() - nHeaderSize >= nMessageSize;
+}
+
 void AddOneShot(string strDest)
 {
     LOCK(cs_vOneShots);
@@ -652,12 +705,65 @@ void ThreadSocketHandler(void* parg)
     printf("ThreadSocketHandler exited\n");
 }
 
+#ifdef USE_EPOLL
+// Only once the socket handler is gone, or never started
+static void CloseSocketPoller()
+{
+    int hWake = hSocketHandlerWake;
+    hSocketHandlerWake = -1;
+    if (hWake != -1)
+        close(hWake);
+    if (hEpoll != -1)
+        close(hEpoll);
+    hEpoll = -1;
+}
+
+static bool InitSocketPoller()
+{
+    hEpoll = epoll_create1(EPOLL_CLOEXEC);
+    if (hEpoll == -1)
+    {
+        printf("epoll_create1 failed %d, using select()\n", errno);
+        return false;
+    }
+
+    // Wakeup channel for queued sends, tagged by its own address
+    hSocketHandlerWake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = &hSocketHandlerWake;
+    bool fOk = (hSocketHandlerWake != -1 && epoll_ctl(hEpoll, EPOLL_CTL_ADD, hSocketHandlerWake, &event) == 0);
+
+    // Listen sockets stay level-triggered and are tagged NULL
+    for (SOCKET hListenSocket : vhListenSocket)
+    {
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if (fOk && epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket, &event) != 0)
+            fOk = false;
+    }
+
+    if (!fOk)
+    {
+        printf("epoll_ctl failed %d, using select()\n", errno);
+        CloseSocketPoller();
+    }
+    return fOk;
+}
+#endif
+
 void ThreadSocketHandler2(void* parg)
 {
     printf("ThreadSocketHandler started\n");
     list<CNode*> vNodesDisconnected;
     unsigned int nPrevNodeCount = 0;
 
+    bool fEpoll = false;
+#ifdef USE_EPOLL
+    fEpoll = InitSocketPoller();
+    struct epoll_event vEvents[MAX_EPOLL_EVENTS];
+#endif
+
     while (true)
     {
         //
@@ -732,60 +838,137 @@ void ThreadSocketHandler2(void* parg)
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
         fd_set fdsetRecv;
         fd_set fdsetSend;
         fd_set fdsetError;
         FD_ZERO(&fdsetRecv);
         FD_ZERO(&fdsetSend);
         FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
+        bool fAccept = false;
 
-        for (SOCKET hListenSocket : vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
-        }
+#ifdef USE_EPOLL
+        if (fEpoll)
         {
-            LOCK(cs_vNodes);
-            for (CNode* pnode : vNodes)
+            // Sockets are registered once and edge-triggered, so each wait
+            // only returns the peers whose state changed. Readiness carries
+            // over in fRecvReady/fSendReady until recv/send drains it.
+            int nTimeout = 50; // frequency to check inactivity and new nodes
             {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetRecv);
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
+                LOCK(cs_vNodes);
+                for (CNode* pnode : vNodes)
                 {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSend.empty())
-                        FD_SET(pnode->hSocket, &fdsetSend);
+                    if (pnode->hSocket == INVALID_SOCKET)
+                        continue;
+                    if (!pnode->fPollRegistered)
+                    {
+                        struct epoll_event event;
+                        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                        event.data.ptr = pnode;
+                        if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) == -1)
+                        {
+                            printf("socket epoll_ctl error %d\n", errno);
+                            pnode->CloseSocketDisconnect();
+                            continue;
+                        }
+                        pnode->fPollRegistered = true;
+                    }
+                    // A socket that was ready but got nowhere is retried
+                    // after a short wait rather than spun on
+                    bool fReady = pnode->fRecvReady;
+                    if (!fReady && pnode->fSendReady)
+                    {
+                        TRY_LOCK(pnode->cs_vSend, lockSend);
+                        fReady = lockSend && !pnode->vSend.empty();
+                    }
+                    if (fReady)
+                        nTimeout = pnode->fPollStalled ? min(nTimeout, EPOLL_RETRY_DELAY) : 0;
                 }
             }
-        }
 
-        vnThreadsRunning[THREAD_SOCKETHANDLER]--;
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        vnThreadsRunning[THREAD_SOCKETHANDLER]++;
-        if (fShutdown)
-            return;
-        if (nSelect == SOCKET_ERROR)
+            vnThreadsRunning[THREAD_SOCKETHANDLER]--;
+            int nEvents = epoll_wait(hEpoll, vEvents, MAX_EPOLL_EVENTS, nTimeout);
+            vnThreadsRunning[THREAD_SOCKETHANDLER]++;
+            if (fShutdown)
+                return;
+            if (nEvents == -1 && errno != EINTR)
+            {
+                printf("socket epoll_wait error %d\n", errno);
+                MilliSleep(nTimeout);
+            }
+            for (int i = 0; i < nEvents; i++)
+            {
+                const struct epoll_event& event = vEvents[i];
+                if (event.data.ptr == NULL)
+                    fAccept = true;
+                else if (event.data.ptr == &hSocketHandlerWake)
+                {
+                    uint64_t n;
+                    while (read(hSocketHandlerWake, &n, sizeof(n)) > 0);
+                }
+                else
+                {
+                    // Nodes are only deleted by this thread, after their
+                    // socket has left the epoll set
+                    CNode* pnode = (CNode*)event.data.ptr;
+                    if (event.events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                        pnode->fRecvReady = true;
+                    if (event.events & EPOLLOUT)
+                        pnode->fSendReady = true;
+                }
+            }
+        }
+        else
+#endif
         {
-            if (have_fds)
+            struct timeval timeout;
+            timeout.tv_sec  = 0;
+            timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+
+            SOCKET hSocketMax = 0;
+            bool have_fds = false;
+
+            for (SOCKET hListenSocket : vhListenSocket) {
+                FD_SET(hListenSocket, &fdsetRecv);
+                hSocketMax = max(hSocketMax, hListenSocket);
+                have_fds = true;
+            }
             {
-                int nErr = WSAGetLastError();
-                printf("socket select error %d\n", nErr);
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+                LOCK(cs_vNodes);
+                for (CNode* pnode : vNodes)
+                {
+                    if (pnode->hSocket == INVALID_SOCKET)
+                        continue;
+                    FD_SET(pnode->hSocket, &fdsetRecv);
+                    FD_SET(pnode->hSocket, &fdsetError);
+                    hSocketMax = max(hSocketMax, pnode->hSocket);
+                    have_fds = true;
+                    {
+                        TRY_LOCK(pnode->cs_vSend, lockSend);
+                        if (lockSend && !pnode->vSend.empty())
+                            FD_SET(pnode->hSocket, &fdsetSend);
+                    }
+                }
+            }
+
+            vnThreadsRunning[THREAD_SOCKETHANDLER]--;
+            int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                                 &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+            vnThreadsRunning[THREAD_SOCKETHANDLER]++;
+            if (fShutdown)
+                return;
+            if (nSelect == SOCKET_ERROR)
+            {
+                if (have_fds)
+                {
+                    int nErr = WSAGetLastError();
+                    printf("socket select error %d\n", nErr);
+                    for (unsigned int i = 0; i <= hSocketMax; i++)
+                        FD_SET(i, &fdsetRecv);
+                }
+                FD_ZERO(&fdsetSend);
+                FD_ZERO(&fdsetError);
+                MilliSleep(timeout.tv_usec/1000);
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
         }
 
 
@@ -793,7 +976,7 @@ void ThreadSocketHandler2(void* parg)
         // Accept new connections
         //
         for (SOCKET hListenSocket : vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        if (hListenSocket != INVALID_SOCKET && (fEpoll ? fAccept : FD_ISSET(hListenSocket, &fdsetRecv)))
         {
 #ifdef USE_IPV6
             struct sockaddr_storage sockaddr;
@@ -864,10 +1047,13 @@ void ThreadSocketHandler2(void* parg)
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            pnode->fPollStalled = false;
+            if (fEpoll ? pnode->fRecvReady : (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError)))
             {
                 TRY_LOCK(pnode->cs_vRecv, lockRecv);
-                if (lockRecv)
+                if (!lockRecv)
+                    pnode->fPollStalled = true;
+                else
                 {
                     CDataStream& vRecv = pnode->vRecv;
                     unsigned int nPos = vRecv.size();
@@ -883,13 +1069,19 @@ void ThreadSocketHandler2(void* parg)
                         int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
                         if (nBytes > 0)
                         {
+                            // A short read means the socket was drained; the
+                            // next edge reports any data that arrives after it
+                            pnode->fRecvReady = (nBytes == (int)sizeof(pchBuf));
                             vRecv.resize(nPos + nBytes);
                             memcpy(&vRecv[nPos], pchBuf, nBytes);
                             pnode->nLastRecv = GetTime();
+                            if (HaveCompleteMessage(vRecv))
+                                WakeMessageHandler();
                         }
                         else if (nBytes == 0)
                         {
                             // socket closed gracefully
+                            pnode->fRecvReady = false;
                             if (!pnode->fDisconnect)
                                 printf("socket closed\n");
                             pnode->CloseSocketDisconnect();
@@ -898,8 +1090,15 @@ void ThreadSocketHandler2(void* parg)
                         {
                             // error
                             int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                            // Only a drained socket waits for the next edge;
+                            // after an interrupted call the data is still there
+                            if (nErr == WSAEWOULDBLOCK)
+                                pnode->fRecvReady = false;
+                            else if (nErr == WSAEMSGSIZE || nErr == WSAEINTR || nErr == WSAEINPROGRESS)
+                                pnode->fPollStalled = true;
+                            else
                             {
+                                pnode->fRecvReady = false;
                                 if (!pnode->fDisconnect)
                                     printf("socket recv error %d\n", nErr);
                                 pnode->CloseSocketDisconnect();
@@ -914,24 +1113,37 @@ void ThreadSocketHandler2(void* parg)
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (fEpoll ? pnode->fSendReady : FD_ISSET(pnode->hSocket, &fdsetSend))
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
+                if (!lockSend)
+                    pnode->fPollStalled = true;
+                else
                 {
                     CDataStream& vSend = pnode->vSend;
                     if (!vSend.empty())
                     {
+                        bool fWasFull = vSend.size() >= SendBufferSize();
                         int nBytes = send(pnode->hSocket, &vSend[0], vSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
                         if (nBytes > 0)
                         {
+                            // A short write means the socket buffer is full
+                            if ((unsigned int)nBytes < vSend.size())
+                                pnode->fSendReady = false;
                             vSend.erase(vSend.begin(), vSend.begin() + nBytes);
                             pnode->nLastSend = GetTime();
+                            // ProcessMessages stops while the send buffer is full
+                            if (fWasFull && vSend.size() < SendBufferSize())
+                                WakeMessageHandler();
                         }
                         else if (nBytes < 0)
                         {
                             // error
                             int nErr = WSAGetLastError();
+                            if (nErr == WSAEWOULDBLOCK)
+                                pnode->fSendReady = false;
+                            else if (nErr == WSAEMSGSIZE || nErr == WSAEINTR || nErr == WSAEINPROGRESS)
+                                pnode->fPollStalled = true;
                             if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                             {
                                 printf("socket send error %d\n", nErr);
@@ -1631,11 +1843,17 @@ void ThreadMessageHandler2(void* parg)
                 pnode->Release();
         }
 
-        // Wait and allow messages to bunch up.
+        // Wait until a peer has a complete message or new inventory, or for
+        // the next trickle round.
         // Reduce vnThreadsRunning so StopNode has permission to exit while
         // we're sleeping, but we must always check fShutdown after doing this.
         vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
-        MilliSleep(100);
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMsgHandler);
+            if (!fMsgHandlerWake)
+                condMsgHandler.timed_wait(lock, boost::posix_time::milliseconds(100));
+            fMsgHandlerWake = false;
+        }
         if (fRequestShutdown)
             StartShutdown();
         vnThreadsRunning[THREAD_MESSAGEHANDLER]++;
@@ -1887,6 +2105,8 @@ bool StopNode()
     if (semOutbound)
         for (int i=0; i<MAX_OUTBOUND_CONNECTIONS; i++)
             semOutbound->post();
+    WakeMessageHandler();
+    WakeSocketHandler();
     do
     {
         int nThreadsRunning = 0;
@@ -1913,6 +2133,10 @@ bool StopNode()
     while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0)
         MilliSleep(20);
     MilliSleep(50);
+#ifdef USE_EPOLL
+    if (vnThreadsRunning[THREAD_SOCKETHANDLER] <= 0)
+        CloseSocketPoller();
+#endif
     DumpAddresses();
     return true;
 }
@@ -1933,6 +2157,9 @@ public:
             if (hListenSocket != INVALID_SOCKET)
                 if (closesocket(hListenSocket) == SOCKET_ERROR)
                     printf("closesocket(hListenSocket) failed with error %d\n", WSAGetLastError());
+#ifdef USE_EPOLL
+        CloseSocketPoller();
+#endif
 
 #ifdef WIN32
         // Shutdown Windows Sockets
@@ -40,6 +40,8 @@ unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::string()));
 void StartNode(void* parg);
 bool StopNode();
+void WakeMessageHandler();
+void WakeSocketHandler();
 
 enum
 {
@@ -175,6 +177,11 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    // Edge-triggered readiness, owned by the socket handler thread
+    bool fPollRegistered;
+    bool fRecvReady;
+    bool fSendReady;
+    bool fPollStalled; // ready, but the last pass couldn't make progress
     CSemaphoreGrant grantOutbound;
     int nRefCount;
 protected:
@@ -226,6 +233,10 @@ public:
         fNetworkNode = false;
         fSuccessfullyConnected = false;
         fDisconnect = false;
+        fPollRegistered = false;
+        fRecvReady = false;
+        fSendReady = false;
+        fPollStalled = false;
         nRefCount = 0;
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
@@ -305,6 +316,7 @@ public:
             if (!setInventoryKnown.count(inv))
                 vInventoryToSend.push_back(inv);
         }
+        WakeMessageHandler();
     }
 
     void AskFor(const CInv& inv)
@@ -381,9 +393,14 @@ public:
             printf("(%d bytes)\n", nSize);
         }
 
+        // The socket handler only needs a nudge when the queue was empty
+        bool fWasEmpty = (nHeaderStart == 0);
         nHeaderStart = -1;
         nMessageStart = -1;
         LEAVE_CRITICAL_SECTION(cs_vSend);
+
+        if (fWasEmpty)
+            WakeSocketHandler();
     }
 
     void EndMessageAbortIfEmpty()
@@ -416,6 +433,22 @@ public:
         }
     }
 
+    // Push a message whose payload is already serialized
+    void PushMessageRaw(const char* pszCommand, const char* pbegin, const char* pend)
+    {
+        try
+        {
+            BeginMessage(pszCommand);
+            vSend.write(pbegin, pend - pbegin);
+            EndMessage();
+        }
+        catch (...)
+        {
+            AbortMessage();
+            throw;
+        }
+    }
+
     template<typename T1>
     void PushMessage(const char* pszCommand, const T1& a1)
     {
@@ -12,6 +12,8 @@
 double getBlockHardness(int height)
 {
     const CBlockIndex* blockindex = getBlockIndex(height);
+    if (!blockindex)
+        return 0;
 
     int nShift = (blockindex->nBits >> 24) & 0xff;
 
@@ -44,111 +46,69 @@ int getBlockHashrate(int height)
 
 const CBlockIndex* getBlockIndex(int height)
 {
-    std::string hex = getBlockHash(height);
-    uint256 hash(hex);
-    return mapBlockIndex[hash];
+    LOCK(cs_main);
+    return FindBlockByHeight(height);
 }
 
 std::string getBlockHash(int Height)
 {
-    if(Height > pindexBest->nHeight) { return "351c6703813172725c6d660aa539ee6a3d7a9fe784c87fae7f36582e3b797058"; }
-    if(Height < 0) { return "351c6703813172725c6d660aa539ee6a3d7a9fe784c87fae7f36582e3b797058"; }
-    int desiredheight;
-    desiredheight = Height;
-    if (desiredheight < 0 || desiredheight > nBestHeight)
-        return 0;
-
-    CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > desiredheight)
-        pblockindex = pblockindex->pprev;
+    const CBlockIndex* pblockindex = getBlockIndex(Height);
+    if (!pblockindex)
+        return "351c6703813172725c6d660aa539ee6a3d7a9fe784c87fae7f36582e3b797058";
     return pblockindex->phashBlock->GetHex();
 }
 
 int getBlockTime(int Height)
 {
-    std::string strHash = getBlockHash(Height);
-    uint256 hash(strHash);
-
-    if (mapBlockIndex.count(hash) == 0)
+    const CBlockIndex* pblockindex = getBlockIndex(Height);
+    if (!pblockindex)
         return 0;
-
-    CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
     return pblockindex->nTime;
 }
 
 std::string getBlockMerkle(int Height)
 {
-    std::string strHash = getBlockHash(Height);
-    uint256 hash(strHash);
-
-    if (mapBlockIndex.count(hash) == 0)
-        return 0;
-
-    CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
+    const CBlockIndex* pblockindex = getBlockIndex(Height);
+    if (!pblockindex)
+        return "";
     return pblockindex->hashMerkleRoot.ToString().substr(0,10).c_str();
 }
 
 int getBlocknBits(int Height)
 {
-    std::string strHash = getBlockHash(Height);
-    uint256 hash(strHash);
-
-    if (mapBlockIndex.count(hash) == 0)
+    const CBlockIndex* pblockindex = getBlockIndex(Height);
+    if (!pblockindex)
         return 0;
-
-    CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
     return pblockindex->nBits;
 }
 
 int getBlockNonce(int Height)
 {
-    std::string strHash = getBlockHash(Height);
-    uint256 hash(strHash);
-
-    if (mapBlockIndex.count(hash) == 0)
+    const CBlockIndex* pblockindex = getBlockIndex(Height);
+    if (!pblockindex)
         return 0;
-
-    CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
     return pblockindex->nNonce;
 }
 
 std::string getBlockDebug(int Height)
 {
-    std::string strHash = getBlockHash(Height);
-    uint256 hash(strHash);
-
-    if (mapBlockIndex.count(hash) == 0)
-        return 0;
-
-    CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
+    const CBlockIndex* pblockindex = getBlockIndex(Height);
+    if (!pblockindex)
+        return "";
     return pblockindex->ToString();
 }
 
 int blocksInPastHours(int hours)
 {
     int wayback = hours * 3600;
-    bool check = true;
-    int height = pindexBest->nHeight;
-    int heightHour = pindexBest->nHeight;
     int utime = (int)time(NULL);
     int target = utime - wayback;
 
-    while(check)
-    {
-        if(getBlockTime(heightHour) < target)
-        {
-            check = false;
+    LOCK(cs_main);
+    int height = chainActive.Height();
+    for (int heightHour = height; heightHour >= 0; heightHour--)
+        if ((int)chainActive[heightHour]->nTime < target)
             return height - heightHour;
-        } else {
-            heightHour = heightHour - 1;
-        }
-    }
 
     return 0;
 }
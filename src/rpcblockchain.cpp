@@ -5,11 +5,12 @@
 
 #include "main.h"
 #include "bitcoinrpc.h"
+#include "jsonstream.h"
 
 using namespace json_spirit;
 using namespace std;
 
-extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, json_spirit::Object& entry);
+extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, CJSONHandler& entry);
 extern enum Checkpoints::CPMode CheckpointsMode;
 
 double GetDifficulty(const CBlockIndex* blockindex)
@@ -95,56 +96,53 @@ double GetPoSKernelPS()
     return nStakesTime ? dStakeKernelsTriedAvg / nStakesTime : 0;
 }
 
-Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPrintTransactionDetail)
+void blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPrintTransactionDetail, CJSONHandler& result)
 {
-    Object result;
-    result.push_back(Pair("hash", block.GetHash().GetHex()));
+    result.BeginObject();
+    result.Pair("hash", block.GetHash().GetHex());
     CMerkleTx txGen(block.vtx[0]);
     txGen.SetMerkleBranch(&block);
-    result.push_back(Pair("confirmations", (int)txGen.GetDepthInMainChain()));
-    result.push_back(Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION)));
-    result.push_back(Pair("height", blockindex->nHeight));
-    result.push_back(Pair("version", block.nVersion));
-    result.push_back(Pair("merkleroot", block.hashMerkleRoot.GetHex()));
-    result.push_back(Pair("mint", ValueFromAmount(blockindex->nMint)));
-    result.push_back(Pair("time", (boost::int64_t)block.GetBlockTime()));
-    result.push_back(Pair("nonce", (boost::uint64_t)block.nNonce));
-    result.push_back(Pair("bits", HexBits(block.nBits)));
-    result.push_back(Pair("difficulty", GetDifficulty(blockindex)));
-    result.push_back(Pair("blocktrust", leftTrim(blockindex->GetBlockTrust().GetHex(), '0')));
-    result.push_back(Pair("chaintrust", leftTrim(blockindex->nChainTrust.GetHex(), '0')));
+    result.Pair("confirmations", (int)txGen.GetDepthInMainChain());
+    result.Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    result.Pair("height", blockindex->nHeight);
+    result.Pair("version", block.nVersion);
+    result.Pair("merkleroot", block.hashMerkleRoot.GetHex());
+    result.Pair("mint", ValueFromAmount(blockindex->nMint));
+    result.Pair("time", (boost::int64_t)block.GetBlockTime());
+    result.Pair("nonce", (boost::uint64_t)block.nNonce);
+    result.Pair("bits", HexBits(block.nBits));
+    result.Pair("difficulty", GetDifficulty(blockindex));
+    result.Pair("blocktrust", leftTrim(blockindex->GetBlockTrust().GetHex(), '0'));
+    result.Pair("chaintrust", leftTrim(blockindex->nChainTrust.GetHex(), '0'));
     if (blockindex->pprev)
-        result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
+        result.Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex());
     if (blockindex->pnext)
-        result.push_back(Pair("nextblockhash", blockindex->pnext->GetBlockHash().GetHex()));
-
-    result.push_back(Pair("flags", strprintf("%s%s", blockindex->IsProofOfStake()? "proof-of-stake" : "proof-of-work", blockindex->GeneratedStakeModifier()? " stake-modifier": "")));
-    result.push_back(Pair("proofhash", blockindex->IsProofOfStake()? blockindex->hashProofOfStake.GetHex() : blockindex->GetBlockHash().GetHex()));
-    result.push_back(Pair("entropybit", (int)blockindex->GetStakeEntropyBit()));
-    result.push_back(Pair("modifier", strprintf("%016" PRIx64, blockindex->nStakeModifier)));
-    result.push_back(Pair("modifierchecksum", strprintf("%08x", blockindex->nStakeModifierChecksum)));
-    Array txinfo;
+        result.Pair("nextblockhash", blockindex->pnext->GetBlockHash().GetHex());
+
+    result.Pair("flags", strprintf("%s%s", blockindex->IsProofOfStake()? "proof-of-stake" : "proof-of-work", blockindex->GeneratedStakeModifier()? " stake-modifier": ""));
+    result.Pair("proofhash", blockindex->IsProofOfStake()? blockindex->hashProofOfStake.GetHex() : blockindex->GetBlockHash().GetHex());
+    result.Pair("entropybit", (int)blockindex->GetStakeEntropyBit());
+    result.Pair("modifier", strprintf("%016" PRIx64, blockindex->nStakeModifier));
+    result.Pair("modifierchecksum", strprintf("%08x", blockindex->nStakeModifierChecksum));
+    result.Key("tx");
+    result.BeginArray();
     for (const CTransaction& tx : block.vtx)
     {
         if (fPrintTransactionDetail)
         {
-            Object entry;
-
-            entry.push_back(Pair("txid", tx.GetHash().GetHex()));
-            TxToJSON(tx, 0, entry);
-
-            txinfo.push_back(entry);
+            result.BeginObject();
+            result.Pair("txid", tx.GetHash().GetHex());
+            TxToJSON(tx, 0, result);
+            result.EndObject();
         }
         else
-            txinfo.push_back(tx.GetHash().GetHex());
+            result.Write(tx.GetHash().GetHex());
     }
-
-    result.push_back(Pair("tx", txinfo));
+    result.EndArray();
 
     if (block.IsProofOfStake())
-        result.push_back(Pair("signature", HexStr(block.vchBlockSig.begin(), block.vchBlockSig.end())));
-
-    return result;
+        result.Pair("signature", HexStr(block.vchBlockSig.begin(), block.vchBlockSig.end()));
+    result.EndObject();
 }
 
 Value getbestblockhash(const Array& params, bool fHelp)
@@ -196,7 +194,7 @@ Value settxfee(const Array& params, bool fHelp)
     return true;
 }
 
-Value getrawmempool(const Array& params, bool fHelp)
+void streamgetrawmempool(const Array& params, bool fHelp, CJSONHandler& result)
 {
     if (fHelp || params.size() != 0)
         throw runtime_error(
@@ -206,11 +204,76 @@ Value getrawmempool(const Array& params, bool fHelp)
     vector<uint256> vtxid;
     mempool.queryHashes(vtxid);
 
-    Array a;
+    result.BeginArray();
     for (const uint256& hash : vtxid)
-        a.push_back(hash.ToString());
+        result.Write(hash.ToString());
+    result.EndArray();
+}
 
-    return a;
+Value getrawmempool(const Array& params, bool fHelp)
+{
+    Value result;
+    CJSONValueBuilder builder(result);
+    streamgetrawmempool(params, fHelp, builder);
+    return result;
+}
+
+Value getmempoolinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmempoolinfo\n"
+            "Returns the memory pool's size, memory use and limit, and how its\n"
+            "transactions spread over fee rates.");
+
+    // Fee rate bands in a 1-2-5 series from the minimum fee up to 1 coin per kB
+    vector<int64_t> vFeeRates;
+    vFeeRates.push_back(0);
+    for (int64_t nFeeRate = MIN_TX_FEE; nFeeRate <= COIN; nFeeRate *= 10)
+    {
+        vFeeRates.push_back(nFeeRate);
+        vFeeRates.push_back(nFeeRate * 2);
+        vFeeRates.push_back(nFeeRate * 5);
+    }
+    vector<int> vCount(vFeeRates.size(), 0);
+    vector<int64_t> vBytes(vFeeRates.size(), 0), vFees(vFeeRates.size(), 0);
+
+    Object result;
+    {
+        LOCK(mempool.cs);
+        int64_t nBytes = 0;
+        for (map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapEntry.begin(); mi != mempool.mapEntry.end(); ++mi)
+        {
+            const CTxMemPoolEntry& entry = (*mi).second;
+            nBytes += entry.nTxSize;
+            unsigned int nBand = upper_bound(vFeeRates.begin(), vFeeRates.end(), (int64_t)entry.GetFeePerKb()) - vFeeRates.begin();
+            nBand = nBand > 0 ? nBand - 1 : 0;
+            vCount[nBand]++;
+            vBytes[nBand] += entry.nTxSize;
+            vFees[nBand] += entry.nFee;
+        }
+        result.push_back(Pair("size", (int)mempool.mapTx.size()));
+        result.push_back(Pair("bytes", nBytes));
+        result.push_back(Pair("usage", (int64_t)mempool.nUsage));
+    }
+    result.push_back(Pair("maxmempool", GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000));
+    result.push_back(Pair("expiryhours", GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY)));
+
+    Array histogram;
+    for (unsigned int i = 0; i < vFeeRates.size(); i++)
+    {
+        if (!vCount[i])
+            continue;
+        Object band;
+        band.push_back(Pair("feeperkb", ValueFromAmount(vFeeRates[i])));
+        band.push_back(Pair("count", vCount[i]));
+        band.push_back(Pair("bytes", vBytes[i]));
+        band.push_back(Pair("fees", ValueFromAmount(vFees[i])));
+        histogram.push_back(band);
+    }
+    result.push_back(Pair("feehistogram", histogram));
+
+    return result;
 }
 
 Value getblockhash(const Array& params, bool fHelp)
@@ -228,7 +291,7 @@ Value getblockhash(const Array& params, bool fHelp)
     return pblockindex->phashBlock->GetHex();
 }
 
-Value getblock(const Array& params, bool fHelp)
+void streamgetblock(const Array& params, bool fHelp, CJSONHandler& result)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
         throw runtime_error(
@@ -239,17 +302,33 @@ Value getblock(const Array& params, bool fHelp)
     std::string strHash = params[0].get_str();
     uint256 hash(strHash);
 
-    if (mapBlockIndex.count(hash) == 0)
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+    CBlockIndex* pblockindex;
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+        pblockindex = (*mi).second;
+    }
 
+    // Block index entries are never freed and block files are only appended
+    // to, so the block is read without holding cs_main
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
     block.ReadFromDisk(pblockindex, true);
 
-    return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
+    LOCK(cs_main);
+    blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false, result);
 }
 
-Value getblockbynumber(const Array& params, bool fHelp)
+Value getblock(const Array& params, bool fHelp)
+{
+    Value result;
+    CJSONValueBuilder builder(result);
+    streamgetblock(params, fHelp, builder);
+    return result;
+}
+
+void streamgetblockbynumber(const Array& params, bool fHelp, CJSONHandler& result)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
         throw runtime_error(
@@ -258,20 +337,27 @@ Value getblockbynumber(const Array& params, bool fHelp)
             "Returns details of a block with given block-number.");
 
     int nHeight = params[0].get_int();
-    if (nHeight < 0 || nHeight > nBestHeight)
-        throw runtime_error("Block number out of range.");
+    CBlockIndex* pblockindex;
+    {
+        LOCK(cs_main);
+        if (nHeight < 0 || nHeight > nBestHeight)
+            throw runtime_error("Block number out of range.");
+        pblockindex = FindBlockByHeight(nHeight);
+    }
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-
-    uint256 hash = *pblockindex->phashBlock;
-
-    pblockindex = mapBlockIndex[hash];
     block.ReadFromDisk(pblockindex, true);
 
-    return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
+    LOCK(cs_main);
+    blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false, result);
+}
+
+Value getblockbynumber(const Array& params, bool fHelp)
+{
+    Value result;
+    CJSONValueBuilder builder(result);
+    streamgetblockbynumber(params, fHelp, builder);
+    return result;
 }
 
 // ppcoin: get information of sync-checkpoint
@@ -305,3 +391,23 @@ Value getcheckpoint(const Array& params, bool fHelp)
 
     return result;
 }
+
+Value getsigcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getsigcacheinfo\n"
+            "Returns usage counters of the valid signature cache.");
+
+    CSignatureCacheStats stats;
+    GetSignatureCacheStats(stats);
+
+    Object obj;
+    obj.push_back(Pair("entries",       stats.nEntries));
+    obj.push_back(Pair("maxentries",    stats.nMaxEntries));
+    obj.push_back(Pair("bytes",         stats.nBytes));
+    obj.push_back(Pair("hits",          stats.nHits));
+    obj.push_back(Pair("misses",        stats.nMisses));
+    obj.push_back(Pair("evictions",     stats.nEvictions));
+    return obj;
+}
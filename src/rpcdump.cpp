@@ -137,7 +137,8 @@ Value importprivkey(const Array& params, bool fHelp)
         if (!pwalletMain->AddKey(key))
             throw JSONRPCError(RPC_WALLET_ERROR, "Error adding key to wallet");
 
-        pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true);
+        if (pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true) < 0)
+            throw JSONRPCError(RPC_WALLET_ERROR, "Error writing the rescan to the wallet");
         pwalletMain->ReacceptWalletTransactions();
     }
 
@@ -162,6 +163,8 @@ Value importwallet(const Array& params, bool fHelp)
 
     bool fGood = true;
 
+    // The keys, their metadata and labels go to disk together
+    bitdb.BeginBatch(pwalletMain->strWalletFile);
     while (file.good()) {
         std::string line;
         std::getline(file, line);
@@ -212,6 +215,8 @@ Value importwallet(const Array& params, bool fHelp)
         nTimeBegin = std::min(nTimeBegin, nTime);
     }
     file.close();
+    if (!bitdb.EndBatch(pwalletMain->strWalletFile))
+        fGood = false;
 
     CBlockIndex *pindex = pindexBest;
     while (pindex && pindex->pprev && pindex->nTime > nTimeBegin - 7200)
@@ -221,7 +226,8 @@ Value importwallet(const Array& params, bool fHelp)
         pwalletMain->nTimeFirstKey = nTimeBegin;
 
     printf("Rescanning last %i blocks\n", pindexBest->nHeight - pindex->nHeight + 1);
-    pwalletMain->ScanForWalletTransactions(pindex);
+    if (pwalletMain->ScanForWalletTransactions(pindex) < 0)
+        throw JSONRPCError(RPC_WALLET_ERROR, "Error writing the rescan to the wallet");
     pwalletMain->ReacceptWalletTransactions();
     pwalletMain->MarkDirty();
 
@@ -7,6 +7,7 @@
 
 #include "base58.h"
 #include "bitcoinrpc.h"
+#include "jsonstream.h"
 #include "txdb.h"
 #include "init.h"
 #include "main.h"
@@ -18,90 +19,108 @@ using namespace boost;
 using namespace boost::assign;
 using namespace json_spirit;
 
-void ScriptPubKeyToJSON(const CScript& scriptPubKey, Object& out, bool fIncludeHex)
+void ScriptPubKeyToJSON(const CScript& scriptPubKey, CJSONHandler& out, bool fIncludeHex)
 {
     txnouttype type;
     vector<CTxDestination> addresses;
     int nRequired;
 
-    out.push_back(Pair("asm", scriptPubKey.ToString()));
+    out.Pair("asm", scriptPubKey.ToString());
 
     if (fIncludeHex)
-        out.push_back(Pair("hex", HexStr(scriptPubKey.begin(), scriptPubKey.end())));
+        out.Pair("hex", HexStr(scriptPubKey.begin(), scriptPubKey.end()));
 
     if (!ExtractDestinations(scriptPubKey, type, addresses, nRequired))
     {
-        out.push_back(Pair("type", GetTxnOutputType(TX_NONSTANDARD)));
+        out.Pair("type", GetTxnOutputType(TX_NONSTANDARD));
         return;
     }
 
-    out.push_back(Pair("reqSigs", nRequired));
-    out.push_back(Pair("type", GetTxnOutputType(type)));
+    out.Pair("reqSigs", nRequired);
+    out.Pair("type", GetTxnOutputType(type));
 
-    Array a;
+    out.Key("addresses");
+    out.BeginArray();
     for (const CTxDestination& addr : addresses)
-        a.push_back(CBitcoinAddress(addr).ToString());
-    out.push_back(Pair("addresses", a));
+        out.Write(CBitcoinAddress(addr).ToString());
+    out.EndArray();
 }
 
-void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
+void ScriptPubKeyToJSON(const CScript& scriptPubKey, Object& out, bool fIncludeHex)
+{
+    CJSONValueBuilder builder(out);
+    ScriptPubKeyToJSON(scriptPubKey, builder, fIncludeHex);
+}
+
+// Writes the pairs of tx into the object entry is inside of
+void TxToJSON(const CTransaction& tx, const uint256 hashBlock, CJSONHandler& entry)
 {
-    entry.push_back(Pair("txid", tx.GetHash().GetHex()));
-    entry.push_back(Pair("version", tx.nVersion));
-    entry.push_back(Pair("time", (boost::int64_t)tx.nTime));
-    entry.push_back(Pair("locktime", (boost::int64_t)tx.nLockTime));
-    Array vin;
+    entry.Pair("txid", tx.GetHash().GetHex());
+    entry.Pair("version", tx.nVersion);
+    entry.Pair("time", (boost::int64_t)tx.nTime);
+    entry.Pair("locktime", (boost::int64_t)tx.nLockTime);
+    entry.Key("vin");
+    entry.BeginArray();
     for (const CTxIn& txin : tx.vin)
     {
-        Object in;
+        entry.BeginObject();
         if (tx.IsCoinBase())
-            in.push_back(Pair("coinbase", HexStr(txin.scriptSig.begin(), txin.scriptSig.end())));
+            entry.Pair("coinbase", HexStr(txin.scriptSig.begin(), txin.scriptSig.end()));
         else
         {
-            in.push_back(Pair("txid", txin.prevout.hash.GetHex()));
-            in.push_back(Pair("vout", (boost::int64_t)txin.prevout.n));
-            Object o;
-            o.push_back(Pair("asm", txin.scriptSig.ToString()));
-            o.push_back(Pair("hex", HexStr(txin.scriptSig.begin(), txin.scriptSig.end())));
-            in.push_back(Pair("scriptSig", o));
+            entry.Pair("txid", txin.prevout.hash.GetHex());
+            entry.Pair("vout", (boost::int64_t)txin.prevout.n);
+            entry.Key("scriptSig");
+            entry.BeginObject();
+            entry.Pair("asm", txin.scriptSig.ToString());
+            entry.Pair("hex", HexStr(txin.scriptSig.begin(), txin.scriptSig.end()));
+            entry.EndObject();
         }
-        in.push_back(Pair("sequence", (boost::int64_t)txin.nSequence));
-        vin.push_back(in);
+        entry.Pair("sequence", (boost::int64_t)txin.nSequence);
+        entry.EndObject();
     }
-    entry.push_back(Pair("vin", vin));
-    Array vout;
+    entry.EndArray();
+    entry.Key("vout");
+    entry.BeginArray();
     for (unsigned int i = 0; i < tx.vout.size(); i++)
     {
         const CTxOut& txout = tx.vout[i];
-        Object out;
-        out.push_back(Pair("value", ValueFromAmount(txout.nValue)));
-        out.push_back(Pair("n", (boost::int64_t)i));
-        Object o;
-        ScriptPubKeyToJSON(txout.scriptPubKey, o, true);
-        out.push_back(Pair("scriptPubKey", o));
-        vout.push_back(out);
+        entry.BeginObject();
+        entry.Pair("value", ValueFromAmount(txout.nValue));
+        entry.Pair("n", (boost::int64_t)i);
+        entry.Key("scriptPubKey");
+        entry.BeginObject();
+        ScriptPubKeyToJSON(txout.scriptPubKey, entry, true);
+        entry.EndObject();
+        entry.EndObject();
     }
-    entry.push_back(Pair("vout", vout));
+    entry.EndArray();
 
     if (hashBlock != 0)
     {
-        entry.push_back(Pair("blockhash", hashBlock.GetHex()));
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        entry.Pair("blockhash", hashBlock.GetHex());
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end() && (*mi).second)
         {
             CBlockIndex* pindex = (*mi).second;
             if (pindex->IsInMainChain())
             {
-                entry.push_back(Pair("confirmations", 1 + nBestHeight - pindex->nHeight));
-                entry.push_back(Pair("time", (boost::int64_t)pindex->nTime));
-                entry.push_back(Pair("blocktime", (boost::int64_t)pindex->nTime));
+                entry.Pair("confirmations", 1 + nBestHeight - pindex->nHeight);
+                entry.Pair("time", (boost::int64_t)pindex->nTime);
+                entry.Pair("blocktime", (boost::int64_t)pindex->nTime);
             }
             else
-                entry.push_back(Pair("confirmations", 0));
+                entry.Pair("confirmations", 0);
         }
     }
 }
 
+void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
+{
+    CJSONValueBuilder builder(entry);
+    TxToJSON(tx, hashBlock, builder);
+}
+
 Value getrawtransaction(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
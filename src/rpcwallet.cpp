@@ -6,6 +6,7 @@
 #include "wallet.h"
 #include "walletdb.h"
 #include "bitcoinrpc.h"
+#include "jsonstream.h"
 #include "init.h"
 #include "base58.h"
 
@@ -60,23 +61,29 @@ void EnsureWalletIsUnlocked()
         throw JSONRPCError(RPC_WALLET_UNLOCK_NEEDED, "Error: Wallet is unlocked for staking only.");
 }
 
-void WalletTxToJSON(const CWalletTx& wtx, Object& entry)
+void WalletTxToJSON(const CWalletTx& wtx, CJSONHandler& entry)
 {
     int confirms = wtx.GetDepthInMainChain();
-    entry.push_back(Pair("confirmations", confirms));
+    entry.Pair("confirmations", confirms);
     if (wtx.IsCoinBase() || wtx.IsCoinStake())
-        entry.push_back(Pair("generated", true));
+        entry.Pair("generated", true);
     if (confirms > 0)
     {
-        entry.push_back(Pair("blockhash", wtx.hashBlock.GetHex()));
-        entry.push_back(Pair("blockindex", wtx.nIndex));
-        entry.push_back(Pair("blocktime", (boost::int64_t)(mapBlockIndex[wtx.hashBlock]->nTime)));
+        entry.Pair("blockhash", wtx.hashBlock.GetHex());
+        entry.Pair("blockindex", wtx.nIndex);
+        entry.Pair("blocktime", (boost::int64_t)(mapBlockIndex[wtx.hashBlock]->nTime));
     }
-    entry.push_back(Pair("txid", wtx.GetHash().GetHex()));
-    entry.push_back(Pair("time", (boost::int64_t)wtx.GetTxTime()));
-    entry.push_back(Pair("timereceived", (boost::int64_t)wtx.nTimeReceived));
+    entry.Pair("txid", wtx.GetHash().GetHex());
+    entry.Pair("time", (boost::int64_t)wtx.GetTxTime());
+    entry.Pair("timereceived", (boost::int64_t)wtx.nTimeReceived);
     for (const PAIRTYPE(string,string)& item : wtx.mapValue)
-        entry.push_back(Pair(item.first, item.second));
+        entry.Pair(item.first, item.second);
+}
+
+void WalletTxToJSON(const CWalletTx& wtx, Object& entry)
+{
+    CJSONValueBuilder builder(entry);
+    WalletTxToJSON(wtx, builder);
 }
 
 string AccountFromValue(const Value& value)
@@ -1007,14 +1014,15 @@ Value listreceivedbyaccount(const Array& params, bool fHelp)
     return ListReceived(params, true);
 }
 
-static void MaybePushAddress(Object & entry, const CTxDestination &dest)
+static void MaybePushAddress(CJSONHandler& entry, const CTxDestination &dest)
 {
     CBitcoinAddress addr;
     if (addr.Set(dest))
-        entry.push_back(Pair("address", addr.ToString()));
+        entry.Pair("address", addr.ToString());
 }
 
-void ListTransactions(const CWalletTx& wtx, const string& strAccount, int nMinDepth, bool fLong, Array& ret)
+// Writes one object per entry
+void ListTransactions(const CWalletTx& wtx, const string& strAccount, int nMinDepth, bool fLong, CJSONHandler& ret)
 {
     int64_t nFee;
     string strSentAccount;
@@ -1030,15 +1038,15 @@ void ListTransactions(const CWalletTx& wtx, const string& strAccount, int nMinDe
     {
         for (const PAIRTYPE(CTxDestination, int64_t)& s : listSent)
         {
-            Object entry;
-            entry.push_back(Pair("account", strSentAccount));
-            MaybePushAddress(entry, s.first);
-            entry.push_back(Pair("category", "send"));
-            entry.push_back(Pair("amount", ValueFromAmount(-s.second)));
-            entry.push_back(Pair("fee", ValueFromAmount(-nFee)));
+            ret.BeginObject();
+            ret.Pair("account", strSentAccount);
+            MaybePushAddress(ret, s.first);
+            ret.Pair("category", "send");
+            ret.Pair("amount", ValueFromAmount(-s.second));
+            ret.Pair("fee", ValueFromAmount(-nFee));
             if (fLong)
-                WalletTxToJSON(wtx, entry);
-            ret.push_back(entry);
+                WalletTxToJSON(wtx, ret);
+            ret.EndObject();
         }
     }
 
@@ -1053,32 +1061,32 @@ void ListTransactions(const CWalletTx& wtx, const string& strAccount, int nMinDe
                 account = pwalletMain->mapAddressBook[r.first];
             if (fAllAccounts || (account == strAccount))
             {
-                Object entry;
-                entry.push_back(Pair("account", account));
-                MaybePushAddress(entry, r.first);
+                ret.BeginObject();
+                ret.Pair("account", account);
+                MaybePushAddress(ret, r.first);
                 if (wtx.IsCoinBase() || wtx.IsCoinStake())
                 {
                     if (wtx.GetDepthInMainChain() < 1)
-                        entry.push_back(Pair("category", "orphan"));
+                        ret.Pair("category", "orphan");
                     else if (wtx.GetBlocksToMaturity() > 0)
-                        entry.push_back(Pair("category", "immature"));
+                        ret.Pair("category", "immature");
                     else
-                        entry.push_back(Pair("category", "generate"));
+                        ret.Pair("category", "generate");
                 }
                 else
                 {
-                    entry.push_back(Pair("category", "receive"));
+                    ret.Pair("category", "receive");
                 }
                 if (!wtx.IsCoinStake())
-                    entry.push_back(Pair("amount", ValueFromAmount(r.second)));
+                    ret.Pair("amount", ValueFromAmount(r.second));
                 else
                 {
-                    entry.push_back(Pair("amount", ValueFromAmount(-nFee)));
+                    ret.Pair("amount", ValueFromAmount(-nFee));
                     stop = true; // only one coinstake output
                 }
                 if (fLong)
-                    WalletTxToJSON(wtx, entry);
-                ret.push_back(entry);
+                    WalletTxToJSON(wtx, ret);
+                ret.EndObject();
             }
             if (stop)
                 break;
@@ -1086,24 +1094,30 @@ void ListTransactions(const CWalletTx& wtx, const string& strAccount, int nMinDe
     }
 }
 
-void AcentryToJSON(const CAccountingEntry& acentry, const string& strAccount, Array& ret)
+void ListTransactions(const CWalletTx& wtx, const string& strAccount, int nMinDepth, bool fLong, Array& ret)
+{
+    CJSONValueBuilder builder(ret);
+    ListTransactions(wtx, strAccount, nMinDepth, fLong, builder);
+}
+
+void AcentryToJSON(const CAccountingEntry& acentry, const string& strAccount, CJSONHandler& ret)
 {
     bool fAllAccounts = (strAccount == string("*"));
 
     if (fAllAccounts || acentry.strAccount == strAccount)
     {
-        Object entry;
-        entry.push_back(Pair("account", acentry.strAccount));
-        entry.push_back(Pair("category", "move"));
-        entry.push_back(Pair("time", (boost::int64_t)acentry.nTime));
-        entry.push_back(Pair("amount", ValueFromAmount(acentry.nCreditDebit)));
-        entry.push_back(Pair("otheraccount", acentry.strOtherAccount));
-        entry.push_back(Pair("comment", acentry.strComment));
-        ret.push_back(entry);
+        ret.BeginObject();
+        ret.Pair("account", acentry.strAccount);
+        ret.Pair("category", "move");
+        ret.Pair("time", (boost::int64_t)acentry.nTime);
+        ret.Pair("amount", ValueFromAmount(acentry.nCreditDebit));
+        ret.Pair("otheraccount", acentry.strOtherAccount);
+        ret.Pair("comment", acentry.strComment);
+        ret.EndObject();
     }
 }
 
-Value listtransactions(const Array& params, bool fHelp)
+void streamlisttransactions(const Array& params, bool fHelp, CJSONHandler& result)
 {
     if (fHelp || params.size() > 3)
         throw runtime_error(
@@ -1125,7 +1139,9 @@ Value listtransactions(const Array& params, bool fHelp)
     if (nFrom < 0)
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative from");
 
-    Array ret;
+    // Each entry is written out on its own, as the page is only known
+    // once the newest ones have been collected
+    CJSONTextList entries;
 
     std::list<CAccountingEntry> acentries;
     CWallet::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, strAccount);
@@ -1135,30 +1151,33 @@ Value listtransactions(const Array& params, bool fHelp)
     {
         CWalletTx *const pwtx = (*it).second.first;
         if (pwtx != 0)
-            ListTransactions(*pwtx, strAccount, 0, true, ret);
+            ListTransactions(*pwtx, strAccount, 0, true, entries);
         CAccountingEntry *const pacentry = (*it).second.second;
         if (pacentry != 0)
-            AcentryToJSON(*pacentry, strAccount, ret);
+            AcentryToJSON(*pacentry, strAccount, entries);
 
-        if ((int)ret.size() >= (nCount+nFrom)) break;
+        if ((int)entries.vText.size() >= (nCount+nFrom)) break;
     }
-    // ret is newest to oldest
-
-    if (nFrom > (int)ret.size())
-        nFrom = ret.size();
-    if ((nFrom + nCount) > (int)ret.size())
-        nCount = ret.size() - nFrom;
-    Array::iterator first = ret.begin();
-    std::advance(first, nFrom);
-    Array::iterator last = ret.begin();
-    std::advance(last, nFrom+nCount);
-
-    if (last != ret.end()) ret.erase(last, ret.end());
-    if (first != ret.begin()) ret.erase(ret.begin(), first);
-
-    std::reverse(ret.begin(), ret.end()); // Return oldest to newest
+    // entries are newest to oldest
+
+    if (nFrom > (int)entries.vText.size())
+        nFrom = entries.vText.size();
+    if ((nFrom + nCount) > (int)entries.vText.size())
+        nCount = entries.vText.size() - nFrom;
+
+    // Return oldest to newest
+    result.BeginArray();
+    for (int i = nFrom + nCount - 1; i >= nFrom; i--)
+        result.Raw(entries.vText[i]);
+    result.EndArray();
+}
 
-    return ret;
+Value listtransactions(const Array& params, bool fHelp)
+{
+    Value result;
+    CJSONValueBuilder builder(result);
+    streamlisttransactions(params, fHelp, builder);
+    return result;
 }
 
 Value listaccounts(const Array& params, bool fHelp)
@@ -1324,7 +1343,7 @@ Value gettransaction(const Array& params, bool fHelp)
             else
             {
                 entry.push_back(Pair("blockhash", hashBlock.GetHex()));
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+                BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
                 if (mi != mapBlockIndex.end() && (*mi).second)
                 {
                     CBlockIndex* pindex = (*mi).second;
@@ -3,12 +3,6 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
-#include <boost/tuple/tuple.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
-
-using namespace std;
-using namespace boost;
-
 #include "script.h"
 #include "keystore.h"
 #include "bignum.h"
@@ -17,27 +11,20 @@ using namespace boost;
 #include "sync.h"
 #include "util.h"
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+#include <openssl/sha.h>
 
-static const valtype vchFalse(0);
-static const valtype vchZero(0);
-static const valtype vchTrue(1, 1);
-static const CBigNum bnZero(0);
-static const CBigNum bnOne(1);
-static const CBigNum bnFalse(0);
-static const CBigNum bnTrue(1);
-static const size_t nMaxNumSize = 4;
+using namespace std;
+using namespace boost;
 
+static const unsigned char pchTrue[] = { 1 };
+static const CScriptValue vchFalse;
+static const CScriptValue vchTrue(pchTrue, pchTrue + 1);
+static const CScriptNum bnZero(0);
+static const CScriptNum bnOne(1);
 
-CBigNum CastToBigNum(const valtype& vch)
-{
-    if (vch.size() > nMaxNumSize)
-        throw runtime_error("CastToBigNum() : overflow");
-    // Get rid of extra leading zeros
-    return CBigNum(CBigNum(vch).getvch());
-}
 
-bool CastToBool(const valtype& vch)
+template<typename V>
+static bool CastToBool(const V& vch)
 {
     for (unsigned int i = 0; i < vch.size(); i++)
     {
@@ -52,32 +39,6 @@ bool CastToBool(const valtype& vch)
     return false;
 }
 
-//
-// WARNING: This does not work as expected for signed integers; the sign-bit
-// is left in place as the integer is zero-extended. The correct behavior
-// would be to move the most significant bit of the last byte during the
-// resize process. MakeSameSize() is currently only used by the disabled
-// opcodes OP_AND, OP_OR, and OP_XOR.
-//
-void MakeSameSize(valtype& vch1, valtype& vch2)
-{
-    // Lengthen the shorter one
-    if (vch1.size() < vch2.size())
-        // PATCH:
-        // +unsigned char msb = vch1[vch1.size()-1];
-        // +vch1[vch1.size()-1] &= 0x7f;
-        //  vch1.resize(vch2.size(), 0);
-        // +vch1[vch1.size()-1] = msb;
-        vch1.resize(vch2.size(), 0);
-    if (vch2.size() < vch1.size())
-        // PATCH:
-        // +unsigned char msb = vch2[vch2.size()-1];
-        // +vch2[vch2.size()-1] &= 0x7f;
-        //  vch2.resize(vch1.size(), 0);
-        // +vch2[vch2.size()-1] = msb;
-        vch2.resize(vch1.size(), 0);
-}
-
 
 
 //
@@ -86,13 +47,20 @@ void MakeSameSize(valtype& vch1, valtype& vch2)
 //
 #define stacktop(i)  (stack.at(stack.size()+(i)))
 #define altstacktop(i)  (altstack.at(altstack.size()+(i)))
-static inline void popstack(vector<valtype>& stack)
+template<typename V>
+static inline void popstack(std::vector<V>& stack)
 {
     if (stack.empty())
         throw runtime_error("popstack() : stack empty");
     stack.pop_back();
 }
 
+static inline void pushnum(CScriptStack& stack, const CScriptNum& bn)
+{
+    stack.push_back(CScriptValue());
+    bn.getvch(stack.back());
+}
+
 
 const char* GetTxnOutputType(txnouttype t)
 {
@@ -251,7 +219,7 @@ const char* GetOpName(opcodetype opcode)
     }
 }
 
-static bool IsCanonicalPubKey(const valtype &vchPubKey) {
+bool IsCanonicalPubKey(const CScriptValue &vchPubKey) {
     if (vchPubKey.size() < 33)
         return error("Non-canonical public key: too short");
     if (vchPubKey[0] == 0x04) {
@@ -266,7 +234,7 @@ static bool IsCanonicalPubKey(const valtype &vchPubKey) {
     return true;
 }
 
-static bool IsCanonicalSignature(const valtype &vchSig) {
+bool IsCanonicalSignature(const CScriptValue &vchSig) {
     // See https://bitcointalk.org/index.php?topic=8392.msg127623#msg127623
     // A canonical signature exists of: <30> <total len> <02> <len R> <R> <02> <len S> <S> <hashtype>
     // Where R and S are not negative (their first byte has its highest bit not set), and not
@@ -319,16 +287,216 @@ static bool IsCanonicalSignature(const valtype &vchSig) {
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType)
+// ( sig pubkey -- bool ), for OP_CHECKSIG and OP_CHECKSIGVERIFY
+static bool EvalCheckSig(CScriptStack& stack, opcodetype opcode, CScript::const_iterator pbegincodehash, CScript::const_iterator pend,
+                         const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashContext* psighash)
+{
+    if (stack.size() < 2)
+        return false;
+
+    CScriptValue& vchSig    = stacktop(-2);
+    CScriptValue& vchPubKey = stacktop(-1);
+
+    ////// debug print
+    //PrintHex(vchSig.begin(), vchSig.end(), "sig: %s\n");
+    //PrintHex(vchPubKey.begin(), vchPubKey.end(), "pubkey: %s\n");
+
+    // Subset of script starting at the most recent codeseparator
+    CScript scriptCode(pbegincodehash, pend);
+
+    // Drop the signature, since there's no way for a signature to sign itself
+    scriptCode.FindAndDelete(CScript(vchSig));
+
+    bool fSuccess = IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey) &&
+        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, psighash);
+
+    popstack(stack);
+    popstack(stack);
+    stack.push_back(fSuccess ? vchTrue : vchFalse);
+    if (opcode == OP_CHECKSIGVERIFY)
+    {
+        if (fSuccess)
+            popstack(stack);
+        else
+            return false;
+    }
+    return true;
+}
+
+// ( [sig ...] num_of_signatures [pubkey ...] num_of_pubkeys -- bool ), for
+// OP_CHECKMULTISIG and OP_CHECKMULTISIGVERIFY
+static bool EvalCheckMultiSig(CScriptStack& stack, opcodetype opcode, CScript::const_iterator pbegincodehash, CScript::const_iterator pend,
+                              int& nOpCount, const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashContext* psighash)
+{
+    int i = 1;
+    if ((int)stack.size() < i)
+        return false;
+
+    int nKeysCount = CScriptNum(stacktop(-i)).getint();
+    if (nKeysCount < 0 || nKeysCount > 20)
+        return false;
+    nOpCount += nKeysCount;
+    if (nOpCount > 201)
+        return false;
+    int ikey = ++i;
+    i += nKeysCount;
+    if ((int)stack.size() < i)
+        return false;
+
+    int nSigsCount = CScriptNum(stacktop(-i)).getint();
+    if (nSigsCount < 0 || nSigsCount > nKeysCount)
+        return false;
+    int isig = ++i;
+    i += nSigsCount;
+    if ((int)stack.size() < i)
+        return false;
+
+    // Subset of script starting at the most recent codeseparator
+    CScript scriptCode(pbegincodehash, pend);
+
+    // Drop the signatures, since there's no way for a signature to sign itself
+    for (int k = 0; k < nSigsCount; k++)
+    {
+        CScriptValue& vchSig = stacktop(-isig-k);
+        scriptCode.FindAndDelete(CScript(vchSig));
+    }
+
+    bool fSuccess = true;
+    while (fSuccess && nSigsCount > 0)
+    {
+        CScriptValue& vchSig    = stacktop(-isig);
+        CScriptValue& vchPubKey = stacktop(-ikey);
+
+        // Check signature
+        bool fOk = IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey) &&
+            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, psighash);
+
+        if (fOk)
+        {
+            isig++;
+            nSigsCount--;
+        }
+        ikey++;
+        nKeysCount--;
+
+        // If there are more signatures left than keys left,
+        // then too many signatures have failed
+        if (nSigsCount > nKeysCount)
+            fSuccess = false;
+    }
+
+    while (i-- > 0)
+        popstack(stack);
+    stack.push_back(fSuccess ? vchTrue : vchFalse);
+
+    if (opcode == OP_CHECKMULTISIGVERIFY)
+    {
+        if (fSuccess)
+            popstack(stack);
+        else
+            return false;
+    }
+    return true;
+}
+
+// Push data of a direct push, the only kind the templates below contain
+static inline void pushdata(CScriptStack& stack, CScript::const_iterator pc)
+{
+    stack.push_back(CScriptValue(pc + 1, pc + 1 + *pc));
+}
+
+// Pay-to-pubkey-hash, pay-to-pubkey, pay-to-script-hash and bare multisig
+// scripts are recognized by their bytes and evaluated straight from them,
+// with the same effect on the stack as the interpreter loop below. Returns
+// false if script is none of them, else sets fResult to EvalScript's result.
+static bool EvalTemplate(CScriptStack& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType,
+                         const CSignatureHashContext* psighash, bool& fResult)
+{
+    unsigned int nSize = script.size();
+    int nOpCount = 0;
+    fResult = false;
+
+    // Any execution that gets past pushing onto a stack this deep fails
+    // the size limit on the way
+    if (nSize == 25 && script[0] == OP_DUP && script[1] == OP_HASH160 && script[2] == 20 &&
+        script[23] == OP_EQUALVERIFY && script[24] == OP_CHECKSIG)
+    {
+        // OP_DUP OP_HASH160 <hash> OP_EQUALVERIFY leaves the stack as it
+        // was if the top hashes to <hash>, two deeper on the way
+        if (stack.empty() || stack.size() + 2 > 1000)
+            return true;
+        const CScriptValue& vch = stacktop(-1);
+        uint160 hash160 = Hash160(vch.begin(), vch.end());
+        if (memcmp(&hash160, &script[3], 20) != 0)
+            return true;
+        fResult = EvalCheckSig(stack, OP_CHECKSIG, script.begin(), script.end(), txTo, nIn, nHashType, psighash);
+        return true;
+    }
+
+    if ((nSize == 35 || nSize == 67) && script[0] == nSize - 2 && script[nSize - 1] == OP_CHECKSIG)
+    {
+        // <pubkey> OP_CHECKSIG
+        if (stack.size() + 1 > 1000)
+            return true;
+        pushdata(stack, script.begin());
+        fResult = EvalCheckSig(stack, OP_CHECKSIG, script.begin(), script.end(), txTo, nIn, nHashType, psighash);
+        return true;
+    }
+
+    if (script.IsPayToScriptHash())
+    {
+        // OP_HASH160 <hash> OP_EQUAL
+        if (stack.empty() || stack.size() + 1 > 1000)
+            return true;
+        CScriptValue& vch = stacktop(-1);
+        uint160 hash160 = Hash160(vch.begin(), vch.end());
+        bool fEqual = memcmp(&hash160, &script[2], 20) == 0;
+        vch = fEqual ? vchTrue : vchFalse;
+        fResult = true;
+        return true;
+    }
+
+    if (nSize >= 3 && script[nSize - 1] == OP_CHECKMULTISIG &&
+        script[0] >= OP_1 && script[0] <= OP_16 && script[nSize - 2] >= OP_1 && script[nSize - 2] <= OP_16)
+    {
+        // OP_m <pubkey> ... OP_n OP_CHECKMULTISIG, with n direct pushes of
+        // 33 or 65 bytes
+        int nKeys = CScript::DecodeOP_N((opcodetype)script[nSize - 2]);
+        CScript::const_iterator pc = script.begin() + 1;
+        CScript::const_iterator pkeys = pc;
+        for (int i = 0; i < nKeys; i++)
+        {
+            if (pc >= script.end() - 2 || (*pc != 33 && *pc != 65) || script.end() - 2 - pc < 1 + *pc)
+                return false;
+            pc += 1 + *pc;
+        }
+        if (pc != script.end() - 2)
+            return false;
+
+        if (stack.size() + 2 + nKeys > 1000)
+            return true;
+        pushnum(stack, CScriptNum(CScript::DecodeOP_N((opcodetype)script[0])));
+        for (pc = pkeys; pc < script.end() - 2; pc += 1 + *pc)
+            pushdata(stack, pc);
+        pushnum(stack, CScriptNum(nKeys));
+        nOpCount++;
+        fResult = EvalCheckMultiSig(stack, OP_CHECKMULTISIG, script.begin(), script.end(), nOpCount, txTo, nIn, nHashType, psighash);
+        return true;
+    }
+
+    return false;
+}
+
+bool EvalScript(CScriptStack& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType,
+                const CSignatureHashContext* psighash)
 {
-    CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
     CScript::const_iterator pend = script.end();
     CScript::const_iterator pbegincodehash = script.begin();
     opcodetype opcode;
     valtype vchPushValue;
     vector<bool> vfExec;
-    vector<valtype> altstack;
+    CScriptStack altstack;
     if (script.size() > 10000)
         return false;
     int nOpCount = 0;
@@ -336,6 +504,10 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
     try
     {
+        bool fResult;
+        if (EvalTemplate(stack, script, txTo, nIn, nHashType, psighash, fResult))
+            return fResult;
+
         while (pc < pend)
         {
             bool fExec = !count(vfExec.begin(), vfExec.end(), false);
@@ -365,10 +537,10 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 opcode == OP_MOD ||
                 opcode == OP_LSHIFT ||
                 opcode == OP_RSHIFT)
-                return false;
+                return false; // Disabled opcodes, even in an unexecuted branch
 
             if (fExec && 0 <= opcode && opcode <= OP_PUSHDATA4)
-                stack.push_back(vchPushValue);
+                stack.push_back(CScriptValue(vchPushValue.begin(), vchPushValue.end()));
             else if (fExec || (OP_IF <= opcode && opcode <= OP_ENDIF))
             switch (opcode)
             {
@@ -394,8 +566,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_16:
                 {
                     // ( -- value)
-                    CBigNum bn((int)opcode - (int)(OP_1 - 1));
-                    stack.push_back(bn.getvch());
+                    CScriptNum bn((int)opcode - (int)(OP_1 - 1));
+                    pushnum(stack, bn);
                 }
                 break;
 
@@ -417,7 +589,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     {
                         if (stack.size() < 1)
                             return false;
-                        valtype& vch = stacktop(-1);
+                        CScriptValue& vch = stacktop(-1);
                         fValue = CastToBool(vch);
                         if (opcode == OP_NOTIF)
                             fValue = !fValue;
@@ -500,8 +672,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x1 x2 x1 x2)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch1 = stacktop(-2);
-                    valtype vch2 = stacktop(-1);
+                    CScriptValue vch1 = stacktop(-2);
+                    CScriptValue vch2 = stacktop(-1);
                     stack.push_back(vch1);
                     stack.push_back(vch2);
                 }
@@ -512,9 +684,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 -- x1 x2 x3 x1 x2 x3)
                     if (stack.size() < 3)
                         return false;
-                    valtype vch1 = stacktop(-3);
-                    valtype vch2 = stacktop(-2);
-                    valtype vch3 = stacktop(-1);
+                    CScriptValue vch1 = stacktop(-3);
+                    CScriptValue vch2 = stacktop(-2);
+                    CScriptValue vch3 = stacktop(-1);
                     stack.push_back(vch1);
                     stack.push_back(vch2);
                     stack.push_back(vch3);
@@ -526,8 +698,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 x4 -- x1 x2 x3 x4 x1 x2)
                     if (stack.size() < 4)
                         return false;
-                    valtype vch1 = stacktop(-4);
-                    valtype vch2 = stacktop(-3);
+                    CScriptValue vch1 = stacktop(-4);
+                    CScriptValue vch2 = stacktop(-3);
                     stack.push_back(vch1);
                     stack.push_back(vch2);
                 }
@@ -538,8 +710,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 x4 x5 x6 -- x3 x4 x5 x6 x1 x2)
                     if (stack.size() < 6)
                         return false;
-                    valtype vch1 = stacktop(-6);
-                    valtype vch2 = stacktop(-5);
+                    CScriptValue vch1 = stacktop(-6);
+                    CScriptValue vch2 = stacktop(-5);
                     stack.erase(stack.end()-6, stack.end()-4);
                     stack.push_back(vch1);
                     stack.push_back(vch2);
@@ -561,7 +733,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x - 0 | x x)
                     if (stack.size() < 1)
                         return false;
-                    valtype vch = stacktop(-1);
+                    CScriptValue vch = stacktop(-1);
                     if (CastToBool(vch))
                         stack.push_back(vch);
                 }
@@ -570,8 +742,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_DEPTH:
                 {
                     // -- stacksize
-                    CBigNum bn(stack.size());
-                    stack.push_back(bn.getvch());
+                    CScriptNum bn(stack.size());
+                    pushnum(stack, bn);
                 }
                 break;
 
@@ -589,7 +761,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x -- x x)
                     if (stack.size() < 1)
                         return false;
-                    valtype vch = stacktop(-1);
+                    CScriptValue vch = stacktop(-1);
                     stack.push_back(vch);
                 }
                 break;
@@ -608,7 +780,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x1 x2 x1)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch = stacktop(-2);
+                    CScriptValue vch = stacktop(-2);
                     stack.push_back(vch);
                 }
                 break;
@@ -620,11 +792,11 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (xn ... x2 x1 x0 n - ... x2 x1 x0 xn)
                     if (stack.size() < 2)
                         return false;
-                    int n = CastToBigNum(stacktop(-1)).getint();
+                    int n = CScriptNum(stacktop(-1)).getint();
                     popstack(stack);
                     if (n < 0 || n >= (int)stack.size())
                         return false;
-                    valtype vch = stacktop(-n-1);
+                    CScriptValue vch = stacktop(-n-1);
                     if (opcode == OP_ROLL)
                         stack.erase(stack.end()-n-1);
                     stack.push_back(vch);
@@ -657,77 +829,19 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x2 x1 x2)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch = stacktop(-1);
+                    CScriptValue vch = stacktop(-1);
                     stack.insert(stack.end()-2, vch);
                 }
                 break;
 
 
-                //
-                // Splice ops
-                //
-                case OP_CAT:
-                {
-                    // (x1 x2 -- out)
-                    if (stack.size() < 2)
-                        return false;
-                    valtype& vch1 = stacktop(-2);
-                    valtype& vch2 = stacktop(-1);
-                    vch1.insert(vch1.end(), vch2.begin(), vch2.end());
-                    popstack(stack);
-                    if (stacktop(-1).size() > 520)
-                        return false;
-                }
-                break;
-
-                case OP_SUBSTR:
-                {
-                    // (in begin size -- out)
-                    if (stack.size() < 3)
-                        return false;
-                    valtype& vch = stacktop(-3);
-                    int nBegin = CastToBigNum(stacktop(-2)).getint();
-                    int nEnd = nBegin + CastToBigNum(stacktop(-1)).getint();
-                    if (nBegin < 0 || nEnd < nBegin)
-                        return false;
-                    if (nBegin > (int)vch.size())
-                        nBegin = vch.size();
-                    if (nEnd > (int)vch.size())
-                        nEnd = vch.size();
-                    vch.erase(vch.begin() + nEnd, vch.end());
-                    vch.erase(vch.begin(), vch.begin() + nBegin);
-                    popstack(stack);
-                    popstack(stack);
-                }
-                break;
-
-                case OP_LEFT:
-                case OP_RIGHT:
-                {
-                    // (in size -- out)
-                    if (stack.size() < 2)
-                        return false;
-                    valtype& vch = stacktop(-2);
-                    int nSize = CastToBigNum(stacktop(-1)).getint();
-                    if (nSize < 0)
-                        return false;
-                    if (nSize > (int)vch.size())
-                        nSize = vch.size();
-                    if (opcode == OP_LEFT)
-                        vch.erase(vch.begin() + nSize, vch.end());
-                    else
-                        vch.erase(vch.begin(), vch.end() - nSize);
-                    popstack(stack);
-                }
-                break;
-
                 case OP_SIZE:
                 {
                     // (in -- in size)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn(stacktop(-1).size());
-                    stack.push_back(bn.getvch());
+                    CScriptNum bn(stacktop(-1).size());
+                    pushnum(stack, bn);
                 }
                 break;
 
@@ -735,51 +849,6 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 //
                 // Bitwise logic
                 //
-                case OP_INVERT:
-                {
-                    // (in - out)
-                    if (stack.size() < 1)
-                        return false;
-                    valtype& vch = stacktop(-1);
-                    for (unsigned int i = 0; i < vch.size(); i++)
-                        vch[i] = ~vch[i];
-                }
-                break;
-
-                //
-                // WARNING: These disabled opcodes exhibit unexpected behavior
-                // when used on signed integers due to a bug in MakeSameSize()
-                // [see definition of MakeSameSize() above].
-                //
-                case OP_AND:
-                case OP_OR:
-                case OP_XOR:
-                {
-                    // (x1 x2 - out)
-                    if (stack.size() < 2)
-                        return false;
-                    valtype& vch1 = stacktop(-2);
-                    valtype& vch2 = stacktop(-1);
-                    MakeSameSize(vch1, vch2); // <-- NOT SAFE FOR SIGNED VALUES
-                    if (opcode == OP_AND)
-                    {
-                        for (unsigned int i = 0; i < vch1.size(); i++)
-                            vch1[i] &= vch2[i];
-                    }
-                    else if (opcode == OP_OR)
-                    {
-                        for (unsigned int i = 0; i < vch1.size(); i++)
-                            vch1[i] |= vch2[i];
-                    }
-                    else if (opcode == OP_XOR)
-                    {
-                        for (unsigned int i = 0; i < vch1.size(); i++)
-                            vch1[i] ^= vch2[i];
-                    }
-                    popstack(stack);
-                }
-                break;
-
                 case OP_EQUAL:
                 case OP_EQUALVERIFY:
                 //case OP_NOTEQUAL: // use OP_NUMNOTEQUAL
@@ -787,8 +856,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 - bool)
                     if (stack.size() < 2)
                         return false;
-                    valtype& vch1 = stacktop(-2);
-                    valtype& vch2 = stacktop(-1);
+                    CScriptValue& vch1 = stacktop(-2);
+                    CScriptValue& vch2 = stacktop(-1);
                     bool fEqual = (vch1 == vch2);
                     // OP_NOTEQUAL is disabled because it would be too easy to say
                     // something like n != 1 and have some wiseguy pass in 1 with extra
@@ -814,8 +883,6 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 //
                 case OP_1ADD:
                 case OP_1SUB:
-                case OP_2MUL:
-                case OP_2DIV:
                 case OP_NEGATE:
                 case OP_ABS:
                 case OP_NOT:
@@ -824,31 +891,24 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- out)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn = CastToBigNum(stacktop(-1));
+                    CScriptNum bn(stacktop(-1));
                     switch (opcode)
                     {
-                    case OP_1ADD:       bn += bnOne; break;
-                    case OP_1SUB:       bn -= bnOne; break;
-                    case OP_2MUL:       bn <<= 1; break;
-                    case OP_2DIV:       bn >>= 1; break;
+                    case OP_1ADD:       bn = bn + bnOne; break;
+                    case OP_1SUB:       bn = bn - bnOne; break;
                     case OP_NEGATE:     bn = -bn; break;
                     case OP_ABS:        if (bn < bnZero) bn = -bn; break;
-                    case OP_NOT:        bn = (bn == bnZero); break;
-                    case OP_0NOTEQUAL:  bn = (bn != bnZero); break;
+                    case OP_NOT:        bn = CScriptNum(bn == bnZero); break;
+                    case OP_0NOTEQUAL:  bn = CScriptNum(bn != bnZero); break;
                     default:            assert(!"invalid opcode"); break;
                     }
                     popstack(stack);
-                    stack.push_back(bn.getvch());
+                    pushnum(stack, bn);
                 }
                 break;
 
                 case OP_ADD:
                 case OP_SUB:
-                case OP_MUL:
-                case OP_DIV:
-                case OP_MOD:
-                case OP_LSHIFT:
-                case OP_RSHIFT:
                 case OP_BOOLAND:
                 case OP_BOOLOR:
                 case OP_NUMEQUAL:
@@ -864,9 +924,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- out)
                     if (stack.size() < 2)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-2));
-                    CBigNum bn2 = CastToBigNum(stacktop(-1));
-                    CBigNum bn;
+                    CScriptNum bn1(stacktop(-2));
+                    CScriptNum bn2(stacktop(-1));
+                    CScriptNum bn(0);
                     switch (opcode)
                     {
                     case OP_ADD:
@@ -877,49 +937,22 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         bn = bn1 - bn2;
                         break;
 
-                    case OP_MUL:
-                        if (!BN_mul(&bn, &bn1, &bn2, pctx))
-                            return false;
-                        break;
-
-                    case OP_DIV:
-                        if (!BN_div(&bn, NULL, &bn1, &bn2, pctx))
-                            return false;
-                        break;
-
-                    case OP_MOD:
-                        if (!BN_mod(&bn, &bn1, &bn2, pctx))
-                            return false;
-                        break;
-
-                    case OP_LSHIFT:
-                        if (bn2 < bnZero || bn2 > CBigNum(2048))
-                            return false;
-                        bn = bn1 << bn2.getulong();
-                        break;
-
-                    case OP_RSHIFT:
-                        if (bn2 < bnZero || bn2 > CBigNum(2048))
-                            return false;
-                        bn = bn1 >> bn2.getulong();
-                        break;
-
-                    case OP_BOOLAND:             bn = (bn1 != bnZero && bn2 != bnZero); break;
-                    case OP_BOOLOR:              bn = (bn1 != bnZero || bn2 != bnZero); break;
-                    case OP_NUMEQUAL:            bn = (bn1 == bn2); break;
-                    case OP_NUMEQUALVERIFY:      bn = (bn1 == bn2); break;
-                    case OP_NUMNOTEQUAL:         bn = (bn1 != bn2); break;
-                    case OP_LESSTHAN:            bn = (bn1 < bn2); break;
-                    case OP_GREATERTHAN:         bn = (bn1 > bn2); break;
-                    case OP_LESSTHANOREQUAL:     bn = (bn1 <= bn2); break;
-                    case OP_GREATERTHANOREQUAL:  bn = (bn1 >= bn2); break;
+                    case OP_BOOLAND:             bn = CScriptNum(bn1 != bnZero && bn2 != bnZero); break;
+                    case OP_BOOLOR:              bn = CScriptNum(bn1 != bnZero || bn2 != bnZero); break;
+                    case OP_NUMEQUAL:            bn = CScriptNum(bn1 == bn2); break;
+                    case OP_NUMEQUALVERIFY:      bn = CScriptNum(bn1 == bn2); break;
+                    case OP_NUMNOTEQUAL:         bn = CScriptNum(bn1 != bn2); break;
+                    case OP_LESSTHAN:            bn = CScriptNum(bn1 < bn2); break;
+                    case OP_GREATERTHAN:         bn = CScriptNum(bn1 > bn2); break;
+                    case OP_LESSTHANOREQUAL:     bn = CScriptNum(bn1 <= bn2); break;
+                    case OP_GREATERTHANOREQUAL:  bn = CScriptNum(bn1 >= bn2); break;
                     case OP_MIN:                 bn = (bn1 < bn2 ? bn1 : bn2); break;
                     case OP_MAX:                 bn = (bn1 > bn2 ? bn1 : bn2); break;
                     default:                     assert(!"invalid opcode"); break;
                     }
                     popstack(stack);
                     popstack(stack);
-                    stack.push_back(bn.getvch());
+                    pushnum(stack, bn);
 
                     if (opcode == OP_NUMEQUALVERIFY)
                     {
@@ -936,9 +969,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x min max -- out)
                     if (stack.size() < 3)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-3));
-                    CBigNum bn2 = CastToBigNum(stacktop(-2));
-                    CBigNum bn3 = CastToBigNum(stacktop(-1));
+                    CScriptNum bn1(stacktop(-3));
+                    CScriptNum bn2(stacktop(-2));
+                    CScriptNum bn3(stacktop(-1));
                     bool fValue = (bn2 <= bn1 && bn1 < bn3);
                     popstack(stack);
                     popstack(stack);
@@ -960,26 +993,25 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- hash)
                     if (stack.size() < 1)
                         return false;
-                    valtype& vch = stacktop(-1);
-                    valtype vchHash((opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32);
+                    CScriptValue& vch = stacktop(-1);
+                    CScriptValue vchHash((opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32);
                     if (opcode == OP_RIPEMD160)
-                        RIPEMD160(&vch[0], vch.size(), &vchHash[0]);
+                        RIPEMD160(vch.data(), vch.size(), vchHash.data());
                     else if (opcode == OP_SHA1)
-                        SHA1(&vch[0], vch.size(), &vchHash[0]);
+                        SHA1(vch.data(), vch.size(), vchHash.data());
                     else if (opcode == OP_SHA256)
-                        SHA256(&vch[0], vch.size(), &vchHash[0]);
+                        SHA256(vch.data(), vch.size(), vchHash.data());
                     else if (opcode == OP_HASH160)
                     {
-                        uint160 hash160 = Hash160(vch);
-                        memcpy(&vchHash[0], &hash160, sizeof(hash160));
+                        uint160 hash160 = Hash160(vch.begin(), vch.end());
+                        memcpy(vchHash.data(), &hash160, sizeof(hash160));
                     }
                     else if (opcode == OP_HASH256)
                     {
                         uint256 hash = Hash(vch.begin(), vch.end());
-                        memcpy(&vchHash[0], &hash, sizeof(hash));
+                        memcpy(vchHash.data(), &hash, sizeof(hash));
                     }
-                    popstack(stack);
-                    stack.push_back(vchHash);
+                    vch.swap(vchHash);
                 }
                 break;
 
@@ -993,112 +1025,16 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_CHECKSIG:
                 case OP_CHECKSIGVERIFY:
                 {
-                    // (sig pubkey -- bool)
-                    if (stack.size() < 2)
+                    if (!EvalCheckSig(stack, opcode, pbegincodehash, pend, txTo, nIn, nHashType, psighash))
                         return false;
-
-                    valtype& vchSig    = stacktop(-2);
-                    valtype& vchPubKey = stacktop(-1);
-
-                    ////// debug print
-                    //PrintHex(vchSig.begin(), vchSig.end(), "sig: %s\n");
-                    //PrintHex(vchPubKey.begin(), vchPubKey.end(), "pubkey: %s\n");
-
-                    // Subset of script starting at the most recent codeseparator
-                    CScript scriptCode(pbegincodehash, pend);
-
-                    // Drop the signature, since there's no way for a signature to sign itself
-                    scriptCode.FindAndDelete(CScript(vchSig));
-
-                    bool fSuccess = IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey) &&
-                        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType);
-
-                    popstack(stack);
-                    popstack(stack);
-                    stack.push_back(fSuccess ? vchTrue : vchFalse);
-                    if (opcode == OP_CHECKSIGVERIFY)
-                    {
-                        if (fSuccess)
-                            popstack(stack);
-                        else
-                            return false;
-                    }
                 }
                 break;
 
                 case OP_CHECKMULTISIG:
                 case OP_CHECKMULTISIGVERIFY:
                 {
-                    // ([sig ...] num_of_signatures [pubkey ...] num_of_pubkeys -- bool)
-
-                    int i = 1;
-                    if ((int)stack.size() < i)
-                        return false;
-
-                    int nKeysCount = CastToBigNum(stacktop(-i)).getint();
-                    if (nKeysCount < 0 || nKeysCount > 20)
-                        return false;
-                    nOpCount += nKeysCount;
-                    if (nOpCount > 201)
-                        return false;
-                    int ikey = ++i;
-                    i += nKeysCount;
-                    if ((int)stack.size() < i)
-                        return false;
-
-                    int nSigsCount = CastToBigNum(stacktop(-i)).getint();
-                    if (nSigsCount < 0 || nSigsCount > nKeysCount)
-                        return false;
-                    int isig = ++i;
-                    i += nSigsCount;
-                    if ((int)stack.size() < i)
+                    if (!EvalCheckMultiSig(stack, opcode, pbegincodehash, pend, nOpCount, txTo, nIn, nHashType, psighash))
                         return false;
-
-                    // Subset of script starting at the most recent codeseparator
-                    CScript scriptCode(pbegincodehash, pend);
-
-                    // Drop the signatures, since there's no way for a signature to sign itself
-                    for (int k = 0; k < nSigsCount; k++)
-                    {
-                        valtype& vchSig = stacktop(-isig-k);
-                        scriptCode.FindAndDelete(CScript(vchSig));
-                    }
-
-                    bool fSuccess = true;
-                    while (fSuccess && nSigsCount > 0)
-                    {
-                        valtype& vchSig    = stacktop(-isig);
-                        valtype& vchPubKey = stacktop(-ikey);
-
-                        // Check signature
-                        bool fOk = IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey) &&
-                            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType);
-
-                        if (fOk)
-                        {
-                            isig++;
-                            nSigsCount--;
-                        }
-                        ikey++;
-                        nKeysCount--;
-
-                        // If there are more signatures left than keys left,
-                        // then too many signatures have failed
-                        if (nSigsCount > nKeysCount)
-                            fSuccess = false;
-                    }
-
-                    while (i-- > 0)
-                        popstack(stack);
-                    stack.push_back(fSuccess ? vchTrue : vchFalse);
-
-                    if (opcode == OP_CHECKMULTISIGVERIFY)
-                    {
-                        if (fSuccess)
-                            popstack(stack);
-                        else
-                            return false;
-                    }
                 }
                 break;
 
@@ -1123,6 +1059,20 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
     return true;
 }
 
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType,
+                const CSignatureHashContext* psighash)
+{
+    CScriptStack stackEval;
+    stackEval.reserve(stack.size());
+    for (const valtype& vch : stack)
+        stackEval.push_back(CScriptValue(vch.begin(), vch.end()));
+    bool fResult = EvalScript(stackEval, script, txTo, nIn, nHashType, psighash);
+    stack.clear();
+    for (const CScriptValue& vch : stackEval)
+        stack.push_back(valtype(vch.begin(), vch.end()));
+    return fResult;
+}
+
 
 
 
@@ -1193,87 +1143,245 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
     return Hash(ss.begin(), ss.end());
 }
 
+CSignatureHashContext::CSignatureHashContext(const CTransaction& txTo) : ptxTo(&txTo)
+{
+    // Everything SignatureHash serializes ahead of the first input
+    CDataStream ss(SER_GETHASH, 0);
+    ss << txTo.nVersion << txTo.nTime;
+    WriteCompactSize(ss, txTo.vin.size());
+
+    CDataStream ssInputs(SER_GETHASH, 0);
+    for (const CTxIn& txin : txTo.vin)
+        ssInputs << txin.prevout << CScript() << txin.nSequence;
+    vchInputs.assign(ssInputs.begin(), ssInputs.end());
+    nInputSize = txTo.vin.empty() ? 0 : vchInputs.size() / txTo.vin.size();
+
+    CDataStream ssTail(SER_GETHASH, 0);
+    ssTail << txTo.vout << txTo.nLockTime;
+    vchTail.assign(ssTail.begin(), ssTail.end());
+
+    vMidstate.resize(txTo.vin.size());
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, &ss[0], ss.size());
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+    {
+        vMidstate[i] = ctx;
+        SHA256_Update(&ctx, &vchInputs[i * nInputSize], nInputSize);
+    }
+}
+
+uint256 CSignatureHashContext::SignatureHash(const CScript& scriptCode, unsigned int nIn, int nHashType) const
+{
+    if (nIn >= ptxTo->vin.size() || (nHashType & 0x1f) == SIGHASH_NONE || (nHashType & 0x1f) == SIGHASH_SINGLE || (nHashType & SIGHASH_ANYONECANPAY))
+        return ::SignatureHash(scriptCode, *ptxTo, nIn, nHashType);
+
+    CScript scriptCodeTmp(scriptCode);
+    scriptCodeTmp.FindAndDelete(CScript(OP_CODESEPARATOR));
+
+    CDataStream ss(SER_GETHASH, 0);
+    ss << ptxTo->vin[nIn].prevout << scriptCodeTmp << ptxTo->vin[nIn].nSequence;
+    CDataStream ssType(SER_GETHASH, 0);
+    ssType << nHashType;
+
+    SHA256_CTX ctx = vMidstate[nIn];
+    SHA256_Update(&ctx, &ss[0], ss.size());
+    SHA256_Update(&ctx, vchInputs.data() + (nIn + 1) * nInputSize, (ptxTo->vin.size() - nIn - 1) * nInputSize);
+    SHA256_Update(&ctx, vchTail.data(), vchTail.size());
+    SHA256_Update(&ctx, &ssType[0], ssType.size());
+
+    uint256 hash1;
+    SHA256_Final((unsigned char*)&hash1, &ctx);
+    uint256 hash2;
+    SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+    return hash2;
+}
+
 
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
+//
+// An entry is a salted SHA256 of (signature hash, signature, public key),
+// stored in fixed-size open-addressing tables. The tables are split over
+// independently locked shards so that parallel script check threads rarely
+// wait on each other, and the total size is bounded by -sigcachemaxmb.
 
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, std::vector<unsigned char> > sigdata_type;
-    std::set< sigdata_type> setValid;
-    CCriticalSection cs_sigcache;
+    static const unsigned int nShards = 16;
+    // slots inspected for a given entry before one of them is evicted
+    static const unsigned int nMaxProbe = 8;
+
+    struct CShard
+    {
+        CCriticalSection cs;
+        std::vector<uint256> vSlots; // 0 marks an empty slot
+        uint64_t nMask;
+        uint64_t nUsed;
+        uint64_t nHits;
+        uint64_t nMisses;
+        uint64_t nEvictions;
+
+        CShard() : nMask(0), nUsed(0), nHits(0), nMisses(0), nEvictions(0) {}
+    };
+
+    // Random per-process salt, so that nobody can pre-compute entries that
+    // collide in the same slots of our tables
+    uint256 salt;
+    CShard shards[nShards];
+
+    uint256 ComputeEntry(const uint256& hash, const CScriptValue& vchSig, const CScriptValue& pubKey) const
+    {
+        uint256 entry;
+        SHA256_CTX ctx;
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, salt.begin(), sizeof(salt));
+        SHA256_Update(&ctx, hash.begin(), sizeof(hash));
+        if (!vchSig.empty())
+            SHA256_Update(&ctx, &vchSig[0], vchSig.size());
+        if (!pubKey.empty())
+            SHA256_Update(&ctx, &pubKey[0], pubKey.size());
+        SHA256_Final(entry.begin(), &ctx);
+        if (entry == 0)
+            entry = 1; // keep the empty marker free
+        return entry;
+    }
+
+    CShard& ShardFor(const uint256& entry)
+    {
+        return shards[entry.Get64(0) % nShards];
+    }
 
 public:
+    CSignatureCache()
+    {
+        salt = GetRandHash();
+
+        // Each shard gets a power-of-two number of slots within its share
+        // of the byte budget; 0 disables the cache.
+        int64_t nMaxBytes = GetArg("-sigcachemaxmb", DEFAULT_SIGCACHE_MAXMB) * 1048576;
+        uint64_t nSlots = 0;
+        if (nMaxBytes >= (int64_t)(sizeof(uint256) * nShards))
+        {
+            nSlots = 1;
+            while (nSlots * 2 * sizeof(uint256) * nShards <= (uint64_t)nMaxBytes)
+                nSlots *= 2;
+        }
+        for (unsigned int i = 0; i < nShards; i++)
+        {
+            shards[i].vSlots.assign(nSlots, uint256());
+            shards[i].nMask = nSlots ? nSlots - 1 : 0;
+        }
+    }
+
     bool
-    Get(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
+    Get(uint256 hash, const CScriptValue& vchSig, const CScriptValue& pubKey)
     {
-        LOCK(cs_sigcache);
+        uint256 entry = ComputeEntry(hash, vchSig, pubKey);
+        CShard& shard = ShardFor(entry);
+        uint64_t nSlot = entry.Get64(1);
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+        LOCK(shard.cs);
+        if (!shard.vSlots.empty())
+        {
+            for (unsigned int i = 0; i < nMaxProbe; i++)
+            {
+                const uint256& slot = shard.vSlots[(nSlot + i) & shard.nMask];
+                if (slot == entry)
+                {
+                    shard.nHits++;
+                    return true;
+                }
+                // entries are only ever replaced, never removed, so the probe
+                // sequence of a cached entry can not cross an empty slot
+                if (slot == 0)
+                    break;
+            }
+        }
+        shard.nMisses++;
         return false;
     }
 
-    void Set(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
+    void Set(uint256 hash, const CScriptValue& vchSig, const CScriptValue& pubKey)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+        uint256 entry = ComputeEntry(hash, vchSig, pubKey);
+        CShard& shard = ShardFor(entry);
+        uint64_t nSlot = entry.Get64(1);
+
+        LOCK(shard.cs);
+        if (shard.vSlots.empty())
+            return;
+        for (unsigned int i = 0; i < nMaxProbe; i++)
+        {
+            uint256& slot = shard.vSlots[(nSlot + i) & shard.nMask];
+            if (slot == entry)
+                return;
+            if (slot == 0)
+            {
+                slot = entry;
+                shard.nUsed++;
+                return;
+            }
+        }
 
-        LOCK(cs_sigcache);
+        // All candidate slots are taken: replace one of them. Which one is
+        // picked by salted bits of the new entry, which an attacker can't
+        // predict, so pre-generated signatures can't be used to pin or
+        // flush particular entries.
+        shard.vSlots[(nSlot + entry.Get64(2) % nMaxProbe) & shard.nMask] = entry;
+        shard.nEvictions++;
+    }
 
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
+    void GetStats(CSignatureCacheStats& stats)
+    {
+        stats = CSignatureCacheStats();
+        for (unsigned int i = 0; i < nShards; i++)
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            CShard& shard = shards[i];
+            LOCK(shard.cs);
+            stats.nEntries += shard.nUsed;
+            stats.nMaxEntries += shard.vSlots.size();
+            stats.nHits += shard.nHits;
+            stats.nMisses += shard.nMisses;
+            stats.nEvictions += shard.nEvictions;
         }
-
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        stats.nBytes = stats.nMaxEntries * sizeof(uint256);
     }
 };
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType)
+static CSignatureCache& GetSignatureCache()
 {
     static CSignatureCache signatureCache;
+    return signatureCache;
+}
+
+void GetSignatureCacheStats(CSignatureCacheStats& stats)
+{
+    GetSignatureCache().GetStats(stats);
+}
+
+bool CheckSig(const CScriptValue& vchSigIn, const CScriptValue& vchPubKey, const CScript& scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashContext* psighash)
+{
+    CSignatureCache& signatureCache = GetSignatureCache();
 
     // Hash type is one byte tacked on to the end of the signature
-    if (vchSig.empty())
+    if (vchSigIn.empty())
         return false;
     if (nHashType == 0)
-        nHashType = vchSig.back();
-    else if (nHashType != vchSig.back())
+        nHashType = vchSigIn.back();
+    else if (nHashType != vchSigIn.back())
         return false;
-    vchSig.pop_back();
+    CScriptValue vchSig(vchSigIn.begin(), vchSigIn.end() - 1);
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash = psighash ? psighash->SignatureHash(scriptCode, nIn, nHashType) : SignatureHash(scriptCode, txTo, nIn, nHashType);
 
     if (signatureCache.Get(sighash, vchSig, vchPubKey))
         return true;
 
-    CKey key;
-    if (!key.SetPubKey(vchPubKey))
-        return false;
-
-    if (!key.Verify(sighash, vchSig))
+    if (!CPubKey(valtype(vchPubKey.begin(), vchPubKey.end())).Verify(sighash, valtype(vchSig.begin(), vchSig.end())))
         return false;
 
     signatureCache.Set(sighash, vchSig, vchPubKey);
@@ -1679,15 +1787,15 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, vecto
 }
 
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  int nHashType)
+                  int nHashType, const CSignatureHashContext* psighash)
 {
-    vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, nHashType))
+    CScriptStack stack, stackCopy;
+    if (!EvalScript(stack, scriptSig, txTo, nIn, nHashType, psighash))
         return false;
 
     stackCopy = stack;
 
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, nHashType))
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, nHashType, psighash))
         return false;
     if (stack.empty())
         return false;
@@ -1701,11 +1809,11 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         if (!scriptSig.IsPushOnly()) // scriptSig must be literals-only
             return false;            // or validation fails
 
-        const valtype& pubKeySerialized = stackCopy.back();
+        const CScriptValue& pubKeySerialized = stackCopy.back();
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, nHashType))
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, nHashType, psighash))
             return false;
         if (stackCopy.empty())
             return false;
@@ -1762,7 +1870,8 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTrans
     return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType);
 }
 
-bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, int nHashType)
+bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, int nHashType,
+                     const CSignatureHashContext* psighash)
 {
     assert(nIn < txTo.vin.size());
     const CTxIn& txin = txTo.vin[nIn];
@@ -1773,7 +1882,7 @@ bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsig
     if (txin.prevout.hash != txFrom.GetHash())
         return false;
 
-    return VerifyScript(txin.scriptSig, txout.scriptPubKey, txTo, nIn, nHashType);
+    return VerifyScript(txin.scriptSig, txout.scriptPubKey, txTo, nIn, nHashType, psighash);
 }
 
 static CScript PushAll(const vector<valtype>& values)
@@ -1814,7 +1923,7 @@ static CScript CombineMultisig(CScript scriptPubKey, const CTransaction& txTo, u
             if (sigs.count(pubkey))
                 continue; // Already got a sig for this pubkey
 
-            if (CheckSig(sig, pubkey, scriptPubKey, txTo, nIn, 0))
+            if (CheckSig(CScriptValue(sig.begin(), sig.end()), CScriptValue(pubkey.begin(), pubkey.end()), scriptPubKey, txTo, nIn, 0))
             {
                 sigs[pubkey] = sig;
                 break;
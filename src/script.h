@@ -6,6 +6,8 @@
 #ifndef H_BITCOIN_SCRIPT
 #define H_BITCOIN_SCRIPT
 
+#include <limits>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -13,8 +15,11 @@
 
 #include <boost/variant.hpp>
 
+#include <openssl/sha.h>
+
 #include "keystore.h"
 #include "bignum.h"
+#include "smallvector.h"
 
 typedef std::vector<unsigned char> valtype;
 
@@ -207,6 +212,112 @@ enum opcodetype
 const char* GetOpName(opcodetype opcode);
 
 
+/** An element of the script interpreter's stack. Signatures, public keys
+ *  and hashes fit without a heap allocation; longer pushes, like P2SH
+ *  redeem scripts, spill over to the heap.
+ */
+typedef small_vector<80, unsigned char> CScriptValue;
+typedef std::vector<CScriptValue> CScriptStack;
+
+class scriptnum_error : public std::runtime_error
+{
+public:
+    explicit scriptnum_error(const std::string& str) : std::runtime_error(str) {}
+};
+
+/** A number on the script stack: little endian magnitude with the sign in
+ *  the top bit of the last byte, as CBigNum reads and writes it. Operands
+ *  are at most 4 bytes, so everything the interpreter computes from them
+ *  fits an int64_t, and the results are the ones CBigNum would give.
+ */
+class CScriptNum
+{
+private:
+    int64_t nValue;
+
+    template<typename V>
+    void setvch(const V& vch, size_t nMaxNumSize)
+    {
+        if (vch.size() > nMaxNumSize)
+            throw scriptnum_error("CScriptNum() : overflow");
+        nValue = 0;
+        if (vch.empty())
+            return;
+        for (size_t i = 0; i < vch.size(); i++)
+            nValue |= (int64_t)vch[i] << (8 * i);
+        // The top bit of the last byte is the sign, and can make negative zero
+        if (vch.back() & 0x80)
+            nValue = -(nValue & ~((int64_t)0x80 << (8 * (vch.size() - 1))));
+    }
+
+public:
+    static const size_t nDefaultMaxNumSize = 4;
+
+    explicit CScriptNum(int64_t n) : nValue(n) {}
+
+    explicit CScriptNum(const std::vector<unsigned char>& vch, size_t nMaxNumSize = nDefaultMaxNumSize)
+    {
+        setvch(vch, nMaxNumSize);
+    }
+
+    explicit CScriptNum(const CScriptValue& vch, size_t nMaxNumSize = nDefaultMaxNumSize)
+    {
+        setvch(vch, nMaxNumSize);
+    }
+
+    friend bool operator==(const CScriptNum& a, const CScriptNum& b) { return a.nValue == b.nValue; }
+    friend bool operator!=(const CScriptNum& a, const CScriptNum& b) { return a.nValue != b.nValue; }
+    friend bool operator<(const CScriptNum& a, const CScriptNum& b)  { return a.nValue < b.nValue; }
+    friend bool operator>(const CScriptNum& a, const CScriptNum& b)  { return a.nValue > b.nValue; }
+    friend bool operator<=(const CScriptNum& a, const CScriptNum& b) { return a.nValue <= b.nValue; }
+    friend bool operator>=(const CScriptNum& a, const CScriptNum& b) { return a.nValue >= b.nValue; }
+
+    friend CScriptNum operator+(const CScriptNum& a, const CScriptNum& b) { return CScriptNum(a.nValue + b.nValue); }
+    friend CScriptNum operator-(const CScriptNum& a, const CScriptNum& b) { return CScriptNum(a.nValue - b.nValue); }
+    CScriptNum operator-() const { return CScriptNum(-nValue); }
+
+    int64_t getint64() const { return nValue; }
+
+    // Clamped to the int range like CBigNum::getint
+    int getint() const
+    {
+        if (nValue > std::numeric_limits<int>::max())
+            return std::numeric_limits<int>::max();
+        if (nValue < std::numeric_limits<int>::min())
+            return std::numeric_limits<int>::min();
+        return (int)nValue;
+    }
+
+    // Shortest encoding, empty for zero
+    template<typename V>
+    void getvch(V& vch) const
+    {
+        vch.clear();
+        if (nValue == 0)
+            return;
+        bool fNegative = nValue < 0;
+        uint64_t n = fNegative ? -(uint64_t)nValue : nValue;
+        while (n)
+        {
+            vch.push_back(n & 0xff);
+            n >>= 8;
+        }
+        // A top byte with its high bit set needs another byte for the sign
+        if (vch.back() & 0x80)
+            vch.push_back(fNegative ? 0x80 : 0);
+        else if (fNegative)
+            vch.back() |= 0x80;
+    }
+
+    std::vector<unsigned char> getvch() const
+    {
+        std::vector<unsigned char> vch;
+        getvch(vch);
+        return vch;
+    }
+};
+
+
 
 inline std::string ValueString(const std::vector<unsigned char>& vch)
 {
@@ -267,6 +378,34 @@ protected:
         return *this;
     }
 
+    template<typename V>
+    CScript& push_data(const V& b)
+    {
+        if (b.size() < OP_PUSHDATA1)
+        {
+            insert(end(), (unsigned char)b.size());
+        }
+        else if (b.size() <= 0xff)
+        {
+            insert(end(), OP_PUSHDATA1);
+            insert(end(), (unsigned char)b.size());
+        }
+        else if (b.size() <= 0xffff)
+        {
+            insert(end(), OP_PUSHDATA2);
+            unsigned short nSize = b.size();
+            insert(end(), (unsigned char*)&nSize, (unsigned char*)&nSize + sizeof(nSize));
+        }
+        else
+        {
+            insert(end(), OP_PUSHDATA4);
+            unsigned int nSize = b.size();
+            insert(end(), (unsigned char*)&nSize, (unsigned char*)&nSize + sizeof(nSize));
+        }
+        insert(end(), b.begin(), b.end());
+        return *this;
+    }
+
 public:
     CScript() { }
     CScript(const CScript& b) : std::vector<unsigned char>(b.begin(), b.end()) { }
@@ -305,6 +444,7 @@ public:
     explicit CScript(const uint256& b) { operator<<(b); }
     explicit CScript(const CBigNum& b) { operator<<(b); }
     explicit CScript(const std::vector<unsigned char>& b) { operator<<(b); }
+    explicit CScript(const CScriptValue& b) { operator<<(b); }
 
 
     //CScript& operator<<(char b) is not portable.  Use 'signed char' or 'unsigned char'.
@@ -355,29 +495,12 @@ public:
 
     CScript& operator<<(const std::vector<unsigned char>& b)
     {
-        if (b.size() < OP_PUSHDATA1)
-        {
-            insert(end(), (unsigned char)b.size());
-        }
-        else if (b.size() <= 0xff)
-        {
-            insert(end(), OP_PUSHDATA1);
-            insert(end(), (unsigned char)b.size());
-        }
-        else if (b.size() <= 0xffff)
-        {
-            insert(end(), OP_PUSHDATA2);
-            unsigned short nSize = b.size();
-            insert(end(), (unsigned char*)&nSize, (unsigned char*)&nSize + sizeof(nSize));
-        }
-        else
-        {
-            insert(end(), OP_PUSHDATA4);
-            unsigned int nSize = b.size();
-            insert(end(), (unsigned char*)&nSize, (unsigned char*)&nSize + sizeof(nSize));
-        }
-        insert(end(), b.begin(), b.end());
-        return *this;
+        return push_data(b);
+    }
+
+    CScript& operator<<(const CScriptValue& b)
+    {
+        return push_data(b);
     }
 
     // WARNING this commented because operator << used in xbridge code (atomic crosschain)
@@ -592,7 +715,37 @@ public:
 
 
 
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType);
+/** The parts of a transaction that the SIGHASH_ALL signature hashes of all
+ *  its inputs share: every input with its script blanked, the outputs, and
+ *  SHA-256 midstates over the inputs ahead of each one. Hashing an input
+ *  then only covers that input's script and the inputs after it, instead of
+ *  copying and serializing the whole transaction. The hashes are the same
+ *  as SignatureHash gives; other hash types are passed on to it. Read only
+ *  once built, so script check threads can share it.
+ */
+class CSignatureHashContext
+{
+private:
+    const CTransaction* ptxTo;
+    unsigned int nInputSize;
+    std::vector<unsigned char> vchInputs;
+    std::vector<unsigned char> vchTail;
+    std::vector<SHA256_CTX> vMidstate;
+
+public:
+    explicit CSignatureHashContext(const CTransaction& txTo);
+
+    uint256 SignatureHash(const CScript& scriptCode, unsigned int nIn, int nHashType) const;
+};
+
+bool IsCanonicalPubKey(const CScriptValue& vchPubKey);
+bool IsCanonicalSignature(const CScriptValue& vchSig);
+bool CheckSig(const CScriptValue& vchSig, const CScriptValue& vchPubKey, const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn,
+              int nHashType, const CSignatureHashContext* psighash=NULL);
+bool EvalScript(CScriptStack& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType,
+                const CSignatureHashContext* psighash=NULL);
+bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType,
+                const CSignatureHashContext* psighash=NULL);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey);
@@ -604,8 +757,27 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::
 bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  int nHashType);
-bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, int nHashType);
+                  int nHashType, const CSignatureHashContext* psighash=NULL);
+bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, int nHashType,
+                     const CSignatureHashContext* psighash=NULL);
+
+/** Default -sigcachemaxmb: memory budget of the valid signature cache */
+static const int64_t DEFAULT_SIGCACHE_MAXMB = 32;
+
+/** Usage counters of the valid signature cache */
+struct CSignatureCacheStats
+{
+    uint64_t nEntries;
+    uint64_t nMaxEntries;
+    uint64_t nBytes;
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nEvictions;
+
+    CSignatureCacheStats() : nEntries(0), nMaxEntries(0), nBytes(0), nHits(0), nMisses(0), nEvictions(0) {}
+};
+
+void GetSignatureCacheStats(CSignatureCacheStats& stats);
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
@@ -1135,4 +1135,52 @@ public:
     }
 };
 
+/** Read-only stream over memory owned by someone else, such as a mapped
+ *  block file. Objects are unserialized straight from that memory instead
+ *  of being copied into a CDataStream or read through a FILE first.
+ */
+class CSpanReader
+{
+private:
+    const char* pcur;
+    const char* pend;
+
+public:
+    int nType;
+    int nVersion;
+
+    CSpanReader(const char* pbeginIn, const char* pendIn, int nTypeIn, int nVersionIn)
+    {
+        pcur = pbeginIn;
+        pend = pendIn;
+        nType = nTypeIn;
+        nVersion = nVersionIn;
+    }
+
+    void SetType(int n)          { nType = n; }
+    int GetType()                { return nType; }
+    void SetVersion(int n)       { nVersion = n; }
+    int GetVersion()             { return nVersion; }
+
+    size_t size() const          { return pend - pcur; }
+    bool empty() const           { return pcur == pend; }
+
+    CSpanReader& read(char* pch, size_t nSize)
+    {
+        if (nSize > (size_t)(pend - pcur))
+            throw std::ios_base::failure("CSpanReader::read : end of data");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    CSpanReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 #endif
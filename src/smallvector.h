@@ -0,0 +1,219 @@
+// Copyright (c) 2014 The Blocknet developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_SMALLVECTOR_H
+#define BITCOIN_SMALLVECTOR_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <new>
+
+/** A vector that keeps up to N elements inside the object and only goes to
+ *  the heap beyond that. Elements are copied with memcpy, so T must be
+ *  trivially copyable. Iterators are plain pointers and are invalidated by
+ *  anything that changes the size, like std::vector's.
+ */
+template<unsigned int N, typename T>
+class small_vector
+{
+public:
+    typedef T value_type;
+    typedef unsigned int size_type;
+    typedef T* iterator;
+    typedef const T* const_iterator;
+
+private:
+    size_type nSize;
+    size_type nCapacity; // N while the elements are held inline
+    union
+    {
+        T direct[N];
+        T* indirect;
+    };
+
+    bool is_direct() const { return nCapacity <= N; }
+
+    void change_capacity(size_type nNewCapacity)
+    {
+        if (nNewCapacity <= N)
+        {
+            if (!is_direct())
+            {
+                T* p = indirect;
+                memcpy(direct, p, nSize * sizeof(T));
+                free(p);
+                nCapacity = N;
+            }
+        }
+        else if (nNewCapacity != nCapacity)
+        {
+            T* p = (T*)(is_direct() ? malloc(nNewCapacity * sizeof(T)) : realloc(indirect, nNewCapacity * sizeof(T)));
+            if (p == NULL)
+                throw std::bad_alloc();
+            if (is_direct())
+                memcpy(p, direct, nSize * sizeof(T));
+            indirect = p;
+            nCapacity = nNewCapacity;
+        }
+    }
+
+    // Make room for at least n elements, growing geometrically
+    void grow(size_type n)
+    {
+        if (n > nCapacity)
+            change_capacity(std::max(n, nCapacity + nCapacity / 2));
+    }
+
+public:
+    small_vector() : nSize(0), nCapacity(N) {}
+
+    explicit small_vector(size_type n) : nSize(0), nCapacity(N)
+    {
+        resize(n);
+    }
+
+    template<typename InputIterator>
+    small_vector(InputIterator first, InputIterator last) : nSize(0), nCapacity(N)
+    {
+        assign(first, last);
+    }
+
+    small_vector(const small_vector& other) : nSize(0), nCapacity(N)
+    {
+        assign(other.begin(), other.end());
+    }
+
+    small_vector(small_vector&& other) noexcept : nSize(other.nSize), nCapacity(other.nCapacity)
+    {
+        if (is_direct())
+            memcpy(direct, other.direct, nSize * sizeof(T));
+        else
+            indirect = other.indirect;
+        other.nSize = 0;
+        other.nCapacity = N;
+    }
+
+    ~small_vector()
+    {
+        if (!is_direct())
+            free(indirect);
+    }
+
+    small_vector& operator=(const small_vector& other)
+    {
+        if (&other != this)
+            assign(other.begin(), other.end());
+        return *this;
+    }
+
+    small_vector& operator=(small_vector&& other) noexcept
+    {
+        swap(other);
+        return *this;
+    }
+
+    template<typename InputIterator>
+    void assign(InputIterator first, InputIterator last)
+    {
+        clear();
+        insert(end(), first, last);
+    }
+
+    size_type size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+    size_type capacity() const { return nCapacity; }
+
+    T* data() { return is_direct() ? direct : indirect; }
+    const T* data() const { return is_direct() ? direct : indirect; }
+
+    iterator begin() { return data(); }
+    const_iterator begin() const { return data(); }
+    iterator end() { return data() + nSize; }
+    const_iterator end() const { return data() + nSize; }
+
+    T& operator[](size_type pos) { return data()[pos]; }
+    const T& operator[](size_type pos) const { return data()[pos]; }
+    T& back() { return data()[nSize - 1]; }
+    const T& back() const { return data()[nSize - 1]; }
+
+    void reserve(size_type n)
+    {
+        if (n > nCapacity)
+            change_capacity(n);
+    }
+
+    void resize(size_type n)
+    {
+        grow(n);
+        if (n > nSize)
+            std::fill(data() + nSize, data() + n, T());
+        nSize = n;
+    }
+
+    void clear() { nSize = 0; }
+
+    void push_back(const T& value)
+    {
+        grow(nSize + 1);
+        data()[nSize++] = value;
+    }
+
+    void pop_back() { nSize--; }
+
+    template<typename InputIterator>
+    iterator insert(iterator pos, InputIterator first, InputIterator last)
+    {
+        size_type nPos = pos - begin();
+        size_type nCount = std::distance(first, last);
+        grow(nSize + nCount);
+        T* p = data() + nPos;
+        memmove(p + nCount, p, (nSize - nPos) * sizeof(T));
+        std::copy(first, last, p);
+        nSize += nCount;
+        return p;
+    }
+
+    iterator erase(iterator first, iterator last)
+    {
+        memmove(first, last, (end() - last) * sizeof(T));
+        nSize -= last - first;
+        return first;
+    }
+
+    void swap(small_vector& other)
+    {
+        // Inline elements and the heap pointer share the storage, so
+        // swapping all of its bytes covers every combination
+        const size_t nBytes = sizeof(direct) > sizeof(indirect) ? sizeof(direct) : sizeof(indirect);
+        unsigned char tmp[nBytes];
+        memcpy(tmp, (void*)direct, nBytes);
+        memcpy((void*)direct, (void*)other.direct, nBytes);
+        memcpy((void*)other.direct, tmp, nBytes);
+        std::swap(nSize, other.nSize);
+        std::swap(nCapacity, other.nCapacity);
+    }
+
+    friend void swap(small_vector& a, small_vector& b)
+    {
+        a.swap(b);
+    }
+
+    friend bool operator==(const small_vector& a, const small_vector& b)
+    {
+        return a.nSize == b.nSize && std::equal(a.begin(), a.end(), b.begin());
+    }
+
+    friend bool operator!=(const small_vector& a, const small_vector& b)
+    {
+        return !(a == b);
+    }
+
+    friend bool operator<(const small_vector& a, const small_vector& b)
+    {
+        return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end());
+    }
+};
+
+#endif
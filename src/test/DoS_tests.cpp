@@ -298,15 +298,20 @@ BOOST_AUTO_TEST_CASE(DoS_checkSig)
     BOOST_CHECK(!VerifySignature(orphans[1], tx, 1, true, SIGHASH_ALL));
     std::swap(tx.vin[0].scriptSig, tx.vin[1].scriptSig);
 
-    // Exercise -maxsigcachesize code:
-    mapArgs["-maxsigcachesize"] = "10";
-    // Generate a new, different signature for vin[0] to trigger cache clear:
+    // Exercise the cache counters:
+    CSignatureCacheStats statsBefore, statsAfter;
+    GetSignatureCacheStats(statsBefore);
+    // Generate a new, different signature for vin[0], which must miss the cache
+    // while the signatures of the other inputs hit it:
     CScript oldSig = tx.vin[0].scriptSig;
     BOOST_CHECK(SignSignature(keystore, orphans[0], tx, 0));
     BOOST_CHECK(tx.vin[0].scriptSig != oldSig);
     for (unsigned int j = 0; j < tx.vin.size(); j++)
         BOOST_CHECK(VerifySignature(orphans[j], tx, j, true, SIGHASH_ALL));
-    mapArgs.erase("-maxsigcachesize");
+    GetSignatureCacheStats(statsAfter);
+    BOOST_CHECK(statsAfter.nMisses > statsBefore.nMisses);
+    BOOST_CHECK(statsAfter.nHits > statsBefore.nHits);
+    BOOST_CHECK(statsAfter.nEntries <= statsAfter.nMaxEntries);
 
     LimitOrphanTxSize(0);
 }
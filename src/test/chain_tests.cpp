@@ -0,0 +1,119 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(chain_tests)
+
+// Link nBlocks new indexes onto pindexPrev, hashing them by a counter
+static void BuildChain(vector<CBlockIndex>& vBlocks, vector<uint256>& vHashes, CBlockIndex* pindexPrev)
+{
+    for (unsigned int i = 0; i < vBlocks.size(); i++)
+    {
+        vBlocks[i].pprev = pindexPrev;
+        vBlocks[i].nHeight = pindexPrev ? pindexPrev->nHeight + 1 : 0;
+        vBlocks[i].phashBlock = &vHashes[i];
+        pindexPrev = &vBlocks[i];
+    }
+}
+
+// The locator CBlockLocator::Set built by walking pprev
+static vector<uint256> WalkLocator(const CBlockIndex* pindex)
+{
+    vector<uint256> vHave;
+    int nStep = 1;
+    while (pindex)
+    {
+        vHave.push_back(pindex->GetBlockHash());
+        for (int i = 0; pindex && i < nStep; i++)
+            pindex = pindex->pprev;
+        if (vHave.size() > 10)
+            nStep *= 2;
+    }
+    vHave.push_back(!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet);
+    return vHave;
+}
+
+class CTestLocator : public CBlockLocator
+{
+public:
+    explicit CTestLocator(const CBlockIndex* pindex) : CBlockLocator(pindex) {}
+    const vector<uint256>& Have() const { return vHave; }
+};
+
+BOOST_AUTO_TEST_CASE(chain_height_lookup)
+{
+    vector<uint256> vHashes(2000), vBranchHashes(500);
+    for (unsigned int i = 0; i < vHashes.size(); i++)
+        vHashes[i] = i + 1;
+    for (unsigned int i = 0; i < vBranchHashes.size(); i++)
+        vBranchHashes[i] = i + 1000000;
+
+    vector<CBlockIndex> vMain(2000);
+    BuildChain(vMain, vHashes, NULL);
+    vector<CBlockIndex> vBranch(500);
+    BuildChain(vBranch, vBranchHashes, &vMain[1700]);
+
+    CChain chain;
+    BOOST_CHECK(chain.Tip() == NULL);
+    BOOST_CHECK_EQUAL(chain.Height(), -1);
+
+    chain.SetTip(&vMain.back());
+    BOOST_CHECK(chain.Genesis() == &vMain[0]);
+    BOOST_CHECK(chain.Tip() == &vMain.back());
+    BOOST_CHECK_EQUAL(chain.Height(), 1999);
+    for (unsigned int i = 0; i < vMain.size(); i++)
+        BOOST_CHECK(chain[i] == &vMain[i]);
+    BOOST_CHECK(chain[-1] == NULL);
+    BOOST_CHECK(chain[2000] == NULL);
+    BOOST_CHECK(chain.Next(&vMain[5]) == &vMain[6]);
+    BOOST_CHECK(chain.Next(&vMain.back()) == NULL);
+    BOOST_CHECK(!chain.Contains(&vBranch[0]));
+    BOOST_CHECK(chain.FindFork(&vBranch.back()) == &vMain[1700]);
+    BOOST_CHECK(chain.FindFork(&vMain[42]) == &vMain[42]);
+
+    // Reorganize onto the longer branch, then back to a shorter main chain
+    chain.SetTip(&vBranch.back());
+    BOOST_CHECK_EQUAL(chain.Height(), 2200);
+    BOOST_CHECK(chain[1700] == &vMain[1700]);
+    BOOST_CHECK(chain[1701] == &vBranch[0]);
+    BOOST_CHECK(!chain.Contains(&vMain[1701]));
+    BOOST_CHECK(chain.FindFork(&vMain[1900]) == &vMain[1700]);
+
+    chain.SetTip(&vMain[1800]);
+    BOOST_CHECK_EQUAL(chain.Height(), 1800);
+    BOOST_CHECK(chain[1701] == &vMain[1701]);
+    BOOST_CHECK(!chain.Contains(&vBranch[0]));
+
+    chain.SetTip(NULL);
+    BOOST_CHECK(chain.Tip() == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(chain_locator)
+{
+    vector<uint256> vHashes(1000), vBranchHashes(100);
+    for (unsigned int i = 0; i < vHashes.size(); i++)
+        vHashes[i] = i + 1;
+    for (unsigned int i = 0; i < vBranchHashes.size(); i++)
+        vBranchHashes[i] = i + 1000000;
+
+    vector<CBlockIndex> vMain(1000);
+    BuildChain(vMain, vHashes, NULL);
+    vector<CBlockIndex> vBranch(100);
+    BuildChain(vBranch, vBranchHashes, &vMain[950]);
+
+    CChain chainSave = chainActive;
+    chainActive.SetTip(&vMain.back());
+
+    // Locators from the best chain, from a side branch, and from genesis
+    // match the ones walked through pprev
+    BOOST_CHECK(CTestLocator(&vMain.back()).Have() == WalkLocator(&vMain.back()));
+    BOOST_CHECK(CTestLocator(&vMain[500]).Have() == WalkLocator(&vMain[500]));
+    BOOST_CHECK(CTestLocator(&vBranch.back()).Have() == WalkLocator(&vBranch.back()));
+    BOOST_CHECK(CTestLocator(&vMain[0]).Have() == WalkLocator(&vMain[0]));
+
+    chainActive = chainSave;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,142 @@
+#include <boost/test/unit_test.hpp>
+
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include <openssl/ecdsa.h>
+#include <openssl/sha.h>
+
+#include "ecdsa.h"
+#include "key.h"
+#include "util.h"
+
+using namespace std;
+
+// The native code is checked against OpenSSL directly, since CKey itself
+// calls into it when built with USE_NATIVE_ECDSA
+
+static bool OpenSSLVerify(CKey& key, const uint256& hash, const vector<unsigned char>& vchSig)
+{
+    return vchSig.size() && ECDSA_verify(0, (const unsigned char*)&hash, sizeof(hash), &vchSig[0], vchSig.size(), key.GetECKey()) == 1;
+}
+
+static vector<unsigned char> OpenSSLSign(CKey& key, const uint256& hash)
+{
+    vector<unsigned char> vchSig(ECDSA_size(key.GetECKey()));
+    unsigned int nSize = 0;
+    BOOST_REQUIRE(ECDSA_sign(0, (const unsigned char*)&hash, sizeof(hash), &vchSig[0], &nSize, key.GetECKey()) == 1);
+    vchSig.resize(nSize);
+    return vchSig;
+}
+
+static bool NativeVerify(const uint256& hash, const vector<unsigned char>& vchSig, const vector<unsigned char>& vchPubKey)
+{
+    return ecdsa::Verify(hash, vchSig.empty() ? NULL : &vchSig[0], vchSig.size(), &vchPubKey[0], vchPubKey.size());
+}
+
+BOOST_AUTO_TEST_SUITE(ecdsa_tests)
+
+BOOST_AUTO_TEST_CASE(ecdsa_rfc6979)
+{
+    // Private key 1 signing SHA256("Satoshi Nakamoto"), with the low S value
+    uint256 hash;
+    const char* pszMessage = "Satoshi Nakamoto";
+    SHA256((const unsigned char*)pszMessage, strlen(pszMessage), (unsigned char*)&hash);
+    unsigned char vchSecret[32] = { 0 };
+    vchSecret[31] = 1;
+
+    vector<unsigned char> vchSig;
+    BOOST_CHECK(ecdsa::Sign(hash, vchSecret, vchSig));
+    BOOST_CHECK_EQUAL(HexStr(vchSig), "3045022100934b1ea10a4b3c1757e2b0c017d0b6143ce3c9a7e6a4a49860d7a6ab210ee3d8"
+                                      "02202442ce9d2b916064108014783e923ec36b49743e2ffa1c4496f01a512aafd9e5");
+
+    vector<unsigned char> vchPubKey;
+    BOOST_CHECK(ecdsa::GetPubKey(vchSecret, true, vchPubKey));
+    BOOST_CHECK_EQUAL(HexStr(vchPubKey), "0279be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798");
+    BOOST_CHECK(NativeVerify(hash, vchSig, vchPubKey));
+}
+
+BOOST_AUTO_TEST_CASE(ecdsa_openssl_agreement)
+{
+    for (int i = 0; i < 32; i++)
+    {
+        uint256 hashSecret = GetRandHash();
+        CSecret vchSecret((unsigned char*)&hashSecret, (unsigned char*)&hashSecret + 32);
+        bool fCompressed = i & 1;
+        CKey key;
+        BOOST_REQUIRE(key.SetSecret(vchSecret, fCompressed));
+        vector<unsigned char> vchPubKey = key.GetPubKey().Raw();
+
+        vector<unsigned char> vchNativePubKey;
+        BOOST_CHECK(ecdsa::GetPubKey(&vchSecret[0], fCompressed, vchNativePubKey));
+        BOOST_CHECK(vchNativePubKey == vchPubKey);
+
+        uint256 hash = GetRandHash();
+        vector<unsigned char> vchSig;
+        BOOST_CHECK(ecdsa::Sign(hash, &vchSecret[0], vchSig));
+        BOOST_CHECK(OpenSSLVerify(key, hash, vchSig));
+        BOOST_CHECK(NativeVerify(hash, vchSig, vchPubKey));
+        BOOST_CHECK(!NativeVerify(GetRandHash(), vchSig, vchPubKey));
+
+        // OpenSSL's signatures may have a high S, which is still valid
+        vector<unsigned char> vchOpenSSLSig = OpenSSLSign(key, hash);
+        BOOST_CHECK(NativeVerify(hash, vchOpenSSLSig, vchPubKey));
+
+        // Both agree on damaged signatures, including broken encodings
+        for (int j = 0; j < 16; j++)
+        {
+            vector<unsigned char> vchBad = vchOpenSSLSig;
+            unsigned int nPos = GetRandInt(vchBad.size());
+            vchBad[nPos] ^= 1 << GetRandInt(8);
+            if (j & 1)
+                vchBad.resize(nPos);
+            BOOST_CHECK_EQUAL(NativeVerify(hash, vchBad, vchPubKey), OpenSSLVerify(key, hash, vchBad));
+        }
+
+        // Compact signatures recover the signing key
+        unsigned char vchCompact[64];
+        int nRecId;
+        BOOST_CHECK(ecdsa::SignCompact(hash, &vchSecret[0], vchCompact, nRecId));
+        vector<unsigned char> vchRecovered;
+        BOOST_CHECK(ecdsa::Recover(hash, vchCompact, nRecId, fCompressed, vchRecovered));
+        BOOST_CHECK(vchRecovered == vchPubKey);
+        BOOST_CHECK(!ecdsa::Recover(hash, vchCompact, nRecId ^ 1, fCompressed, vchRecovered) || vchRecovered != vchPubKey);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(ecdsa_pubkey_encodings)
+{
+    uint256 hashSecret = GetRandHash();
+    CSecret vchSecret((unsigned char*)&hashSecret, (unsigned char*)&hashSecret + 32);
+    CKey key;
+    BOOST_REQUIRE(key.SetSecret(vchSecret, false));
+    vector<unsigned char> vchPubKey = key.GetPubKey().Raw();
+    uint256 hash = GetRandHash();
+    vector<unsigned char> vchSig;
+    BOOST_CHECK(ecdsa::Sign(hash, &vchSecret[0], vchSig));
+
+    // Hybrid keys carry the parity of y in the prefix, as OpenSSL checks
+    bool fOdd = vchPubKey[64] & 1;
+    vector<unsigned char> vchHybrid = vchPubKey;
+    vchHybrid[0] = fOdd ? 0x07 : 0x06;
+    BOOST_CHECK(NativeVerify(hash, vchSig, vchHybrid));
+    vchHybrid[0] = fOdd ? 0x06 : 0x07;
+    BOOST_CHECK(!NativeVerify(hash, vchSig, vchHybrid));
+
+    // Off the curve, wrong length or the point at infinity never verify
+    vector<unsigned char> vchBad = vchPubKey;
+    vchBad[64] ^= 1;
+    BOOST_CHECK(!NativeVerify(hash, vchSig, vchBad));
+    vchBad = vchPubKey;
+    vchBad.resize(64);
+    BOOST_CHECK(!NativeVerify(hash, vchSig, vchBad));
+    BOOST_CHECK(!NativeVerify(hash, vchSig, vector<unsigned char>(1, 0)));
+
+    // CPubKey takes the same path as CheckSig
+    BOOST_CHECK(CPubKey(vchPubKey).Verify(hash, vchSig));
+    BOOST_CHECK(!CPubKey(vchPubKey).Verify(hash, vector<unsigned char>()));
+    BOOST_CHECK(!CPubKey().Verify(hash, vchSig));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,55 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "hashblock.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(hashblock_tests)
+
+BOOST_AUTO_TEST_CASE(hashblock_batch_matches_scalar)
+{
+    // enough headers to be split over several lanes, and a few that are not
+    const size_t nSizes[] = { 1, 7, 1000 };
+    for (unsigned int n = 0; n < sizeof(nSizes) / sizeof(nSizes[0]); n++)
+    {
+        size_t nHeaders = nSizes[n];
+        vector<unsigned char> vHeaders(nHeaders * HASH9_HEADER_SIZE);
+        for (unsigned int i = 0; i < vHeaders.size(); i++)
+            vHeaders[i] = GetRandInt(256);
+
+        vector<uint256> vHashes(nHeaders);
+        Hash9Batch(&vHeaders[0], nHeaders, &vHashes[0]);
+        for (size_t i = 0; i < nHeaders; i++)
+        {
+            const unsigned char* pheader = &vHeaders[i * HASH9_HEADER_SIZE];
+            BOOST_CHECK(vHashes[i] == Hash9(pheader, pheader + HASH9_HEADER_SIZE));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(hashblock_cached_header_hash)
+{
+    CBlock block;
+    block.nTime = 1415491199;
+    block.nBits = 0x1e0fffff;
+    uint256 hash = block.GetHash();
+    BOOST_CHECK(hash == Hash9(BEGIN(block.nVersion), END(block.nNonce)));
+
+    // editing the header in place must not return the stale hash
+    block.nNonce++;
+    BOOST_CHECK(block.GetHash() != hash);
+    BOOST_CHECK(block.GetHash() == Hash9(BEGIN(block.nVersion), END(block.nNonce)));
+
+    block.nNonce--;
+    BOOST_CHECK(block.GetHash() == hash);
+
+    // a copy carries the cache along with the header
+    CBlock copy = block;
+    BOOST_CHECK(copy.GetHash() == hash);
+
+    block.SetNull();
+    BOOST_CHECK(block.GetHash() == Hash9(BEGIN(block.nVersion), END(block.nNonce)));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
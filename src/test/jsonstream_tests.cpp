@@ -0,0 +1,408 @@
+#include <boost/test/unit_test.hpp>
+
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "json/json_spirit_reader_template.h"
+#include "json/json_spirit_writer_template.h"
+#include "jsonstream.h"
+#include "uint256.h"
+#include "util.h"
+
+using namespace std;
+using namespace json_spirit;
+
+static string RandomString()
+{
+    string str;
+    int nLen = GetRandInt(12);
+    for (int i = 0; i < nLen; i++)
+    {
+        int nKind = GetRandInt(4);
+        if (nKind == 0)
+            str += (char)GetRandInt(256); // control and non-ASCII bytes
+        else if (nKind == 1)
+            str += "\"\\/\n\t"[GetRandInt(5)];
+        else
+            str += (char)('a' + GetRandInt(26));
+    }
+    return str;
+}
+
+static Value RandomValue(int nDepth)
+{
+    switch (GetRandInt(nDepth > 3 ? 6 : 8))
+    {
+    case 0:
+        return RandomString();
+    case 1:
+        return (boost::int64_t)(GetRand(std::numeric_limits<uint64_t>::max()) >> GetRandInt(64)) * (GetRandInt(2) ? 1 : -1);
+    case 2:
+        return (boost::uint64_t)(0x8000000000000000ULL + GetRand(1000000));
+    case 3:
+        return (double)(int64_t)GetRand(1000000000000LL) / (GetRandInt(2) ? 100000000.0 : -3.0);
+    case 4:
+        return (bool)GetRandInt(2);
+    case 5:
+        return Value();
+    case 6:
+    {
+        Array arr;
+        int nSize = GetRandInt(5);
+        for (int i = 0; i < nSize; i++)
+            arr.push_back(RandomValue(nDepth + 1));
+        return arr;
+    }
+    default:
+    {
+        Object obj;
+        int nSize = GetRandInt(5);
+        for (int i = 0; i < nSize; i++)
+            obj.push_back(Pair(RandomString(), RandomValue(nDepth + 1)));
+        return obj;
+    }
+    }
+}
+
+// A transaction shaped like TxToJSON's output, built both ways
+struct SampleTx
+{
+    string strTxid;
+    vector<string> vPrevout;
+    vector<string> vScript;
+};
+
+static Object TxObject(const SampleTx& tx)
+{
+    Object entry;
+    entry.push_back(Pair("txid", tx.strTxid));
+    entry.push_back(Pair("version", 1));
+    entry.push_back(Pair("time", (boost::int64_t)1400000000));
+    Array vin;
+    for (unsigned int i = 0; i < tx.vPrevout.size(); i++)
+    {
+        Object in;
+        in.push_back(Pair("txid", tx.vPrevout[i]));
+        in.push_back(Pair("vout", (boost::int64_t)i));
+        in.push_back(Pair("sequence", (boost::int64_t)0xffffffff));
+        vin.push_back(in);
+    }
+    entry.push_back(Pair("vin", vin));
+    Array vout;
+    for (unsigned int i = 0; i < tx.vScript.size(); i++)
+    {
+        Object out;
+        out.push_back(Pair("value", (double)(i + 1) * 12.3456789));
+        out.push_back(Pair("n", (boost::int64_t)i));
+        out.push_back(Pair("hex", tx.vScript[i]));
+        vout.push_back(out);
+    }
+    entry.push_back(Pair("vout", vout));
+    return entry;
+}
+
+static void WriteTx(const SampleTx& tx, CJSONHandler& entry)
+{
+    entry.BeginObject();
+    entry.Pair("txid", tx.strTxid);
+    entry.Pair("version", 1);
+    entry.Pair("time", (boost::int64_t)1400000000);
+    entry.Key("vin");
+    entry.BeginArray();
+    for (unsigned int i = 0; i < tx.vPrevout.size(); i++)
+    {
+        entry.BeginObject();
+        entry.Pair("txid", tx.vPrevout[i]);
+        entry.Pair("vout", (boost::int64_t)i);
+        entry.Pair("sequence", (boost::int64_t)0xffffffff);
+        entry.EndObject();
+    }
+    entry.EndArray();
+    entry.Key("vout");
+    entry.BeginArray();
+    for (unsigned int i = 0; i < tx.vScript.size(); i++)
+    {
+        entry.BeginObject();
+        entry.Pair("value", (double)(i + 1) * 12.3456789);
+        entry.Pair("n", (boost::int64_t)i);
+        entry.Pair("hex", tx.vScript[i]);
+        entry.EndObject();
+    }
+    entry.EndArray();
+    entry.EndObject();
+}
+
+// Two inputs and two outputs to each transaction
+static void MakeSampleBlock(vector<SampleTx>& vtx, unsigned int nTx)
+{
+    vtx.resize(nTx);
+    for (unsigned int i = 0; i < vtx.size(); i++)
+    {
+        vtx[i].strTxid = GetRandHash().GetHex();
+        for (int j = 0; j < 2; j++)
+        {
+            vtx[i].vPrevout.push_back(GetRandHash().GetHex());
+            vtx[i].vScript.push_back("76a914" + GetRandHash().GetHex().substr(0, 40) + "88ac");
+        }
+    }
+}
+
+#ifdef BENCH
+// Counts events, to time ParseJSON on its own
+class CJSONCounter : public CJSONHandler
+{
+public:
+    int nEvents;
+
+    CJSONCounter() : nEvents(0) {}
+
+    void BeginObject() { nEvents++; }
+    void EndObject() { nEvents++; }
+    void BeginArray() { nEvents++; }
+    void EndArray() { nEvents++; }
+    void Key(const std::string& str) { nEvents++; }
+    void String(const std::string& str) { nEvents++; }
+    void Int(int64_t n) { nEvents++; }
+    void Uint64(uint64_t n) { nEvents++; }
+    void Real(double d) { nEvents++; }
+    void Bool(bool f) { nEvents++; }
+    void Null() { nEvents++; }
+};
+#endif
+
+BOOST_AUTO_TEST_SUITE(jsonstream_tests)
+
+BOOST_AUTO_TEST_CASE(jsonstream_writer_matches_json_spirit)
+{
+    for (int i = 0; i < 2000; i++)
+    {
+        Value value = RandomValue(0);
+        CJSONWriter writer;
+        writer.Write(value);
+        BOOST_CHECK_EQUAL(writer.str(), write_string(value, false));
+    }
+
+    CJSONWriter writer;
+    writer.BeginArray();
+    writer.Write((boost::int64_t)std::numeric_limits<int64_t>::min());
+    writer.Write(std::numeric_limits<uint64_t>::max());
+    writer.Write(-0.5);
+    writer.Write("\x01\x7f");
+    writer.BeginObject();
+    writer.Pair("a", Value::null);
+    writer.Pair("b", true);
+    writer.EndObject();
+    writer.Raw("[1,2]");
+    writer.EndArray();
+    BOOST_CHECK_EQUAL(writer.str(), "[-9223372036854775808,18446744073709551615,-0.50000000000000000,"
+                                    "\"\\u0001\\u007F\",{\"a\":null,\"b\":true},[1,2]]");
+}
+
+BOOST_AUTO_TEST_CASE(jsonstream_reader_matches_json_spirit)
+{
+    for (int i = 0; i < 2000; i++)
+    {
+        string str = write_string(RandomValue(0), false);
+        Value value;
+        BOOST_CHECK(ReadJSON(str, value));
+        // Reals read back exactly, where json_spirit can be a bit off
+        BOOST_CHECK_EQUAL(write_string(value, false), str);
+    }
+
+    const char* ppszAccepted[][2] = {
+        { "1e5", "100000.00000000000000000" },
+        { "-.5", "-0.50000000000000000" },
+        { "5.", "5.00000000000000000" },
+        { "+3", "3" },
+        { "007", "7" },
+        { "18446744073709551615", "18446744073709551615" },
+        { "-9223372036854775808", "-9223372036854775808" },
+        { " /* comment */ [1, // comment\n 2]", "[1,2]" },
+        { "{\"a\" : [true,false,null], \"a\":{}}", "{\"a\":[true,false,null],\"a\":{}}" },
+        { "\"\\u00e9\\x41\\q\\/\\\"\"", "\"\\u00E9A/\\\"\"" },
+        { "true and more", "true" },
+        { "7.45E", "7" },
+        { "7e+", "7" },
+    };
+    for (unsigned int i = 0; i < sizeof(ppszAccepted) / sizeof(ppszAccepted[0]); i++)
+    {
+        Value value, valueSpirit;
+        BOOST_CHECK(ReadJSON(ppszAccepted[i][0], value));
+        BOOST_CHECK_EQUAL(write_string(value, false), ppszAccepted[i][1]);
+        BOOST_CHECK(read_string(string(ppszAccepted[i][0]), valueSpirit));
+        BOOST_CHECK_EQUAL(write_string(valueSpirit, false), ppszAccepted[i][1]);
+    }
+
+    const char* ppszRejected[] = { "", " ", "[1,]", "{\"a\":1,}", "[true x]", "{1:2}", "\"open",
+                                   "+18446744073709551615", "18446744073709551616", "-9223372036854775809",
+                                   ".5e", "\"\\x\"", "\"a\\x/\"" };
+    for (unsigned int i = 0; i < sizeof(ppszRejected) / sizeof(ppszRejected[0]); i++)
+    {
+        Value value;
+        BOOST_CHECK(!ReadJSON(ppszRejected[i], value));
+        BOOST_CHECK(!read_string(string(ppszRejected[i]), value));
+    }
+
+    // Too deep to parse without risking the stack
+    Value value;
+    BOOST_CHECK(ReadJSON(string(100, '[') + string(100, ']'), value));
+    BOOST_CHECK(!ReadJSON(string(5000, '[') + string(5000, ']'), value));
+}
+
+BOOST_AUTO_TEST_CASE(jsonstream_builders)
+{
+    // Appending to an existing object, as the Object based helpers do
+    Object obj;
+    obj.push_back(Pair("hex", "00"));
+    CJSONValueBuilder builder(obj);
+    builder.Pair("n", 1);
+    builder.Key("list");
+    builder.BeginArray();
+    builder.Write("x");
+    builder.BeginObject();
+    builder.EndObject();
+    builder.EndArray();
+    BOOST_CHECK_EQUAL(write_string(Value(obj), false), "{\"hex\":\"00\",\"n\":1,\"list\":[\"x\",{}]}");
+
+    // Each top level value collected on its own
+    CJSONTextList entries;
+    entries.BeginObject();
+    entries.Pair("a", 1);
+    entries.EndObject();
+    entries.Write("b");
+    entries.BeginArray();
+    entries.EndArray();
+    BOOST_CHECK_EQUAL(entries.vText.size(), 3U);
+    BOOST_CHECK_EQUAL(entries.vText[0], "{\"a\":1}");
+    BOOST_CHECK_EQUAL(entries.vText[1], "\"b\"");
+    BOOST_CHECK_EQUAL(entries.vText[2], "[]");
+
+    // Raw text is parsed into a value
+    Value value;
+    CJSONValueBuilder builderRaw(value);
+    builderRaw.BeginArray();
+    builderRaw.Raw(entries.vText[0]);
+    builderRaw.EndArray();
+    BOOST_CHECK_EQUAL(write_string(value, false), "[{\"a\":1}]");
+}
+
+BOOST_AUTO_TEST_CASE(jsonstream_emitted_matches_built)
+{
+    // A block with detailed transactions, emitted directly and built first
+    vector<SampleTx> vtx;
+    MakeSampleBlock(vtx, 50);
+
+    Array arr;
+    for (unsigned int i = 0; i < vtx.size(); i++)
+        arr.push_back(TxObject(vtx[i]));
+    string strSpirit = write_string(Value(arr), false);
+
+    CJSONWriter writer;
+    writer.BeginArray();
+    for (unsigned int i = 0; i < vtx.size(); i++)
+        WriteTx(vtx[i], writer);
+    writer.EndArray();
+    BOOST_CHECK(writer.str() == strSpirit);
+
+    Value valueSpirit, valueStream;
+    BOOST_CHECK(read_string(strSpirit, valueSpirit));
+    BOOST_CHECK(ReadJSON(strSpirit, valueStream));
+    BOOST_CHECK(write_string(valueStream, false) == strSpirit);
+}
+
+#ifdef BENCH
+BOOST_AUTO_TEST_CASE(jsonstream_benchmark)
+{
+    // A getblock reply for a 2000 transaction block and a getrawmempool
+    // reply for a 50000 transaction pool
+    vector<SampleTx> vtx;
+    MakeSampleBlock(vtx, 2000);
+    vector<string> vMempool;
+    for (int i = 0; i < 50000; i++)
+        vMempool.push_back(GetRandHash().GetHex());
+
+    const int nRounds = 5;
+    string strBlockSpirit, strBlockStream, strMempoolSpirit, strMempoolStream;
+
+    int64_t nStart = GetTimeMicros();
+    for (int n = 0; n < nRounds; n++)
+    {
+        Array arr;
+        for (unsigned int i = 0; i < vtx.size(); i++)
+            arr.push_back(TxObject(vtx[i]));
+        strBlockSpirit = write_string(Value(arr), false);
+    }
+    int64_t nBlockSpirit = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    for (int n = 0; n < nRounds; n++)
+    {
+        CJSONWriter writer;
+        writer.BeginArray();
+        for (unsigned int i = 0; i < vtx.size(); i++)
+            WriteTx(vtx[i], writer);
+        writer.EndArray();
+        strBlockStream = writer.str();
+    }
+    int64_t nBlockStream = GetTimeMicros() - nStart;
+    BOOST_CHECK(strBlockStream == strBlockSpirit);
+
+    nStart = GetTimeMicros();
+    for (int n = 0; n < nRounds; n++)
+    {
+        Array arr;
+        for (unsigned int i = 0; i < vMempool.size(); i++)
+            arr.push_back(vMempool[i]);
+        strMempoolSpirit = write_string(Value(arr), false);
+    }
+    int64_t nMempoolSpirit = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    for (int n = 0; n < nRounds; n++)
+    {
+        CJSONWriter writer;
+        writer.BeginArray();
+        for (unsigned int i = 0; i < vMempool.size(); i++)
+            writer.Write(vMempool[i]);
+        writer.EndArray();
+        strMempoolStream = writer.str();
+    }
+    int64_t nMempoolStream = GetTimeMicros() - nStart;
+    BOOST_CHECK(strMempoolStream == strMempoolSpirit);
+
+    // Reading the block back, into a Value both ways and as events only
+    nStart = GetTimeMicros();
+    for (int n = 0; n < nRounds; n++)
+    {
+        Value value;
+        BOOST_CHECK(read_string(strBlockSpirit, value));
+    }
+    int64_t nReadSpirit = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    for (int n = 0; n < nRounds; n++)
+    {
+        Value value;
+        BOOST_CHECK(ReadJSON(strBlockSpirit, value));
+    }
+    int64_t nReadStream = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    for (int n = 0; n < nRounds; n++)
+    {
+        CJSONCounter counter;
+        BOOST_CHECK(ParseJSON(strBlockSpirit, counter));
+    }
+    int64_t nParse = GetTimeMicros() - nStart;
+
+    BOOST_TEST_MESSAGE(strprintf("block, %" PRIszu " bytes: json_spirit %" PRId64 "us, streamed %" PRId64 "us",
+                                 strBlockSpirit.size(), nBlockSpirit / nRounds, nBlockStream / nRounds));
+    BOOST_TEST_MESSAGE(strprintf("mempool, %" PRIszu " bytes: json_spirit %" PRId64 "us, streamed %" PRId64 "us",
+                                 strMempoolSpirit.size(), nMempoolSpirit / nRounds, nMempoolStream / nRounds));
+    BOOST_TEST_MESSAGE(strprintf("reading the block: read_string %" PRId64 "us, ReadJSON %" PRId64 "us, ParseJSON events only %" PRId64 "us",
+                                 nReadSpirit / nRounds, nReadStream / nRounds, nParse / nRounds));
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,198 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "kernel.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(kernel_tests)
+
+// The kernel hash and target as CheckStakeKernelHash computes them
+static bool ReferenceKernel(unsigned int nBits, const CStakeKernel& kernel, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake)
+{
+    CDataStream ss(SER_GETHASH, 0);
+    ss << kernel.nStakeModifier;
+    ss << kernel.nTimeBlockFrom << kernel.nTxPrevOffset << kernel.nTimeTxPrev << kernel.nPrevout << nTimeTx;
+    hashProofOfStake = Hash(ss.begin(), ss.end());
+
+    CBigNum bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+    CBigNum bnCoinDayWeight = CBigNum(kernel.nValueIn) * GetWeight((int64_t)kernel.nTimeTxPrev, (int64_t)nTimeTx) / COIN / (24 * 60 * 60);
+    targetProofOfStake = (bnCoinDayWeight * bnTargetPerCoinDay).getuint256();
+    return CBigNum(hashProofOfStake) <= bnCoinDayWeight * bnTargetPerCoinDay;
+}
+
+BOOST_AUTO_TEST_CASE(kernel_search_matches_reference)
+{
+    // Targets from hard to past 256 bits, windows shorter and longer than a
+    // hashing pass, timestamps up against the min age rule
+    const unsigned int nBitsList[] = { 0x1b00ffff, 0x1d00ffff, 0x1e0fffff, 0x207fffff };
+    int nFound = 0;
+    for (int n = 0; n < 400; n++)
+    {
+        CStakeKernel kernel;
+        kernel.nStakeModifier = GetRand(std::numeric_limits<uint64_t>::max());
+        kernel.nTimeTxPrev = 1400000000 + GetRandInt(1000000);
+        kernel.nTimeBlockFrom = kernel.nTimeTxPrev + GetRandInt(100);
+        kernel.nTxPrevOffset = 81 + GetRandInt(100000);
+        kernel.nPrevout = GetRandInt(4);
+        kernel.nValueIn = GetRand(100000 * COIN);
+        unsigned int nBits = nBitsList[n % 4];
+        unsigned int nTimeTx = kernel.nTimeBlockFrom + nStakeMinAge + (n % 5 == 0 ? GetRandInt(30) : GetRandInt(10000000));
+        unsigned int nSearchSpan = 1 + GetRandInt(60);
+
+        bool fExpected = false;
+        unsigned int nTimeExpected = 0;
+        uint256 hashExpected, targetExpected;
+        for (unsigned int i = 0; i < nSearchSpan; i++)
+        {
+            unsigned int nTimeTry = nTimeTx - i;
+            if (nTimeTry < kernel.nTimeTxPrev || kernel.nTimeBlockFrom + nStakeMinAge > nTimeTry)
+                break;
+            if (ReferenceKernel(nBits, kernel, nTimeTry, hashExpected, targetExpected))
+            {
+                fExpected = true;
+                nTimeExpected = nTimeTry;
+                break;
+            }
+        }
+
+        unsigned int nTimeFound = nTimeTx;
+        uint256 hashFound, targetFound;
+        bool fFound = SearchStakeKernel(nBits, kernel, nTimeFound, nSearchSpan, hashFound, targetFound);
+        BOOST_CHECK_EQUAL(fFound, fExpected);
+        if (fFound && fExpected)
+        {
+            BOOST_CHECK_EQUAL(nTimeFound, nTimeExpected);
+            BOOST_CHECK(hashFound == hashExpected);
+            BOOST_CHECK(targetFound == targetExpected);
+            nFound++;
+        }
+    }
+    BOOST_CHECK(nFound > 0);
+}
+
+BOOST_AUTO_TEST_CASE(kernel_search_lowest_index)
+{
+    // With an unreachable target nothing is found; with the easiest one the
+    // first kernel at or after nStart wins, threads or not
+    vector<CStakeKernel> vKernels(20);
+    for (unsigned int i = 0; i < vKernels.size(); i++)
+    {
+        vKernels[i].nStakeModifier = i;
+        vKernels[i].nTimeTxPrev = 1400000000;
+        vKernels[i].nTimeBlockFrom = 1400000000;
+        vKernels[i].nTxPrevOffset = 81;
+        vKernels[i].nPrevout = 0;
+        vKernels[i].nValueIn = 1000 * COIN;
+    }
+    unsigned int nTimeTx = 1400000000 + 30 * 24 * 60 * 60;
+    uint256 hashProofOfStake, targetProofOfStake;
+
+    unsigned int nTime = nTimeTx;
+    BOOST_CHECK_EQUAL(SearchStakeKernels(0x01000000, vKernels, 0, nTime, 60, hashProofOfStake, targetProofOfStake), -1);
+
+    nTime = nTimeTx;
+    BOOST_CHECK_EQUAL(SearchStakeKernels(0x207fffff, vKernels, 0, nTime, 60, hashProofOfStake, targetProofOfStake), 0);
+    BOOST_CHECK_EQUAL(nTime, nTimeTx);
+
+    nTime = nTimeTx;
+    BOOST_CHECK_EQUAL(SearchStakeKernels(0x207fffff, vKernels, 7, nTime, 60, hashProofOfStake, targetProofOfStake), 7);
+    BOOST_CHECK_EQUAL(SearchStakeKernels(0x207fffff, vKernels, 20, nTime, 60, hashProofOfStake, targetProofOfStake), -1);
+}
+
+// The pnext walk GetKernelStakeModifier did before the modifier index
+static const CBlockIndex* WalkStakeModifier(const CBlockIndex* pindexFrom, int64_t nSelectionInterval)
+{
+    int64_t nModifierTime = pindexFrom->GetBlockTime();
+    const CBlockIndex* pindex = pindexFrom;
+    while (nModifierTime < pindexFrom->GetBlockTime() + nSelectionInterval)
+    {
+        if (!pindex->pnext)
+            return NULL;
+        pindex = pindex->pnext;
+        if (pindex->GeneratedStakeModifier())
+            nModifierTime = pindex->GetBlockTime();
+    }
+    return pindex;
+}
+
+// Extend pindexPrev by nBlocks with jittery, sometimes backwards, timestamps
+static void BuildChain(vector<CBlockIndex>& vBlocks, CBlockIndex* pindexPrev, unsigned int nTime)
+{
+    int64_t nLastModifierTime = 0;
+    for (unsigned int i = 0; i < vBlocks.size(); i++)
+    {
+        CBlockIndex& block = vBlocks[i];
+        nTime += GetRandInt(180);
+        block.nTime = (GetRandInt(10) == 0) ? nTime - GetRandInt(360) : nTime;
+        block.nHeight = pindexPrev ? pindexPrev->nHeight + 1 : 0;
+        block.pprev = pindexPrev;
+        block.pnext = NULL;
+        bool fGenerated = !pindexPrev || block.GetBlockTime() / nModifierInterval > nLastModifierTime / nModifierInterval;
+        if (fGenerated)
+            nLastModifierTime = block.GetBlockTime();
+        block.SetStakeModifier(block.nHeight, fGenerated);
+        if (pindexPrev)
+            pindexPrev->pnext = &block;
+        pindexPrev = &block;
+    }
+}
+
+static void CheckStakeModifiers(CBlockIndex* pindexGenesis, int64_t nSelectionInterval)
+{
+    for (const CBlockIndex* pindexFrom = pindexGenesis; pindexFrom; pindexFrom = pindexFrom->pnext)
+    {
+        uint64_t nStakeModifier;
+        const CBlockIndex* pindexModifier = NULL;
+        const CBlockIndex* pindexExpected = WalkStakeModifier(pindexFrom, nSelectionInterval);
+        bool fFound = GetKernelStakeModifier(pindexFrom, nStakeModifier, pindexModifier);
+        BOOST_CHECK_EQUAL(fFound, pindexExpected != NULL);
+        if (fFound && pindexExpected)
+        {
+            BOOST_CHECK(pindexModifier == pindexExpected);
+            BOOST_CHECK_EQUAL(nStakeModifier, pindexExpected->nStakeModifier);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(stake_modifier_index_matches_walk)
+{
+    int64_t nSelectionInterval = 0;
+    for (int nSection = 0; nSection < 64; nSection++)
+        nSelectionInterval += nModifierInterval * 63 / (63 + ((63 - nSection) * (MODIFIER_INTERVAL_RATIO - 1)));
+
+    CBlockIndex* pindexGenesisSave = pindexGenesisBlock;
+    CBlockIndex* pindexBestSave = pindexBest;
+
+    vector<CBlockIndex> vMain(3000);
+    BuildChain(vMain, NULL, 1400000000);
+    pindexGenesisBlock = &vMain[0];
+    pindexBest = &vMain.back();
+    UpdateStakeModifierIndex();
+    CheckStakeModifiers(pindexGenesisBlock, nSelectionInterval);
+
+    // Reorganize onto a branch from height 2000, unlinking the disconnected
+    // blocks the way DisconnectBlock does
+    vector<CBlockIndex> vBranch(1500);
+    for (unsigned int i = 2000; i < vMain.size(); i++)
+        vMain[i].pnext = NULL;
+    BuildChain(vBranch, &vMain[2000], vMain[2000].nTime);
+    pindexBest = &vBranch.back();
+    UpdateStakeModifierIndex();
+    CheckStakeModifiers(pindexGenesisBlock, nSelectionInterval);
+
+    // Let the index forget the test chain before it goes away
+    for (unsigned int i = 0; i < vMain.size(); i++)
+        vMain[i].pnext = NULL;
+    for (unsigned int i = 0; i < vBranch.size(); i++)
+        vBranch[i].pnext = NULL;
+    pindexGenesisBlock = NULL;
+    pindexBest = NULL;
+    UpdateStakeModifierIndex();
+
+    pindexGenesisBlock = pindexGenesisSave;
+    pindexBest = pindexBestSave;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,124 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+static CTransaction MakeTx(const COutPoint& prevout, int64_t nValueOut, unsigned int nLockTime)
+{
+    CTransaction tx;
+    tx.nLockTime = nLockTime; // so all transactions get different hashes
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vout.resize(2);
+    tx.vout[0].nValue = nValueOut / 2;
+    tx.vout[1].nValue = nValueOut - nValueOut / 2;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(mempool_entry_tracking)
+{
+    LOCK(mempool.cs);
+    mempool.clear();
+
+    // A parent spending 10 coins from the chain, a child spending the
+    // parent's first output
+    CTransaction txFunding;
+    txFunding.vout.resize(1);
+    txFunding.vout[0].nValue = 10 * COIN;
+    COutPoint prevoutFunding(txFunding.GetHash(), 0);
+    MapPrevTx mapInputs;
+    mapInputs[prevoutFunding.hash].second = txFunding;
+
+    CTransaction txParent = MakeTx(prevoutFunding, 9 * COIN, 1);
+    uint256 hashParent = txParent.GetHash();
+    CTransaction txChild = MakeTx(COutPoint(hashParent, 0), 4 * COIN, 2);
+    uint256 hashChild = txChild.GetHash();
+
+    mempool.addUnchecked(hashParent, txParent, &mapInputs);
+    mempool.addUnchecked(hashChild, txChild);
+    BOOST_CHECK_EQUAL(mempool.mapEntry[hashParent].nFee, 1 * COIN);
+    BOOST_CHECK(mempool.mapEntry[hashParent].setDepends.empty());
+    BOOST_CHECK_EQUAL(mempool.mapEntry[hashChild].nFee, COIN / 2);
+    BOOST_CHECK(mempool.mapEntry[hashChild].setDepends.count(hashParent));
+    BOOST_CHECK_EQUAL(mempool.setTxByFeeRate.size(), 2U);
+    BOOST_CHECK(mempool.setTxByFeeRate.rbegin()->second == hashParent);
+
+    // The parent getting mined leaves the child with a confirmed input
+    mempool.remove(txParent);
+    BOOST_CHECK(!mempool.mapEntry.count(hashParent));
+    BOOST_CHECK(mempool.mapEntry[hashChild].setDepends.empty());
+    BOOST_CHECK_EQUAL(mempool.mapEntry[hashChild].nValueInChain, txParent.vout[0].nValue);
+    BOOST_CHECK(mempool.mapEntry[hashChild].GetPriority(nBestHeight) > 0);
+    BOOST_CHECK_EQUAL(mempool.setTxByFeeRate.size(), 1U);
+
+    // Resurrected out of order, the child still waits for the parent, and
+    // conflicting it away takes the child along
+    mempool.clear();
+    mempool.addUnchecked(hashChild, txChild);
+    BOOST_CHECK(mempool.mapEntry[hashChild].setDepends.empty());
+    BOOST_CHECK_EQUAL(mempool.mapEntry[hashChild].nFee, -4 * COIN);
+    BOOST_CHECK(mempool.setTxByFeeRate.begin()->second == hashChild);
+    mempool.addUnchecked(hashParent, txParent, &mapInputs);
+    BOOST_CHECK(mempool.mapEntry[hashChild].setDepends.count(hashParent));
+    BOOST_CHECK(mempool.mapEntry[hashChild].setMissing.empty());
+
+    // and the parent's output now counts towards the child's fee rate
+    BOOST_CHECK_EQUAL(mempool.mapEntry[hashChild].nFee, COIN / 2);
+    BOOST_CHECK_EQUAL(mempool.setTxByFeeRate.size(), 2U);
+    BOOST_CHECK(mempool.setTxByFeeRate.count(make_pair(mempool.mapEntry[hashChild].GetFeePerKb(), hashChild)));
+    BOOST_CHECK(mempool.setTxByFeeRate.rbegin()->second == hashParent);
+
+    mempool.remove(txParent, true);
+    BOOST_CHECK(mempool.mapTx.empty());
+    BOOST_CHECK(mempool.mapEntry.empty());
+    BOOST_CHECK(mempool.setTxByFeeRate.empty());
+}
+
+BOOST_AUTO_TEST_CASE(mempool_trim_and_expire)
+{
+    LOCK(mempool.cs);
+    mempool.clear();
+
+    // Three independent chains of parent and child, paying 1, 2 and 3
+    // coins in fees at the parent
+    CTransaction txFunding;
+    txFunding.vout.resize(3);
+    MapPrevTx mapInputs;
+    vector<CTransaction> vParents, vChildren;
+    for (int i = 0; i < 3; i++)
+        txFunding.vout[i].nValue = 10 * COIN;
+    mapInputs[txFunding.GetHash()].second = txFunding;
+    for (int i = 0; i < 3; i++)
+    {
+        vParents.push_back(MakeTx(COutPoint(txFunding.GetHash(), i), (9 - i) * COIN, 10 + i));
+        vChildren.push_back(MakeTx(COutPoint(vParents[i].GetHash(), 0), 1 * COIN, 20 + i));
+    }
+
+    size_t nUsage = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        mempool.addUnchecked(vParents[i].GetHash(), vParents[i], &mapInputs);
+        BOOST_CHECK(mempool.DynamicMemoryUsage() > nUsage);
+        nUsage = mempool.DynamicMemoryUsage();
+        mempool.addUnchecked(vChildren[i].GetHash(), vChildren[i]);
+    }
+    size_t nUsageAll = mempool.DynamicMemoryUsage();
+
+    // Dropping the lowest fee rate parent takes its child along
+    BOOST_CHECK_EQUAL(mempool.TrimToSize(nUsageAll - 1), 2U);
+    BOOST_CHECK(!mempool.exists(vParents[0].GetHash()));
+    BOOST_CHECK(!mempool.exists(vChildren[0].GetHash()));
+    BOOST_CHECK(mempool.exists(vParents[2].GetHash()));
+    BOOST_CHECK(mempool.DynamicMemoryUsage() < nUsageAll);
+    BOOST_CHECK_EQUAL(mempool.TrimToSize(mempool.DynamicMemoryUsage()), 0U);
+
+    BOOST_CHECK_EQUAL(mempool.Expire(GetTime() - 60), 0U);
+    BOOST_CHECK_EQUAL(mempool.Expire(GetTime() + 1), 4U);
+    BOOST_CHECK(mempool.mapTx.empty());
+    BOOST_CHECK_EQUAL(mempool.DynamicMemoryUsage(), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -1,4 +1,5 @@
 #include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
 #include <boost/foreach.hpp>
 
 #include "base58.h"
@@ -59,4 +60,97 @@ BOOST_AUTO_TEST_CASE(rpc_addmultisig)
     BOOST_CHECK_THROW(addmultisig(createArgs(2, short2.c_str()), false), runtime_error);
 }
 
+BOOST_AUTO_TEST_CASE(rpc_lockmodes)
+{
+    // Read-only chain queries don't wait for the global locks
+    BOOST_CHECK_EQUAL(tableRPC["getblockcount"]->lockMode, RPC_LOCK_NONE);
+    BOOST_CHECK_EQUAL(tableRPC["getrawmempool"]->lockMode, RPC_LOCK_NONE);
+    BOOST_CHECK_EQUAL(tableRPC["getblock"]->lockMode, RPC_LOCK_NONE);
+    BOOST_CHECK_EQUAL(tableRPC["getbestblockhash"]->lockMode, RPC_LOCK_MAIN);
+
+    // Anything touching the wallet still holds both
+    BOOST_CHECK_EQUAL(tableRPC["getbalance"]->lockMode, RPC_LOCK_WALLET);
+    BOOST_CHECK_EQUAL(tableRPC["sendtoaddress"]->lockMode, RPC_LOCK_WALLET);
+    BOOST_CHECK_EQUAL(tableRPC["validateaddress"]->lockMode, RPC_LOCK_WALLET);
+}
+
+BOOST_AUTO_TEST_CASE(rpc_http_pipelining)
+{
+    // Two requests in one read come out one at a time, in order
+    string strFirst = "POST / HTTP/1.1\r\nContent-Length: 5\r\n\r\nfirst";
+    string strSecond = "POST / HTTP/1.1\r\nConnection: close\r\nContent-Length: 6\r\n\r\nsecond";
+    string strBuffer = strFirst + "\r\n" + strSecond;
+    map<string, string> mapHeaders;
+    string strRequest;
+
+    int nUsed = ReadHTTPRequest(strBuffer, mapHeaders, strRequest);
+    BOOST_CHECK_EQUAL(nUsed, (int)strFirst.size());
+    BOOST_CHECK_EQUAL(strRequest, "first");
+    BOOST_CHECK_EQUAL(mapHeaders["connection"], "keep-alive");
+    strBuffer.erase(0, nUsed);
+
+    nUsed = ReadHTTPRequest(strBuffer, mapHeaders, strRequest);
+    BOOST_CHECK_EQUAL(nUsed, (int)strBuffer.size());
+    BOOST_CHECK_EQUAL(strRequest, "second");
+    BOOST_CHECK_EQUAL(mapHeaders["connection"], "close");
+
+    // HTTP/1.0 closes unless asked not to
+    BOOST_CHECK(ReadHTTPRequest("POST / HTTP/1.0\r\n\r\n", mapHeaders, strRequest) > 0);
+    BOOST_CHECK_EQUAL(mapHeaders["connection"], "close");
+
+    // A request cut anywhere waits for the rest
+    for (unsigned int i = 0; i < strFirst.size(); i++)
+        BOOST_CHECK_EQUAL(ReadHTTPRequest(strFirst.substr(0, i), mapHeaders, strRequest), 0);
+}
+
+BOOST_AUTO_TEST_CASE(rpc_http_limits)
+{
+    map<string, string> mapHeaders;
+    string strRequest;
+
+    // The header may not grow past MAX_HTTP_HEADER_SIZE, ended or not
+    string strHeader = "POST / HTTP/1.1\r\nX-Padding: " + string(MAX_HTTP_HEADER_SIZE, 'x');
+    BOOST_CHECK_EQUAL(ReadHTTPRequest(strHeader.substr(0, MAX_HTTP_HEADER_SIZE), mapHeaders, strRequest), 0);
+    BOOST_CHECK_EQUAL(ReadHTTPRequest(strHeader, mapHeaders, strRequest), -1);
+    BOOST_CHECK_EQUAL(ReadHTTPRequest(strHeader + "\r\n\r\n", mapHeaders, strRequest), -1);
+    BOOST_CHECK_EQUAL(ReadHTTPRequest(string(MAX_HTTP_HEADER_SIZE + 1, '\n'), mapHeaders, strRequest), -1);
+
+    // and the body past MAX_SIZE, before any of it is read
+    BOOST_CHECK_EQUAL(ReadHTTPRequest(strprintf("POST / HTTP/1.1\r\nContent-Length: %u\r\n\r\n", MAX_SIZE + 1), mapHeaders, strRequest), -1);
+    BOOST_CHECK_EQUAL(ReadHTTPRequest("POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n", mapHeaders, strRequest), -1);
+    BOOST_CHECK_EQUAL(ReadHTTPRequest(strprintf("POST / HTTP/1.1\r\nContent-Length: %u\r\n\r\n", MAX_SIZE), mapHeaders, strRequest), 0);
+}
+
+static void AppendJob(vector<int>* pvRun, int n)
+{
+    pvRun->push_back(n);
+}
+
+BOOST_AUTO_TEST_CASE(rpc_work_queue)
+{
+    CRPCWorkQueue queue(2);
+    vector<int> vRun;
+
+    // Past -rpcworkqueue requests are turned away, and get a 503
+    BOOST_CHECK(queue.Enqueue(boost::bind(AppendJob, &vRun, 1)));
+    BOOST_CHECK(queue.Enqueue(boost::bind(AppendJob, &vRun, 2)));
+    BOOST_CHECK(!queue.Enqueue(boost::bind(AppendJob, &vRun, 3)));
+    BOOST_CHECK(HTTPReply(HTTP_SERVICE_UNAVAILABLE, "", true).find("HTTP/1.1 503 ") == 0);
+
+    // Jobs run oldest first, and free their place when taken
+    boost::function<void ()> job;
+    BOOST_CHECK(queue.Dequeue(job, 0));
+    job();
+    BOOST_CHECK(queue.Enqueue(boost::bind(AppendJob, &vRun, 3)));
+    while (queue.Dequeue(job, 0))
+        job();
+    BOOST_CHECK_EQUAL(vRun.size(), 3U);
+    BOOST_CHECK(vRun[0] == 1 && vRun[1] == 2 && vRun[2] == 3);
+
+    // Clearing drops what wasn't taken
+    BOOST_CHECK(queue.Enqueue(boost::bind(AppendJob, &vRun, 4)));
+    queue.Clear();
+    BOOST_CHECK(!queue.Dequeue(job, 0));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
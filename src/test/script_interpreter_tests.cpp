@@ -0,0 +1,1144 @@
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+
+#include "bignum.h"
+#include "key.h"
+#include "keystore.h"
+#include "main.h"
+#include "script.h"
+
+using namespace std;
+
+// The interpreter as it was before CScriptValue and CScriptNum, kept as the
+// reference the current one is checked against: CBigNum arithmetic and a
+// stack of std::vector, with no special cases for standard scripts.
+namespace legacy
+{
+
+static const valtype vchFalse(0);
+static const valtype vchTrue(1, 1);
+static const CBigNum bnZero(0);
+static const CBigNum bnOne(1);
+static const size_t nMaxNumSize = 4;
+
+static CBigNum CastToBigNum(const valtype& vch)
+{
+    if (vch.size() > nMaxNumSize)
+        throw runtime_error("CastToBigNum() : overflow");
+    // Get rid of extra leading zeros
+    return CBigNum(CBigNum(vch).getvch());
+}
+
+static bool CastToBool(const valtype& vch)
+{
+    for (unsigned int i = 0; i < vch.size(); i++)
+    {
+        if (vch[i] != 0)
+        {
+            // Can be negative zero
+            if (i == vch.size()-1 && vch[i] == 0x80)
+                return false;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void MakeSameSize(valtype& vch1, valtype& vch2)
+{
+    // Lengthen the shorter one
+    if (vch1.size() < vch2.size())
+        vch1.resize(vch2.size(), 0);
+    if (vch2.size() < vch1.size())
+        vch2.resize(vch1.size(), 0);
+}
+
+#define stacktop(i)  (stack.at(stack.size()+(i)))
+#define altstacktop(i)  (altstack.at(altstack.size()+(i)))
+static inline void popstack(vector<valtype>& stack)
+{
+    if (stack.empty())
+        throw runtime_error("popstack() : stack empty");
+    stack.pop_back();
+}
+
+static bool LegacyCheckSig(const valtype& vchSigIn, const valtype& vchPubKeyIn, const CScript& scriptCode,
+                           const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    CScriptValue vchSig(vchSigIn.begin(), vchSigIn.end());
+    CScriptValue vchPubKey(vchPubKeyIn.begin(), vchPubKeyIn.end());
+    return IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey) &&
+        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType);
+}
+
+static bool LegacyEvalScript(vector<valtype>& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    CAutoBN_CTX pctx;
+    CScript::const_iterator pc = script.begin();
+    CScript::const_iterator pend = script.end();
+    CScript::const_iterator pbegincodehash = script.begin();
+    opcodetype opcode;
+    valtype vchPushValue;
+    vector<bool> vfExec;
+    vector<valtype> altstack;
+    if (script.size() > 10000)
+        return false;
+    int nOpCount = 0;
+
+
+    try
+    {
+        while (pc < pend)
+        {
+            bool fExec = !count(vfExec.begin(), vfExec.end(), false);
+
+            //
+            // Read instruction
+            //
+            if (!script.GetOp(pc, opcode, vchPushValue))
+                return false;
+            if (vchPushValue.size() > 520)
+                return false;
+            if (opcode > OP_16 && ++nOpCount > 201)
+                return false;
+
+            if (opcode == OP_CAT ||
+                opcode == OP_SUBSTR ||
+                opcode == OP_LEFT ||
+                opcode == OP_RIGHT ||
+                opcode == OP_INVERT ||
+                opcode == OP_AND ||
+                opcode == OP_OR ||
+                opcode == OP_XOR ||
+                opcode == OP_2MUL ||
+                opcode == OP_2DIV ||
+                opcode == OP_MUL ||
+                opcode == OP_DIV ||
+                opcode == OP_MOD ||
+                opcode == OP_LSHIFT ||
+                opcode == OP_RSHIFT)
+                return false;
+
+            if (fExec && 0 <= opcode && opcode <= OP_PUSHDATA4)
+                stack.push_back(vchPushValue);
+            else if (fExec || (OP_IF <= opcode && opcode <= OP_ENDIF))
+            switch (opcode)
+            {
+                //
+                // Push value
+                //
+                case OP_1NEGATE:
+                case OP_1:
+                case OP_2:
+                case OP_3:
+                case OP_4:
+                case OP_5:
+                case OP_6:
+                case OP_7:
+                case OP_8:
+                case OP_9:
+                case OP_10:
+                case OP_11:
+                case OP_12:
+                case OP_13:
+                case OP_14:
+                case OP_15:
+                case OP_16:
+                {
+                    // ( -- value)
+                    CBigNum bn((int)opcode - (int)(OP_1 - 1));
+                    stack.push_back(bn.getvch());
+                }
+                break;
+
+
+                //
+                // Control
+                //
+                case OP_NOP:
+                case OP_NOP1: case OP_NOP2: case OP_NOP3: case OP_NOP4: case OP_NOP5:
+                case OP_NOP6: case OP_NOP7: case OP_NOP8: case OP_NOP9: case OP_NOP10:
+                break;
+
+                case OP_IF:
+                case OP_NOTIF:
+                {
+                    // <expression> if [statements] [else [statements]] endif
+                    bool fValue = false;
+                    if (fExec)
+                    {
+                        if (stack.size() < 1)
+                            return false;
+                        valtype& vch = stacktop(-1);
+                        fValue = CastToBool(vch);
+                        if (opcode == OP_NOTIF)
+                            fValue = !fValue;
+                        popstack(stack);
+                    }
+                    vfExec.push_back(fValue);
+                }
+                break;
+
+                case OP_ELSE:
+                {
+                    if (vfExec.empty())
+                        return false;
+                    vfExec.back() = !vfExec.back();
+                }
+                break;
+
+                case OP_ENDIF:
+                {
+                    if (vfExec.empty())
+                        return false;
+                    vfExec.pop_back();
+                }
+                break;
+
+                case OP_VERIFY:
+                {
+                    // (true -- ) or
+                    // (false -- false) and return
+                    if (stack.size() < 1)
+                        return false;
+                    bool fValue = CastToBool(stacktop(-1));
+                    if (fValue)
+                        popstack(stack);
+                    else
+                        return false;
+                }
+                break;
+
+                case OP_RETURN:
+                {
+                    return false;
+                }
+                break;
+
+
+                //
+                // Stack ops
+                //
+                case OP_TOALTSTACK:
+                {
+                    if (stack.size() < 1)
+                        return false;
+                    altstack.push_back(stacktop(-1));
+                    popstack(stack);
+                }
+                break;
+
+                case OP_FROMALTSTACK:
+                {
+                    if (altstack.size() < 1)
+                        return false;
+                    stack.push_back(altstacktop(-1));
+                    popstack(altstack);
+                }
+                break;
+
+                case OP_2DROP:
+                {
+                    // (x1 x2 -- )
+                    if (stack.size() < 2)
+                        return false;
+                    popstack(stack);
+                    popstack(stack);
+                }
+                break;
+
+                case OP_2DUP:
+                {
+                    // (x1 x2 -- x1 x2 x1 x2)
+                    if (stack.size() < 2)
+                        return false;
+                    valtype vch1 = stacktop(-2);
+                    valtype vch2 = stacktop(-1);
+                    stack.push_back(vch1);
+                    stack.push_back(vch2);
+                }
+                break;
+
+                case OP_3DUP:
+                {
+                    // (x1 x2 x3 -- x1 x2 x3 x1 x2 x3)
+                    if (stack.size() < 3)
+                        return false;
+                    valtype vch1 = stacktop(-3);
+                    valtype vch2 = stacktop(-2);
+                    valtype vch3 = stacktop(-1);
+                    stack.push_back(vch1);
+                    stack.push_back(vch2);
+                    stack.push_back(vch3);
+                }
+                break;
+
+                case OP_2OVER:
+                {
+                    // (x1 x2 x3 x4 -- x1 x2 x3 x4 x1 x2)
+                    if (stack.size() < 4)
+                        return false;
+                    valtype vch1 = stacktop(-4);
+                    valtype vch2 = stacktop(-3);
+                    stack.push_back(vch1);
+                    stack.push_back(vch2);
+                }
+                break;
+
+                case OP_2ROT:
+                {
+                    // (x1 x2 x3 x4 x5 x6 -- x3 x4 x5 x6 x1 x2)
+                    if (stack.size() < 6)
+                        return false;
+                    valtype vch1 = stacktop(-6);
+                    valtype vch2 = stacktop(-5);
+                    stack.erase(stack.end()-6, stack.end()-4);
+                    stack.push_back(vch1);
+                    stack.push_back(vch2);
+                }
+                break;
+
+                case OP_2SWAP:
+                {
+                    // (x1 x2 x3 x4 -- x3 x4 x1 x2)
+                    if (stack.size() < 4)
+                        return false;
+                    swap(stacktop(-4), stacktop(-2));
+                    swap(stacktop(-3), stacktop(-1));
+                }
+                break;
+
+                case OP_IFDUP:
+                {
+                    // (x - 0 | x x)
+                    if (stack.size() < 1)
+                        return false;
+                    valtype vch = stacktop(-1);
+                    if (CastToBool(vch))
+                        stack.push_back(vch);
+                }
+                break;
+
+                case OP_DEPTH:
+                {
+                    // -- stacksize
+                    CBigNum bn(stack.size());
+                    stack.push_back(bn.getvch());
+                }
+                break;
+
+                case OP_DROP:
+                {
+                    // (x -- )
+                    if (stack.size() < 1)
+                        return false;
+                    popstack(stack);
+                }
+                break;
+
+                case OP_DUP:
+                {
+                    // (x -- x x)
+                    if (stack.size() < 1)
+                        return false;
+                    valtype vch = stacktop(-1);
+                    stack.push_back(vch);
+                }
+                break;
+
+                case OP_NIP:
+                {
+                    // (x1 x2 -- x2)
+                    if (stack.size() < 2)
+                        return false;
+                    stack.erase(stack.end() - 2);
+                }
+                break;
+
+                case OP_OVER:
+                {
+                    // (x1 x2 -- x1 x2 x1)
+                    if (stack.size() < 2)
+                        return false;
+                    valtype vch = stacktop(-2);
+                    stack.push_back(vch);
+                }
+                break;
+
+                case OP_PICK:
+                case OP_ROLL:
+                {
+                    // (xn ... x2 x1 x0 n - xn ... x2 x1 x0 xn)
+                    // (xn ... x2 x1 x0 n - ... x2 x1 x0 xn)
+                    if (stack.size() < 2)
+                        return false;
+                    int n = CastToBigNum(stacktop(-1)).getint();
+                    popstack(stack);
+                    if (n < 0 || n >= (int)stack.size())
+                        return false;
+                    valtype vch = stacktop(-n-1);
+                    if (opcode == OP_ROLL)
+                        stack.erase(stack.end()-n-1);
+                    stack.push_back(vch);
+                }
+                break;
+
+                case OP_ROT:
+                {
+                    // (x1 x2 x3 -- x2 x3 x1)
+                    //  x2 x1 x3  after first swap
+                    //  x2 x3 x1  after second swap
+                    if (stack.size() < 3)
+                        return false;
+                    swap(stacktop(-3), stacktop(-2));
+                    swap(stacktop(-2), stacktop(-1));
+                }
+                break;
+
+                case OP_SWAP:
+                {
+                    // (x1 x2 -- x2 x1)
+                    if (stack.size() < 2)
+                        return false;
+                    swap(stacktop(-2), stacktop(-1));
+                }
+                break;
+
+                case OP_TUCK:
+                {
+                    // (x1 x2 -- x2 x1 x2)
+                    if (stack.size() < 2)
+                        return false;
+                    valtype vch = stacktop(-1);
+                    stack.insert(stack.end()-2, vch);
+                }
+                break;
+
+
+                //
+                // Splice ops
+                //
+                case OP_CAT:
+                {
+                    // (x1 x2 -- out)
+                    if (stack.size() < 2)
+                        return false;
+                    valtype& vch1 = stacktop(-2);
+                    valtype& vch2 = stacktop(-1);
+                    vch1.insert(vch1.end(), vch2.begin(), vch2.end());
+                    popstack(stack);
+                    if (stacktop(-1).size() > 520)
+                        return false;
+                }
+                break;
+
+                case OP_SUBSTR:
+                {
+                    // (in begin size -- out)
+                    if (stack.size() < 3)
+                        return false;
+                    valtype& vch = stacktop(-3);
+                    int nBegin = CastToBigNum(stacktop(-2)).getint();
+                    int nEnd = nBegin + CastToBigNum(stacktop(-1)).getint();
+                    if (nBegin < 0 || nEnd < nBegin)
+                        return false;
+                    if (nBegin > (int)vch.size())
+                        nBegin = vch.size();
+                    if (nEnd > (int)vch.size())
+                        nEnd = vch.size();
+                    vch.erase(vch.begin() + nEnd, vch.end());
+                    vch.erase(vch.begin(), vch.begin() + nBegin);
+                    popstack(stack);
+                    popstack(stack);
+                }
+                break;
+
+                case OP_LEFT:
+                case OP_RIGHT:
+                {
+                    // (in size -- out)
+                    if (stack.size() < 2)
+                        return false;
+                    valtype& vch = stacktop(-2);
+                    int nSize = CastToBigNum(stacktop(-1)).getint();
+                    if (nSize < 0)
+                        return false;
+                    if (nSize > (int)vch.size())
+                        nSize = vch.size();
+                    if (opcode == OP_LEFT)
+                        vch.erase(vch.begin() + nSize, vch.end());
+                    else
+                        vch.erase(vch.begin(), vch.end() - nSize);
+                    popstack(stack);
+                }
+                break;
+
+                case OP_SIZE:
+                {
+                    // (in -- in size)
+                    if (stack.size() < 1)
+                        return false;
+                    CBigNum bn(stacktop(-1).size());
+                    stack.push_back(bn.getvch());
+                }
+                break;
+
+
+                //
+                // Bitwise logic
+                //
+                case OP_INVERT:
+                {
+                    // (in - out)
+                    if (stack.size() < 1)
+                        return false;
+                    valtype& vch = stacktop(-1);
+                    for (unsigned int i = 0; i < vch.size(); i++)
+                        vch[i] = ~vch[i];
+                }
+                break;
+
+                //
+                // WARNING: These disabled opcodes exhibit unexpected behavior
+                // when used on signed integers due to a bug in MakeSameSize()
+                // [see definition of MakeSameSize() above].
+                //
+                case OP_AND:
+                case OP_OR:
+                case OP_XOR:
+                {
+                    // (x1 x2 - out)
+                    if (stack.size() < 2)
+                        return false;
+                    valtype& vch1 = stacktop(-2);
+                    valtype& vch2 = stacktop(-1);
+                    MakeSameSize(vch1, vch2); // <-- NOT SAFE FOR SIGNED VALUES
+                    if (opcode == OP_AND)
+                    {
+                        for (unsigned int i = 0; i < vch1.size(); i++)
+                            vch1[i] &= vch2[i];
+                    }
+                    else if (opcode == OP_OR)
+                    {
+                        for (unsigned int i = 0; i < vch1.size(); i++)
+                            vch1[i] |= vch2[i];
+                    }
+                    else if (opcode == OP_XOR)
+                    {
+                        for (unsigned int i = 0; i < vch1.size(); i++)
+                            vch1[i] ^= vch2[i];
+                    }
+                    popstack(stack);
+                }
+                break;
+
+                case OP_EQUAL:
+                case OP_EQUALVERIFY:
+                //case OP_NOTEQUAL: // use OP_NUMNOTEQUAL
+                {
+                    // (x1 x2 - bool)
+                    if (stack.size() < 2)
+                        return false;
+                    valtype& vch1 = stacktop(-2);
+                    valtype& vch2 = stacktop(-1);
+                    bool fEqual = (vch1 == vch2);
+                    // OP_NOTEQUAL is disabled because it would be too easy to say
+                    // something like n != 1 and have some wiseguy pass in 1 with extra
+                    // zero bytes after it (numerically, 0x01 == 0x0001 == 0x000001)
+                    //if (opcode == OP_NOTEQUAL)
+                    //    fEqual = !fEqual;
+                    popstack(stack);
+                    popstack(stack);
+                    stack.push_back(fEqual ? vchTrue : vchFalse);
+                    if (opcode == OP_EQUALVERIFY)
+                    {
+                        if (fEqual)
+                            popstack(stack);
+                        else
+                            return false;
+                    }
+                }
+                break;
+
+
+                //
+                // Numeric
+                //
+                case OP_1ADD:
+                case OP_1SUB:
+                case OP_2MUL:
+                case OP_2DIV:
+                case OP_NEGATE:
+                case OP_ABS:
+                case OP_NOT:
+                case OP_0NOTEQUAL:
+                {
+                    // (in -- out)
+                    if (stack.size() < 1)
+                        return false;
+                    CBigNum bn = CastToBigNum(stacktop(-1));
+                    switch (opcode)
+                    {
+                    case OP_1ADD:       bn += bnOne; break;
+                    case OP_1SUB:       bn -= bnOne; break;
+                    case OP_2MUL:       bn <<= 1; break;
+                    case OP_2DIV:       bn >>= 1; break;
+                    case OP_NEGATE:     bn = -bn; break;
+                    case OP_ABS:        if (bn < bnZero) bn = -bn; break;
+                    case OP_NOT:        bn = (bn == bnZero); break;
+                    case OP_0NOTEQUAL:  bn = (bn != bnZero); break;
+                    default:            assert(!"invalid opcode"); break;
+                    }
+                    popstack(stack);
+                    stack.push_back(bn.getvch());
+                }
+                break;
+
+                case OP_ADD:
+                case OP_SUB:
+                case OP_MUL:
+                case OP_DIV:
+                case OP_MOD:
+                case OP_LSHIFT:
+                case OP_RSHIFT:
+                case OP_BOOLAND:
+                case OP_BOOLOR:
+                case OP_NUMEQUAL:
+                case OP_NUMEQUALVERIFY:
+                case OP_NUMNOTEQUAL:
+                case OP_LESSTHAN:
+                case OP_GREATERTHAN:
+                case OP_LESSTHANOREQUAL:
+                case OP_GREATERTHANOREQUAL:
+                case OP_MIN:
+                case OP_MAX:
+                {
+                    // (x1 x2 -- out)
+                    if (stack.size() < 2)
+                        return false;
+                    CBigNum bn1 = CastToBigNum(stacktop(-2));
+                    CBigNum bn2 = CastToBigNum(stacktop(-1));
+                    CBigNum bn;
+                    switch (opcode)
+                    {
+                    case OP_ADD:
+                        bn = bn1 + bn2;
+                        break;
+
+                    case OP_SUB:
+                        bn = bn1 - bn2;
+                        break;
+
+                    case OP_MUL:
+                        if (!BN_mul(&bn, &bn1, &bn2, pctx))
+                            return false;
+                        break;
+
+                    case OP_DIV:
+                        if (!BN_div(&bn, NULL, &bn1, &bn2, pctx))
+                            return false;
+                        break;
+
+                    case OP_MOD:
+                        if (!BN_mod(&bn, &bn1, &bn2, pctx))
+                            return false;
+                        break;
+
+                    case OP_LSHIFT:
+                        if (bn2 < bnZero || bn2 > CBigNum(2048))
+                            return false;
+                        bn = bn1 << bn2.getulong();
+                        break;
+
+                    case OP_RSHIFT:
+                        if (bn2 < bnZero || bn2 > CBigNum(2048))
+                            return false;
+                        bn = bn1 >> bn2.getulong();
+                        break;
+
+                    case OP_BOOLAND:             bn = (bn1 != bnZero && bn2 != bnZero); break;
+                    case OP_BOOLOR:              bn = (bn1 != bnZero || bn2 != bnZero); break;
+                    case OP_NUMEQUAL:            bn = (bn1 == bn2); break;
+                    case OP_NUMEQUALVERIFY:      bn = (bn1 == bn2); break;
+                    case OP_NUMNOTEQUAL:         bn = (bn1 != bn2); break;
+                    case OP_LESSTHAN:            bn = (bn1 < bn2); break;
+                    case OP_GREATERTHAN:         bn = (bn1 > bn2); break;
+                    case OP_LESSTHANOREQUAL:     bn = (bn1 <= bn2); break;
+                    case OP_GREATERTHANOREQUAL:  bn = (bn1 >= bn2); break;
+                    case OP_MIN:                 bn = (bn1 < bn2 ? bn1 : bn2); break;
+                    case OP_MAX:                 bn = (bn1 > bn2 ? bn1 : bn2); break;
+                    default:                     assert(!"invalid opcode"); break;
+                    }
+                    popstack(stack);
+                    popstack(stack);
+                    stack.push_back(bn.getvch());
+
+                    if (opcode == OP_NUMEQUALVERIFY)
+                    {
+                        if (CastToBool(stacktop(-1)))
+                            popstack(stack);
+                        else
+                            return false;
+                    }
+                }
+                break;
+
+                case OP_WITHIN:
+                {
+                    // (x min max -- out)
+                    if (stack.size() < 3)
+                        return false;
+                    CBigNum bn1 = CastToBigNum(stacktop(-3));
+                    CBigNum bn2 = CastToBigNum(stacktop(-2));
+                    CBigNum bn3 = CastToBigNum(stacktop(-1));
+                    bool fValue = (bn2 <= bn1 && bn1 < bn3);
+                    popstack(stack);
+                    popstack(stack);
+                    popstack(stack);
+                    stack.push_back(fValue ? vchTrue : vchFalse);
+                }
+                break;
+
+
+                //
+                // Crypto
+                //
+                case OP_RIPEMD160:
+                case OP_SHA1:
+                case OP_SHA256:
+                case OP_HASH160:
+                case OP_HASH256:
+                {
+                    // (in -- hash)
+                    if (stack.size() < 1)
+                        return false;
+                    valtype& vch = stacktop(-1);
+                    valtype vchHash((opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32);
+                    if (opcode == OP_RIPEMD160)
+                        RIPEMD160(&vch[0], vch.size(), &vchHash[0]);
+                    else if (opcode == OP_SHA1)
+                        SHA1(&vch[0], vch.size(), &vchHash[0]);
+                    else if (opcode == OP_SHA256)
+                        SHA256(&vch[0], vch.size(), &vchHash[0]);
+                    else if (opcode == OP_HASH160)
+                    {
+                        uint160 hash160 = Hash160(vch);
+                        memcpy(&vchHash[0], &hash160, sizeof(hash160));
+                    }
+                    else if (opcode == OP_HASH256)
+                    {
+                        uint256 hash = Hash(vch.begin(), vch.end());
+                        memcpy(&vchHash[0], &hash, sizeof(hash));
+                    }
+                    popstack(stack);
+                    stack.push_back(vchHash);
+                }
+                break;
+
+                case OP_CODESEPARATOR:
+                {
+                    // Hash starts after the code separator
+                    pbegincodehash = pc;
+                }
+                break;
+
+                case OP_CHECKSIG:
+                case OP_CHECKSIGVERIFY:
+                {
+                    // (sig pubkey -- bool)
+                    if (stack.size() < 2)
+                        return false;
+
+                    valtype& vchSig    = stacktop(-2);
+                    valtype& vchPubKey = stacktop(-1);
+
+                    ////// debug print
+                    //PrintHex(vchSig.begin(), vchSig.end(), "sig: %s\n");
+                    //PrintHex(vchPubKey.begin(), vchPubKey.end(), "pubkey: %s\n");
+
+                    // Subset of script starting at the most recent codeseparator
+                    CScript scriptCode(pbegincodehash, pend);
+
+                    // Drop the signature, since there's no way for a signature to sign itself
+                    scriptCode.FindAndDelete(CScript(vchSig));
+
+                    bool fSuccess = LegacyCheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType);
+
+                    popstack(stack);
+                    popstack(stack);
+                    stack.push_back(fSuccess ? vchTrue : vchFalse);
+                    if (opcode == OP_CHECKSIGVERIFY)
+                    {
+                        if (fSuccess)
+                            popstack(stack);
+                        else
+                            return false;
+                    }
+                }
+                break;
+
+                case OP_CHECKMULTISIG:
+                case OP_CHECKMULTISIGVERIFY:
+                {
+                    // ([sig ...] num_of_signatures [pubkey ...] num_of_pubkeys -- bool)
+
+                    int i = 1;
+                    if ((int)stack.size() < i)
+                        return false;
+
+                    int nKeysCount = CastToBigNum(stacktop(-i)).getint();
+                    if (nKeysCount < 0 || nKeysCount > 20)
+                        return false;
+                    nOpCount += nKeysCount;
+                    if (nOpCount > 201)
+                        return false;
+                    int ikey = ++i;
+                    i += nKeysCount;
+                    if ((int)stack.size() < i)
+                        return false;
+
+                    int nSigsCount = CastToBigNum(stacktop(-i)).getint();
+                    if (nSigsCount < 0 || nSigsCount > nKeysCount)
+                        return false;
+                    int isig = ++i;
+                    i += nSigsCount;
+                    if ((int)stack.size() < i)
+                        return false;
+
+                    // Subset of script starting at the most recent codeseparator
+                    CScript scriptCode(pbegincodehash, pend);
+
+                    // Drop the signatures, since there's no way for a signature to sign itself
+                    for (int k = 0; k < nSigsCount; k++)
+                    {
+                        valtype& vchSig = stacktop(-isig-k);
+                        scriptCode.FindAndDelete(CScript(vchSig));
+                    }
+
+                    bool fSuccess = true;
+                    while (fSuccess && nSigsCount > 0)
+                    {
+                        valtype& vchSig    = stacktop(-isig);
+                        valtype& vchPubKey = stacktop(-ikey);
+
+                        // Check signature
+                        bool fOk = LegacyCheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType);
+
+                        if (fOk)
+                        {
+                            isig++;
+                            nSigsCount--;
+                        }
+                        ikey++;
+                        nKeysCount--;
+
+                        // If there are more signatures left than keys left,
+                        // then too many signatures have failed
+                        if (nSigsCount > nKeysCount)
+                            fSuccess = false;
+                    }
+
+                    while (i-- > 0)
+                        popstack(stack);
+                    stack.push_back(fSuccess ? vchTrue : vchFalse);
+
+                    if (opcode == OP_CHECKMULTISIGVERIFY)
+                    {
+                        if (fSuccess)
+                            popstack(stack);
+                        else
+                            return false;
+                    }
+                }
+                break;
+
+                default:
+                    return false;
+            }
+
+            // Size limits
+            if (stack.size() + altstack.size() > 1000)
+                return false;
+        }
+    }
+    catch (...)
+    {
+        return false;
+    }
+
+
+    if (!vfExec.empty())
+        return false;
+
+    return true;
+}
+
+static bool LegacyVerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    vector<vector<unsigned char> > stack, stackCopy;
+    if (!LegacyEvalScript(stack, scriptSig, txTo, nIn, nHashType))
+        return false;
+
+    stackCopy = stack;
+
+    if (!LegacyEvalScript(stack, scriptPubKey, txTo, nIn, nHashType))
+        return false;
+    if (stack.empty())
+        return false;
+
+    if (CastToBool(stack.back()) == false)
+        return false;
+
+    if (scriptPubKey.IsPayToScriptHash())
+    {
+        if (!scriptSig.IsPushOnly())
+            return false;
+
+        const valtype& pubKeySerialized = stackCopy.back();
+        CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
+        popstack(stackCopy);
+
+        if (!LegacyEvalScript(stackCopy, pubKey2, txTo, nIn, nHashType))
+            return false;
+        if (stackCopy.empty())
+            return false;
+        return CastToBool(stackCopy.back());
+    }
+
+    return true;
+}
+
+#undef stacktop
+#undef altstacktop
+
+}
+
+BOOST_AUTO_TEST_SUITE(script_interpreter_tests)
+
+static valtype RandomBytes(unsigned int nSize)
+{
+    valtype vch(nSize);
+    for (unsigned int i = 0; i < nSize; i++)
+        vch[i] = GetRandInt(256);
+    return vch;
+}
+
+// Numbers near the edges of the encoding: zero and negative zero, padded
+// zeros, sign bits and the largest 4 byte values
+static vector<valtype> EdgeNumbers()
+{
+    static const unsigned char pchEdges[][5] = {
+        { 0 }, { 1, 0x00 }, { 1, 0x80 }, { 2, 0x00, 0x00 }, { 2, 0x00, 0x80 }, { 1, 0x7f }, { 1, 0xff },
+        { 2, 0x80, 0x00 }, { 2, 0x80, 0x80 }, { 2, 0xff, 0x7f }, { 3, 0x00, 0x00, 0x80 },
+        { 4, 0xff, 0xff, 0xff, 0x7f }, { 4, 0xff, 0xff, 0xff, 0xff }, { 4, 0x00, 0x00, 0x00, 0x80 },
+        { 4, 0x01, 0x00, 0x00, 0x00 }, { 4, 0x00, 0x00, 0x00, 0x00 },
+    };
+    vector<valtype> vEdges;
+    for (unsigned int i = 0; i < sizeof(pchEdges) / sizeof(pchEdges[0]); i++)
+        vEdges.push_back(valtype(pchEdges[i] + 1, pchEdges[i] + 1 + pchEdges[i][0]));
+    return vEdges;
+}
+
+BOOST_AUTO_TEST_CASE(scriptnum_bignum_agreement)
+{
+    vector<valtype> vNums = EdgeNumbers();
+    for (int i = 0; i < 200; i++)
+        vNums.push_back(RandomBytes(GetRandInt(5)));
+
+    for (const valtype& a : vNums)
+    {
+        CBigNum bnA = legacy::CastToBigNum(a);
+        CScriptNum numA(a);
+        BOOST_CHECK(numA.getvch() == bnA.getvch());
+        BOOST_CHECK_EQUAL(numA.getint(), bnA.getint());
+        BOOST_CHECK((-numA).getvch() == (-bnA).getvch());
+
+        CScriptValue vchA(a.begin(), a.end());
+        BOOST_CHECK(CScriptNum(vchA) == numA);
+
+        for (int j = 0; j < 16; j++)
+        {
+            const valtype& b = vNums[GetRandInt(vNums.size())];
+            CBigNum bnB = legacy::CastToBigNum(b);
+            CScriptNum numB(b);
+            BOOST_CHECK((numA + numB).getvch() == (bnA + bnB).getvch());
+            BOOST_CHECK((numA - numB).getvch() == (bnA - bnB).getvch());
+            BOOST_CHECK_EQUAL(numA < numB, bnA < bnB);
+            BOOST_CHECK_EQUAL(numA == numB, bnA == bnB);
+            BOOST_CHECK_EQUAL(numA >= numB, bnA >= bnB);
+        }
+    }
+
+    // Sums of two operands can take 5 bytes, but can't be operands again
+    valtype vchMax = CScriptNum(0x7fffffff).getvch();
+    valtype vchSum = (CScriptNum(vchMax) + CScriptNum(vchMax)).getvch();
+    BOOST_CHECK(vchSum == (CBigNum(0x7fffffff) + CBigNum(0x7fffffff)).getvch());
+    BOOST_CHECK_EQUAL(vchSum.size(), 5U);
+    BOOST_CHECK_THROW(CScriptNum num(vchSum), scriptnum_error);
+}
+
+BOOST_AUTO_TEST_CASE(scriptvalue_small_vector)
+{
+    // Growing past the inline capacity, shrinking and copying both ways
+    CScriptValue vch;
+    valtype vchRef;
+    for (int i = 0; i < 600; i++)
+    {
+        unsigned char c = GetRandInt(256);
+        vch.push_back(c);
+        vchRef.push_back(c);
+        if (i % 97 == 0)
+        {
+            CScriptValue vchCopy(vch);
+            BOOST_CHECK(valtype(vchCopy.begin(), vchCopy.end()) == vchRef);
+            CScriptValue vchMoved(std::move(vchCopy));
+            BOOST_CHECK(vchMoved == vch);
+            CScriptValue vchShort(vchRef.begin(), vchRef.begin() + i / 10);
+            swap(vchShort, vchMoved);
+            BOOST_CHECK(vchShort == vch);
+            BOOST_CHECK_EQUAL(vchMoved.size(), (unsigned int)(i / 10));
+        }
+    }
+    BOOST_CHECK(valtype(vch.begin(), vch.end()) == vchRef);
+    vch.erase(vch.begin() + 10, vch.end() - 10);
+    vchRef.erase(vchRef.begin() + 10, vchRef.end() - 10);
+    BOOST_CHECK(valtype(vch.begin(), vch.end()) == vchRef);
+    vch.resize(3);
+    BOOST_CHECK(CScriptValue(vchRef.begin(), vchRef.begin() + 3) == vch);
+}
+
+// Run both interpreters from the same stack: they have to agree on the
+// result, and on the stack when the script succeeds
+static void CheckAgainstLegacy(const vector<valtype>& stackIn, const CScript& script, const CTransaction& txTo, unsigned int nIn)
+{
+    vector<valtype> stackLegacy = stackIn;
+    bool fLegacy = legacy::LegacyEvalScript(stackLegacy, script, txTo, nIn, 0);
+
+    CScriptStack stack;
+    for (const valtype& vch : stackIn)
+        stack.push_back(CScriptValue(vch.begin(), vch.end()));
+    bool fResult = EvalScript(stack, script, txTo, nIn, 0);
+    BOOST_CHECK_MESSAGE(fResult == fLegacy, script.ToString());
+    if (fResult && fLegacy)
+    {
+        BOOST_CHECK_EQUAL(stack.size(), stackLegacy.size());
+        for (unsigned int i = 0; i < stack.size() && i < stackLegacy.size(); i++)
+            BOOST_CHECK(valtype(stack[i].begin(), stack[i].end()) == stackLegacy[i]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(script_interpreter_fuzz)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CTransaction txTo;
+    txTo.vin.resize(1);
+    txTo.vout.resize(1);
+    txTo.vout[0].nValue = 1;
+    vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(GetRandHash(), vchSig));
+    vchSig.push_back(SIGHASH_ALL);
+
+    // Pushes the generator picks from
+    vector<valtype> vPushes = EdgeNumbers();
+    vPushes.push_back(key.GetPubKey().Raw());
+    vPushes.push_back(vchSig);
+    vPushes.push_back(RandomBytes(80));
+    vPushes.push_back(RandomBytes(300));
+    for (int i = 0; i < 16; i++)
+        vPushes.push_back(RandomBytes(GetRandInt(8)));
+
+    for (int n = 0; n < 4000; n++)
+    {
+        vector<valtype> stack;
+        for (int i = GetRandInt(6); i > 0; i--)
+            stack.push_back(vPushes[GetRandInt(vPushes.size())]);
+
+        // Every opcode up to OP_NOP10, enabled or not, with pushes mixed in
+        CScript script;
+        for (int i = GetRandInt(24); i > 0; i--)
+        {
+            if (GetRandInt(3) == 0)
+                script << vPushes[GetRandInt(vPushes.size())];
+            else
+                script.push_back(OP_PUSHDATA4 + 1 + GetRandInt(OP_NOP10 - OP_PUSHDATA4));
+        }
+        // Sometimes a push that runs past the end
+        if (GetRandInt(20) == 0)
+            script.push_back(1 + GetRandInt(OP_PUSHDATA4));
+
+        CheckAgainstLegacy(stack, script, txTo, 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(script_interpreter_templates)
+{
+    CBasicKeyStore keystore;
+    CKey key[3];
+    for (int i = 0; i < 3; i++)
+    {
+        key[i].MakeNewKey(i != 1);
+        keystore.AddKey(key[i]);
+    }
+    vector<CKey> keys(key, key + 3);
+
+    CScript scriptMultisig;
+    scriptMultisig.SetMultisig(2, keys);
+    keystore.AddCScript(scriptMultisig);
+
+    vector<CScript> vScripts(6);
+    vScripts[0].SetDestination(key[0].GetPubKey().GetID());
+    vScripts[1] << key[1].GetPubKey() << OP_CHECKSIG;
+    vScripts[2] << key[0].GetPubKey() << OP_CHECKSIG;
+    vScripts[3] = scriptMultisig;
+    vScripts[4].SetMultisig(1, vector<CKey>(key, key + 2));
+    vScripts[5].SetDestination(scriptMultisig.GetID());
+
+    CTransaction txFrom;
+    for (unsigned int i = 0; i < vScripts.size(); i++)
+        txFrom.vout.push_back(CTxOut(1, vScripts[i]));
+    CTransaction txTo;
+    txTo.vout.push_back(CTxOut(1, CScript() << OP_1));
+    for (unsigned int i = 0; i < vScripts.size(); i++)
+        txTo.vin.push_back(CTxIn(COutPoint(txFrom.GetHash(), i)));
+    for (unsigned int i = 0; i < vScripts.size(); i++)
+        BOOST_CHECK(SignSignature(keystore, txFrom, txTo, i));
+
+    for (unsigned int i = 0; i < vScripts.size(); i++)
+    {
+        const CScript& scriptPubKey = vScripts[i];
+        vector<valtype> stack;
+        BOOST_CHECK(legacy::LegacyEvalScript(stack, txTo.vin[i].scriptSig, txTo, i, 0));
+        BOOST_CHECK(VerifyScript(txTo.vin[i].scriptSig, scriptPubKey, txTo, i, 0));
+        CheckAgainstLegacy(stack, scriptPubKey, txTo, i);
+        if (scriptPubKey.IsPayToScriptHash())
+            CheckAgainstLegacy(vector<valtype>(stack.begin(), stack.end() - 1), scriptMultisig, txTo, i);
+
+        // Broken spends, and stacks deep enough to hit the size limit
+        // while the script runs
+        for (int n = 0; n < 64; n++)
+        {
+            vector<valtype> stackBad = stack;
+            unsigned int nPos = GetRandInt(stackBad.size());
+            switch (n % 6)
+            {
+            case 0: stackBad.erase(stackBad.begin() + nPos); break;
+            case 1: stackBad.insert(stackBad.begin() + nPos, stackBad[nPos]); break;
+            case 2: swap(stackBad[nPos], stackBad[GetRandInt(stackBad.size())]); break;
+            case 3: if (!stackBad[nPos].empty()) stackBad[nPos][GetRandInt(stackBad[nPos].size())] ^= 1 << GetRandInt(8); break;
+            case 4: stackBad.insert(stackBad.begin(), valtype()); break;
+            case 5: stackBad.insert(stackBad.begin(), 995 + n / 6 % 6 - stackBad.size(), valtype()); break;
+            }
+            CheckAgainstLegacy(stackBad, scriptPubKey, txTo, i);
+
+            CScript scriptSig;
+            for (const valtype& vch : stackBad)
+                scriptSig << vch;
+            BOOST_CHECK_EQUAL(VerifyScript(scriptSig, scriptPubKey, txTo, i, 0),
+                              legacy::LegacyVerifyScript(scriptSig, scriptPubKey, txTo, i, 0));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
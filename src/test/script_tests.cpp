@@ -442,4 +442,40 @@ BOOST_AUTO_TEST_CASE(script_combineSigs)
     BOOST_CHECK(combined == partial3c);
 }
 
+BOOST_AUTO_TEST_CASE(script_sighash_context)
+{
+    // Hashes from the per-transaction midstates match SignatureHash for
+    // every input and hash type, code separators and scriptSigs included
+    const int nHashTypes[] = { SIGHASH_ALL, SIGHASH_NONE, SIGHASH_SINGLE, SIGHASH_ALL | SIGHASH_ANYONECANPAY,
+                               SIGHASH_NONE | SIGHASH_ANYONECANPAY, SIGHASH_SINGLE | SIGHASH_ANYONECANPAY, 0, 0x42 };
+    for (int n = 0; n < 50; n++)
+    {
+        CTransaction txTo;
+        txTo.nTime = 1400000000 + GetRandInt(1000000);
+        txTo.nLockTime = (n % 3 == 0) ? GetRandInt(500000) : 0;
+        txTo.vin.resize(1 + GetRandInt(n % 5 == 0 ? 300 : 10));
+        txTo.vout.resize(1 + GetRandInt(5));
+        for (unsigned int i = 0; i < txTo.vin.size(); i++)
+        {
+            txTo.vin[i].prevout = COutPoint(GetRandHash(), GetRandInt(4));
+            txTo.vin[i].scriptSig = CScript() << vector<unsigned char>(GetRandInt(80), 0x30) << GetRandInt(100);
+            txTo.vin[i].nSequence = (GetRandInt(2) == 0) ? std::numeric_limits<unsigned int>::max() : GetRandInt(1000);
+        }
+        for (unsigned int i = 0; i < txTo.vout.size(); i++)
+        {
+            txTo.vout[i].nValue = GetRand(100 * COIN);
+            txTo.vout[i].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20, i) << OP_EQUALVERIFY << OP_CHECKSIG;
+        }
+
+        CScript scriptCode = CScript() << OP_1 << OP_CODESEPARATOR << vector<unsigned char>(33, n) << OP_CHECKSIG;
+        if (n % 2)
+            scriptCode << OP_CODESEPARATOR << OP_DROP;
+
+        CSignatureHashContext sighash(txTo);
+        for (unsigned int i = 0; i <= txTo.vin.size(); i++)
+            for (unsigned int j = 0; j < sizeof(nHashTypes) / sizeof(nHashTypes[0]); j++)
+                BOOST_CHECK(sighash.SignatureHash(scriptCode, i, nHashTypes[j]) == SignatureHash(scriptCode, txTo, i, nHashTypes[j]));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -166,6 +166,31 @@ BOOST_AUTO_TEST_CASE(basic_transaction_tests)
     BOOST_CHECK_MESSAGE(!tx.CheckTransaction(), "Transaction with duplicate txins should be invalid.");
 }
 
+BOOST_AUTO_TEST_CASE(span_reader_tests)
+{
+    CTransaction tx;
+    tx.nTime = 1415491199;
+    tx.vin.resize(2);
+    tx.vin[1].prevout.n = 1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 5 * CENT;
+    tx.vout[0].scriptPubKey << OP_TRUE;
+    CDataStream stream(SER_DISK, CLIENT_VERSION);
+    stream << tx;
+
+    // Reads in place what the block store hands out of a mapped file
+    vector<char> vData(stream.begin(), stream.end());
+    CSpanReader reader(&vData[0], &vData[0] + vData.size(), SER_DISK, CLIENT_VERSION);
+    CTransaction txRead;
+    reader >> txRead;
+    BOOST_CHECK(txRead.GetHash() == tx.GetHash());
+    BOOST_CHECK(reader.empty());
+
+    // Running off the end of the span throws instead of reading past it
+    CSpanReader truncated(&vData[0], &vData[0] + vData.size() - 1, SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK_THROW(truncated >> txRead, std::ios_base::failure);
+}
+
 //
 // Helper: create two dummy transactions, each with
 // two outputs.  The first has 11 and 50 CENT outputs
@@ -0,0 +1,171 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(txdb_tests)
+
+BOOST_AUTO_TEST_CASE(txdb_batch_overlay)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(2);
+    tx.vout[0].nValue = 1;
+    uint256 hash = tx.GetHash();
+
+    CTxDB txdb;
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(!txdb.ContainsTx(hash));
+    BOOST_CHECK(txdb.AddTxIndex(tx, CDiskTxPos(1, 1, 1), 1));
+    BOOST_CHECK(txdb.ContainsTx(hash));
+
+    // pending writes replace each other
+    CTxIndex txindex;
+    BOOST_CHECK(txdb.ReadTxIndex(hash, txindex));
+    BOOST_CHECK(txindex.vSpent.size() == 2 && txindex.vSpent[1].IsNull());
+    txindex.vSpent[1] = CDiskTxPos(1, 1, 2);
+    BOOST_CHECK(txdb.UpdateTxIndex(hash, txindex));
+    BOOST_CHECK(txdb.ReadTxIndex(hash, txindex));
+    BOOST_CHECK(!txindex.vSpent[1].IsNull());
+
+    // pending deletes hide the key from both reads and Exists()
+    BOOST_CHECK(txdb.EraseTxIndex(tx));
+    BOOST_CHECK(!txdb.ReadTxIndex(hash, txindex));
+    BOOST_CHECK(!txdb.ContainsTx(hash));
+
+    BOOST_CHECK(txdb.AddTxIndex(tx, CDiskTxPos(1, 1, 1), 1));
+    BOOST_CHECK(txdb.ContainsTx(hash));
+
+    BOOST_CHECK(txdb.TxnAbort());
+    BOOST_CHECK(!txdb.ContainsTx(hash));
+}
+
+// A chain of nTx transactions, each spending the one before it
+static void MakeSpendChain(vector<CTransaction>& vtx, unsigned int nTx)
+{
+    vtx.resize(nTx);
+    for (unsigned int i = 0; i < nTx; i++)
+    {
+        vtx[i].nTime = i;
+        vtx[i].vin.resize(1);
+        vtx[i].vout.resize(1);
+        vtx[i].vout[0].nValue = i + 1;
+        if (i > 0)
+            vtx[i].vin[0].prevout = COutPoint(vtx[i - 1].GetHash(), 0);
+    }
+}
+
+// Replays the txindex traffic of ConnectBlock: every transaction reads and
+// updates the index of the output it spends, then adds its own
+static void ConnectSpendChain(CTxDB& txdb, const vector<CTransaction>& vtx)
+{
+    for (unsigned int i = 0; i < vtx.size(); i++)
+    {
+        if (i > 0)
+        {
+            uint256 hashPrev = vtx[i].vin[0].prevout.hash;
+            CTxIndex txindex;
+            BOOST_CHECK(txdb.ReadTxIndex(hashPrev, txindex));
+            BOOST_CHECK(txindex.vSpent[0].IsNull());
+            txindex.vSpent[0] = CDiskTxPos(1, 1, i + 1);
+            BOOST_CHECK(txdb.UpdateTxIndex(hashPrev, txindex));
+        }
+        BOOST_CHECK(txdb.AddTxIndex(vtx[i], CDiskTxPos(1, 1, i + 1), 1));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(txdb_connect_synthetic_block)
+{
+    // A block's worth of spends inside one db transaction
+    vector<CTransaction> vtx;
+    MakeSpendChain(vtx, 500);
+
+    CTxDB txdb;
+    BOOST_CHECK(txdb.TxnBegin());
+    ConnectSpendChain(txdb, vtx);
+
+    for (unsigned int i = 0; i < vtx.size(); i++)
+    {
+        CTxIndex txindex;
+        BOOST_CHECK(txdb.ReadTxIndex(vtx[i].GetHash(), txindex));
+        BOOST_CHECK(txindex.vSpent[0].IsNull() == (i == vtx.size() - 1));
+    }
+
+    // leave the test datadir as we found it
+    BOOST_CHECK(txdb.TxnAbort());
+    BOOST_CHECK(!txdb.ContainsTx(vtx[0].GetHash()));
+}
+
+#ifdef BENCH
+BOOST_AUTO_TEST_CASE(txdb_connect_benchmark)
+{
+    // The same traffic for a 5000 transaction block
+    vector<CTransaction> vtx;
+    MakeSpendChain(vtx, 5000);
+
+    CTxDB txdb;
+    int64_t nStart = GetTimeMicros();
+    BOOST_CHECK(txdb.TxnBegin());
+    ConnectSpendChain(txdb, vtx);
+    int64_t nConnect = GetTimeMicros() - nStart;
+    BOOST_CHECK(txdb.TxnAbort());
+
+    BOOST_TEST_MESSAGE(strprintf("connecting %" PRIszu " transactions: %" PRId64 "us", vtx.size(), nConnect));
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(txdb_cache_coherence)
+{
+    CTransaction tx;
+    tx.nTime = 1;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    uint256 hash = tx.GetHash();
+
+    CTxDB txdb;
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(txdb.AddTxIndex(tx, CDiskTxPos(1, 1, 1), 1));
+    BOOST_CHECK(txdb.TxnCommit());
+
+    // the second read is served from the cache
+    CTxIndex txindex;
+    BOOST_CHECK(txdb.ReadTxIndex(hash, txindex));
+    CTxDBCacheStats before;
+    GetTxDBCacheStats(before);
+    BOOST_CHECK(txdb.ReadTxIndex(hash, txindex));
+    CTxDBCacheStats after;
+    GetTxDBCacheStats(after);
+    BOOST_CHECK(after.nHits == before.nHits + 1);
+    BOOST_CHECK(after.nTxIndexEntries > 0);
+    BOOST_CHECK(txindex.vSpent[0].IsNull());
+
+    // a pending update is seen by its own batch only
+    CTxDB txdbOther("r");
+    BOOST_CHECK(txdb.TxnBegin());
+    txindex.vSpent[0] = CDiskTxPos(1, 1, 2);
+    BOOST_CHECK(txdb.UpdateTxIndex(hash, txindex));
+    BOOST_CHECK(txdb.ReadTxIndex(hash, txindex) && !txindex.vSpent[0].IsNull());
+    BOOST_CHECK(txdbOther.ReadTxIndex(hash, txindex) && txindex.vSpent[0].IsNull());
+
+    // an aborted batch leaves the cache as it was
+    BOOST_CHECK(txdb.TxnAbort());
+    BOOST_CHECK(txdb.ReadTxIndex(hash, txindex) && txindex.vSpent[0].IsNull());
+
+    // a committed one replaces the cached entry
+    BOOST_CHECK(txdb.TxnBegin());
+    txindex.vSpent[0] = CDiskTxPos(1, 1, 2);
+    BOOST_CHECK(txdb.UpdateTxIndex(hash, txindex));
+    BOOST_CHECK(txdb.TxnCommit());
+    BOOST_CHECK(txdbOther.ReadTxIndex(hash, txindex) && !txindex.vSpent[0].IsNull());
+
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(txdb.EraseTxIndex(tx));
+    BOOST_CHECK(txdb.TxnCommit());
+    BOOST_CHECK(!txdbOther.ReadTxIndex(hash, txindex));
+    BOOST_CHECK(!txdbOther.ContainsTx(hash));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
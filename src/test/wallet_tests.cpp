@@ -1,5 +1,6 @@
 #include <boost/test/unit_test.hpp>
 
+#include "init.h"
 #include "main.h"
 #include "wallet.h"
 
@@ -254,19 +255,22 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
             for (int i2 = 0; i2 < 100; i2++)
                 add_coin(COIN);
 
-            // picking 50 from 100 coins doesn't depend on the shuffle,
-            // but does depend on randomness in the stochastic approximation code
+            // the changeless search takes exactly enough of 100 identical
+            // coins, but which ones depends on the order ties are put in
             BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, 1, 6, vCoins, setCoinsRet , nValueRet));
+            BOOST_CHECK_EQUAL(nValueRet, 50 * COIN);
+            BOOST_CHECK_EQUAL(setCoinsRet.size(), 50);
             BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, 1, 6, vCoins, setCoinsRet2, nValueRet));
             BOOST_CHECK(!equal_sets(setCoinsRet, setCoinsRet2));
 
             int fails = 0;
             for (int i = 0; i < RANDOM_REPEATS; i++)
             {
-                // selecting 1 from 100 identical coins depends on the shuffle; this test will fail 1% of the time
+                // selecting 1 from 100 identical coins depends on the tie break; this test will fail 1% of the time
                 // run the test RANDOM_REPEATS times and only complain if all of them fail
                 BOOST_CHECK(wallet.SelectCoinsMinConf(COIN, 1, 6, vCoins, setCoinsRet , nValueRet));
                 BOOST_CHECK(wallet.SelectCoinsMinConf(COIN, 1, 6, vCoins, setCoinsRet2, nValueRet));
+                BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
                 if (equal_sets(setCoinsRet, setCoinsRet2))
                     fails++;
             }
@@ -280,16 +284,155 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
             fails = 0;
             for (int i = 0; i < RANDOM_REPEATS; i++)
             {
-                // selecting 1 from 100 identical coins depends on the shuffle; this test will fail 1% of the time
+                // selecting 1 from 100 identical coins depends on the tie break; this test will fail 1% of the time
                 // run the test RANDOM_REPEATS times and only complain if all of them fail
                 BOOST_CHECK(wallet.SelectCoinsMinConf(90*CENT, 1, 6, vCoins, setCoinsRet , nValueRet));
+                BOOST_CHECK_EQUAL(nValueRet, COIN);
                 BOOST_CHECK(wallet.SelectCoinsMinConf(90*CENT, 1, 6, vCoins, setCoinsRet2, nValueRet));
                 if (equal_sets(setCoinsRet, setCoinsRet2))
                     fails++;
             }
             BOOST_CHECK_NE(fails, RANDOM_REPEATS);
+
+            // 40 cents from the small change without any left over
+            BOOST_CHECK(wallet.SelectCoinsMinConf(40*CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+            BOOST_CHECK_EQUAL(nValueRet, 40*CENT);
         }
     }
 }
 
+// Balances summed over every wallet transaction, as they were before the
+// unspent index
+static void CheckBalancesAgainstScan(const CWallet* pwallet)
+{
+    int64_t nBalance = 0, nUnconfirmed = 0, nImmature = 0, nStake = 0, nNewMint = 0;
+    for (map<uint256, CWalletTx>::const_iterator it = pwallet->mapWallet.begin(); it != pwallet->mapWallet.end(); ++it)
+    {
+        const CWalletTx& wtx = (*it).second;
+        if (wtx.IsTrusted())
+            nBalance += wtx.GetAvailableCredit();
+        if (!wtx.IsFinal() || !wtx.IsTrusted())
+            nUnconfirmed += wtx.GetAvailableCredit();
+        if (wtx.IsCoinBase() && wtx.GetBlocksToMaturity() > 0 && wtx.IsInMainChain())
+            nImmature += pwallet->GetCredit(wtx);
+        if (wtx.IsCoinStake() && wtx.GetBlocksToMaturity() > 0 && wtx.GetDepthInMainChain() > 0)
+            nStake += pwallet->GetCredit(wtx);
+        if (wtx.IsCoinBase() && wtx.GetBlocksToMaturity() > 0 && wtx.GetDepthInMainChain() > 0)
+            nNewMint += pwallet->GetCredit(wtx);
+    }
+    BOOST_CHECK_EQUAL(pwallet->GetBalance(), nBalance);
+    BOOST_CHECK_EQUAL(pwallet->GetUnconfirmedBalance(), nUnconfirmed);
+    BOOST_CHECK_EQUAL(pwallet->GetImmatureBalance(), nImmature);
+    BOOST_CHECK_EQUAL(pwallet->GetStake(), nStake);
+    BOOST_CHECK_EQUAL(pwallet->GetNewMint(), nNewMint);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_unspent_balances)
+{
+    LOCK(pwalletMain->cs_wallet);
+    CKey key;
+    key.MakeNewKey(true);
+    pwalletMain->AddKey(key);
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(key.GetPubKey().GetID());
+
+    CheckBalancesAgainstScan(pwalletMain);
+    int64_t nUnconfirmed = pwalletMain->GetUnconfirmedBalance();
+
+    // A payment to us shows up at once, and again once it is partly spent
+    CTransaction txCredit;
+    txCredit.nLockTime = 1;
+    txCredit.vout.resize(2);
+    txCredit.vout[0].nValue = 5 * COIN;
+    txCredit.vout[0].scriptPubKey = scriptPubKey;
+    txCredit.vout[1].nValue = 3 * COIN;
+    txCredit.vout[1].scriptPubKey = scriptPubKey;
+    BOOST_CHECK(pwalletMain->AddToWallet(CWalletTx(pwalletMain, txCredit)));
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed + 8 * COIN);
+    CheckBalancesAgainstScan(pwalletMain);
+
+    CTransaction txSpend;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout = COutPoint(txCredit.GetHash(), 0);
+    txSpend.vout.resize(1);
+    txSpend.vout[0].nValue = 2 * COIN;
+    txSpend.vout[0].scriptPubKey = scriptPubKey;
+    BOOST_CHECK(pwalletMain->AddToWallet(CWalletTx(pwalletMain, txSpend)));
+    BOOST_CHECK(pwalletMain->mapWallet[txCredit.GetHash()].IsSpent(0));
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed + 5 * COIN);
+    CheckBalancesAgainstScan(pwalletMain);
+
+    // Spending the rest and forgetting the spend bring the output back
+    CTransaction txSpendRest;
+    txSpendRest.vin.resize(1);
+    txSpendRest.vin[0].prevout = COutPoint(txCredit.GetHash(), 1);
+    txSpendRest.vout.resize(1);
+    txSpendRest.vout[0].nValue = 3 * COIN;
+    BOOST_CHECK(pwalletMain->AddToWallet(CWalletTx(pwalletMain, txSpendRest)));
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed + 2 * COIN);
+    CheckBalancesAgainstScan(pwalletMain);
+
+    pwalletMain->mapWallet[txCredit.GetHash()].MarkUnspent(1);
+    pwalletMain->MarkDirty();
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed + 5 * COIN);
+    CheckBalancesAgainstScan(pwalletMain);
+
+    pwalletMain->EraseFromWallet(txSpendRest.GetHash());
+    pwalletMain->EraseFromWallet(txSpend.GetHash());
+    pwalletMain->EraseFromWallet(txCredit.GetHash());
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed);
+    CheckBalancesAgainstScan(pwalletMain);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_db_batch)
+{
+    const string& strFile = pwalletMain->strWalletFile;
+    CKeyPool keypool(pwalletMain->GenerateNewKey());
+    CKeyPool keypoolRead;
+    const int64_t nPool = 1000000;
+    const CDBEnv::BatchKey key(strFile, boost::this_thread::get_id());
+
+    {
+        CDBBatch batch(strFile);
+        CWalletDB walletdb(strFile);
+        BOOST_CHECK(walletdb.WritePool(nPool, keypool));
+        BOOST_CHECK(!bitdb.mapBatch[key].mapWrites.empty());
+
+        // Pending writes are seen by reads through any handle, and the
+        // last write to a key is the one kept
+        BOOST_CHECK(CWalletDB(strFile).ReadPool(nPool, keypoolRead));
+        BOOST_CHECK(keypoolRead.vchPubKey == keypool.vchPubKey);
+        BOOST_CHECK(walletdb.ErasePool(nPool));
+        BOOST_CHECK(!walletdb.ReadPool(nPool, keypoolRead));
+        BOOST_CHECK(walletdb.WritePool(nPool, keypool));
+        BOOST_CHECK_EQUAL(bitdb.mapBatch[key].mapWrites.size(), 1U);
+
+        // Nested batches commit with the outermost one
+        {
+            CDBBatch batchInner(strFile);
+            BOOST_CHECK(walletdb.WritePool(nPool + 1, keypool));
+        }
+        BOOST_CHECK_EQUAL(bitdb.mapBatch[key].mapWrites.size(), 2U);
+        BOOST_CHECK(batch.Commit());
+    }
+    BOOST_CHECK(!bitdb.mapBatch.count(key));
+
+    CWalletDB walletdb(strFile);
+    BOOST_CHECK(walletdb.ReadPool(nPool, keypoolRead));
+    BOOST_CHECK(keypoolRead.vchPubKey == keypool.vchPubKey);
+    BOOST_CHECK(walletdb.ReadPool(nPool + 1, keypoolRead));
+    BOOST_CHECK(walletdb.ErasePool(nPool));
+    BOOST_CHECK(walletdb.ErasePool(nPool + 1));
+    BOOST_CHECK(!walletdb.ReadPool(nPool, keypoolRead));
+
+    // A key written outside the batch, as from another thread, leaves it
+    {
+        CDBBatch batch(strFile);
+        BOOST_CHECK(CWalletDB(strFile).WritePool(nPool, keypool));
+        BOOST_CHECK(walletdb.ErasePool(nPool));
+        bitdb.Unbatch(strFile, bitdb.mapBatch[key].mapWrites.begin()->first);
+        BOOST_CHECK(bitdb.mapBatch[key].mapWrites.empty());
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -3,17 +3,22 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file license.txt or http://www.opensource.org/licenses/mit-license.php.
 
+#include <deque>
+#include <list>
 #include <map>
 
 #include <boost/version.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/thread.hpp>
 
 #include <leveldb/env.h>
 #include <leveldb/cache.h>
 #include <leveldb/filter_policy.h>
 #include <memenv/memenv.h>
 
+#include <openssl/sha.h>
+
 #include "kernel.h"
 #include "checkpoints.h"
 #include "txdb.h"
@@ -25,6 +30,18 @@ using namespace boost;
 
 leveldb::DB *txdb; // global pointer for LevelDB object instance
 
+// Number of block index entries decoded and hashed together at startup
+static const unsigned int BLOCKINDEX_LOAD_BATCH = 4096;
+// Decoded batches the reader thread may run ahead of LoadBlockIndex
+static const unsigned int BLOCKINDEX_LOAD_QUEUE = 8;
+// Entries per value of the persisted chain trust snapshot
+static const unsigned int BLOCKINDEX_SNAPSHOT_CHUNK = 16384;
+static const int BLOCKINDEX_SNAPSHOT_VERSION = 2;
+
+// Set once nChainTrust and nStakeModifierChecksum are valid for the whole
+// index, so a snapshot is never taken of a partially loaded one.
+static bool fBlockIndexComplete = false;
+
 static leveldb::Options GetOptions() {
     leveldb::Options options;
     int nCacheSizeMB = GetArg("-dbcache", 25);
@@ -33,6 +50,213 @@ static leveldb::Options GetOptions() {
     return options;
 }
 
+/** Memory-bounded LRU map from transaction hash to a decoded object. */
+template<typename V>
+class CTxDBCacheMap
+{
+private:
+    struct CEntry
+    {
+        uint256 hash;
+        V value;
+        size_t nBytes;
+    };
+    typedef std::list<CEntry> list_type;
+
+    list_type entries; // most recently used first
+    std::map<uint256, typename list_type::iterator> mapEntries;
+    size_t nBytes;
+    size_t nMaxBytes;
+
+public:
+    CTxDBCacheMap() : nBytes(0), nMaxBytes(0) {}
+
+    size_t size() const { return mapEntries.size(); }
+    size_t GetUsage() const { return nBytes; }
+
+    void SetMaxUsage(size_t nMaxBytesIn)
+    {
+        nMaxBytes = nMaxBytesIn;
+        while (nBytes > nMaxBytes)
+            EraseLast();
+    }
+
+    bool Get(const uint256& hash, V& value)
+    {
+        typename std::map<uint256, typename list_type::iterator>::iterator mi = mapEntries.find(hash);
+        if (mi == mapEntries.end())
+            return false;
+        entries.splice(entries.begin(), entries, mi->second);
+        value = mi->second->value;
+        return true;
+    }
+
+    void Put(const uint256& hash, const V& value, size_t nEntryBytes)
+    {
+        Erase(hash);
+        if (nEntryBytes > nMaxBytes)
+            return;
+        while (nBytes + nEntryBytes > nMaxBytes)
+            EraseLast();
+        CEntry entry;
+        entry.hash = hash;
+        entry.value = value;
+        entry.nBytes = nEntryBytes;
+        entries.push_front(entry);
+        mapEntries[hash] = entries.begin();
+        nBytes += nEntryBytes;
+    }
+
+    void Erase(const uint256& hash)
+    {
+        typename std::map<uint256, typename list_type::iterator>::iterator mi = mapEntries.find(hash);
+        if (mi == mapEntries.end())
+            return;
+        nBytes -= mi->second->nBytes;
+        entries.erase(mi->second);
+        mapEntries.erase(mi);
+    }
+
+    void Clear()
+    {
+        entries.clear();
+        mapEntries.clear();
+        nBytes = 0;
+    }
+
+private:
+    void EraseLast()
+    {
+        nBytes -= entries.back().nBytes;
+        mapEntries.erase(entries.back().hash);
+        entries.pop_back();
+    }
+};
+
+/**
+ * Decoded CTxIndex and CTransaction objects shared by every CTxDB, so hot
+ * prevouts don't go through LevelDB and a CDataStream on every lookup.
+ *
+ * Only committed state is cached: writes made inside a batch stay in the
+ * batch overlay and drop the cached entry when the batch is committed.
+ * Callers take a generation before reading disk and pass it to Put*(); any
+ * invalidation in between bumps the generation and the stale read is not
+ * cached. Transactions are immutable, but are keyed on their position too
+ * so a reorganisation that moves one never returns the old location.
+ */
+class CTxDBCache
+{
+private:
+    CCriticalSection cs;
+    CTxDBCacheMap<CTxIndex> mapTxIndex;
+    CTxDBCacheMap<std::pair<CDiskTxPos, CTransaction> > mapTx;
+    uint64_t nGeneration;
+    uint64_t nHits;
+    uint64_t nMisses;
+
+    // Rough heap footprint of an entry including list and map nodes
+    static size_t Usage(const CTxIndex& txindex)
+    {
+        return sizeof(CTxIndex) + txindex.vSpent.size() * sizeof(CDiskTxPos) + 128;
+    }
+
+    static size_t Usage(const CTransaction& tx)
+    {
+        return sizeof(CTransaction) + 2 * ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION) + 128;
+    }
+
+public:
+    CTxDBCache() : nGeneration(0), nHits(0), nMisses(0) {}
+
+    void SetMaxUsage(size_t nMaxBytes)
+    {
+        LOCK(cs);
+        // The index entries are smaller and read far more often
+        mapTxIndex.SetMaxUsage(nMaxBytes / 2);
+        mapTx.SetMaxUsage(nMaxBytes - nMaxBytes / 2);
+    }
+
+    uint64_t GetGeneration()
+    {
+        LOCK(cs);
+        return nGeneration;
+    }
+
+    bool GetTxIndex(const uint256& hash, CTxIndex& txindex)
+    {
+        LOCK(cs);
+        if (mapTxIndex.Get(hash, txindex))
+        {
+            nHits++;
+            return true;
+        }
+        nMisses++;
+        return false;
+    }
+
+    void PutTxIndex(const uint256& hash, const CTxIndex& txindex, uint64_t nGenerationRead)
+    {
+        LOCK(cs);
+        if (nGenerationRead == nGeneration)
+            mapTxIndex.Put(hash, txindex, Usage(txindex));
+    }
+
+    bool GetTx(const uint256& hash, const CDiskTxPos& pos, CTransaction& tx)
+    {
+        LOCK(cs);
+        std::pair<CDiskTxPos, CTransaction> entry;
+        if (mapTx.Get(hash, entry) && entry.first == pos)
+        {
+            nHits++;
+            tx = entry.second;
+            return true;
+        }
+        nMisses++;
+        return false;
+    }
+
+    void PutTx(const uint256& hash, const CDiskTxPos& pos, const CTransaction& tx)
+    {
+        LOCK(cs);
+        mapTx.Put(hash, std::make_pair(pos, tx), Usage(tx));
+    }
+
+    template<typename I>
+    void Invalidate(I begin, I end)
+    {
+        LOCK(cs);
+        for (I it = begin; it != end; ++it)
+            mapTxIndex.Erase(*it);
+        nGeneration++;
+    }
+
+    void Clear()
+    {
+        LOCK(cs);
+        mapTxIndex.Clear();
+        mapTx.Clear();
+        nGeneration++;
+    }
+
+    void GetStats(CTxDBCacheStats& stats)
+    {
+        LOCK(cs);
+        stats.nTxIndexEntries = mapTxIndex.size();
+        stats.nTxEntries = mapTx.size();
+        stats.nBytes = mapTxIndex.GetUsage() + mapTx.GetUsage();
+        stats.nHits = nHits;
+        stats.nMisses = nMisses;
+    }
+};
+
+static CTxDBCache txdbcache;
+
+void GetTxDBCacheStats(CTxDBCacheStats& stats)
+{
+    txdbcache.GetStats(stats);
+    stats.nMaxBytes = GetArg("-txcache", DEFAULT_TXCACHE_MB) * 1048576;
+}
+
 void init_blockindex(leveldb::Options& options, bool fRemoveOld = false) {
     // First time init.
     filesystem::path directory = GetDataDir() / "txleveldb";
@@ -69,6 +293,7 @@ CTxDB::CTxDB(const char* pszMode)
 {
     assert(pszMode);
     activeBatch = NULL;
+    activeOverlay = NULL;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
 
     if (txdb) {
@@ -84,6 +309,8 @@ CTxDB::CTxDB(const char* pszMode)
 
     init_blockindex(options); // Init directory
     pdb = txdb;
+    txdbcache.Clear();
+    txdbcache.SetMaxUsage(GetArg("-txcache", DEFAULT_TXCACHE_MB) * 1048576);
 
     if (Exists(string("version")))
     {
@@ -99,6 +326,10 @@ CTxDB::CTxDB(const char* pszMode)
             txdb = pdb = NULL;
             delete activeBatch;
             activeBatch = NULL;
+            delete activeOverlay;
+            activeOverlay = NULL;
+            vTxnTxIndex.clear();
+            txdbcache.Clear();
 
             init_blockindex(options, true); // Remove directory and create new database
             pdb = txdb;
@@ -130,12 +361,17 @@ void CTxDB::Close()
     options.block_cache = NULL;
     delete activeBatch;
     activeBatch = NULL;
+    delete activeOverlay;
+    activeOverlay = NULL;
+    vTxnTxIndex.clear();
+    txdbcache.Clear();
 }
 
 bool CTxDB::TxnBegin()
 {
     assert(!activeBatch);
     activeBatch = new leveldb::WriteBatch();
+    activeOverlay = new CBatchOverlay();
     return true;
 }
 
@@ -145,6 +381,12 @@ bool CTxDB::TxnCommit()
     leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
     delete activeBatch;
     activeBatch = NULL;
+    delete activeOverlay;
+    activeOverlay = NULL;
+    // Drop the cached entries the batch replaced, even if the write failed
+    // part way through.
+    txdbcache.Invalidate(vTxnTxIndex.begin(), vTxnTxIndex.end());
+    vTxnTxIndex.clear();
     if (!status.ok()) {
         printf("LevelDB batch commit failure: %s\n", status.ToString().c_str());
         return false;
@@ -152,61 +394,65 @@ bool CTxDB::TxnCommit()
     return true;
 }
 
-class CBatchScanner : public leveldb::WriteBatch::Handler {
-public:
-    std::string needle;
-    bool *deleted;
-    std::string *foundValue;
-    bool foundEntry;
-
-    CBatchScanner() : foundEntry(false) {}
-
-    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = false;
-            *foundValue = value.ToString();
-        }
-    }
-
-    virtual void Delete(const leveldb::Slice& key) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = true;
-        }
-    }
-};
-
 // When performing a read, if we have an active batch we need to check it first
 // before reading from the database, as the rest of the code assumes that once
-// a database transaction begins reads are consistent with it. It would be good
-// to change that assumption in future and avoid the performance hit, though in
-// practice it does not appear to be large.
+// a database transaction begins reads are consistent with it. The batch itself
+// can only be iterated front to back, so the lookup goes to the overlay map
+// that Write() and Erase() keep in step with it.
 bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) const {
-    assert(activeBatch);
+    assert(activeBatch && activeOverlay);
     *deleted = false;
-    CBatchScanner scanner;
-    scanner.needle = key.str();
-    scanner.deleted = deleted;
-    scanner.foundValue = value;
-    leveldb::Status status = activeBatch->Iterate(&scanner);
-    if (!status.ok()) {
-        throw runtime_error(status.ToString());
-    }
-    return scanner.foundEntry;
+    CBatchOverlay::const_iterator it = activeOverlay->find(key.str());
+    if (it == activeOverlay->end())
+        return false;
+    if (it->second.first)
+        *deleted = true;
+    else
+        *value = it->second.second;
+    return true;
+}
+
+bool CTxDB::InBatch(uint256 hash)
+{
+    if (!activeBatch)
+        return false;
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << make_pair(string("tx"), hash);
+    return activeOverlay->count(ssKey.str()) != 0;
+}
+
+// Called after the index of hash was written or erased. Outside a batch the
+// change is already on disk; inside one it becomes visible at TxnCommit.
+void CTxDB::InvalidateTxIndex(uint256 hash)
+{
+    if (activeBatch)
+        vTxnTxIndex.push_back(hash);
+    else
+        txdbcache.Invalidate(&hash, &hash + 1);
 }
 
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
 {
     assert(!fClient);
     txindex.SetNull();
-    return Read(make_pair(string("tx"), hash), txindex);
+    if (InBatch(hash))
+        return Read(make_pair(string("tx"), hash), txindex);
+
+    if (txdbcache.GetTxIndex(hash, txindex))
+        return true;
+    uint64_t nGeneration = txdbcache.GetGeneration();
+    if (!Read(make_pair(string("tx"), hash), txindex))
+        return false;
+    txdbcache.PutTxIndex(hash, txindex, nGeneration);
+    return true;
 }
 
 bool CTxDB::UpdateTxIndex(uint256 hash, const CTxIndex& txindex)
 {
     assert(!fClient);
-    return Write(make_pair(string("tx"), hash), txindex);
+    bool ret = Write(make_pair(string("tx"), hash), txindex);
+    InvalidateTxIndex(hash);
+    return ret;
 }
 
 bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight)
@@ -216,7 +462,9 @@ bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeigh
     // Add to tx index
     uint256 hash = tx.GetHash();
     CTxIndex txindex(pos, tx.vout.size());
-    return Write(make_pair(string("tx"), hash), txindex);
+    bool ret = Write(make_pair(string("tx"), hash), txindex);
+    InvalidateTxIndex(hash);
+    return ret;
 }
 
 bool CTxDB::EraseTxIndex(const CTransaction& tx)
@@ -224,22 +472,39 @@ bool CTxDB::EraseTxIndex(const CTransaction& tx)
     assert(!fClient);
     uint256 hash = tx.GetHash();
 
-    return Erase(make_pair(string("tx"), hash));
+    bool ret = Erase(make_pair(string("tx"), hash));
+    InvalidateTxIndex(hash);
+    return ret;
 }
 
 bool CTxDB::ContainsTx(uint256 hash)
 {
     assert(!fClient);
+    CTxIndex txindex;
+    if (!InBatch(hash) && txdbcache.GetTxIndex(hash, txindex))
+        return true;
     return Exists(make_pair(string("tx"), hash));
 }
 
+// Reads the transaction hash stored at pos, from the cache if it was read
+// from there before.
+bool CTxDB::ReadDiskTxAt(uint256 hash, const CDiskTxPos& pos, CTransaction& tx)
+{
+    if (txdbcache.GetTx(hash, pos, tx))
+        return true;
+    if (!tx.ReadFromDisk(pos))
+        return false;
+    txdbcache.PutTx(hash, pos, tx);
+    return true;
+}
+
 bool CTxDB::ReadDiskTx(uint256 hash, CTransaction& tx, CTxIndex& txindex)
 {
     assert(!fClient);
     tx.SetNull();
     if (!ReadTxIndex(hash, txindex))
         return false;
-    return (tx.ReadFromDisk(txindex.pos));
+    return ReadDiskTxAt(hash, txindex.pos, tx);
 }
 
 bool CTxDB::ReadDiskTx(uint256 hash, CTransaction& tx)
@@ -310,20 +575,450 @@ static CBlockIndex *InsertBlockIndex(uint256 hash)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = NewBlockIndex();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
     return pindexNew;
 }
 
+/** Header of the chain trust snapshot. The snapshot holds the nChainTrust
+ *  of every block index entry in LevelDB key order, and is only used if the
+ *  entries loaded hash to hashDigest.
+ */
+class CBlockIndexSnapshot
+{
+public:
+    int nVersion;
+    unsigned int nBlocks;
+    uint256 hashDigest;
+
+    CBlockIndexSnapshot()
+    {
+        nVersion = BLOCKINDEX_SNAPSHOT_VERSION;
+        nBlocks = 0;
+        hashDigest = 0;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nVersion);
+        READWRITE(nBlocks);
+        READWRITE(hashDigest);
+    )
+};
+
+typedef vector<uint256> CBlockIndexSnapshotChunk;
+
+/** Iterates the "blockindex" entries on a background thread, decoding and
+ *  hashing them a batch at a time while LoadBlockIndex links the batches
+ *  already handed out.
+ */
+class CBlockIndexReader
+{
+private:
+    leveldb::Iterator *iterator;
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    deque<vector<CDiskBlockIndex> > queue;
+    bool fDone;
+    bool fFailed;
+    bool fStop;
+    boost::thread thread;
+
+    void Run()
+    {
+        RenameThread("blocknet-loadidx");
+        try
+        {
+            CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+            ssStartKey << make_pair(string("blockindex"), uint256());
+            iterator->Seek(ssStartKey.str());
+
+            bool fEnd = false;
+            while (!fEnd)
+            {
+                vector<CDiskBlockIndex> vBatch;
+                vBatch.reserve(BLOCKINDEX_LOAD_BATCH);
+                while (vBatch.size() < BLOCKINDEX_LOAD_BATCH)
+                {
+                    if (!iterator->Valid())
+                    {
+                        fEnd = true;
+                        break;
+                    }
+                    // Unpack keys and values.
+                    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+                    ssKey.write(iterator->key().data(), iterator->key().size());
+                    string strType;
+                    ssKey >> strType;
+                    // Did we reach the end of the data to read?
+                    if (fRequestShutdown || strType != "blockindex")
+                    {
+                        fEnd = true;
+                        break;
+                    }
+                    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+                    ssValue.write(iterator->value().data(), iterator->value().size());
+                    vBatch.push_back(CDiskBlockIndex());
+                    ssValue >> vBatch.back();
+                    iterator->Next();
+                }
+                CDiskBlockIndex::ComputeBlockHashes(vBatch);
+
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queue.size() >= BLOCKINDEX_LOAD_QUEUE && !fStop)
+                    cond.wait(lock);
+                if (fStop)
+                    return;
+                if (!vBatch.empty())
+                {
+                    queue.push_back(vector<CDiskBlockIndex>());
+                    queue.back().swap(vBatch);
+                }
+                fDone = fEnd;
+                cond.notify_all();
+            }
+        }
+        catch (std::exception& e)
+        {
+            printf("LoadBlockIndex() : block index entry unreadable: %s\n", e.what());
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fFailed = fDone = true;
+            cond.notify_all();
+        }
+    }
+
+public:
+    CBlockIndexReader(leveldb::DB *pdb) : fDone(false), fFailed(false), fStop(false)
+    {
+        iterator = pdb->NewIterator(leveldb::ReadOptions());
+        thread = boost::thread(boost::bind(&CBlockIndexReader::Run, this));
+    }
+
+    ~CBlockIndexReader()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+            cond.notify_all();
+        }
+        thread.join();
+        delete iterator;
+    }
+
+    // Takes the next batch of entries with their hashes computed. Returns
+    // false once all of them have been handed out or reading failed.
+    bool Next(vector<CDiskBlockIndex>& vBatch)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (queue.empty() && !fDone)
+            cond.wait(lock);
+        if (queue.empty() || fFailed)
+            return false;
+        vBatch.swap(queue.front());
+        queue.pop_front();
+        cond.notify_all();
+        return true;
+    }
+
+    bool Failed()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return fFailed;
+    }
+};
+
+// Digest of the block hashes in LevelDB key order, which is memcmp order of
+// the raw hashes since they follow the same "blockindex" prefix.
+static uint256 GetBlockIndexDigest(const vector<CBlockIndex*>& vIndex)
+{
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    for (const CBlockIndex* pindex : vIndex)
+        SHA256_Update(&ctx, pindex->phashBlock, sizeof(uint256));
+    uint256 hash;
+    SHA256_Final((unsigned char*)&hash, &ctx);
+    return hash;
+}
+
+static bool BlockIndexKeyLess(const CBlockIndex* a, const CBlockIndex* b)
+{
+    return memcmp(a->phashBlock, b->phashBlock, sizeof(uint256)) < 0;
+}
+
+// Fill in nChainTrust from the snapshot, if it was taken of exactly the
+// entries in vIndex.
+bool CTxDB::ReadBlockIndexSnapshot(const vector<CBlockIndex*>& vIndex)
+{
+    CBlockIndexSnapshot snapshot;
+    if (!Read(string("indexsnapshot"), snapshot))
+        return false;
+    if (snapshot.nVersion != BLOCKINDEX_SNAPSHOT_VERSION || snapshot.nBlocks != vIndex.size() ||
+        snapshot.hashDigest != GetBlockIndexDigest(vIndex))
+        return false;
+
+    unsigned int nChunk = 0;
+    for (unsigned int i = 0; i < vIndex.size(); i += BLOCKINDEX_SNAPSHOT_CHUNK)
+    {
+        CBlockIndexSnapshotChunk chunk;
+        if (!Read(make_pair(string("indexsnapshot"), nChunk++), chunk) ||
+            chunk.size() != min((size_t)BLOCKINDEX_SNAPSHOT_CHUNK, vIndex.size() - i))
+            return false;
+        for (unsigned int j = 0; j < chunk.size(); j++)
+            vIndex[i + j]->nChainTrust = chunk[j];
+    }
+    return true;
+}
+
+bool CTxDB::WriteBlockIndexSnapshot()
+{
+    if (!fBlockIndexComplete)
+        return false;
+
+    vector<CBlockIndex*> vIndex;
+    vIndex.reserve(mapBlockIndex.size());
+    for (const BlockMap::value_type& item : mapBlockIndex)
+        vIndex.push_back(item.second);
+    sort(vIndex.begin(), vIndex.end(), BlockIndexKeyLess);
+
+    CBlockIndexSnapshot snapshot;
+    snapshot.nBlocks = vIndex.size();
+    snapshot.hashDigest = GetBlockIndexDigest(vIndex);
+
+    if (!TxnBegin())
+        return false;
+    unsigned int nChunk = 0;
+    for (unsigned int i = 0; i < vIndex.size(); i += BLOCKINDEX_SNAPSHOT_CHUNK)
+    {
+        CBlockIndexSnapshotChunk chunk;
+        for (unsigned int j = i; j < vIndex.size() && j < i + BLOCKINDEX_SNAPSHOT_CHUNK; j++)
+            chunk.push_back(vIndex[j]->nChainTrust);
+        Write(make_pair(string("indexsnapshot"), nChunk++), chunk);
+    }
+    Write(string("indexsnapshot"), snapshot);
+    return TxnCommit();
+}
+
+/** Verifies the blocks at the tip of the best chain for -checkblocks on a
+ *  pool of threads. Each block is read and checked on its own; the fork
+ *  point is reduced afterwards so that, as with a walk down from the tip,
+ *  it is the parent of the lowest bad block.
+ */
+class CBlockVerifier
+{
+private:
+    int nCheckLevel;
+    vector<CBlockIndex*> vIndex;
+    vector<char> vBad;
+    // height of the block at each (nFile, nBlockPos), for check level 4
+    map<pair<unsigned int, unsigned int>, int> mapBlockPos;
+
+    CCriticalSection cs;
+    unsigned int nNext;
+    bool fReadFailed;
+    int64_t nReadMicros;
+    int64_t nCheckMicros;
+    int64_t nIndexMicros;
+
+    bool CheckTxIndex(CTxDB& txdb, const CBlockIndex* pindex, const CBlock& block);
+    void ThreadVerify();
+
+public:
+    CBlockVerifier(int nCheckLevelIn) : nCheckLevel(nCheckLevelIn), nNext(0), fReadFailed(false),
+        nReadMicros(0), nCheckMicros(0), nIndexMicros(0) {}
+
+    // Blocks are added from the tip down
+    void Add(CBlockIndex* pindex)
+    {
+        vIndex.push_back(pindex);
+        if (nCheckLevel>1)
+            mapBlockPos[make_pair(pindex->nFile, pindex->nBlockPos)] = pindex->nHeight;
+    }
+
+    bool Run(int nThreads);
+
+    CBlockIndex* GetFork() const
+    {
+        CBlockIndex* pindexFork = NULL;
+        for (unsigned int i = 0; i < vIndex.size(); i++)
+            if (vBad[i])
+                pindexFork = vIndex[i]->pprev;
+        return pindexFork;
+    }
+};
+
+// Transaction index checks of levels 2 to 6 for one block
+bool CBlockVerifier::CheckTxIndex(CTxDB& txdb, const CBlockIndex* pindex, const CBlock& block)
+{
+    bool fGood = true;
+    for (const CTransaction &tx : block.vtx)
+    {
+        uint256 hashTx = tx.GetHash();
+        CTxIndex txindex;
+        if (txdb.ReadTxIndex(hashTx, txindex))
+        {
+            // check level 3: checker transaction hashes
+            if (nCheckLevel>2 || pindex->nFile != txindex.pos.nFile || pindex->nBlockPos != txindex.pos.nBlockPos)
+            {
+                // either an error or a duplicate transaction
+                CTransaction txFound;
+                if (!txFound.ReadFromDisk(txindex.pos))
+                {
+                    printf("LoadBlockIndex() : *** cannot read mislocated transaction %s\n", hashTx.ToString().c_str());
+                    fGood = false;
+                }
+                else
+                    if (txFound.GetHash() != hashTx) // not a duplicate tx
+                    {
+                        printf("LoadBlockIndex(): *** invalid tx position for %s\n", hashTx.ToString().c_str());
+                        fGood = false;
+                    }
+            }
+            // check level 4: check whether spent txouts were spent within the main chain
+            unsigned int nOutput = 0;
+            if (nCheckLevel>3)
+            {
+                for (const CDiskTxPos &txpos : txindex.vSpent)
+                {
+                    if (!txpos.IsNull())
+                    {
+                        // the spend must be in this block or one above it
+                        map<pair<unsigned int, unsigned int>, int>::const_iterator mi = mapBlockPos.find(make_pair(txpos.nFile, txpos.nBlockPos));
+                        if (mi == mapBlockPos.end() || mi->second < pindex->nHeight)
+                        {
+                            printf("LoadBlockIndex(): *** found bad spend at %d, hashBlock=%s, hashTx=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str(), hashTx.ToString().c_str());
+                            fGood = false;
+                        }
+                        // check level 6: check whether spent txouts were spent by a valid transaction that consume them
+                        if (nCheckLevel>5)
+                        {
+                            CTransaction txSpend;
+                            if (!txSpend.ReadFromDisk(txpos))
+                            {
+                                printf("LoadBlockIndex(): *** cannot read spending transaction of %s:%i from disk\n", hashTx.ToString().c_str(), nOutput);
+                                fGood = false;
+                            }
+                            else if (!txSpend.CheckTransaction())
+                            {
+                                printf("LoadBlockIndex(): *** spending transaction of %s:%i is invalid\n", hashTx.ToString().c_str(), nOutput);
+                                fGood = false;
+                            }
+                            else
+                            {
+                                bool fFound = false;
+                                for (const CTxIn &txin : txSpend.vin)
+                                    if (txin.prevout.hash == hashTx && txin.prevout.n == nOutput)
+                                        fFound = true;
+                                if (!fFound)
+                                {
+                                    printf("LoadBlockIndex(): *** spending transaction of %s:%i does not spend it\n", hashTx.ToString().c_str(), nOutput);
+                                    fGood = false;
+                                }
+                            }
+                        }
+                    }
+                    nOutput++;
+                }
+            }
+        }
+        // check level 5: check whether all prevouts are marked spent
+        if (nCheckLevel>4)
+        {
+             for (const CTxIn &txin : tx.vin)
+             {
+                  CTxIndex txindex;
+                  if (txdb.ReadTxIndex(txin.prevout.hash, txindex))
+                      if (txindex.vSpent.size()-1 < txin.prevout.n || txindex.vSpent[txin.prevout.n].IsNull())
+                      {
+                          printf("LoadBlockIndex(): *** found unspent prevout %s:%i in %s\n", txin.prevout.hash.ToString().c_str(), txin.prevout.n, hashTx.ToString().c_str());
+                          fGood = false;
+                      }
+             }
+        }
+    }
+    return fGood;
+}
+
+void CBlockVerifier::ThreadVerify()
+{
+    CTxDB txdb("r");
+    int64_t nRead = 0, nCheck = 0, nIndex = 0;
+    while (!fRequestShutdown)
+    {
+        unsigned int i;
+        {
+            LOCK(cs);
+            if (fReadFailed || nNext == vIndex.size())
+                break;
+            i = nNext++;
+        }
+        CBlockIndex* pindex = vIndex[i];
+
+        int64_t nStart = GetTimeMicros();
+        CBlock block;
+        if (!block.ReadFromDisk(pindex))
+        {
+            LOCK(cs);
+            fReadFailed = true;
+            break;
+        }
+        int64_t nReadDone = GetTimeMicros();
+        nRead += nReadDone - nStart;
+
+        // check level 1: verify block validity
+        // check level 7: verify block signature too
+        if (nCheckLevel>0 && !block.CheckBlock(true, true, (nCheckLevel>6)))
+        {
+            printf("LoadBlockIndex() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+            vBad[i] = true;
+        }
+        int64_t nCheckDone = GetTimeMicros();
+        nCheck += nCheckDone - nReadDone;
+
+        // check level 2: verify transaction index validity
+        if (nCheckLevel>1 && !CheckTxIndex(txdb, pindex, block))
+            vBad[i] = true;
+        nIndex += GetTimeMicros() - nCheckDone;
+    }
+
+    LOCK(cs);
+    nReadMicros += nRead;
+    nCheckMicros += nCheck;
+    nIndexMicros += nIndex;
+}
+
+bool CBlockVerifier::Run(int nThreads)
+{
+    int64_t nStart = GetTimeMillis();
+    vBad.assign(vIndex.size(), false);
+    if (nThreads > (int)vIndex.size())
+        nThreads = max((int)vIndex.size(), 1);
+
+    boost::thread_group threads;
+    try
+    {
+        for (int i = 1; i < nThreads; i++)
+            threads.create_thread(boost::bind(&CBlockVerifier::ThreadVerify, this));
+    }
+    catch (boost::thread_resource_error& e)
+    {
+        // Verify with the threads we have
+    }
+    ThreadVerify();
+    threads.join_all();
+
+    // Thread times are summed, so the split shows where the work went
+    printf("Verified %" PRIszu " blocks in %" PRId64 "ms on %d threads: reading %" PRId64 "ms, checking %" PRId64 "ms, tx index %" PRId64 "ms\n",
+      vIndex.size(), GetTimeMillis() - nStart, nThreads, nReadMicros / 1000, nCheckMicros / 1000, nIndexMicros / 1000);
+    return !fReadFailed;
+}
+
 bool CTxDB::LoadBlockIndex()
 {
     if (mapBlockIndex.size() > 0) {
@@ -331,90 +1026,115 @@ bool CTxDB::LoadBlockIndex()
         // from BDB.
         return true;
     }
+    fBlockIndexComplete = false;
+
+    // The last snapshot knows how many entries to expect
+    bool fUseSnapshot = GetBoolArg("-indexsnapshot", true);
+    CBlockIndexSnapshot snapshot;
+    if (fUseSnapshot && Read(string("indexsnapshot"), snapshot))
+        mapBlockIndex.rehash(snapshot.nBlocks);
+
     // The block index is an in-memory structure that maps hashes to on-disk
     // locations where the contents of the block can be found. Here, we scan it
-    // out of the DB and into mapBlockIndex.
-    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
-    // Seek to start key.
-    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
-    ssStartKey << make_pair(string("blockindex"), uint256());
-    iterator->Seek(ssStartKey.str());
-    // Now read each entry.
-    while (iterator->Valid())
-    {
-        // Unpack keys and values.
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
-        string strType;
-        ssKey >> strType;
-        // Did we reach the end of the data to read?
-        if (fRequestShutdown || strType != "blockindex")
-            break;
-        CDiskBlockIndex diskindex;
-        ssValue >> diskindex;
-
-        uint256 blockHash = diskindex.GetBlockHash();
-
-        // Construct block index object
-        CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
-        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-        pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
-        pindexNew->nFile          = diskindex.nFile;
-        pindexNew->nBlockPos      = diskindex.nBlockPos;
-        pindexNew->nHeight        = diskindex.nHeight;
-        pindexNew->nMint          = diskindex.nMint;
-        pindexNew->nMoneySupply   = diskindex.nMoneySupply;
-        pindexNew->nFlags         = diskindex.nFlags;
-        pindexNew->nStakeModifier = diskindex.nStakeModifier;
-        pindexNew->prevoutStake   = diskindex.prevoutStake;
-        pindexNew->nStakeTime     = diskindex.nStakeTime;
-        pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
-        pindexNew->nVersion       = diskindex.nVersion;
-        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-        pindexNew->nTime          = diskindex.nTime;
-        pindexNew->nBits          = diskindex.nBits;
-        pindexNew->nNonce         = diskindex.nNonce;
-
-        // Watch for genesis block
-        if (pindexGenesisBlock == NULL && blockHash == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
-            pindexGenesisBlock = pindexNew;
-
-        if (!pindexNew->CheckIndex()) {
-            delete iterator;
-            return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+    // out of the DB and into mapBlockIndex. The reader thread decodes and
+    // hashes the next batches while this one links them.
+    vector<CBlockIndex*> vLoaded;
+    {
+        CBlockIndexReader reader(pdb);
+        vector<CDiskBlockIndex> vDiskIndex;
+        while (reader.Next(vDiskIndex))
+        {
+            for (const CDiskBlockIndex& diskindex : vDiskIndex)
+            {
+                uint256 blockHash = diskindex.GetBlockHash();
+
+                // Construct block index object
+                CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
+                pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+                pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
+                pindexNew->nFile          = diskindex.nFile;
+                pindexNew->nBlockPos      = diskindex.nBlockPos;
+                pindexNew->nHeight        = diskindex.nHeight;
+                pindexNew->nMint          = diskindex.nMint;
+                pindexNew->nMoneySupply   = diskindex.nMoneySupply;
+                pindexNew->nFlags         = diskindex.nFlags;
+                pindexNew->nStakeModifier = diskindex.nStakeModifier;
+                pindexNew->prevoutStake   = diskindex.prevoutStake;
+                pindexNew->nStakeTime     = diskindex.nStakeTime;
+                pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
+                pindexNew->nVersion       = diskindex.nVersion;
+                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+                pindexNew->nTime          = diskindex.nTime;
+                pindexNew->nBits          = diskindex.nBits;
+                pindexNew->nNonce         = diskindex.nNonce;
+                vLoaded.push_back(pindexNew);
+
+                // Watch for genesis block
+                if (pindexGenesisBlock == NULL && blockHash == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
+                    pindexGenesisBlock = pindexNew;
+
+                if (!pindexNew->CheckIndex())
+                    return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+
+                // NovaCoin: build setStakeSeen
+                if (pindexNew->IsProofOfStake())
+                    setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+            }
         }
-
-        // NovaCoin: build setStakeSeen
-        if (pindexNew->IsProofOfStake())
-            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
-
-        iterator->Next();
+        if (reader.Failed())
+            return error("LoadBlockIndex() : failed to read the block index");
     }
-    delete iterator;
 
     if (fRequestShutdown)
         return true;
 
-    // Calculate nChainTrust
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    for (const PAIRTYPE(uint256, CBlockIndex*)& item : mapBlockIndex)
+    // Take nChainTrust from the snapshot if it matches; entries referenced
+    // but not stored never do. The stake modifier checksums are computed
+    // again, each after its parent's, so the checkpoints check what the
+    // stored modifiers hash to.
+    if (fUseSnapshot && vLoaded.size() == mapBlockIndex.size() && ReadBlockIndexSnapshot(vLoaded))
     {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+        printf("LoadBlockIndex(): chain trust loaded from snapshot\n");
+        set<CBlockIndex*> setChecksummed;
+        vector<CBlockIndex*> vPending;
+        for (CBlockIndex* pindexLoaded : vLoaded)
+        {
+            for (CBlockIndex* pindex = pindexLoaded; pindex && !setChecksummed.count(pindex); pindex = pindex->pprev)
+                vPending.push_back(pindex);
+            while (!vPending.empty())
+            {
+                CBlockIndex* pindex = vPending.back();
+                vPending.pop_back();
+                // NovaCoin: calculate stake modifier checksum
+                pindex->nStakeModifierChecksum = GetStakeModifierChecksum(pindex);
+                if (!CheckStakeModifierCheckpoints(pindex->nHeight, pindex->nStakeModifierChecksum))
+                    return error("CTxDB::LoadBlockIndex() : Failed stake modifier checkpoint height=%d, modifier=0x%016" PRIx64, pindex->nHeight, pindex->nStakeModifier);
+                setChecksummed.insert(pindex);
+            }
+        }
     }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    for (const PAIRTYPE(int, CBlockIndex*)& item : vSortedByHeight)
+    else
     {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
-        // NovaCoin: calculate stake modifier checksum
-        pindex->nStakeModifierChecksum = GetStakeModifierChecksum(pindex);
-        if (!CheckStakeModifierCheckpoints(pindex->nHeight, pindex->nStakeModifierChecksum))
-            return error("CTxDB::LoadBlockIndex() : Failed stake modifier checkpoint height=%d, modifier=0x%016" PRIx64, pindex->nHeight, pindex->nStakeModifier);
+        // Calculate nChainTrust
+        vector<pair<int, CBlockIndex*> > vSortedByHeight;
+        vSortedByHeight.reserve(mapBlockIndex.size());
+        for (const BlockMap::value_type& item : mapBlockIndex)
+        {
+            CBlockIndex* pindex = item.second;
+            vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+        }
+        sort(vSortedByHeight.begin(), vSortedByHeight.end());
+        for (const PAIRTYPE(int, CBlockIndex*)& item : vSortedByHeight)
+        {
+            CBlockIndex* pindex = item.second;
+            pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
+            // NovaCoin: calculate stake modifier checksum
+            pindex->nStakeModifierChecksum = GetStakeModifierChecksum(pindex);
+            if (!CheckStakeModifierCheckpoints(pindex->nHeight, pindex->nStakeModifierChecksum))
+                return error("CTxDB::LoadBlockIndex() : Failed stake modifier checkpoint height=%d, modifier=0x%016" PRIx64, pindex->nHeight, pindex->nStakeModifier);
+        }
     }
+    fBlockIndexComplete = true;
 
     // Load hashBestChain pointer to end of best chain
     if (!ReadHashBestChain(hashBestChain))
@@ -426,6 +1146,7 @@ bool CTxDB::LoadBlockIndex()
     if (!mapBlockIndex.count(hashBestChain))
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
+    chainActive.SetTip(pindexBest);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexBest->nChainTrust;
 
@@ -451,113 +1172,16 @@ bool CTxDB::LoadBlockIndex()
     if (nCheckDepth > nBestHeight)
         nCheckDepth = nBestHeight;
     printf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
-    CBlockIndex* pindexFork = NULL;
-    map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
+    CBlockVerifier verifier(nCheckLevel);
     for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
     {
-        if (fRequestShutdown || pindex->nHeight < nBestHeight-nCheckDepth)
+        if (pindex->nHeight < nBestHeight-nCheckDepth)
             break;
-        CBlock block;
-        if (!block.ReadFromDisk(pindex))
-            return error("LoadBlockIndex() : block.ReadFromDisk failed");
-        // check level 1: verify block validity
-        // check level 7: verify block signature too
-        if (nCheckLevel>0 && !block.CheckBlock(true, true, (nCheckLevel>6)))
-        {
-            printf("LoadBlockIndex() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
-            pindexFork = pindex->pprev;
-        }
-        // check level 2: verify transaction index validity
-        if (nCheckLevel>1)
-        {
-            pair<unsigned int, unsigned int> pos = make_pair(pindex->nFile, pindex->nBlockPos);
-            mapBlockPos[pos] = pindex;
-            for (const CTransaction &tx : block.vtx)
-            {
-                uint256 hashTx = tx.GetHash();
-                CTxIndex txindex;
-                if (ReadTxIndex(hashTx, txindex))
-                {
-                    // check level 3: checker transaction hashes
-                    if (nCheckLevel>2 || pindex->nFile != txindex.pos.nFile || pindex->nBlockPos != txindex.pos.nBlockPos)
-                    {
-                        // either an error or a duplicate transaction
-                        CTransaction txFound;
-                        if (!txFound.ReadFromDisk(txindex.pos))
-                        {
-                            printf("LoadBlockIndex() : *** cannot read mislocated transaction %s\n", hashTx.ToString().c_str());
-                            pindexFork = pindex->pprev;
-                        }
-                        else
-                            if (txFound.GetHash() != hashTx) // not a duplicate tx
-                            {
-                                printf("LoadBlockIndex(): *** invalid tx position for %s\n", hashTx.ToString().c_str());
-                                pindexFork = pindex->pprev;
-                            }
-                    }
-                    // check level 4: check whether spent txouts were spent within the main chain
-                    unsigned int nOutput = 0;
-                    if (nCheckLevel>3)
-                    {
-                        for (const CDiskTxPos &txpos : txindex.vSpent)
-                        {
-                            if (!txpos.IsNull())
-                            {
-                                pair<unsigned int, unsigned int> posFind = make_pair(txpos.nFile, txpos.nBlockPos);
-                                if (!mapBlockPos.count(posFind))
-                                {
-                                    printf("LoadBlockIndex(): *** found bad spend at %d, hashBlock=%s, hashTx=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str(), hashTx.ToString().c_str());
-                                    pindexFork = pindex->pprev;
-                                }
-                                // check level 6: check whether spent txouts were spent by a valid transaction that consume them
-                                if (nCheckLevel>5)
-                                {
-                                    CTransaction txSpend;
-                                    if (!txSpend.ReadFromDisk(txpos))
-                                    {
-                                        printf("LoadBlockIndex(): *** cannot read spending transaction of %s:%i from disk\n", hashTx.ToString().c_str(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else if (!txSpend.CheckTransaction())
-                                    {
-                                        printf("LoadBlockIndex(): *** spending transaction of %s:%i is invalid\n", hashTx.ToString().c_str(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else
-                                    {
-                                        bool fFound = false;
-                                        for (const CTxIn &txin : txSpend.vin)
-                                            if (txin.prevout.hash == hashTx && txin.prevout.n == nOutput)
-                                                fFound = true;
-                                        if (!fFound)
-                                        {
-                                            printf("LoadBlockIndex(): *** spending transaction of %s:%i does not spend it\n", hashTx.ToString().c_str(), nOutput);
-                                            pindexFork = pindex->pprev;
-                                        }
-                                    }
-                                }
-                            }
-                            nOutput++;
-                        }
-                    }
-                }
-                // check level 5: check whether all prevouts are marked spent
-                if (nCheckLevel>4)
-                {
-                     for (const CTxIn &txin : tx.vin)
-                     {
-                          CTxIndex txindex;
-                          if (ReadTxIndex(txin.prevout.hash, txindex))
-                              if (txindex.vSpent.size()-1 < txin.prevout.n || txindex.vSpent[txin.prevout.n].IsNull())
-                              {
-                                  printf("LoadBlockIndex(): *** found unspent prevout %s:%i in %s\n", txin.prevout.hash.ToString().c_str(), txin.prevout.n, hashTx.ToString().c_str());
-                                  pindexFork = pindex->pprev;
-                              }
-                     }
-                }
-            }
-        }
+        verifier.Add(pindex);
     }
+    if (!verifier.Run(max(nScriptCheckThreads, 1)))
+        return error("LoadBlockIndex() : block.ReadFromDisk failed");
+    CBlockIndex* pindexFork = verifier.GetFork();
     if (pindexFork && !fRequestShutdown)
     {
         // Reorg back to the fork
@@ -15,6 +15,23 @@
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
+/** Default for -txcache, the decoded CTxIndex/CTransaction cache size in megabytes. */
+static const int DEFAULT_TXCACHE_MB = 16;
+
+struct CTxDBCacheStats
+{
+    uint64_t nTxIndexEntries;
+    uint64_t nTxEntries;
+    uint64_t nBytes;
+    uint64_t nMaxBytes;
+    uint64_t nHits;
+    uint64_t nMisses;
+
+    CTxDBCacheStats() : nTxIndexEntries(0), nTxEntries(0), nBytes(0), nMaxBytes(0), nHits(0), nMisses(0) {}
+};
+
+void GetTxDBCacheStats(CTxDBCacheStats& stats);
+
 // Class that provides access to a LevelDB. Note that this class is frequently
 // instantiated on the stack and then destroyed again, so instantiation has to
 // be very cheap. Unfortunately that means, a CTxDB instance is actually just a
@@ -35,6 +52,7 @@ public:
         // Note that this is not the same as Close() because it deletes only
         // data scoped to this TxDB object.
         delete activeBatch;
+        delete activeOverlay;
     }
 
     // Destroys the underlying shared global state accessed by this TxDB.
@@ -46,6 +64,17 @@ private:
     // A batch stores up writes and deletes for atomic application. When this
     // field is non-NULL, writes/deletes go there instead of directly to disk.
     leveldb::WriteBatch *activeBatch;
+
+    // Ordered in-memory view of activeBatch, maintained alongside it. Maps
+    // every key written or erased in the current transaction to whether it
+    // was erased and otherwise its latest value.
+    typedef std::map<std::string, std::pair<bool, std::string> > CBatchOverlay;
+    CBatchOverlay *activeOverlay;
+
+    // Transactions whose index was written or erased in the current batch.
+    // Their cached entries are dropped once the batch reaches disk.
+    std::vector<uint256> vTxnTxIndex;
+
     leveldb::Options options;
     bool fReadOnly;
     int nVersion;
@@ -53,7 +82,8 @@ private:
 protected:
     // Returns true and sets (value,false) if activeBatch contains the given key
     // or leaves value alone and sets deleted = true if activeBatch contains a
-    // delete for it.
+    // delete for it. Looks the key up in activeOverlay, so it is O(log n) in
+    // the number of pending changes.
     bool ScanBatch(const CDataStream &key, std::string *value, bool *deleted) const;
 
     template<typename K, typename T>
@@ -111,7 +141,11 @@ protected:
         ssValue << value;
 
         if (activeBatch) {
-            activeBatch->Put(ssKey.str(), ssValue.str());
+            std::string strKey = ssKey.str();
+            std::pair<bool, std::string>& entry = (*activeOverlay)[strKey];
+            entry.first = false;
+            entry.second = ssValue.str();
+            activeBatch->Put(strKey, entry.second);
             return true;
         }
         leveldb::Status status = pdb->Put(leveldb::WriteOptions(), ssKey.str(), ssValue.str());
@@ -134,7 +168,11 @@ protected:
         ssKey.reserve(1000);
         ssKey << key;
         if (activeBatch) {
-            activeBatch->Delete(ssKey.str());
+            std::string strKey = ssKey.str();
+            std::pair<bool, std::string>& entry = (*activeOverlay)[strKey];
+            entry.first = true;
+            entry.second.clear();
+            activeBatch->Delete(strKey);
             return true;
         }
         leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), ssKey.str());
@@ -151,9 +189,8 @@ protected:
 
         if (activeBatch) {
             bool deleted;
-            if (ScanBatch(ssKey, &unused, &deleted) && !deleted) {
-                return true;
-            }
+            if (ScanBatch(ssKey, &unused, &deleted))
+                return !deleted;
         }
 
 
@@ -169,6 +206,9 @@ public:
     {
         delete activeBatch;
         activeBatch = NULL;
+        delete activeOverlay;
+        activeOverlay = NULL;
+        vTxnTxIndex.clear();
         return true;
     }
 
@@ -192,6 +232,7 @@ public:
     bool ReadDiskTx(uint256 hash, CTransaction& tx);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx, CTxIndex& txindex);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx);
+    bool ReadDiskTxAt(uint256 hash, const CDiskTxPos& pos, CTransaction& tx);
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
     bool ReadHashBestChain(uint256& hashBestChain);
     bool WriteHashBestChain(uint256 hashBestChain);
@@ -202,8 +243,12 @@ public:
     bool ReadCheckpointPubKey(std::string& strPubKey);
     bool WriteCheckpointPubKey(const std::string& strPubKey);
     bool LoadBlockIndex();
+    bool WriteBlockIndexSnapshot();
 private:
     bool LoadBlockIndexGuts();
+    bool ReadBlockIndexSnapshot(const std::vector<CBlockIndex*>& vIndex);
+    bool InBatch(uint256 hash);
+    void InvalidateTxIndex(uint256 hash);
 };
 
 
@@ -33,6 +33,14 @@ struct CompareValueOnly
     }
 };
 
+struct CompareOutputValue
+{
+    bool operator()(const COutput& t1, const COutput& t2) const
+    {
+        return t1.tx->vout[t1.i].nValue < t2.tx->vout[t2.i].nValue;
+    }
+};
+
 CPubKey CWallet::GenerateNewKey()
 {
     bool fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
@@ -382,6 +390,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
                     printf("WalletUpdateSpent found spent coin %s SUM %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkSpent(txin.prevout.n);
                     wtx.WriteToDisk();
+                    UpdateUnspent(txin.prevout.hash);
                     NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
                 }
             }
@@ -399,6 +408,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
                 {
                     wtx.MarkUnspent(&txout - &tx.vout[0]);
                     wtx.WriteToDisk();
+                    UpdateUnspent(hash);
                     NotifyTransactionChanged(this, hash, CT_UPDATED);
                 }
             }
@@ -413,9 +423,50 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         for (PAIRTYPE(const uint256, CWalletTx)& item : mapWallet)
             item.second.MarkDirty();
+        RebuildUnspent();
     }
 }
 
+// Call while the transaction is still in mapWallet
+void CWallet::EraseUnspent(const uint256& hash)
+{
+    map<uint256, const CWalletTx*>::iterator mi = mapWalletUnspent.find(hash);
+    if (mi == mapWalletUnspent.end())
+        return;
+    const CWalletTx* pcoin = (*mi).second;
+    for (unsigned int i = 0; i < pcoin->vout.size(); i++)
+        setCoinsByValue.erase(make_pair(pcoin->vout[i].nValue, make_pair(pcoin, i)));
+    mapWalletUnspent.erase(mi);
+}
+
+void CWallet::UpdateUnspent(const uint256& hash)
+{
+    fBalancesCached = false;
+    EraseUnspent(hash);
+    map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+    if (mi != mapWallet.end())
+    {
+        const CWalletTx& wtx = (*mi).second;
+        for (unsigned int i = 0; i < wtx.vout.size(); i++)
+        {
+            if (!wtx.IsSpent(i) && IsMine(wtx.vout[i]))
+            {
+                mapWalletUnspent[hash] = &wtx;
+                setCoinsByValue.insert(make_pair(wtx.vout[i].nValue, make_pair(&wtx, i)));
+            }
+        }
+    }
+}
+
+void CWallet::RebuildUnspent()
+{
+    LOCK(cs_wallet);
+    mapWalletUnspent.clear();
+    setCoinsByValue.clear();
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateUnspent((*it).first);
+}
+
 bool CWallet::AddToWallet(const CWalletTx& wtxIn)
 {
     uint256 hash = wtxIn.GetHash();
@@ -525,6 +576,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
             }
         }
 #endif
+        UpdateUnspent(hash);
+
         // since AddToWallet is called directly for self-originating transactions, check for consumption of own coins
         WalletUpdateSpent(wtx, (wtxIn.hashBlock != 0));
 
@@ -574,8 +627,10 @@ bool CWallet::EraseFromWallet(uint256 hash)
         return false;
     {
         LOCK(cs_wallet);
+        EraseUnspent(hash);
         if (mapWallet.erase(hash))
             CWalletDB(strWalletFile).EraseTx(hash);
+        UpdateUnspent(hash);
     }
     return true;
 }
@@ -835,38 +890,338 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
-// Scan the block chain (starting in pindexStart) for transactions
-// from or to us. If fUpdate is true, found transactions that already
-// exist in the wallet will be updated.
-int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
+// Blocks the rescan readers may run ahead of the committer
+static const unsigned int WALLET_RESCAN_WINDOW = 64;
+
+/** The wallet's keys, scripts, transactions and owned outputs as they were
+ *  when a rescan started, so reader threads can test transactions without
+ *  taking the wallet lock. A transaction it matches may still turn out not
+ *  to be ours; one it does not match is not ours unless it spends an output
+ *  found earlier in the same rescan.
+ */
+class CWalletScanFilter
+{
+private:
+    set<CKeyID> setKeys;
+    map<CScriptID, CScript> mapScripts;
+    set<uint256> setWalletTx;
+    set<COutPoint> setOwned;
+
+public:
+    // Called with the wallet and keystore locked
+    void Load(const CWallet* pwallet, const map<CScriptID, CScript>& mapScriptsIn)
+    {
+        pwallet->GetKeys(setKeys);
+        mapScripts = mapScriptsIn;
+        for (map<uint256, CWalletTx>::const_iterator it = pwallet->mapWallet.begin(); it != pwallet->mapWallet.end(); ++it)
+        {
+            setWalletTx.insert(it->first);
+            const CWalletTx& wtx = it->second;
+            for (unsigned int i = 0; i < wtx.vout.size(); i++)
+                if (IsMine(wtx.vout[i].scriptPubKey))
+                    setOwned.insert(COutPoint(it->first, i));
+        }
+    }
+
+    // ::IsMine against the snapshot
+    bool IsMine(const CScript& scriptPubKey) const
+    {
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+        if (!Solver(scriptPubKey, whichType, vSolutions))
+            return false;
+
+        switch (whichType)
+        {
+        case TX_NONSTANDARD:
+            return false;
+        case TX_PUBKEY:
+            return setKeys.count(CPubKey(vSolutions[0]).GetID());
+        case TX_PUBKEYHASH:
+            return setKeys.count(CKeyID(uint160(vSolutions[0])));
+        case TX_SCRIPTHASH:
+        {
+            map<CScriptID, CScript>::const_iterator mi = mapScripts.find(CScriptID(uint160(vSolutions[0])));
+            return mi != mapScripts.end() && IsMine(mi->second);
+        }
+        case TX_MULTISIG:
+            for (unsigned int i = 1; i + 1 < vSolutions.size(); i++)
+                if (!setKeys.count(CPubKey(vSolutions[i]).GetID()))
+                    return false;
+            return true;
+        }
+        return false;
+    }
+
+    bool Matches(const CTransaction& tx, const uint256& hashTx) const
+    {
+        if (setWalletTx.count(hashTx))
+            return true;
+        for (const CTxOut& txout : tx.vout)
+            if (IsMine(txout.scriptPubKey))
+                return true;
+        if (!setOwned.empty())
+            for (const CTxIn& txin : tx.vin)
+                if (setOwned.count(txin.prevout))
+                    return true;
+        return false;
+    }
+};
+
+/** Rescans a stretch of the best chain. Reader threads read blocks ahead of
+ *  the calling thread and flag the transactions the filter matches; the
+ *  calling thread commits the flagged ones to the wallet in chain order,
+ *  taking the wallet lock one block at a time.
+ */
+class CWalletRescanner
+{
+private:
+    struct CScanSlot
+    {
+        CBlock block;
+        vector<char> vMatch;
+        bool fReady;
+
+        CScanSlot() : fReady(false) {}
+    };
+
+    CWallet* pwallet;
+    bool fUpdate;
+    vector<CBlockIndex*> vIndex;
+    const CWalletScanFilter& filter;
+    vector<CScanSlot> vSlots;
+    // outputs of transactions the rescan added, which the snapshot misses
+    set<COutPoint> setFound;
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    unsigned int nNext;
+    unsigned int nCommitted;
+    bool fStop;
+    int64_t nReadMicros;
+    int64_t nMatchMicros;
+
+    void ReadSlot(unsigned int i);
+    void ThreadRead();
+    int Commit(unsigned int i);
+
+public:
+    CWalletRescanner(CWallet* pwalletIn, bool fUpdateIn, const CWalletScanFilter& filterIn)
+        : pwallet(pwalletIn), fUpdate(fUpdateIn), filter(filterIn), vSlots(WALLET_RESCAN_WINDOW),
+          nNext(0), nCommitted(0), fStop(false), nReadMicros(0), nMatchMicros(0) {}
+
+    void Add(CBlockIndex* pindex) { vIndex.push_back(pindex); }
+
+    // Returns the number of transactions found, or -1 if they couldn't be
+    // written to the wallet file
+    int Run(int nThreads);
+};
+
+void CWalletRescanner::ReadSlot(unsigned int i)
+{
+    CScanSlot& slot = vSlots[i % WALLET_RESCAN_WINDOW];
+    int64_t nStart = GetTimeMicros();
+    slot.block.ReadFromDisk(vIndex[i], true);
+    int64_t nReadDone = GetTimeMicros();
+    slot.vMatch.assign(slot.block.vtx.size(), false);
+    for (unsigned int n = 0; n < slot.block.vtx.size(); n++)
+        slot.vMatch[n] = filter.Matches(slot.block.vtx[n], slot.block.vtx[n].GetHash());
+    int64_t nMatchDone = GetTimeMicros();
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    nReadMicros += nReadDone - nStart;
+    nMatchMicros += nMatchDone - nReadDone;
+    slot.fReady = true;
+    cond.notify_all();
+}
+
+void CWalletRescanner::ThreadRead()
 {
+    RenameThread("blocknet-rescan");
+    while (true)
+    {
+        unsigned int i;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fStop && nNext < vIndex.size() && nNext >= nCommitted + WALLET_RESCAN_WINDOW)
+                cond.wait(lock);
+            if (fStop || fRequestShutdown || nNext == vIndex.size())
+                break;
+            i = nNext++;
+        }
+        ReadSlot(i);
+    }
+}
+
+// Applies block i to the wallet, returning the number of transactions added
+// or updated
+int CWalletRescanner::Commit(unsigned int i)
+{
+    CScanSlot& slot = vSlots[i % WALLET_RESCAN_WINDOW];
     int ret = 0;
+    LOCK(pwallet->cs_wallet);
+    for (unsigned int n = 0; n < slot.block.vtx.size(); n++)
+    {
+        const CTransaction& tx = slot.block.vtx[n];
+        bool fMatch = slot.vMatch[n];
+        if (!fMatch && !setFound.empty())
+            for (const CTxIn& txin : tx.vin)
+                if (setFound.count(txin.prevout))
+                    fMatch = true;
+        if (!fMatch)
+            continue;
+
+        if (pwallet->AddToWalletIfInvolvingMe(tx, &slot.block, fUpdate))
+        {
+            ret++;
+            uint256 hashTx = tx.GetHash();
+            for (unsigned int j = 0; j < tx.vout.size(); j++)
+                if (pwallet->IsMine(tx.vout[j]))
+                    setFound.insert(COutPoint(hashTx, j));
+        }
+    }
+    slot.block.SetNull();
+    slot.vMatch.clear();
+    slot.fReady = false;
+    return ret;
+}
 
-    CBlockIndex* pindex = pindexStart;
+int CWalletRescanner::Run(int nThreads)
+{
+    int64_t nStart = GetTimeMillis();
+    int64_t nLastProgress = nStart;
+    int64_t nLastCheckpoint = nStart;
+
+    boost::thread_group threads;
+    try
     {
-        LOCK(cs_wallet);
-        while (pindex)
+        for (int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&CWalletRescanner::ThreadRead, this));
+    }
+    catch (boost::thread_resource_error& e)
+    {
+        // Read with the threads we have, if any
+    }
+
+    // What the rescan finds goes to disk a checkpoint at a time
+    bitdb.BeginBatch(pwallet->strWalletFile);
+
+    int ret = 0;
+    bool fFailed = false;
+    unsigned int i = 0;
+    for (; i < vIndex.size() && !fRequestShutdown; i++)
+    {
+        // Wait for the readers, or read the block here if none has claimed it
+        bool fRead = false;
         {
-            // no need to read and scan block, if block was created before
-            // our wallet birthday (as adjusted for block time variability)
-            if (nTimeFirstKey && (pindex->nTime < (nTimeFirstKey - 7200))) {
-                pindex = pindex->pnext;
-                continue;
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (nNext == i)
+            {
+                nNext++;
+                fRead = true;
             }
+            else
+                while (!vSlots[i % WALLET_RESCAN_WINDOW].fReady)
+                    cond.wait(lock);
+        }
+        if (fRead)
+            ReadSlot(i);
+
+        ret += Commit(i);
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nCommitted = i + 1;
+            cond.notify_all();
+        }
 
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
-            for (CTransaction& tx : block.vtx)
+        // Record how far the wallet has been scanned, so the next start
+        // rescans from here if this one gets interrupted
+        int64_t nNow = GetTimeMillis();
+        if (pwallet->fFileBacked && nNow - nLastCheckpoint > 60 * 1000)
+        {
+            // The locator jumps along chainActive, which needs cs_main
+            CBlockLocator locator;
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+                LOCK(cs_main);
+                locator.Set(vIndex[i]);
             }
-            pindex = pindex->pnext;
+            pwallet->SetBestChain(locator);
+            if (!bitdb.EndBatch(pwallet->strWalletFile))
+            {
+                // Checkpointing past blocks whose results were lost would
+                // keep them from being scanned again
+                fFailed = true;
+                break;
+            }
+            bitdb.BeginBatch(pwallet->strWalletFile);
+            nLastCheckpoint = nNow;
+        }
+        if (nNow - nLastProgress > 10 * 1000)
+        {
+            printf("Rescanning wallet: block %d, %u of %" PRIszu " (%d%%), %d transactions found\n",
+              vIndex[i]->nHeight, i + 1, vIndex.size(), (int)((i + 1) * 100 / vIndex.size()), ret);
+            nLastProgress = nNow;
         }
     }
+
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStop = true;
+        cond.notify_all();
+    }
+    threads.join_all();
+
+    if (fFailed)
+    {
+        printf("ERROR: CWalletRescanner::Run() : writing the rescan to %s failed at block %d\n", pwallet->strWalletFile.c_str(), vIndex[i]->nHeight);
+        return -1;
+    }
+
+    if (i > 0 && pwallet->fFileBacked)
+    {
+        CBlockLocator locator;
+        {
+            LOCK(cs_main);
+            locator.Set(vIndex[i - 1]);
+        }
+        pwallet->SetBestChain(locator);
+    }
+    if (!bitdb.EndBatch(pwallet->strWalletFile))
+    {
+        printf("ERROR: CWalletRescanner::Run() : writing the rescan to %s failed\n", pwallet->strWalletFile.c_str());
+        return -1;
+    }
+
+    // Thread times are summed, so the split shows where the work went
+    printf("Rescanned %u of %" PRIszu " blocks in %" PRId64 "ms on %d threads: reading %" PRId64 "ms, matching %" PRId64 "ms, %d transactions found\n",
+      i, vIndex.size(), GetTimeMillis() - nStart, nThreads, nReadMicros / 1000, nMatchMicros / 1000, ret);
     return ret;
 }
 
+// Scan the block chain (starting in pindexStart) for transactions
+// from or to us. If fUpdate is true, found transactions that already
+// exist in the wallet will be updated. Returns -1 if writing what was
+// found to the wallet file failed.
+int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
+{
+    CWalletScanFilter filter;
+    {
+        LOCK2(cs_wallet, cs_KeyStore);
+        filter.Load(this, mapScripts);
+    }
+
+    CWalletRescanner rescanner(this, fUpdate, filter);
+    for (CBlockIndex* pindex = pindexStart; pindex; pindex = pindex->pnext)
+    {
+        // no need to read and scan block, if block was created before
+        // our wallet birthday (as adjusted for block time variability)
+        if (nTimeFirstKey && (pindex->nTime < (nTimeFirstKey - 7200)))
+            continue;
+        rescanner.Add(pindex);
+    }
+    return rescanner.Run(max(nScriptCheckThreads, 1));
+}
+
 int CWallet::ScanForWalletTransaction(const uint256& hashTx)
 {
     CTransaction tx;
@@ -917,6 +1272,7 @@ void CWallet::ReacceptWalletTransactions()
                     printf("ReacceptWalletTransactions found spent coin %s SUM %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkDirty();
                     wtx.WriteToDisk();
+                    UpdateUnspent(item.first);
                 }
             }
             else
@@ -929,7 +1285,7 @@ void CWallet::ReacceptWalletTransactions()
         if (!vMissingTx.empty())
         {
             // TODO: optimize this to scan just part of the block chain?
-            if (ScanForWalletTransactions(pindexGenesisBlock))
+            if (ScanForWalletTransactions(pindexGenesisBlock) > 0)
                 fRepeat = true;  // Found missing transactions: re-do re-accept.
         }
     }
@@ -1021,50 +1377,57 @@ void CWallet::ResendWalletTransactions(bool fForce)
 //
 
 
-int64_t CWallet::GetBalance() const
+const CWallet::CWalletBalances& CWallet::GetBalances() const
 {
-    int64_t nTotal = 0;
+    if (fBalancesCached && nBalancesTransactionsUpdated == nTransactionsUpdated)
+        return balancesCached;
+
+    // Transactions with nothing of ours left unspent have no available
+    // credit, and immature generated coins can't have been spent yet
+    CWalletBalances balances = { 0, 0, 0, 0, 0 };
+    for (map<uint256, const CWalletTx*>::const_iterator it = mapWalletUnspent.begin(); it != mapWalletUnspent.end(); ++it)
     {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        const CWalletTx* pcoin = (*it).second;
+        bool fTrusted = pcoin->IsTrusted();
+        if (fTrusted)
+            balances.nBalance += pcoin->GetAvailableCredit();
+        if (!pcoin->IsFinal() || !fTrusted)
+            balances.nUnconfirmed += pcoin->GetAvailableCredit();
+        if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
+            int64_t nCredit = GetCredit(*pcoin);
+            if (pcoin->IsCoinBase())
+            {
+                balances.nImmature += nCredit;
+                balances.nNewMint += nCredit;
+            }
+            else
+                balances.nStake += nCredit;
         }
     }
 
-    return nTotal;
+    balancesCached = balances;
+    fBalancesCached = true;
+    nBalancesTransactionsUpdated = nTransactionsUpdated;
+    return balancesCached;
+}
+
+int64_t CWallet::GetBalance() const
+{
+    LOCK(cs_wallet);
+    return GetBalances().nBalance;
 }
 
 int64_t CWallet::GetUnconfirmedBalance() const
 {
-    int64_t nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || !pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    LOCK(cs_wallet);
+    return GetBalances().nUnconfirmed;
 }
 
 int64_t CWallet::GetImmatureBalance() const
 {
-    int64_t nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx& pcoin = (*it).second;
-            if (pcoin.IsCoinBase() && pcoin.GetBlocksToMaturity() > 0 && pcoin.IsInMainChain())
-                nTotal += GetCredit(pcoin);
-        }
-    }
-    return nTotal;
+    LOCK(cs_wallet);
+    return GetBalances().nImmature;
 }
 
 // populate vCoins with vector of spendable COutputs
@@ -1074,9 +1437,9 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (map<uint256, const CWalletTx*>::const_iterator it = mapWalletUnspent.begin(); it != mapWalletUnspent.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
 
             if (!pcoin->IsFinal())
                 continue;
@@ -1116,9 +1479,9 @@ void CWallet::AvailableCoinsMinConf(vector<COutput>& vCoins, int nConf) const
 
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (map<uint256, const CWalletTx*>::const_iterator it = mapWalletUnspent.begin(); it != mapWalletUnspent.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
 
             if (!pcoin->IsFinal())
                 continue;
@@ -1140,7 +1503,108 @@ void CWallet::AvailableCoinsMinConf(vector<COutput>& vCoins, int nConf) const
     }
 }
 
-static void ApproximateBestSubset(vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > >vValue, int64_t nTotalLower, int64_t nTargetValue,
+// The spendable outputs of AvailableCoins in ascending value order, read off
+// setCoinsByValue. The walk stops after the outputs of the same value as the
+// first one of at least nTargetValue + CENT with 6 confirmations:
+// SelectCoinsMinConf would pick no larger output under any confirmation
+// rule, and chooses among those at random.
+void CWallet::AvailableCoinsByValue(vector<COutput>& vCoins, int64_t nTargetValue, unsigned int nSpendTime, const set<pair<const CWalletTx*,unsigned int> >* psetExclude) const
+{
+    vCoins.clear();
+
+    LOCK(cs_wallet);
+    int64_t nStopValue = -1;
+    set<pair<int64_t, pair<const CWalletTx*, unsigned int> > >::const_iterator it = setCoinsByValue.lower_bound(make_pair(nMinimumInputValue, make_pair((const CWalletTx*)NULL, 0U)));
+    for (; it != setCoinsByValue.end(); ++it)
+    {
+        if (nStopValue >= 0 && (*it).first != nStopValue)
+            break;
+
+        const CWalletTx* pcoin = (*it).second.first;
+        unsigned int i = (*it).second.second;
+
+        if (!pcoin->IsFinal() || !pcoin->IsTrusted())
+            continue;
+
+        if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0)
+            continue;
+
+        int nDepth = pcoin->GetDepthInMainChain();
+        if (nDepth < 0)
+            continue;
+
+        if (IsLockedCoin(pcoin->GetHash(), i) || (psetExclude && psetExclude->count((*it).second)))
+            continue;
+
+        vCoins.push_back(COutput(pcoin, i, nDepth));
+        if (nStopValue < 0 && (*it).first >= nTargetValue + CENT && nDepth >= 6 && pcoin->nTime <= nSpendTime)
+            nStopValue = (*it).first;
+    }
+}
+
+// Cost of a change output: its own bytes now and the input spending it later
+static int64_t GetChangeCost()
+{
+    return max(nTransactionFee, MIN_TX_FEE) * (34 + 148) / 1000;
+}
+
+// Depth first search over vValue (largest first) for the subset closest to
+// nTargetValue without exceeding it by more than nMaxWaste, for a
+// transaction that needs no change output. Gives up after a bounded number
+// of steps.
+static bool SelectCoinsBnB(const vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > >& vValue, int64_t nTotal, int64_t nTargetValue, int64_t nMaxWaste,
+                           vector<char>& vfBest, int64_t& nBest)
+{
+    static const int BNB_MAX_TRIES = 100000;
+
+    bool fFound = false;
+    vector<char> vfIncluded(vValue.size(), false);
+    int64_t nCurrent = 0;
+    int64_t nRemaining = nTotal; // sum of the coins not yet decided on
+    unsigned int i = 0;
+    for (int nTries = 0; nTries < BNB_MAX_TRIES; nTries++)
+    {
+        bool fBacktrack = false;
+        if (nCurrent + nRemaining < nTargetValue || nCurrent > nTargetValue + nMaxWaste)
+            fBacktrack = true;
+        else if (nCurrent >= nTargetValue)
+        {
+            if (!fFound || nCurrent < nBest)
+            {
+                fFound = true;
+                nBest = nCurrent;
+                vfBest = vfIncluded;
+                if (nBest == nTargetValue)
+                    break;
+            }
+            fBacktrack = true;
+        }
+
+        if (fBacktrack)
+        {
+            // Undo the trailing exclusions, then exclude the last coin included
+            while (i > 0 && !vfIncluded[i - 1])
+            {
+                i--;
+                nRemaining += vValue[i].first;
+            }
+            if (i == 0)
+                break;
+            vfIncluded[i - 1] = false;
+            nCurrent -= vValue[i - 1].first;
+        }
+        else
+        {
+            nRemaining -= vValue[i].first;
+            nCurrent += vValue[i].first;
+            vfIncluded[i] = true;
+            i++;
+        }
+    }
+    return fFound;
+}
+
+static void ApproximateBestSubset(const vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > >& vValue, int64_t nTotalLower, int64_t nTargetValue,
                                   vector<char>& vfBest, int64_t& nBest, int iterations = 1000)
 {
     vector<char> vfIncluded;
@@ -1181,45 +1645,42 @@ static void ApproximateBestSubset(vector<pair<int64_t, pair<const CWalletTx*,uns
 // ppcoin: total coins staked (non-spendable until maturity)
 int64_t CWallet::GetStake() const
 {
-    int64_t nTotal = 0;
     LOCK(cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    return GetBalances().nStake;
 }
 
 int64_t CWallet::GetNewMint() const
 {
-    int64_t nTotal = 0;
     LOCK(cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    return GetBalances().nNewMint;
 }
 
-bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, vector<COutput> vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const
+bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const
 {
+    // The coins are expected in ascending value order, as AvailableCoinsByValue
+    // lists them
+    if (!is_sorted(vCoins.begin(), vCoins.end(), CompareOutputValue()))
+    {
+        vector<COutput> vSorted(vCoins);
+        stable_sort(vSorted.begin(), vSorted.end(), CompareOutputValue());
+        return SelectCoinsMinConf(nTargetValue, nSpendTime, nConfMine, nConfTheirs, vSorted, setCoinsRet, nValueRet);
+    }
+
     setCoinsRet.clear();
     nValueRet = 0;
 
-    // List of values less than target
-    pair<int64_t, pair<const CWalletTx*,unsigned int> > coinLowestLarger;
+    // List of values less than target. Where several coins of the same value
+    // qualify, the one taken is picked at random, so that the same output
+    // isn't always the one spent.
+    pair<int64_t, pair<const CWalletTx*,unsigned int> > coinLowestLarger, coinExact;
     coinLowestLarger.first = std::numeric_limits<int64_t>::max();
     coinLowestLarger.second.first = NULL;
+    coinExact.second.first = NULL;
+    int nLargerTies = 0, nExactTies = 0;
     vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > > vValue;
     int64_t nTotalLower = 0;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
-
-    for (COutput output : vCoins)
+    for (const COutput& output : vCoins)
     {
         const CWalletTx *pcoin = output.tx;
 
@@ -1236,21 +1697,36 @@ bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime,
 
         pair<int64_t,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(pcoin, i));
 
+        if (coinExact.second.first && n != nTargetValue)
+            break;
+
         if (n == nTargetValue)
         {
-            setCoinsRet.insert(coin.second);
-            nValueRet += coin.first;
-            return true;
+            if (GetRandInt(++nExactTies) == 0)
+                coinExact = coin;
         }
         else if (n < nTargetValue + CENT)
         {
             vValue.push_back(coin);
             nTotalLower += n;
         }
-        else if (n < coinLowestLarger.first)
+        else if (coinLowestLarger.second.first == NULL)
         {
+            // the first larger coin is the lowest one
             coinLowestLarger = coin;
+            nLargerTies = 1;
         }
+        else if (n != coinLowestLarger.first)
+            break;
+        else if (GetRandInt(++nLargerTies) == 0)
+            coinLowestLarger = coin;
+    }
+
+    if (coinExact.second.first)
+    {
+        setCoinsRet.insert(coinExact.second);
+        nValueRet += coinExact.first;
+        return true;
     }
 
     if (nTotalLower == nTargetValue)
@@ -1272,14 +1748,36 @@ bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime,
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
+    // Largest first for the searches, with coins of the same value in random
+    // order so the searches don't always take the same ones
+    reverse(vValue.begin(), vValue.end());
+    for (unsigned int i = 0, j; i < vValue.size(); i = j)
+    {
+        for (j = i + 1; j < vValue.size() && vValue[j].first == vValue[i].first; j++);
+        if (j - i > 1)
+            random_shuffle(vValue.begin() + i, vValue.begin() + j, GetRandInt);
+    }
     vector<char> vfBest;
     int64_t nBest;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
+    // A subset that leaves less change than a change output costs
+    if (SelectCoinsBnB(vValue, nTotalLower, nTargetValue, GetChangeCost(), vfBest, nBest))
+    {
+        for (unsigned int i = 0; i < vValue.size(); i++)
+            if (vfBest[i])
+            {
+                setCoinsRet.insert(vValue[i].second);
+                nValueRet += vValue[i].first;
+            }
+        return true;
+    }
+
+    // Solve subset sum by stochastic approximation, in bounded time however
+    // many small coins there are
+    int nIterations = max(1, min(1000, (int)(2000000 / vValue.size())));
+    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, nIterations);
     if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, nIterations);
 
     // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
@@ -1311,22 +1809,28 @@ bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime,
     return true;
 }
 
-bool CWallet::SelectCoins(int64_t nTargetValue, unsigned int nSpendTime, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl* coinControl) const
+// Coins in psetExclude, already chosen for the transaction, are not chosen again
+bool CWallet::SelectCoins(int64_t nTargetValue, unsigned int nSpendTime, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl* coinControl,
+                          const set<pair<const CWalletTx*,unsigned int> >* psetExclude) const
 {
     vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, coinControl);
 
     // coin control -> return all selected outputs (we want all selected to go into the transaction for sure)
     if (coinControl && coinControl->HasSelected())
     {
+        AvailableCoins(vCoins, true, coinControl);
         for (const COutput& out : vCoins)
         {
+            if (psetExclude && psetExclude->count(make_pair(out.tx, out.i)))
+                continue;
             nValueRet += out.tx->vout[out.i].nValue;
             setCoinsRet.insert(make_pair(out.tx, out.i));
         }
         return (nValueRet >= nTargetValue);
     }
 
+    AvailableCoinsByValue(vCoins, nTargetValue, nSpendTime, psetExclude);
+
     return (SelectCoinsMinConf(nTargetValue, nSpendTime, 1, 6, vCoins, setCoinsRet, nValueRet) ||
             SelectCoinsMinConf(nTargetValue, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet) ||
             SelectCoinsMinConf(nTargetValue, nSpendTime, 0, 1, vCoins, setCoinsRet, nValueRet));
@@ -1396,6 +1900,10 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend,
         CTxDB txdb("r");
         {
             nFeeRet = nTransactionFee;
+            // Coins chosen so far. A higher fee on a later pass keeps them
+            // and only selects more if they no longer cover it.
+            set<pair<const CWalletTx*,unsigned int> > setCoins;
+            int64_t nValueIn = 0;
             while (true)
             {
                 wtxNew.vin.clear();
@@ -1409,10 +1917,15 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend,
                     wtxNew.vout.push_back(CTxOut(s.second, s.first));
 
                 // Choose coins to use
-                set<pair<const CWalletTx*,unsigned int> > setCoins;
-                int64_t nValueIn = 0;
-                if (!SelectCoins(nTotalValue, wtxNew.nTime, setCoins, nValueIn, coinControl))
-                    return false;
+                if (nValueIn < nTotalValue)
+                {
+                    set<pair<const CWalletTx*,unsigned int> > setCoinsMore;
+                    int64_t nValueMore = 0;
+                    if (!SelectCoins(nTotalValue - nValueIn, wtxNew.nTime, setCoinsMore, nValueMore, coinControl, &setCoins))
+                        return false;
+                    setCoins.insert(setCoinsMore.begin(), setCoinsMore.end());
+                    nValueIn += nValueMore;
+                }
                 for (PAIRTYPE(const CWalletTx*, unsigned int) pcoin : setCoins)
                 {
                     int64_t nCredit = pcoin.first->vout[pcoin.second].nValue;
@@ -1430,6 +1943,13 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend,
                     nFeeRet += nMoveToFee;
                 }
 
+                // change worth less than its output costs goes to the fee
+                if (nChange > 0 && nChange <= GetChangeCost())
+                {
+                    nFeeRet += nChange;
+                    nChange = 0;
+                }
+
                 if (nChange > 0)
                 {
                     // Fill a vout to ourself
@@ -1595,108 +2115,92 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     if (setCoins.empty())
         return false;
 
+    static int nMaxStakeSearchInterval = 60;
+    vector<PAIRTYPE(const CWalletTx*, unsigned int) > vCoins;
+    vector<CStakeKernel> vKernels;
+    {
+        LOCK2(cs_main, cs_wallet);
+        UpdateStakeCandidates(setCoins, txNew.nTime - nMaxStakeSearchInterval, vCoins, vKernels);
+    }
+
     int64_t nCredit = 0;
     CScript scriptPubKeyKernel;
-    CTxDB txdb("r");
-    for (PAIRTYPE(const CWalletTx*, unsigned int) pcoin : setCoins)
-    {
-        CTxIndex txindex;
-        {
-            LOCK2(cs_main, cs_wallet);
-            if (!txdb.ReadTxIndex(pcoin.first->GetHash(), txindex))
-                continue;
+    unsigned int nSearchSpan = min(nSearchInterval, (int64_t)nMaxStakeSearchInterval);
+    int nKernel = -1;
+    while (!fShutdown && pindexPrev == pindexBest)
+    {
+        // Search backward in time from the given txNew timestamp
+        // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
+        unsigned int nTimeTx = txNew.nTime;
+        uint256 hashProofOfStake = 0, targetProofOfStake = 0;
+        nKernel = SearchStakeKernels(nBits, vKernels, nKernel + 1, nTimeTx, nSearchSpan, hashProofOfStake, targetProofOfStake);
+        if (nKernel < 0 || pindexPrev != pindexBest)
+            break;
+        const PAIRTYPE(const CWalletTx*, unsigned int)& pcoin = vCoins[nKernel];
+
+        // Found a kernel
+        if (fDebug && GetBoolArg("-printcoinstake"))
+            printf("CreateCoinStake : kernel found\n");
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+        CScript scriptPubKeyOut;
+        scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
+        if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
+        {
+            if (fDebug && GetBoolArg("-printcoinstake"))
+                printf("CreateCoinStake : failed to parse kernel\n");
+            continue;
         }
-
-        // Read block header
-        CBlock block;
+        if (fDebug && GetBoolArg("-printcoinstake"))
+            printf("CreateCoinStake : parsed kernel type=%d\n", whichType);
+        if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
         {
-            LOCK2(cs_main, cs_wallet);
-            if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-                continue;
+            if (fDebug && GetBoolArg("-printcoinstake"))
+                printf("CreateCoinStake : no support for kernel type=%d\n", whichType);
+            continue;  // only support pay to public key and pay to address
         }
-
-        static int nMaxStakeSearchInterval = 60;
-        if (block.GetBlockTime() + nStakeMinAge > txNew.nTime - nMaxStakeSearchInterval)
-            continue; // only count coins meeting min age requirement
-
-        bool fKernelFound = false;
-        for (unsigned int n=0; n<min(nSearchInterval,(int64_t)nMaxStakeSearchInterval) && !fKernelFound && !fShutdown && pindexPrev == pindexBest; n++)
+        if (whichType == TX_PUBKEYHASH) // pay to address type
         {
-            // Search backward in time from the given txNew timestamp 
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-            uint256 hashProofOfStake = 0, targetProofOfStake = 0;
-            COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            if (CheckStakeKernelHash(nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, *pcoin.first, prevoutStake, txNew.nTime - n, hashProofOfStake, targetProofOfStake))
+            // convert to pay to public key type
+            if (!keystore.GetKey(uint160(vSolutions[0]), key))
             {
-                // Found a kernel
                 if (fDebug && GetBoolArg("-printcoinstake"))
-                    printf("CreateCoinStake : kernel found\n");
-                vector<valtype> vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-                {
-                    if (fDebug && GetBoolArg("-printcoinstake"))
-                        printf("CreateCoinStake : failed to parse kernel\n");
-                    break;
-                }
+                    printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                continue;  // unable to find corresponding public key
+            }
+            scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
+        }
+        if (whichType == TX_PUBKEY)
+        {
+            valtype& vchPubKey = vSolutions[0];
+            if (!keystore.GetKey(Hash160(vchPubKey), key))
+            {
                 if (fDebug && GetBoolArg("-printcoinstake"))
-                    printf("CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-                {
-                    if (fDebug && GetBoolArg("-printcoinstake"))
-                        printf("CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;  // only support pay to public key and pay to address
-                }
-                if (whichType == TX_PUBKEYHASH) // pay to address type
-                {
-                    // convert to pay to public key type
-                    if (!keystore.GetKey(uint160(vSolutions[0]), key))
-                    {
-                        if (fDebug && GetBoolArg("-printcoinstake"))
-                            printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-                    scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
-                }
-                if (whichType == TX_PUBKEY)
-                {
-                    valtype& vchPubKey = vSolutions[0];
-                    if (!keystore.GetKey(Hash160(vchPubKey), key))
-                    {
-                        if (fDebug && GetBoolArg("-printcoinstake"))
-                            printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-
-                if (key.GetPubKey() != vchPubKey)
-                {
-                    if (fDebug && GetBoolArg("-printcoinstake"))
-                        printf("CreateCoinStake : invalid key for kernel type=%d\n", whichType);
-                        break; // keys mismatch
-                    }
-
-                    scriptPubKeyOut = scriptPubKeyKernel;
-                }
-
-                txNew.nTime -= n;
-                txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-                nCredit += pcoin.first->vout[pcoin.second].nValue;
-                vwtxPrev.push_back(pcoin.first);
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+                    printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                continue;  // unable to find corresponding public key
+            }
 
-                if (GetWeight(block.GetBlockTime(), (int64_t)txNew.nTime) < nStakeSplitAge)
-                    txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
+            if (key.GetPubKey() != vchPubKey)
+            {
                 if (fDebug && GetBoolArg("-printcoinstake"))
-                    printf("CreateCoinStake : added kernel type=%d\n", whichType);
-                fKernelFound = true;
-                break;
+                    printf("CreateCoinStake : invalid key for kernel type=%d\n", whichType);
+                continue; // keys mismatch
             }
+
+            scriptPubKeyOut = scriptPubKeyKernel;
         }
 
-        if (fKernelFound || fShutdown)
-            break; // if kernel is found stop searching
+        txNew.nTime = nTimeTx;
+        txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
+        nCredit += pcoin.first->vout[pcoin.second].nValue;
+        vwtxPrev.push_back(pcoin.first);
+        txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+
+        if (GetWeight((int64_t)vKernels[nKernel].nTimeBlockFrom, (int64_t)txNew.nTime) < nStakeSplitAge)
+            txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
+        if (fDebug && GetBoolArg("-printcoinstake"))
+            printf("CreateCoinStake : added kernel type=%d\n", whichType);
+        break; // if kernel is found stop searching
     }
 
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
@@ -1774,6 +2278,105 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
 }
 
 
+// Bring the stake candidate table in line with setCoins and return the
+// kernels of the coins that meet the min age at nTimeMin, in setCoins order
+void CWallet::UpdateStakeCandidates(const set<pair<const CWalletTx*,unsigned int> >& setCoins, unsigned int nTimeMin, vector<pair<const CWalletTx*,unsigned int> >& vCoinsRet, vector<CStakeKernel>& vKernelsRet)
+{
+    nStakePass++;
+    vCoinsRet.clear();
+    vKernelsRet.clear();
+
+    CTxDB txdb("r");
+    for (PAIRTYPE(const CWalletTx*, unsigned int) pcoin : setCoins)
+    {
+        COutPoint prevout(pcoin.first->GetHash(), pcoin.second);
+        map<COutPoint, CStakeCandidate>::iterator mi = mapStakeCandidates.find(prevout);
+        if (mi != mapStakeCandidates.end() && !mi->second.pindexFrom->IsInMainChain())
+        {
+            mapStakeCandidates.erase(mi);
+            mi = mapStakeCandidates.end();
+        }
+
+        if (mi == mapStakeCandidates.end())
+        {
+            CTxIndex txindex;
+            if (!txdb.ReadTxIndex(prevout.hash, txindex))
+                continue;
+
+            // The wallet already knows the block; read the header only if
+            // its idea of it disagrees with the tx index
+            const CBlockIndex* pindexFrom = NULL;
+            BlockMap::iterator bi = mapBlockIndex.find(pcoin.first->hashBlock);
+            if (bi != mapBlockIndex.end() && bi->second->nFile == txindex.pos.nFile && bi->second->nBlockPos == txindex.pos.nBlockPos)
+                pindexFrom = bi->second;
+            else
+            {
+                CBlock block;
+                if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+                    continue;
+                bi = mapBlockIndex.find(block.GetHash());
+                if (bi == mapBlockIndex.end())
+                    continue;
+                pindexFrom = bi->second;
+            }
+            if (!pindexFrom->IsInMainChain())
+                continue;
+
+            CStakeCandidate candidate;
+            candidate.pindexFrom = pindexFrom;
+            candidate.pindexModifier = NULL;
+            candidate.kernel.nStakeModifier = 0;
+            candidate.kernel.nTimeBlockFrom = pindexFrom->GetBlockTime();
+            candidate.kernel.nTxPrevOffset = txindex.pos.nTxPos - txindex.pos.nBlockPos;
+            candidate.kernel.nTimeTxPrev = pcoin.first->nTime;
+            candidate.kernel.nPrevout = prevout.n;
+            candidate.kernel.nValueIn = pcoin.first->vout[prevout.n].nValue;
+            mi = mapStakeCandidates.insert(make_pair(prevout, candidate)).first;
+        }
+
+        CStakeCandidate& candidate = mi->second;
+        candidate.nPass = nStakePass;
+        if (candidate.kernel.nTimeBlockFrom + nStakeMinAge > nTimeMin)
+            continue; // only count coins meeting min age requirement
+
+        if (candidate.pindexModifier && !candidate.pindexModifier->IsInMainChain())
+            candidate.pindexModifier = NULL;
+        if (!candidate.pindexModifier && !GetKernelStakeModifier(candidate.pindexFrom, candidate.kernel.nStakeModifier, candidate.pindexModifier))
+            continue; // chain not yet a selection interval past the coin
+
+        vCoinsRet.push_back(pcoin);
+        vKernelsRet.push_back(candidate.kernel);
+    }
+
+    // Forget outputs that were spent or are no longer selected
+    for (map<COutPoint, CStakeCandidate>::iterator mi = mapStakeCandidates.begin(); mi != mapStakeCandidates.end();)
+    {
+        if (mi->second.nPass != nStakePass)
+            mapStakeCandidates.erase(mi++);
+        else
+            ++mi;
+    }
+}
+
+// Drop stake candidates that depend on a block leaving the main chain
+void CWallet::BlockDisconnected(const CBlockIndex* pindex)
+{
+    LOCK(cs_wallet);
+    for (map<COutPoint, CStakeCandidate>::iterator mi = mapStakeCandidates.begin(); mi != mapStakeCandidates.end();)
+    {
+        CStakeCandidate& candidate = mi->second;
+        if (candidate.pindexFrom->nHeight >= pindex->nHeight)
+        {
+            mapStakeCandidates.erase(mi++);
+            continue;
+        }
+        if (candidate.pindexModifier && candidate.pindexModifier->nHeight >= pindex->nHeight)
+            candidate.pindexModifier = NULL;
+        ++mi;
+    }
+}
+
+
 // Call after CreateTransaction unless you want to abort
 bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
 {
@@ -1801,6 +2404,7 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
                 coin.WriteToDisk();
+                UpdateUnspent(txin.prevout.hash);
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
 
@@ -1903,6 +2507,7 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
     if (nLoadWalletRet != DB_LOAD_OK)
         return nLoadWalletRet;
     fFirstRunRet = !vchDefaultKey.IsValid();
+    RebuildUnspent();
 
     NewThread(ThreadFlushWalletDB, &strWalletFile);
     return DB_LOAD_OK;
@@ -1989,6 +2594,7 @@ bool CWallet::NewKeyPool()
 {
     {
         LOCK(cs_wallet);
+        CDBBatch batch(strWalletFile);
         CWalletDB walletdb(strWalletFile);
         for (int64_t nIndex : setKeyPool)
             walletdb.ErasePool(nIndex);
@@ -2004,6 +2610,12 @@ bool CWallet::NewKeyPool()
             walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
             setKeyPool.insert(nIndex);
         }
+        if (!batch.Commit())
+        {
+            // Don't hand out keys that aren't on disk
+            setKeyPool.clear();
+            throw runtime_error("NewKeyPool() : writing generated keys failed");
+        }
         printf("CWallet::NewKeyPool wrote %" PRId64 " new keys\n", nKeys);
     }
     return true;
@@ -2017,6 +2629,8 @@ bool CWallet::TopUpKeyPool(unsigned int nSize)
         if (IsLocked())
             return false;
 
+        // The keys and their pool entries go to disk together
+        CDBBatch batch(strWalletFile);
         CWalletDB walletdb(strWalletFile);
 
         // Top up key pool
@@ -2026,6 +2640,7 @@ bool CWallet::TopUpKeyPool(unsigned int nSize)
         else
             nTargetSize = max(GetArg("-keypool", 100), (int64_t)0);
 
+        int64_t nLast = setKeyPool.empty() ? 0 : *(--setKeyPool.end());
         while (setKeyPool.size() < (nTargetSize + 1))
         {
             int64_t nEnd = 1;
@@ -2036,6 +2651,12 @@ bool CWallet::TopUpKeyPool(unsigned int nSize)
             setKeyPool.insert(nEnd);
             printf("keypool added key %" PRId64 ", size=%" PRIszu "\n", nEnd, setKeyPool.size());
         }
+        if (!batch.Commit())
+        {
+            // Don't hand out keys that aren't on disk
+            setKeyPool.erase(setKeyPool.upper_bound(nLast), setKeyPool.end());
+            throw runtime_error("TopUpKeyPool() : writing generated keys failed");
+        }
     }
     return true;
 }
@@ -2296,6 +2917,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64_t& nBalanceInQuestion, bo
                 {
                     pcoin->MarkUnspent(n);
                     pcoin->WriteToDisk();
+                    UpdateUnspent(pcoin->GetHash());
                 }
             }
             else if (IsMine(pcoin->vout[n]) && !pcoin->IsSpent(n) && (txindex.vSpent.size() > n && !txindex.vSpent[n].IsNull()))
@@ -2308,6 +2930,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64_t& nBalanceInQuestion, bo
                 {
                     pcoin->MarkSpent(n);
                     pcoin->WriteToDisk();
+                    UpdateUnspent(pcoin->GetHash());
                 }
             }
         }
@@ -2331,6 +2954,7 @@ void CWallet::DisableTransaction(const CTransaction &tx)
             {
                 prev.MarkUnspent(txin.prevout.n);
                 prev.WriteToDisk();
+                UpdateUnspent(txin.prevout.hash);
             }
         }
     }
@@ -2429,7 +3053,7 @@ void CWallet::GetKeyBirthTimes(std::map<CKeyID, int64_t> &mapKeyBirth) const {
     for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); it++) {
         // iterate over all wallet transactions...
         const CWalletTx &wtx = (*it).second;
-        std::map<uint256, CBlockIndex*>::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
+        BlockMap::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
         if (blit != mapBlockIndex.end() && blit->second->IsInMainChain()) {
             // ... which are already in a block
             int nHeight = blit->second->nHeight;
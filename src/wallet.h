@@ -11,6 +11,7 @@
 #include <stdlib.h>
 
 #include "main.h"
+#include "kernel.h"
 #include "key.h"
 #include "keystore.h"
 #include "script.h"
@@ -71,7 +72,8 @@ class CWallet : public CCryptoKeyStore
 {
 private:
     bool SelectCoinsSimple(int64_t nTargetValue, unsigned int nSpendTime, int nMinConf, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
-    bool SelectCoins(int64_t nTargetValue, unsigned int nSpendTime, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl *coinControl=NULL) const;
+    bool SelectCoins(int64_t nTargetValue, unsigned int nSpendTime, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl *coinControl=NULL,
+                     const std::set<std::pair<const CWalletTx*,unsigned int> >* psetExclude=NULL) const;
 
     CWalletDB *pwalletdbEncryption;
 
@@ -81,6 +83,46 @@ private:
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
+    // Stake kernel inputs of the outputs the staker selected, kept across
+    // passes so only new outputs cost a disk read and a modifier lookup
+    struct CStakeCandidate
+    {
+        const CBlockIndex* pindexFrom;     // block holding the output
+        const CBlockIndex* pindexModifier; // block whose modifier the kernel uses, NULL until resolved
+        CStakeKernel kernel;
+        unsigned int nPass;                // last staking pass that selected the output
+    };
+    std::map<COutPoint, CStakeCandidate> mapStakeCandidates;
+    unsigned int nStakePass;
+
+    void UpdateStakeCandidates(const std::set<std::pair<const CWalletTx*,unsigned int> >& setCoins, unsigned int nTimeMin, std::vector<std::pair<const CWalletTx*,unsigned int> >& vCoinsRet, std::vector<CStakeKernel>& vKernelsRet);
+
+    // Transactions with an output of ours not yet marked spent. Balances and
+    // coin listings only look at these instead of all of mapWallet.
+    std::map<uint256, const CWalletTx*> mapWalletUnspent;
+
+    // The unspent outputs of ours in those transactions, by value
+    std::set<std::pair<int64_t, std::pair<const CWalletTx*, unsigned int> > > setCoinsByValue;
+
+    // Balance totals over mapWalletUnspent, good until the wallet changes or
+    // nTransactionsUpdated moves (a new best block or memory pool change)
+    struct CWalletBalances
+    {
+        int64_t nBalance;
+        int64_t nUnconfirmed;
+        int64_t nImmature;
+        int64_t nStake;
+        int64_t nNewMint;
+    };
+    mutable CWalletBalances balancesCached;
+    mutable bool fBalancesCached;
+    mutable unsigned int nBalancesTransactionsUpdated;
+
+    void EraseUnspent(const uint256& hash);
+    void UpdateUnspent(const uint256& hash);
+    void RebuildUnspent();
+    const CWalletBalances& GetBalances() const;
+
 public:
     mutable CCriticalSection cs_wallet;
 
@@ -103,6 +145,9 @@ public:
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
+        nStakePass = 0;
+        fBalancesCached = false;
+        nBalancesTransactionsUpdated = 0;
     }
     CWallet(std::string strWalletFileIn)
     {
@@ -113,6 +158,9 @@ public:
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
+        nStakePass = 0;
+        fBalancesCached = false;
+        nBalancesTransactionsUpdated = 0;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -132,7 +180,8 @@ public:
 
     void AvailableCoinsMinConf(std::vector<COutput>& vCoins, int nConf) const;
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl=NULL) const;
-    bool SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
+    void AvailableCoinsByValue(std::vector<COutput>& vCoins, int64_t nTargetValue, unsigned int nSpendTime, const std::set<std::pair<const CWalletTx*,unsigned int> >* psetExclude=NULL) const;
+    bool SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
     // keystore implementation
     // Generate a new key
     CPubKey GenerateNewKey();
@@ -193,6 +242,7 @@ public:
 
     bool GetStakeWeight(const CKeyStore& keystore, uint64_t& nMinWeight, uint64_t& nMaxWeight, uint64_t& nWeight);
     bool CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, int64_t nFees, CTransaction& txNew, CKey& key);
+    void BlockDisconnected(const CBlockIndex* pindex);
 
     std::string SendMoney(CScript scriptPubKey, int64_t nValue, CWalletTx& wtxNew, bool fAskFee=false);
     std::string SendMoneyToDestination(const CTxDestination &address, int64_t nValue, CWalletTx& wtxNew, bool fAskFee=false);
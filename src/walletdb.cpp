@@ -570,7 +570,8 @@ void ThreadFlushWalletDB(void* parg)
                     mi++;
                 }
 
-                if (nRefCount == 0 && !fShutdown)
+                // nor while writes to them are held back in a batch
+                if (nRefCount == 0 && bitdb.mapBatch.empty() && !fShutdown)
                 {
                     map<string, int>::iterator mi = bitdb.mapFileUseCount.find(strFile);
                     if (mi != bitdb.mapFileUseCount.end())